@@ -0,0 +1,691 @@
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndaddrperf.cpp - NetworkDirect address lookup scalability test
+//
+// This test calls NdCheckAddress for the input address from an increasing
+// number of threads and reports the aggregate lookup rate.  Lookups do not
+// take a lock, so the rate should scale with the number of threads up to the
+// number of processors.
+//
+// With --scale, the test instead enables the loopback provider with 4, 64
+// and 1024 addresses and reports the cost of a single lookup for each.
+// Lookups are hashed, so the cost should not depend on the number of
+// addresses.
+//
+// With --resolve, the test enables the loopback provider and resolves a
+// number of distinct peers on the loopback subnet, as a job does during
+// wire-up, one at a time and then with NdResolveAddresses, and reports the
+// route cache statistics.  Peers on the same subnet share a cache entry, so
+// only the first resolution should miss.
+//
+// With --open, the test opens and closes an adapter on the input address
+// repeatedly, with the provider kept loaded between opens and with the
+// providers flushed before each open, and reports the cost of each.
+//
+// With --first, the test starts the framework repeatedly and has all threads
+// make their first NdCheckAddress call for the input address at the same
+// time, right after NdStartup.  Every call must find the address; a call that
+// fails means the address list was not yet published.
+
+#include "ndcommon.h"
+#include <logging.h>
+
+const unsigned long x_DefaultIters = 1000000;
+const unsigned long x_DefaultOpenIters = 1000;
+const unsigned long x_ScaleAddresses[] = { 4, 64, 1024 };
+const unsigned long x_DefaultPeers = 1000;
+const unsigned long x_DefaultFirstRounds = 100;
+
+const LPCWSTR TESTNAME = L"ndaddrperf.exe";
+
+void ShowUsage()
+{
+    printf("ndaddrperf [options] <IPv4 Address>\n"
+        "ndaddrperf [options] -s\n"
+        "ndaddrperf [options] -r [numPeers]\n"
+        "ndaddrperf [options] -o <IPv4 Address>\n"
+        "ndaddrperf [options] -f <IPv4 Address>\n"
+        "Options:\n"
+        "\t-s,--scale                  Measure lookup cost against the number of loopback addresses\n"
+        "\t-r,--resolve [numPeers]     Resolve distinct loopback peers and report route cache use (default: %u)\n"
+        "\t-o,--open                   Measure NdOpenAdapter cost with the provider loaded and flushed\n"
+        "\t-f,--first                  Check concurrent first lookups right after NdStartup\n"
+        "\t-t,--threads <numThreads>   Maximum number of threads (default: number of processors)\n"
+        "\t-i,--iterations <count>     Lookups per thread, opens, or startups with -f\n"
+        "\t                            (default: %u, %u with -o, %u with -f)\n"
+        "\t-l,--logFile <logFile>      Log output to a given file\n"
+        "\t-h,--help                   Show this message\n",
+        x_DefaultPeers,
+        x_DefaultIters,
+        x_DefaultOpenIters,
+        x_DefaultFirstRounds);
+}
+
+struct ThreadParam
+{
+    const struct sockaddr_in *m_pAddr;
+    unsigned long m_nIters;
+    volatile LONG *m_pnReady;
+    HANDLE m_hStart;
+    volatile LONG *m_pnFailed;
+};
+
+static DWORD WINAPI CheckAddressTest(void *param)
+{
+    ThreadParam *threadParam = static_cast<ThreadParam *>(param);
+
+    // signal that this thread is ready and wait for the others
+    InterlockedIncrement(threadParam->m_pnReady);
+    WaitForSingleObject(threadParam->m_hStart, INFINITE);
+
+    for (unsigned long i = 0; i < threadParam->m_nIters; i++)
+    {
+        HRESULT hr = NdCheckAddress(
+            reinterpret_cast<const struct sockaddr*>(threadParam->m_pAddr),
+            sizeof(*threadParam->m_pAddr)
+        );
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCheckAddress failed with %08x\n", __LINE__);
+        }
+    }
+    return 0;
+}
+
+static DWORD WINAPI FirstCheckAddressTest(void *param)
+{
+    ThreadParam *threadParam = static_cast<ThreadParam *>(param);
+
+    InterlockedIncrement(threadParam->m_pnReady);
+    WaitForSingleObject(threadParam->m_hStart, INFINITE);
+
+    HRESULT hr = NdCheckAddress(
+        reinterpret_cast<const struct sockaddr*>(threadParam->m_pAddr),
+        sizeof(*threadParam->m_pAddr)
+    );
+    if (FAILED(hr))
+    {
+        InterlockedIncrement(threadParam->m_pnFailed);
+    }
+    return 0;
+}
+
+//
+// Runs numThreads threads doing nIters lookups each, and returns the aggregate
+// rate in lookups per microsecond.
+//
+static double RunTest(const struct sockaddr_in& v4, DWORD numThreads, unsigned long nIters)
+{
+    HANDLE* hThreads = new (std::nothrow) HANDLE[numThreads];
+    if (hThreads == nullptr)
+    {
+        LOG_FAILURE_AND_EXIT(L"Failed to allocate memory for threads\n", __LINE__);
+    }
+
+    HANDLE hStart = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (hStart == nullptr)
+    {
+        LOG_FAILURE_AND_EXIT(L"CreateEvent failed\n", __LINE__);
+    }
+
+    volatile LONG nReady = 0;
+    ThreadParam param;
+    param.m_pAddr = &v4;
+    param.m_nIters = nIters;
+    param.m_pnReady = &nReady;
+    param.m_hStart = hStart;
+    param.m_pnFailed = nullptr;
+
+    for (DWORD i = 0; i < numThreads; i++)
+    {
+        hThreads[i] = CreateThread(nullptr, 0, &CheckAddressTest, &param, 0, nullptr);
+        if (hThreads[i] == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"CreateThread failed\n", __LINE__);
+        }
+    }
+
+    while (InterlockedCompareExchange(&nReady, 0, 0) != static_cast<LONG>(numThreads))
+    {
+        SwitchToThread();
+    }
+
+    Timer timer;
+    timer.Start();
+    SetEvent(hStart);
+
+    // Wait for the threads to exit.
+    for (DWORD i = 0; i < numThreads; i++)
+    {
+#pragma warning(push)
+#pragma warning(disable: 6387) //hThreads[i] is already nullptr checked
+        WaitForSingleObject(hThreads[i], INFINITE);
+        CloseHandle(hThreads[i]);
+#pragma warning(pop)
+    }
+    timer.End();
+
+    CloseHandle(hStart);
+    delete[] hThreads;
+
+    return (static_cast<double>(nIters) * numThreads) / timer.Report();
+}
+
+//
+// Restarts the framework with the loopback provider reporting nAddresses IPv4
+// addresses, and returns the average cost in nanoseconds of looking up the
+// last one.
+//
+static double RunScaleTest(unsigned long nAddresses, unsigned long nIters)
+{
+    WCHAR value[16];
+    swprintf_s(value, L"%u", nAddresses);
+    if (!SetEnvironmentVariableW(L"ND_LOOPBACK_PROVIDER", L"1") ||
+        !SetEnvironmentVariableW(L"ND_LOOPBACK_ADDRESSES", value))
+    {
+        LOG_FAILURE_AND_EXIT(L"SetEnvironmentVariable failed\n", __LINE__);
+    }
+
+    HRESULT hr = NdStartup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
+    }
+
+    struct sockaddr_in v4 = { 0 };
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_LOOPBACK + nAddresses - 1);
+
+    // The first call picks up the provider and address lists.
+    hr = NdCheckAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4));
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCheckAddress for loopback address returned %08x\n", __LINE__);
+    }
+
+    Timer timer;
+    timer.Start();
+    for (unsigned long i = 0; i < nIters; i++)
+    {
+        hr = NdCheckAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4));
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCheckAddress failed with %08x\n", __LINE__);
+        }
+    }
+    timer.End();
+
+    hr = NdCleanup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+    }
+
+    return (timer.Report() * 1000) / nIters;
+}
+
+static void InvokeScaleTest(unsigned long nIters)
+{
+    printf(
+        "Frequency is %I64d\n",
+        Timer::Frequency());
+
+    printf(
+        "Addresses      Iter  nsec/lookup\n"
+    );
+
+    for (SIZE_T i = 0; i < _countof(x_ScaleAddresses); i++)
+    {
+        printf(
+            "%9u %9u %12.2f\n",
+            x_ScaleAddresses[i],
+            nIters,
+            RunScaleTest(x_ScaleAddresses[i], nIters)
+        );
+    }
+}
+
+//
+// Resolves nPeers distinct loopback addresses, one at a time or with a single
+// NdResolveAddresses call.
+//
+static void ResolvePeers(unsigned long nPeers, bool batch)
+{
+    SOCKADDR_INET* remote = new (std::nothrow) SOCKADDR_INET[nPeers];
+    SOCKADDR_INET* local = new (std::nothrow) SOCKADDR_INET[nPeers];
+    HRESULT* results = new (std::nothrow) HRESULT[nPeers];
+    if (remote == nullptr || local == nullptr || results == nullptr)
+    {
+        LOG_FAILURE_AND_EXIT(L"Failed to allocate memory for peers\n", __LINE__);
+    }
+
+    ZeroMemory(remote, sizeof(*remote) * nPeers);
+    for (unsigned long i = 0; i < nPeers; i++)
+    {
+        remote[i].Ipv4.sin_family = AF_INET;
+        remote[i].Ipv4.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i);
+    }
+
+    HRESULT hr;
+    if (batch)
+    {
+        hr = NdResolveAddresses(nPeers, remote, local, results);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddresses failed with %08x\n", __LINE__);
+        }
+    }
+    else
+    {
+        for (unsigned long i = 0; i < nPeers; i++)
+        {
+            SIZE_T len = sizeof(local[i]);
+            hr = NdResolveAddress(
+                reinterpret_cast<const struct sockaddr*>(&remote[i]),
+                sizeof(remote[i].Ipv4),
+                reinterpret_cast<struct sockaddr*>(&local[i]),
+                &len
+            );
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x\n", __LINE__);
+            }
+        }
+    }
+
+    delete[] results;
+    delete[] local;
+    delete[] remote;
+}
+
+//
+// Resolves nPeers distinct loopback addresses one at a time with a cold and a
+// warm route cache, then in a single batch, and reports the time per
+// resolution and the route cache hits and misses for each pass.
+//
+static void InvokeResolveTest(unsigned long nPeers)
+{
+    if (!SetEnvironmentVariableW(L"ND_LOOPBACK_PROVIDER", L"1"))
+    {
+        LOG_FAILURE_AND_EXIT(L"SetEnvironmentVariable failed\n", __LINE__);
+    }
+
+    HRESULT hr = NdStartup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
+    }
+
+    printf(
+        "Frequency is %I64d\n",
+        Timer::Frequency());
+
+    printf(
+        "     Pass     Peers  usec/resolve       Hits    Misses\n"
+    );
+
+    const struct
+    {
+        const char* name;
+        bool batch;
+    } passes[] = { { "cold", false }, { "warm", false }, { "batch", true } };
+
+    ND_ROUTE_CACHE_STATISTICS prev = { 0 };
+    for (SIZE_T pass = 0; pass < _countof(passes); pass++)
+    {
+        Timer timer;
+        timer.Start();
+        ResolvePeers(nPeers, passes[pass].batch);
+        timer.End();
+
+        ND_ROUTE_CACHE_STATISTICS stats;
+        hr = NdQueryRouteCacheStatistics(&stats);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdQueryRouteCacheStatistics failed with %08x\n", __LINE__);
+        }
+
+        printf(
+            "%9s %9u %13.2f %10I64u %9I64u\n",
+            passes[pass].name,
+            nPeers,
+            timer.Report() / nPeers,
+            stats.Hits - prev.Hits,
+            stats.Misses - prev.Misses
+        );
+        prev = stats;
+    }
+
+    hr = NdCleanup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+    }
+}
+
+//
+// Opens and releases an adapter on v4 nIters times, flushing the providers
+// before each open if requested, and returns the average cost in
+// microseconds.
+//
+static double RunOpenTest(const struct sockaddr_in& v4, unsigned long nIters, bool flush)
+{
+    Timer timer;
+    timer.Start();
+    for (unsigned long i = 0; i < nIters; i++)
+    {
+        if (flush)
+        {
+            NdFlushProviders();
+        }
+
+        IND2Adapter* pAdapter;
+        HRESULT hr = NdOpenAdapter(
+            IID_IND2Adapter,
+            reinterpret_cast<const struct sockaddr*>(&v4),
+            sizeof(v4),
+            reinterpret_cast<void**>(&pAdapter)
+        );
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdOpenAdapter failed with %08x\n", __LINE__);
+        }
+        pAdapter->Release();
+    }
+    timer.End();
+
+    return timer.Report() / nIters;
+}
+
+static void InvokeOpenTest(const struct sockaddr_in& v4, unsigned long nIters)
+{
+    printf(
+        "Frequency is %I64d\n",
+        Timer::Frequency());
+
+    printf(
+        " Provider      Iter  usec/open\n"
+    );
+
+    printf("%9s %9u %10.2f\n", "loaded", nIters, RunOpenTest(v4, nIters, false));
+    printf("%9s %9u %10.2f\n", "flushed", nIters, RunOpenTest(v4, nIters, true));
+}
+
+//
+// Starts the framework nRounds times, and each time releases numThreads
+// threads that make their first lookup of v4 together.  Returns the number of
+// lookups that failed.
+//
+static LONG RunFirstTest(const struct sockaddr_in& v4, DWORD numThreads, unsigned long nRounds)
+{
+    HANDLE* hThreads = new (std::nothrow) HANDLE[numThreads];
+    if (hThreads == nullptr)
+    {
+        LOG_FAILURE_AND_EXIT(L"Failed to allocate memory for threads\n", __LINE__);
+    }
+
+    volatile LONG nFailed = 0;
+    for (unsigned long round = 0; round < nRounds; round++)
+    {
+        HANDLE hStart = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (hStart == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"CreateEvent failed\n", __LINE__);
+        }
+
+        volatile LONG nReady = 0;
+        ThreadParam param;
+        param.m_pAddr = &v4;
+        param.m_nIters = 1;
+        param.m_pnReady = &nReady;
+        param.m_hStart = hStart;
+        param.m_pnFailed = &nFailed;
+
+        for (DWORD i = 0; i < numThreads; i++)
+        {
+            hThreads[i] = CreateThread(nullptr, 0, &FirstCheckAddressTest, &param, 0, nullptr);
+            if (hThreads[i] == nullptr)
+            {
+                LOG_FAILURE_AND_EXIT(L"CreateThread failed\n", __LINE__);
+            }
+        }
+
+        while (InterlockedCompareExchange(&nReady, 0, 0) != static_cast<LONG>(numThreads))
+        {
+            SwitchToThread();
+        }
+
+        HRESULT hr = NdStartup();
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
+        }
+        SetEvent(hStart);
+
+        for (DWORD i = 0; i < numThreads; i++)
+        {
+#pragma warning(push)
+#pragma warning(disable: 6387) //hThreads[i] is already nullptr checked
+            WaitForSingleObject(hThreads[i], INFINITE);
+            CloseHandle(hThreads[i]);
+#pragma warning(pop)
+        }
+
+        hr = NdCleanup();
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+        }
+        CloseHandle(hStart);
+    }
+
+    delete[] hThreads;
+    return nFailed;
+}
+
+static void InvokeFirstTest(const struct sockaddr_in& v4, DWORD numThreads, unsigned long nRounds)
+{
+    printf(
+        "   Rounds   Threads    Failed\n"
+    );
+
+    LONG nFailed = RunFirstTest(v4, numThreads, nRounds);
+    printf("%9u %9u %9d\n", nRounds, numThreads, nFailed);
+
+    if (nFailed != 0)
+    {
+        LOG_FAILURE_AND_EXIT(L"First lookups after NdStartup failed\n", __LINE__);
+    }
+}
+
+int __cdecl _tmain(int argc, TCHAR* argv[])
+{
+    WSADATA wsaData;
+    INIT_LOG(TESTNAME);
+    int ret = ::WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (ret != 0)
+    {
+        printf("Failed to initialize Windows Sockets: %d\n", ret);
+        exit(__LINE__);
+    }
+
+    DWORD maxThreads = CpuMonitor::CpuCount();
+    unsigned long nIters = 0;
+    bool scale = false;
+    bool open = false;
+    bool first = false;
+    unsigned long nPeers = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        TCHAR *arg = argv[i];
+        if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
+        {
+            RedirectLogsToFile(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-s") == 0) || (wcscmp(arg, L"--scale") == 0))
+        {
+            scale = true;
+        }
+        else if ((wcscmp(arg, L"-r") == 0) || (wcscmp(arg, L"--resolve") == 0))
+        {
+            nPeers = x_DefaultPeers;
+            if (i + 1 < argc && _istdigit(argv[i + 1][0]))
+            {
+                nPeers = _ttol(argv[++i]);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--open") == 0))
+        {
+            open = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--first") == 0))
+        {
+            first = true;
+        }
+        else if ((wcscmp(arg, L"-t") == 0) || (wcscmp(arg, L"--threads") == 0))
+        {
+            maxThreads = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-i") == 0) || (wcscmp(arg, L"--iterations") == 0))
+        {
+            nIters = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-h") == 0) || (wcscmp(arg, L"--help") == 0))
+        {
+            ShowUsage();
+            exit(0);
+        }
+    }
+
+    if (nIters == 0)
+    {
+        nIters = open ? x_DefaultOpenIters : (first ? x_DefaultFirstRounds : x_DefaultIters);
+    }
+
+    if (maxThreads == 0 || nIters == 0)
+    {
+        printf("Invalid thread or iteration count.\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (nPeers != 0)
+    {
+        InvokeResolveTest(nPeers);
+
+        END_LOG(TESTNAME);
+        _fcloseall();
+        WSACleanup();
+        return 0;
+    }
+
+    if (scale)
+    {
+        InvokeScaleTest(nIters);
+
+        END_LOG(TESTNAME);
+        _fcloseall();
+        WSACleanup();
+        return 0;
+    }
+
+    TCHAR *ipAddress = argv[argc - 1];
+    struct sockaddr_in v4 = { 0 };
+    int addrLen = sizeof(v4);
+    WSAStringToAddress(ipAddress, AF_INET, nullptr,
+        reinterpret_cast<struct sockaddr*>(&v4), &addrLen);
+
+    if (v4.sin_addr.s_addr == 0)
+    {
+        printf("Bad address.\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (first)
+    {
+        // Each round starts the framework itself.
+        InvokeFirstTest(v4, maxThreads, nIters);
+
+        END_LOG(TESTNAME);
+        _fcloseall();
+        WSACleanup();
+        return 0;
+    }
+
+    HRESULT hr = NdStartup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
+    }
+
+    // Make sure the address is valid before timing anything.
+    hr = NdCheckAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4));
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCheckAddress for input address returned %08x\n", __LINE__);
+    }
+
+    if (open)
+    {
+        InvokeOpenTest(v4, nIters);
+
+        hr = NdCleanup();
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+        }
+
+        END_LOG(TESTNAME);
+        _fcloseall();
+        WSACleanup();
+        return 0;
+    }
+
+    printf(
+        "Using %u processors. Frequency is %I64d\n",
+        CpuMonitor::CpuCount(),
+        Timer::Frequency());
+
+    printf(
+        "  Threads      Iter   Mops/sec   Speedup\n"
+    );
+
+    double baseRate = 0;
+    DWORD numThreads = 1;
+    for (;;)
+    {
+        double rate = RunTest(v4, numThreads, nIters);
+        if (numThreads == 1)
+        {
+            baseRate = rate;
+        }
+
+        printf(
+            "%9u %9u %10.2f %9.2f\n",
+            numThreads,
+            nIters,
+            rate,
+            rate / baseRate
+        );
+
+        // Double the thread count, always finishing with the requested count.
+        if (numThreads == maxThreads)
+        {
+            break;
+        }
+        numThreads = min(numThreads << 1, maxThreads);
+    }
+
+    hr = NdCleanup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+    }
+
+    END_LOG(TESTNAME);
+    _fcloseall();
+    WSACleanup();
+    return 0;
+}
@@ -73,6 +73,13 @@ public:
         return m_Freq.QuadPart;
     }
 
+    static LONGLONG Now()
+    {
+        LARGE_INTEGER now;
+        ::QueryPerformanceCounter( &now );
+        return now.QuadPart;
+    }
+
 private:
     double ElapsedMicrosec(
         _In_ LARGE_INTEGER start,
@@ -7,9 +7,12 @@
 #include "ndcommon.h"
 #include <logging.h>
 #include "ndtestutil.h"
+#include "ndmrcache.h"
 
 const SIZE_T x_MaxSize = (4 * 1024 * 1024);
 const SIZE_T x_Iterations = 10000;
+// Distinct message buffers cycled through by the registration cache test.
+const SIZE_T x_CacheBuffers = 16;
 
 const LPCWSTR TESTNAME = L"ndmrlat.exe";
 
@@ -17,8 +20,15 @@ void ShowUsage()
 {
     printf("ndmrlat [options] <IPv4 Address>\n"
         "Options:\n"
+        "\t-m,--mrCache [budgetKB]  Compare per-message registration with and without a\n"
+        "\t                         registration cache keeping up to budgetKB idle (default: %Iu)\n"
+        "\t-L,--largePages          Also register buffers backed by large pages, to compare\n"
+        "\t                         against 4K pages (needs the lock pages privilege)\n"
+        "\t-f,--format <format>     Result format: table (default), csv or json\n"
+        "\t-o,--output <file>       Write results to a given file (default: stdout)\n"
         "\t-l,--logFile <logFile>   Log output to a given file\n"
-        "\t-h,--help                Show this message\n");
+        "\t-h,--help                Show this message\n",
+        MrCache::x_DefaultIdleBudget / 1024);
 }
 
 class NDMrLatencyTest : public NdTestBase
@@ -26,10 +36,8 @@ class NDMrLatencyTest : public NdTestBase
 public:
     ~NDMrLatencyTest()
     {
-        if (m_pBuf != nullptr)
-        {
-            HeapFree(GetProcessHeap(), 0, m_pBuf);
-        }
+        FreeDataBuffer(m_pBuf);
+        FreeDataBuffer(m_pLargeBuf);
 
         if (m_hIocp != nullptr)
         {
@@ -37,17 +45,39 @@ public:
         }
     }
 
-    void InitTest(const struct sockaddr_in &ipAddress)
+    void InitTest(const struct sockaddr_in &ipAddress, bool bLargePages, ResultReport& report)
     {
         NdTestBase::Init(ipAddress);
         NdTestBase::CreateMR();
 
-        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxSize));
+        ND2_ADAPTER_INFO adapterInfo;
+        NdTestBase::GetAdapterInfo(&adapterInfo);
+        report.AddAdapterInfo(adapterInfo);
+
+        m_pBuf = AllocDataBuffer(x_MaxSize, false);
         if (m_pBuf == nullptr)
         {
             LOG_FAILURE_AND_EXIT(L"Failed to allocate memeory\n", __LINE__);
         }
 
+        if (bLargePages)
+        {
+            bool bGotLargePages;
+            m_pLargeBuf = AllocDataBuffer(x_MaxSize, true, &bGotLargePages);
+            if (!bGotLargePages)
+            {
+                // Only the 4K results would be reported twice.  Noted in the
+                // report rather than printed, since stdout may be csv or json.
+                FreeDataBuffer(m_pLargeBuf);
+                m_pLargeBuf = nullptr;
+                report.AddMetadata("LargePages", "unavailable");
+            }
+            else
+            {
+                report.AddMetadata("LargePageSize", static_cast<ULONGLONG>(GetLargePageMinimum()));
+            }
+        }
+
         m_hIocp = CreateIoCompletionPort(m_hAdapterFile, nullptr, 0, 0);
         if (m_hIocp == nullptr)
         {
@@ -56,7 +86,23 @@ public:
         }
     }
 
-    void RunTest(OVERLAPPED *pOv)
+    //runs every size for the given completion mode, once on the 4K page
+    //buffer and once on the large page buffer if there is one
+    void RunTest(OVERLAPPED *pOv, const char *completion, ResultReport& report)
+    {
+        RunTest(pOv, completion, "4K", m_pBuf, report);
+        if (m_pLargeBuf != nullptr)
+        {
+            RunTest(pOv, completion, "large", m_pLargeBuf, report);
+        }
+    }
+
+    void RunTest(
+        OVERLAPPED *pOv,
+        const char *completion,
+        const char *pages,
+        void *pBuf,
+        ResultReport& report)
     {
         Timer timer;
         CpuMonitor cpu;
@@ -79,7 +125,7 @@ public:
             {
                 // Register
                 timer.Start();
-                hr = m_pMr->Register(m_pBuf, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, pOv);
+                hr = m_pMr->Register(pBuf, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, pOv);
                 timer.Split();
 
                 if (FAILED(hr))
@@ -155,45 +201,128 @@ public:
             }
             cpu.End();
 
-            printf(
-                "%9Id %9.2f %9.2f %9.2f %9.2f %7.2f\n",
-                szXfer,
-                totalRegCallTime / x_Iterations,
-                totalRegTime / x_Iterations,
-                totalDeregCallTime / x_Iterations,
-                totalDeregTime / x_Iterations,
-                cpu.Report());
+            report.Value(completion);
+            report.Value(pages);
+            report.Value(static_cast<ULONGLONG>(szXfer));
+            report.Value(totalRegCallTime / x_Iterations);
+            report.Value(totalRegTime / x_Iterations);
+            report.Value(totalDeregCallTime / x_Iterations);
+            report.Value(totalDeregTime / x_Iterations);
+            report.Value(cpu.Report());
+            report.EndRow();
+        }
+    }
+
+    //per-message cost of registering a buffer for every message, against
+    //acquiring it from a registration cache
+    void RunCacheTest(SIZE_T idleBudget, ResultReport& report)
+    {
+        MrCache cache;
+        HRESULT hr = cache.Init(m_pAdapter, m_hAdapterFile, idleBudget);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"MrCache::Init failed with %08x\n", __LINE__);
+        }
+
+        OVERLAPPED ov = { 0 };
+        HANDLE hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (hEvent == nullptr)
+        {
+            printf("Create event failed with %u\n", GetLastError());
+            exit(__LINE__);
+        }
+        // Keep the completions away from the IOCP, as in the event driven test.
+        ov.hEvent = (HANDLE)(((SIZE_T)hEvent) | 0x1);
+
+        Timer timer;
+        for (SIZE_T szXfer = 1; szXfer <= x_MaxSize; szXfer <<= 1)
+        {
+            SIZE_T nBuffers = min(x_CacheBuffers, x_MaxSize / szXfer);
+
+            timer.Start();
+            for (SIZE_T i = 0; i < x_Iterations; i++)
+            {
+                char *pMsg = static_cast<char *>(m_pBuf) + (i % nBuffers) * szXfer;
+                hr = m_pMr->Register(pMsg, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, &ov);
+                if (hr == ND_PENDING)
+                {
+                    hr = m_pMr->GetOverlappedResult(&ov, TRUE);
+                }
+                if (FAILED(hr))
+                {
+                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"RegisterMemory failed with %08x\n", __LINE__);
+                }
+
+                hr = m_pMr->Deregister(&ov);
+                if (hr == ND_PENDING)
+                {
+                    hr = m_pMr->GetOverlappedResult(&ov, TRUE);
+                }
+                if (FAILED(hr))
+                {
+                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"DeregisterMemory failed with %08x\n", __LINE__);
+                }
+            }
+            timer.End();
+            double uncached = timer.Report() / x_Iterations;
+
+            // Start each size cold, so the first use of every buffer misses.
+            cache.Flush();
+            ULONGLONG hits = cache.Hits();
+            ULONGLONG evictions = cache.Evictions();
+
+            timer.Start();
+            for (SIZE_T i = 0; i < x_Iterations; i++)
+            {
+                char *pMsg = static_cast<char *>(m_pBuf) + (i % nBuffers) * szXfer;
+                MrCacheEntry *pEntry;
+                hr = cache.Acquire(pMsg, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, &pEntry);
+                if (FAILED(hr))
+                {
+                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"MrCache::Acquire failed with %08x\n", __LINE__);
+                }
+                cache.Release(pEntry);
+            }
+            timer.End();
+
+            report.Value(static_cast<ULONGLONG>(szXfer));
+            report.Value(static_cast<ULONGLONG>(nBuffers));
+            report.Value(uncached);
+            report.Value(timer.Report() / x_Iterations);
+            report.Value(100.0 * (cache.Hits() - hits) / x_Iterations);
+            report.Value(cache.Evictions() - evictions);
+            report.EndRow();
         }
+
+        CloseHandle(hEvent);
     }
 
 private:
     void *m_pBuf = nullptr;
+    // Backed by large pages, only allocated for the large page comparison.
+    void *m_pLargeBuf = nullptr;
     HANDLE m_hIocp = nullptr;
 };
 
-void InvokeTest(const struct sockaddr_in& v4)
+void InvokeTest(const struct sockaddr_in& v4, bool bLargePages, ResultReport& report)
 {
+    report.AddMetadata("Processors", CpuMonitor::CpuCount());
+    report.AddMetadata("TimerFrequency", Timer::Frequency());
+    report.AddMetadata("Iterations", x_Iterations);
+
     NDMrLatencyTest mrlatencyTest;
-    mrlatencyTest.InitTest(v4);
-
-    printf(
-        "Using %u processors. Sender Frequency is %I64d\n",
-        CpuMonitor::CpuCount(),
-        Timer::Frequency());
-
-    printf(
-        "\n Event Driven:\n"
-        "%29s %19s %7s\n"
-        "%9s %9s %9s %9s %9s\n",
-        "Register (usec)",
-        "Deregister (usec)",
-        "CPU",
-        "Size",
-        "call",
-        "total",
-        "call",
-        "total"
-    );
+    mrlatencyTest.InitTest(v4, bLargePages, report);
+
+    // Times are in microseconds; "call" is the time spent in Register or
+    // Deregister itself, "total" includes waiting for the completion.
+    report.AddColumn("Completion", 10);
+    report.AddColumn("Pages", 5);
+    report.AddColumn("Size", 9);
+    report.AddColumn("RegCall", 9, 2);
+    report.AddColumn("RegTotal", 9, 2);
+    report.AddColumn("DeregCall", 10, 2);
+    report.AddColumn("DeregTotal", 10, 2);
+    report.AddColumn("CPU", 7, 2);
 
     OVERLAPPED Ov;
 
@@ -215,7 +344,7 @@ void InvokeTest(const struct sockaddr_in& v4)
     //
     Ov.hEvent = (HANDLE)(((SIZE_T)Ov.hEvent) | 0x1);
 
-    mrlatencyTest.RunTest(&Ov);
+    mrlatencyTest.RunTest(&Ov, "event", report);
 
     //
     // Now we run again, using the IOCP, to see if performance is any different.
@@ -223,26 +352,42 @@ void InvokeTest(const struct sockaddr_in& v4)
     CloseHandle(Ov.hEvent);
     Ov.hEvent = nullptr;
 
-    printf(
-        "\n IOCP:\n"
-        "%29s %19s %7s\n"
-        "%9s %9s %9s %9s %9s\n",
-        "Register (usec)",
-        "Deregister (usec)",
-        "CPU",
-        "Size",
-        "call",
-        "total",
-        "call",
-        "total"
-    );
+    mrlatencyTest.RunTest(&Ov, "iocp", report);
+    report.End();
+}
+
+void InvokeCacheTest(const struct sockaddr_in& v4, SIZE_T idleBudget, ResultReport& report)
+{
+    report.AddMetadata("Processors", CpuMonitor::CpuCount());
+    report.AddMetadata("TimerFrequency", Timer::Frequency());
+    report.AddMetadata("Iterations", x_Iterations);
+    report.AddMetadata("Buffers", x_CacheBuffers);
+    report.AddMetadata("IdleBudget", idleBudget);
 
-    mrlatencyTest.RunTest(&Ov);
+    NDMrLatencyTest mrlatencyTest;
+    mrlatencyTest.InitTest(v4, false, report);
+
+    // Times are in microseconds per message: "Uncached" registers and
+    // deregisters every message, "Cached" acquires and releases it.
+    report.AddColumn("Size", 9);
+    report.AddColumn("Buffers", 7);
+    report.AddColumn("Uncached", 9, 2);
+    report.AddColumn("Cached", 9, 2);
+    report.AddColumn("Hits", 7, 1, "%");
+    report.AddColumn("Evictions", 9);
+
+    mrlatencyTest.RunCacheTest(idleBudget, report);
+    report.End();
 }
 
 int __cdecl _tmain(int argc, TCHAR* argv[])
 {
     WSADATA wsaData;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
+    bool bCache = false;
+    bool bLargePages = false;
+    SIZE_T cacheBudget = MrCache::x_DefaultIdleBudget;
     INIT_LOG(TESTNAME);
     int ret = ::WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (ret != 0)
@@ -258,6 +403,36 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         {
             RedirectLogsToFile(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-m") == 0) || (wcscmp(arg, L"--mrCache") == 0))
+        {
+            bCache = true;
+            // The budget is optional; the address is always last.
+            if (i < argc - 2 && _istdigit(argv[i + 1][0]))
+            {
+                cacheBudget = static_cast<SIZE_T>(_ttol(argv[++i])) * 1024;
+            }
+        }
+        else if ((wcscmp(arg, L"-L") == 0) || (wcscmp(arg, L"--largePages") == 0))
+        {
+            bLargePages = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-h") == 0) || (wcscmp(arg, L"--help") == 0))
         {
             ShowUsage();
@@ -289,7 +464,16 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
     }
 
-    InvokeTest(v4);
+    ResultReport report;
+    report.Init("ndmrlat", reportFormat, reportFile);
+    if (bCache)
+    {
+        InvokeCacheTest(v4, cacheBudget, report);
+    }
+    else
+    {
+        InvokeTest(v4, bLargePages, report);
+    }
 
     hr = NdCleanup();
     if (FAILED(hr))
@@ -1,17 +1,18 @@
 // Copyright(c) Microsoft Corporation.All rights reserved.
 // Licensed under the MIT License.
 //
-// ndmrlat.cpp - NetworkDirect memory registration bandwidth test
+// ndmrrate.cpp - NetworkDirect memory registration rate test
 //
 
 #include "ndcommon.h"
 #include <logging.h>
 #include "ndtestutil.h"
-#include <map>
 
 const unsigned long x_MaxSize = (4 * 1024 * 1024);
 const unsigned long x_MaxReg = 10000;
 const unsigned long x_MinReg = 2000; // Number of iterations for x_MaxSize.
+const DWORD x_MaxThreads = 256;
+const DWORD x_MaxDepth = 256;
 
 const LPCWSTR TESTNAME = L"ndmrrate.exe";
 
@@ -19,13 +20,18 @@ void ShowUsage()
 {
     printf("ndmrrate [options] <IPv4 Address>\n"
         "Options:\n"
-        "\t-t,--threads <numThreads>   Number of threads for the test (default: 2)\n"
+        "\t-t,--threads <numThreads>   Number of threads for the test (default: 1, max: %u)\n"
+        "\t-s,--sweep                  Run with 1, 2, 4, ... threads up to <numThreads>\n"
+        "\t-q,--depth <depth>          Requests outstanding per thread (default: 1, max: %u)\n"
+        "\t-e,--events                 Wait on an event per request instead of a per-thread IOCP\n"
+        "\t-f,--format <format>        Result format: table (default), csv or json\n"
+        "\t-o,--output <file>          Write results to a given file (default: stdout)\n"
         "\t-l,--logFile <logFile>      Log output to a given file\n"
-        "\t-h,--help                   Show this message\n");
+        "\t-h,--help                   Show this message\n",
+        x_MaxThreads,
+        x_MaxDepth);
 }
 
-std::map <DWORD, volatile unsigned> g_ThreadStatusMap;
-
 class NDMrRateTest;
 struct ThreadParam
 {
@@ -36,68 +42,195 @@ struct ThreadParam
 class NDMrRateTest : public NdTestBase
 {
 public:
-    NDMrRateTest(DWORD numThreads) :
-        m_nThreads(numThreads)
+    NDMrRateTest(DWORD depth, bool bEvents, ResultReport& report) :
+        m_Depth(depth),
+        m_bEvents(bEvents),
+        m_Report(report)
     {
     }
 
     void InitTest(const struct sockaddr_in &ip)
     {
         NdTestBase::Init(ip);
-        m_hIocp = CreateIoCompletionPort(m_hAdapterFile, nullptr, 0, m_nThreads);
-        if (m_hIocp == nullptr)
-        {
-            printf("Failed to bind adapter to IOCP, error %u\n", GetLastError());
-            exit(__LINE__);
-        }
 
-        // reset counters
-        for (unsigned long szXfer = 0; szXfer <= x_MaxSize; szXfer == 0 ? szXfer = 1 : szXfer <<= 1)
-        {
-            g_ThreadStatusMap[szXfer] = 0;
-        }
+        ND2_ADAPTER_INFO adapterInfo;
+        NdTestBase::GetAdapterInfo(&adapterInfo);
+        m_Report.AddAdapterInfo(adapterInfo);
     }
 
-    ~NDMrRateTest()
+    //
+    // Everything a thread needs to drive registrations on its own: an
+    // overlapped file with its own IOCP (or an event per outstanding
+    // request), and memory regions created up front so that only the
+    // Register/Deregister path is timed.
+    //
+    class RegThread
     {
-        if (m_hIocp != nullptr)
+    public:
+        RegThread(IND2Adapter *pAdapter, DWORD depth, bool bEvents) :
+            m_Depth(depth),
+            m_bEvents(bEvents)
         {
-            CloseHandle(m_hIocp);
-        }
-    }
+            HRESULT hr = pAdapter->CreateOverlappedFile(&m_hFile);
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"CreateOverlappedFile failed: %x\n", __LINE__);
+            }
 
-    struct MemRegContext
-    {
-        OVERLAPPED ov;
-        IND2MemoryRegion *pMr;
-    };
+            if (!m_bEvents)
+            {
+                m_hIocp = CreateIoCompletionPort(m_hFile, nullptr, 0, 1);
+                if (m_hIocp == nullptr)
+                {
+                    printf("Failed to bind adapter to IOCP, error %u\n", GetLastError());
+                    exit(__LINE__);
+                }
+            }
 
-    static inline void GetCompletion(HANDLE& hIocp, IND2MemoryRegion *pMr)
-    {
-        DWORD bytes;
-        ULONG_PTR key;
-        OVERLAPPED *pOv;
+            m_pBuf = HeapAlloc(GetProcessHeap(), 0, x_MaxSize);
+            m_pMrContext = new (std::nothrow) MemRegContext[x_MaxReg];
+            m_hEvents = new (std::nothrow) HANDLE[m_Depth];
+            if (m_pBuf == nullptr || m_pMrContext == nullptr || m_hEvents == nullptr)
+            {
+                LOG_FAILURE_AND_EXIT(L"failed to allocate memory\n", __LINE__);
+            }
+            memset(m_pMrContext, 0, sizeof(MemRegContext) * x_MaxReg);
+            memset(m_hEvents, 0, sizeof(HANDLE) * m_Depth);
+
+            if (m_bEvents)
+            {
+                for (DWORD i = 0; i < m_Depth; i++)
+                {
+                    m_hEvents[i] = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+                    if (m_hEvents[i] == nullptr)
+                    {
+                        printf("Create event failed with %u\n", GetLastError());
+                        exit(__LINE__);
+                    }
+                }
+            }
 
-        if (!GetQueuedCompletionStatus(hIocp, &bytes, &key, &pOv, INFINITE))
+            for (unsigned long i = 0; i < x_MaxReg; i++)
+            {
+                hr = pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion,
+                    m_hFile, reinterpret_cast<VOID**>(&(m_pMrContext[i].pMr)));
+                if (hr != ND_SUCCESS)
+                {
+                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"Failed to create memory region: %x\n", __LINE__);
+                }
+            }
+        }
+
+        ~RegThread()
         {
-            LOG_FAILURE_AND_EXIT(L"GetQueuedCompletionStatus failed\n", __LINE__);
+            for (unsigned long i = 0; i < x_MaxReg; i++)
+            {
+                if (m_pMrContext[i].pMr != nullptr)
+                {
+                    m_pMrContext[i].pMr->Release();
+                }
+            }
+            for (DWORD i = 0; i < m_Depth; i++)
+            {
+                if (m_hEvents[i] != nullptr)
+                {
+                    CloseHandle(m_hEvents[i]);
+                }
+            }
+            delete[] m_hEvents;
+            delete[] m_pMrContext;
+            HeapFree(GetProcessHeap(), 0, m_pBuf);
+
+            if (m_hIocp != nullptr)
+            {
+                CloseHandle(m_hIocp);
+            }
+            CloseHandle(m_hFile);
         }
 
-        HRESULT hr = pMr->GetOverlappedResult(pOv, FALSE);
-        if (hr != ND_SUCCESS)
+        //register (or deregister) the first iters regions with up to the
+        //queue depth of requests outstanding
+        void Run(unsigned long iters, unsigned long szXfer, bool bRegister)
         {
-            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"GetOverlappedResult failed\n", __LINE__);
+            unsigned long issued = 0;
+            unsigned long completed = 0;
+            while (completed < iters)
+            {
+                while (issued < iters && issued - completed < m_Depth)
+                {
+                    MemRegContext *pCtx = &m_pMrContext[issued];
+                    pCtx->ov.hEvent = m_hEvents[issued % m_Depth];
+
+                    HRESULT hr;
+                    if (bRegister)
+                    {
+#pragma warning (suppress: 6387) // m_pBuf is already checked for nullptr
+                        hr = pCtx->pMr->Register(m_pBuf, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, &pCtx->ov);
+                    }
+                    else
+                    {
+                        hr = pCtx->pMr->Deregister(&pCtx->ov);
+                    }
+                    if (FAILED(hr))
+                    {
+                        LOG_FAILURE_HRESULT_AND_EXIT(hr,
+                            bRegister ? L"Failed to register memory: %x" : L"Failed to deregister memory: %x",
+                            __LINE__);
+                    }
+                    issued++;
+                }
+
+                GetCompletion(completed);
+                completed++;
+            }
         }
-    }
 
-    static void ThreadBarrier(DWORD size, DWORD nThreads)
-    {
-        // signal completion of current thread
-        InterlockedIncrement(&g_ThreadStatusMap[size]);
+    private:
+        struct MemRegContext
+        {
+            OVERLAPPED ov;
+            IND2MemoryRegion *pMr;
+        };
 
-        // wait until other threads are done
-        while (InterlockedCompareExchange(&g_ThreadStatusMap[size], 0, 0) != nThreads);
-    }
+        void GetCompletion(unsigned long oldest)
+        {
+            MemRegContext *pCtx;
+            BOOL wait;
+            if (m_bEvents)
+            {
+                // Each event is shared by every m_Depth'th request, so
+                // requests are reaped in the order they were issued.
+                pCtx = &m_pMrContext[oldest];
+                wait = TRUE;
+            }
+            else
+            {
+                DWORD bytes;
+                ULONG_PTR key;
+                OVERLAPPED *pOv;
+                if (!GetQueuedCompletionStatus(m_hIocp, &bytes, &key, &pOv, INFINITE))
+                {
+                    LOG_FAILURE_AND_EXIT(L"GetQueuedCompletionStatus failed\n", __LINE__);
+                }
+                pCtx = CONTAINING_RECORD(pOv, MemRegContext, ov);
+                wait = FALSE;
+            }
+
+            HRESULT hr = pCtx->pMr->GetOverlappedResult(&pCtx->ov, wait);
+            if (hr != ND_SUCCESS)
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"GetOverlappedResult failed\n", __LINE__);
+            }
+        }
+
+        DWORD m_Depth;
+        bool m_bEvents;
+        HANDLE m_hFile = nullptr;
+        HANDLE m_hIocp = nullptr;
+        HANDLE *m_hEvents = nullptr;
+        void *m_pBuf = nullptr;
+        MemRegContext *m_pMrContext = nullptr;
+    };
 
     static DWORD WINAPI MrRateTest(void *param)
     {
@@ -107,29 +240,14 @@ public:
             LOG_FAILURE_AND_EXIT(L"Invalid thread param\n", __LINE__);
         }
 
-        void *pBuf = HeapAlloc(GetProcessHeap(), 0, x_MaxSize);
-        if (pBuf == nullptr)
-        {
-            LOG_FAILURE_AND_EXIT(L"failed to allocate memory\n", __LINE__);
-        }
-
 #pragma warning (suppress: 6011) // threadParam and threadParam->m_pTest are already checked for nullptr
-        IND2Adapter *pAdapter = threadParam->m_pTest->m_pAdapter;
-        DWORD numThreads = threadParam->m_pTest->m_nThreads;
+        NDMrRateTest *pTest = threadParam->m_pTest;
+        RegThread regThread(pTest->m_pAdapter, pTest->m_Depth, pTest->m_bEvents);
 
         // wait for other threads to be ready
-        ThreadBarrier(0, numThreads);
+        pTest->m_pBarrier->Wait();
 
         unsigned long iters;
-        MemRegContext *pMrContext = new (std::nothrow) MemRegContext[x_MaxReg];
-        if (pMrContext == nullptr)
-        {
-            HeapFree(GetProcessHeap(), 0, pBuf);
-            LOG_FAILURE_AND_EXIT(L"failed to allocate memory for MemRegContext\n", __LINE__);
-            return -1;
-        }
-        memset(pMrContext, 0, sizeof(MemRegContext) * x_MaxReg);
-
         for (unsigned long szXfer = 1; szXfer <= x_MaxSize; szXfer <<= 1)
         {
             Timer timer;
@@ -143,76 +261,47 @@ public:
                 iters = static_cast<ULONG>((x_MaxSize / szXfer) * x_MinReg);
             }
 
-            // register
-            HRESULT hr;
+            pTest->m_pBarrier->Wait();
             cpu.Start();
             timer.Start();
-            for (unsigned long int i = 0; i < iters; i++)
-            {
-                hr = pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion,
-                    threadParam->m_pTest->m_hAdapterFile, reinterpret_cast<VOID**>(&(pMrContext[i].pMr)));
-                if (hr != ND_SUCCESS)
-                {
-                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"Failed to create memory region: %x\n", __LINE__);
-                }
 
-#pragma warning (suppress: 6387) // pBuf is already checked for nullptr
-                hr = pMrContext[i].pMr->Register(pBuf, szXfer, ND_MR_FLAG_ALLOW_LOCAL_WRITE, &pMrContext[i].ov);
-                if (FAILED(hr))
-                {
-                    LOG_FAILURE_HRESULT_AND_EXIT(hr, L"Failed to register memory: %x", __LINE__);
-                }
-                GetCompletion(threadParam->m_pTest->m_hIocp, pMrContext[i].pMr);
-            }
+            regThread.Run(iters, szXfer, true);
 
-            ThreadBarrier(szXfer, numThreads);
+            pTest->m_pBarrier->Wait();
             timer.Split();
             cpu.Split();
 
-            // deregister
-            for (unsigned long int i = 0; i < iters; i++)
-            {
-                hr = pMrContext[i].pMr->Deregister(&pMrContext[i].ov);
-                if (FAILED(hr))
-                {
-                    LOG_FAILURE_AND_EXIT(L"Failed to deregister memory", __LINE__);
-                }
-                GetCompletion(threadParam->m_pTest->m_hIocp, pMrContext[i].pMr);
-            }
+            regThread.Run(iters, szXfer, false);
 
-            ThreadBarrier(szXfer, numThreads * 2);
+            pTest->m_pBarrier->Wait();
             timer.End();
             cpu.End();
 
             if (threadParam->m_tId == 0)
             {
-                printf(
-                    "%9ul %9ul %9.2f %9.2f  %9.2f %9.2f\n",
-                    szXfer,
-                    iters,
-                    timer.ReportPreSplit() / iters,
-                    cpu.ReportPreSplit(),
-                    timer.ReportPostSplit() / iters,
-                    cpu.ReportPostSplit()
-                );
-            }
-
-            // release memory region
-            for (unsigned long int i = 0; i < iters; i++)
-            {
-                pMrContext[i].pMr->Release();
+                // Rates are for all threads together.
+                double nRegs = static_cast<double>(iters) * pTest->m_nThreads;
+                ResultReport& report = pTest->m_Report;
+                report.Value(pTest->m_nThreads);
+                report.Value(szXfer);
+                report.Value(iters);
+                report.Value(nRegs / (timer.ReportPreSplit() / 1000000));
+                report.Value(timer.ReportPreSplit() / iters);
+                report.Value(cpu.ReportPreSplit());
+                report.Value(nRegs / (timer.ReportPostSplit() / 1000000));
+                report.Value(timer.ReportPostSplit() / iters);
+                report.Value(cpu.ReportPostSplit());
+                report.EndRow();
             }
         }
 
-        HeapFree(GetProcessHeap(), 0, pBuf);
-        delete[] pMrContext;
         return 0;
     }
 
-    void RunTest()
+    void RunTest(DWORD numThreads)
     {
-        HANDLE* hThreads = new (std::nothrow) HANDLE[m_nThreads];
-        ThreadParam *params = new (std::nothrow) ThreadParam[m_nThreads];
+        HANDLE* hThreads = new (std::nothrow) HANDLE[numThreads];
+        ThreadParam *params = new (std::nothrow) ThreadParam[numThreads];
 
         if (hThreads == nullptr || params == nullptr)
         {
@@ -220,7 +309,11 @@ public:
             exit(-1);
         }
 
-        for (DWORD i = 0; i < m_nThreads; i++)
+        ThreadBarrier barrier(numThreads);
+        m_pBarrier = &barrier;
+        m_nThreads = numThreads;
+
+        for (DWORD i = 0; i < numThreads; i++)
         {
             params[i].m_tId = i;
             params[i].m_pTest = this;
@@ -232,7 +325,7 @@ public:
         }
 
         // Wait for the threads to exit.
-        for (DWORD i = 0; i < m_nThreads; i++)
+        for (DWORD i = 0; i < numThreads; i++)
         {
 #pragma warning(push)
 #pragma warning(disable: 6387) //hThreads[i] is already nullptr checked
@@ -242,31 +335,56 @@ public:
 #pragma warning(pop)
         }
 
+        m_pBarrier = nullptr;
         delete[] hThreads;
         delete[] params;
     }
 
 private:
-    HANDLE m_hIocp = nullptr;
-    DWORD m_nThreads;
+    DWORD m_Depth;
+    bool m_bEvents;
+    DWORD m_nThreads = 0;
+    ThreadBarrier *m_pBarrier = nullptr;
+    ResultReport& m_Report;
 };
 
-void InvokeTest(const struct sockaddr_in& ip, DWORD numThreads)
+void InvokeTest(
+    const struct sockaddr_in& ip,
+    DWORD numThreads,
+    bool bSweep,
+    DWORD depth,
+    bool bEvents,
+    ResultReport& report)
 {
-    NDMrRateTest mrRateTest(numThreads);
-    mrRateTest.InitTest(ip);
-
-    printf(
-        "Using %u processors. Sender Frequency is %I64d\n",
-        CpuMonitor::CpuCount(),
-        Timer::Frequency());
+    report.AddMetadata("Processors", CpuMonitor::CpuCount());
+    report.AddMetadata("TimerFrequency", Timer::Frequency());
+    report.AddMetadata("Depth", depth);
+    report.AddMetadata("Completion", bEvents ? "event" : "iocp");
 
-    printf(
-        "                        Register            Deregister\n"
-        "     Size     Iter      usec        CPU     usec         CPU\n"
-    );
+    NDMrRateTest mrRateTest(depth, bEvents, report);
+    mrRateTest.InitTest(ip);
 
-    mrRateTest.RunTest();
+    // Rates are registrations per second across all threads, times are
+    // microseconds per registration on each thread.
+    report.AddColumn("Threads", 7);
+    report.AddColumn("Size", 9);
+    report.AddColumn("Iter", 9);
+    report.AddColumn("Reg/Sec", 11);
+    report.AddColumn("RegUsec", 9, 2);
+    report.AddColumn("RegCPU", 7, 2);
+    report.AddColumn("Dereg/Sec", 11);
+    report.AddColumn("DeregUsec", 9, 2);
+    report.AddColumn("DeregCPU", 8, 2);
+
+    for (DWORD nThreads = bSweep ? 1 : numThreads; ; nThreads = min(nThreads * 2, numThreads))
+    {
+        mrRateTest.RunTest(nThreads);
+        if (nThreads == numThreads)
+        {
+            break;
+        }
+    }
+    report.End();
 }
 
 int __cdecl _tmain(int argc, TCHAR* argv[])
@@ -281,6 +399,11 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     }
 
     DWORD numThreads = 1;
+    bool bSweep = false;
+    DWORD depth = 1;
+    bool bEvents = false;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
     for (int i = 1; i < argc; i++)
     {
         TCHAR *arg = argv[i];
@@ -292,6 +415,40 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         {
             numThreads = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-s") == 0) || (wcscmp(arg, L"--sweep") == 0))
+        {
+            bSweep = true;
+        }
+        else if ((wcscmp(arg, L"-q") == 0) || (wcscmp(arg, L"--depth") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            depth = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-e") == 0) || (wcscmp(arg, L"--events") == 0))
+        {
+            bEvents = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-h") == 0) || (wcscmp(arg, L"--help") == 0))
         {
             ShowUsage();
@@ -312,14 +469,29 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         exit(__LINE__);
     }
 
+    if (numThreads == 0 || numThreads > x_MaxThreads)
+    {
+        printf("Invalid number of threads.\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (depth == 0 || depth > x_MaxDepth)
+    {
+        printf("Invalid queue depth.\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
     HRESULT hr = NdStartup();
     if (FAILED(hr))
     {
         LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x\n", __LINE__);
     }
 
-    printf("Running test with %d threads\n", numThreads);
-    InvokeTest(v4, numThreads);
+    ResultReport report;
+    report.Init("ndmrrate", reportFormat, reportFile);
+    InvokeTest(v4, numThreads, bSweep, depth, bEvents, report);
 
     hr = NdCleanup();
     if (FAILED(hr))
@@ -0,0 +1,1135 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndmsgrate.cpp - NetworkDirect multi-connection message rate test
+//
+
+#include "ndcommon.h"
+#include "ndtestutil.h"
+#include "ndsrq.h"
+#include <logging.h>
+
+const USHORT x_DefaultPort = 54330;
+const ULONG x_MaxXfer = (64 * 1024);
+const ULONG x_HdrLen = 40;
+const SIZE_T x_MaxVolume = (16384 * x_MaxXfer);
+const SIZE_T x_MaxIterations = 500000;
+const ULONG x_WarmupIterations = 1000;
+const DWORD x_MaxThreads = 256;
+const ULONG x_ResultsPerCall = 16;
+// Receives the client keeps posted for credit updates and SYNC acks.
+const DWORD x_ClientRecvs = 4;
+
+// Message sizes 1, 2, 4 ... x_MaxXfer.
+const DWORD x_nSizes = 17;
+// Each connection sends a SYNC after the warmup and after every size.
+const DWORD x_SyncsPerConnection = 1 + x_nSizes;
+
+// Shared receive queue entries, split evenly between the connections.
+const DWORD x_DefaultSrqDepth = 1024;
+// Smallest share that still returns a credit with every update.
+const DWORD x_MinSrqShare = 3;
+// Send queue depth of each connection of the shared receive queue server,
+// which only sends credit updates and SYNC acks.
+const DWORD x_SrqSendDepth = 16;
+
+const LPCWSTR TESTNAME = L"ndmsgrate.exe";
+
+#define RECV_CTXT ((void *) 0x1000)
+#define SEND_CTXT ((void *) 0x2000)
+
+void ShowUsage()
+{
+    printf("ndmsgrate [options] <ip>[:<port>]\n"
+        "Options:\n"
+        "\t-s            - Start as server (listen on IP/Port)\n"
+        "\t-c            - Start as client (connect to server IP/Port)\n"
+        "\t-t <threads>  - Number of connections, each driven by its own thread (default: 1, max: %u)\n"
+        "\t-w            - Use RMA Write (default: Send)\n"
+        "\t-b            - Blocking I/O (wait for CQ notification)\n"
+        "\t-p            - Polling I/O (poll on the CQ) (default)\n"
+        "\t-q <pipeline> - Pipeline limit of <pipeline> requests per connection\n"
+        "\t-r [srqDepth] - Shared receive queue (Send only, pass to both sides): the server\n"
+        "\t                accepts every connection on <port> from one thread and posts their\n"
+        "\t                receives on one shared receive queue of <srqDepth> entries (default: %u)\n"
+        REPORT_USAGE
+        "\t-l <logFile>  - Log output to a file named <logFile>\n"
+        "<ip>            - IPv4 Address\n"
+        "<port>          - Port number of the first connection, (default: %hu)\n"
+        "                  Connection <n> uses <port> + <n> unless -r is given.\n",
+        x_MaxThreads,
+        x_DefaultSrqDepth,
+        x_DefaultPort
+    );
+}
+
+struct PeerInfo
+{
+    UINT32 m_remoteToken;
+    UINT64 m_remoteAddress;
+};
+
+// Private data the server accepts a Send connection with.
+struct ServerInfo
+{
+    // Credits the client starts with.
+    ULONG m_credits;
+    // Receives the server keeps posted for the connection, shared with all
+    // the other connections if m_bShared.
+    ULONG m_recvs;
+    // Bytes each receive takes. The per-connection server lets all its
+    // receives land in one buffer, as it drops the data.
+    ULONG m_recvLength;
+    ULONG m_bShared;
+};
+
+struct ThreadResult
+{
+    ULONG m_iterations;
+    double m_elapsedUs;
+};
+
+// State shared by all the connection threads of one side.
+struct MsgRateRun
+{
+    struct sockaddr_in m_v4Server;
+    struct sockaddr_in m_v4Src;
+    DWORD m_nThreads;
+    bool m_bWrite;
+    bool m_bBlocking;
+    bool m_bSrq;
+    DWORD m_srqDepth;
+    SIZE_T m_nPipeline;
+    ThreadBarrier *m_pBarrier;
+    // m_nThreads * x_nSizes entries, indexed by [thread][size].
+    ThreadResult *m_pResults;
+    // What the server posted for each connection, m_nThreads entries.
+    ServerInfo *m_pServerInfo;
+    // System CPU utilization while each size ran, sampled by thread 0.
+    double m_cpu[x_nSizes];
+    // Adapter and queue depth used by the connections, saved by thread 0.
+    ND2_ADAPTER_INFO m_adapterInfo;
+    DWORD m_queueDepth;
+};
+
+struct ThreadParam
+{
+    DWORD m_tId;
+    MsgRateRun *m_pRun;
+};
+
+void PinThread(DWORD tId)
+{
+    DWORD nCpus = min(CpuMonitor::CpuCount(), static_cast<DWORD>(sizeof(DWORD_PTR) * 8));
+    DWORD_PTR mask = static_cast<DWORD_PTR>(1) << (tId % nCpus);
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+    {
+        LOG_FAILURE_AND_EXIT(L"SetThreadAffinityMask failed\n", __LINE__);
+    }
+}
+
+struct sockaddr_in ConnectionAddress(const MsgRateRun& run, DWORD tId)
+{
+    // The shared receive queue server accepts every connection on one port.
+    struct sockaddr_in v4 = run.m_v4Server;
+    if (!run.m_bSrq)
+    {
+        v4.sin_port = htons(static_cast<USHORT>(ntohs(run.m_v4Server.sin_port) + tId));
+    }
+    return v4;
+}
+
+class NdMsgRateServer : public NdTestServerBase
+{
+public:
+    NdMsgRateServer(bool bWrite, bool bBlocking) :
+        m_bWrite(bWrite),
+        m_bBlocking(bBlocking)
+    {}
+
+    ~NdMsgRateServer()
+    {
+        if (m_pBuf != nullptr)
+        {
+            HeapFree(GetProcessHeap(), 0, m_pBuf);
+        }
+    }
+
+    void RunTest(
+        _In_ const struct sockaddr_in& v4Src,
+        _In_ DWORD queueDepth,
+        _In_ DWORD /*nSge*/)
+    {
+        NdTestBase::Init(v4Src);
+        ND2_ADAPTER_INFO adapterInfo = { 0 };
+        NdTestBase::GetAdapterInfo(&adapterInfo);
+        m_queueDepth = min(adapterInfo.MaxCompletionQueueDepth, adapterInfo.MaxReceiveQueueDepth);
+        m_queueDepth = (queueDepth != 0) ? min(queueDepth, m_queueDepth) : m_queueDepth;
+        m_inlineSizeThreshold = adapterInfo.InlineRequestThreshold;
+
+        NdTestBase::CreateMR();
+        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
+        if (m_pBuf == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
+        }
+
+        ULONG flags = m_bWrite ?
+            ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE :
+            ND_MR_FLAG_ALLOW_LOCAL_WRITE;
+        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen, flags);
+
+        NdTestBase::CreateCQ(m_queueDepth);
+        NdTestBase::CreateConnector();
+        NdTestBase::CreateQueuePair(m_queueDepth, 1, m_inlineSizeThreshold);
+        NdTestServerBase::CreateListener();
+        NdTestServerBase::Listen(v4Src);
+        NdTestServerBase::GetConnectionRequest();
+
+        m_sge.Buffer = m_pBuf;
+        m_sge.BufferLength = x_MaxXfer + x_HdrLen;
+        m_sge.MemoryRegionToken = m_pMr->GetLocalToken();
+
+        if (m_bWrite)
+        {
+            // post receive for the terminate message
+            NdTestBase::PostReceive(&m_sge, 1, RECV_CTXT);
+            NdTestServerBase::Accept(0, 0);
+
+            NdTestBase::CreateMW();
+            NdTestBase::Bind(m_pBuf, x_MaxXfer + x_HdrLen, ND_OP_FLAG_ALLOW_WRITE);
+
+            // send remote token and address
+            PeerInfo *pInfo = reinterpret_cast<PeerInfo *>(m_pBuf);
+            pInfo->m_remoteToken = m_pMw->GetRemoteToken();
+            pInfo->m_remoteAddress = reinterpret_cast<UINT64>(m_pBuf);
+
+            ND2_SGE infoSge = m_sge;
+            infoSge.BufferLength = sizeof(*pInfo);
+            NdTestBase::Send(&infoSge, 1, 0, SEND_CTXT);
+            WaitForCompletionAndCheckContext(SEND_CTXT);
+
+            // The writes complete without involving this side.
+            WaitForCompletionAndCheckContext(RECV_CTXT);
+        }
+        else
+        {
+            for (DWORD i = 0; i < m_queueDepth; i++)
+            {
+                NdTestBase::PostReceive(&m_sge, 1);
+            }
+
+            // advertise one less to account for incoming SYNC message
+            ServerInfo info = { m_queueDepth - 1, m_queueDepth, x_MaxXfer + x_HdrLen, FALSE };
+            NdTestServerBase::Accept(0, 0, &info, sizeof(info));
+            ReceiveMessages();
+        }
+
+        //tear down
+        NdTestBase::Shutdown();
+    }
+
+    void ReceiveMessages()
+    {
+        // Prepare an SGE for sending credit updates.
+        ND2_SGE creditSge;
+        creditSge.Buffer = m_pBuf;
+        creditSge.BufferLength = 1;
+        creditSge.MemoryRegionToken = m_pMr->GetLocalToken();
+
+        SIZE_T threshold = m_queueDepth / 2;
+        HRESULT hr = ND_SUCCESS;
+        auto processCompletion = [&](ND2_RESULT *pResult)
+        {
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            hr = pResult->Status;
+            switch (hr)
+            {
+            case ND_SUCCESS:
+                // Ignore send completions
+                if (pResult->RequestType == Nd2RequestTypeSend)
+                {
+                    break;
+                }
+
+                // Check for SYNC
+                if (pResult->BytesTransferred == 0)
+                {
+                    // ack SYNC message
+                    NdTestBase::Send(nullptr, 0, 0);
+                }
+
+                // Repost receive
+                NdTestBase::PostReceive(&m_sge, 1);
+
+                // Check if credit update is needed.
+                if (--threshold == 0)
+                {
+                    NdTestBase::Send(&creditSge, 1,
+                        creditSge.BufferLength < m_inlineSizeThreshold ? ND_OP_FLAG_INLINE : 0);
+                    threshold = m_queueDepth / 2;
+                }
+
+                __fallthrough;
+            case ND_CANCELED:
+                break;
+
+            default:
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    hr,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+        };
+
+        // Runs until the client disconnects and the receives are flushed.
+        ND2_RESULT results[x_ResultsPerCall];
+        do
+        {
+            WaitForCompletions(results, x_ResultsPerCall, processCompletion, m_bBlocking);
+        } while (hr == ND_SUCCESS);
+    }
+
+private:
+    char *m_pBuf = nullptr;
+    ND2_SGE m_sge = { 0 };
+    DWORD m_queueDepth = 0;
+    DWORD m_inlineSizeThreshold = 0;
+    bool m_bWrite = false;
+    bool m_bBlocking = false;
+};
+
+// Serves every connection from one thread, with the receives of all their
+// queue pairs posted on one shared receive queue.  Each connection gets an
+// even share of the queue as credits, and the queue is refilled before any
+// credits are handed back, so no client can send to an empty queue.
+class NdMsgRateSrqServer : public NdTestServerBase
+{
+public:
+    NdMsgRateSrqServer(DWORD nConnections, bool bBlocking) :
+        m_nConnections(nConnections),
+        m_bBlocking(bBlocking)
+    {}
+
+    ~NdMsgRateSrqServer()
+    {
+        if (m_pConns != nullptr)
+        {
+            for (DWORD i = 0; i < m_nConnections; i++)
+            {
+                if (m_pConns[i].m_pQp != nullptr)
+                {
+                    m_pConns[i].m_pQp->Release();
+                }
+                if (m_pConns[i].m_pConnector != nullptr)
+                {
+                    m_pConns[i].m_pConnector->Release();
+                }
+            }
+            delete[] m_pConns;
+        }
+    }
+
+    // queueDepth is that of the shared receive queue.
+    void RunTest(
+        _In_ const struct sockaddr_in& v4Src,
+        _In_ DWORD queueDepth,
+        _In_ DWORD /*nSge*/)
+    {
+        NdTestBase::Init(v4Src);
+        ND2_ADAPTER_INFO adapterInfo = { 0 };
+        NdTestBase::GetAdapterInfo(&adapterInfo);
+        if (adapterInfo.MaxSharedReceiveQueueDepth == 0)
+        {
+            LOG_FAILURE_AND_EXIT(L"Adapter does not support shared receive queues.", __LINE__);
+        }
+        DWORD srqDepth = min((queueDepth != 0) ? queueDepth : x_DefaultSrqDepth,
+            adapterInfo.MaxSharedReceiveQueueDepth);
+        m_share = srqDepth / m_nConnections;
+        if (m_share < x_MinSrqShare)
+        {
+            LOG_FAILURE_AND_EXIT(L"Shared receive queue too shallow for the number of connections.", __LINE__);
+        }
+        DWORD sendDepth = min(x_SrqSendDepth, adapterInfo.MaxInitiatorQueueDepth);
+        m_inlineSizeThreshold = adapterInfo.InlineRequestThreshold;
+
+        m_pConns = new (std::nothrow) SrqConnection[m_nConnections];
+        if (m_pConns == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"Failed to allocate connections.", __LINE__);
+        }
+
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::AllocPooledBuffer(1, &m_creditBuf);
+        HRESULT hr = m_srq.Init(m_pAdapter, m_hAdapterFile, m_pBufPool, srqDepth, x_MaxXfer + x_HdrLen);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"SharedReceiveQueue::Init failed with %08x", __LINE__);
+        }
+
+        NdTestBase::CreateCQ(min(srqDepth + m_nConnections * sendDepth, adapterInfo.MaxCompletionQueueDepth));
+        NdTestServerBase::CreateListener();
+        NdTestServerBase::Listen(v4Src);
+
+        // advertise one less to account for incoming SYNC message
+        ServerInfo info = { m_share - 1, srqDepth, m_srq.SlotSize(), TRUE };
+        for (DWORD i = 0; i < m_nConnections; i++)
+        {
+            // The base class helpers work on m_pConnector and m_pQp.
+            NdTestBase::CreateConnector();
+            hr = m_pAdapter->CreateQueuePairWithSrq(
+                IID_IND2QueuePair,
+                m_pCq,
+                m_pCq,
+                m_srq.Srq(),
+                &m_pConns[i],
+                sendDepth,
+                1,
+                m_inlineSizeThreshold,
+                reinterpret_cast<VOID**>(&m_pQp)
+            );
+            LogIfErrorExit(hr, ND_SUCCESS, "CreateQueuePairWithSrq failed", __LINE__);
+
+            NdTestServerBase::GetConnectionRequest();
+            NdTestServerBase::Accept(0, 0, &info, sizeof(info));
+
+            m_pConns[i].m_pConnector = m_pConnector;
+            m_pConns[i].m_pQp = m_pQp;
+            m_pConns[i].m_threshold = m_share / 2;
+            m_pConnector = nullptr;
+            m_pQp = nullptr;
+        }
+
+        ReceiveMessages();
+
+        //tear down
+        for (DWORD i = 0; i < m_nConnections; i++)
+        {
+            hr = m_pConns[i].m_pConnector->Disconnect(&m_Ov);
+            if (hr == ND_PENDING)
+            {
+                m_pConns[i].m_pConnector->GetOverlappedResult(&m_Ov, TRUE);
+            }
+        }
+    }
+
+    // Runs until every connection sent its last SYNC and the acks went out.
+    void ReceiveMessages()
+    {
+        ND2_SGE creditSge = m_creditBuf.Sge;
+        DWORD creditFlags = creditSge.BufferLength < m_inlineSizeThreshold ? ND_OP_FLAG_INLINE : 0;
+
+        ULONG nSyncs = m_nConnections * x_SyncsPerConnection;
+        ULONG nSends = 0;
+        HRESULT hr = ND_SUCCESS;
+        auto processCompletion = [&](ND2_RESULT *pResult)
+        {
+            // A client may disconnect before the completion of its last ack
+            // is reaped.
+            if (pResult->RequestType == Nd2RequestTypeSend &&
+                (pResult->Status == ND_SUCCESS || pResult->Status == ND_CANCELED))
+            {
+                nSends--;
+                return;
+            }
+
+            if (pResult->Status != ND_SUCCESS)
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    pResult->Status,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+
+            m_srq.Complete(pResult);
+            SrqConnection *pConn = static_cast<SrqConnection *>(pResult->QueuePairContext);
+
+            // Check for SYNC
+            if (pResult->BytesTransferred == 0)
+            {
+                // ack SYNC message
+                hr = pConn->m_pQp->Send(nullptr, nullptr, 0, 0);
+                LogIfErrorExit(hr, ND_SUCCESS, "Send failed", __LINE__);
+                nSends++;
+                nSyncs--;
+            }
+
+            // Check if credit update is needed; credits must only be
+            // granted for receives that are posted.
+            if (--pConn->m_threshold == 0)
+            {
+                hr = m_srq.Refill();
+                LogIfErrorExit(hr, ND_SUCCESS, "IND2SharedReceiveQueue::Receive failed", __LINE__);
+                hr = pConn->m_pQp->Send(nullptr, &creditSge, 1, creditFlags);
+                LogIfErrorExit(hr, ND_SUCCESS, "Send failed", __LINE__);
+                nSends++;
+                pConn->m_threshold = m_share / 2;
+            }
+        };
+
+        ND2_RESULT results[x_ResultsPerCall];
+        while (nSyncs != 0 || nSends != 0)
+        {
+            WaitForCompletions(results, x_ResultsPerCall, processCompletion, m_bBlocking);
+
+            hr = m_srq.Poll();
+            LogIfErrorExit(hr, ND_SUCCESS, "Refilling the shared receive queue failed", __LINE__);
+        }
+    }
+
+private:
+    struct SrqConnection
+    {
+        IND2Connector *m_pConnector = nullptr;
+        IND2QueuePair *m_pQp = nullptr;
+        // Receives left until the next credit update.
+        ULONG m_threshold = 0;
+    };
+
+    DWORD m_nConnections;
+    SrqConnection *m_pConns = nullptr;
+    SharedReceiveQueue m_srq;
+    PooledBuffer m_creditBuf = {};
+    DWORD m_share = 0;
+    DWORD m_inlineSizeThreshold = 0;
+    bool m_bBlocking = false;
+};
+
+class NdMsgRateClient : public NdTestClientBase
+{
+public:
+    NdMsgRateClient(DWORD tId, MsgRateRun *pRun) :
+        m_tId(tId),
+        m_pRun(pRun)
+    {}
+
+    ~NdMsgRateClient()
+    {
+        if (m_pBuf != nullptr)
+        {
+            HeapFree(GetProcessHeap(), 0, m_pBuf);
+        }
+    }
+
+    void RunTest(
+        _In_ const struct sockaddr_in& v4Src,
+        _In_ const struct sockaddr_in& v4Dst,
+        _In_ DWORD queueDepth,
+        _In_ DWORD /*nSge*/)
+    {
+        NdTestBase::Init(v4Src);
+        ND2_ADAPTER_INFO adapterInfo = { 0 };
+        NdTestBase::GetAdapterInfo(&adapterInfo);
+        m_queueDepth = min(adapterInfo.MaxCompletionQueueDepth, adapterInfo.MaxInitiatorQueueDepth);
+        m_queueDepth = (queueDepth != 0) ? min(queueDepth, m_queueDepth) : m_queueDepth;
+        m_inlineSizeThreshold = adapterInfo.InlineRequestThreshold;
+
+        // Leave room in the CQ for the completions of the posted receives.
+        DWORD maxOutstanding = m_queueDepth > x_ClientRecvs ? m_queueDepth - x_ClientRecvs : 1;
+        m_maxOutstanding = static_cast<ULONG>(min(m_pRun->m_nPipeline, static_cast<SIZE_T>(maxOutstanding)));
+        if (m_tId == 0)
+        {
+            m_pRun->m_adapterInfo = adapterInfo;
+            m_pRun->m_queueDepth = m_queueDepth;
+        }
+
+        NdTestBase::CreateMR();
+        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
+        if (m_pBuf == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
+        }
+        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen, ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+
+        NdTestBase::CreateCQ(m_queueDepth);
+        NdTestBase::CreateConnector();
+        NdTestBase::CreateQueuePair(
+            min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth), 1, m_inlineSizeThreshold);
+
+        m_recvSge.Buffer = m_pBuf;
+        m_recvSge.BufferLength = x_MaxXfer + x_HdrLen;
+        m_recvSge.MemoryRegionToken = m_pMr->GetLocalToken();
+        m_sendSge = m_recvSge;
+
+        if (m_pRun->m_bWrite)
+        {
+            NdTestBase::PostReceive(&m_recvSge, 1, RECV_CTXT);
+            NdTestClientBase::Connect(v4Src, v4Dst, 0, 0);
+            NdTestClientBase::CompleteConnect();
+
+            // wait for incoming peer info message
+            WaitForCompletionAndCheckContext(RECV_CTXT);
+
+            PeerInfo *pInfo = reinterpret_cast<PeerInfo *>(m_pBuf);
+            m_remoteToken = pInfo->m_remoteToken;
+            m_remoteAddress = pInfo->m_remoteAddress;
+        }
+        else
+        {
+            for (DWORD i = 0; i < x_ClientRecvs; i++)
+            {
+                NdTestBase::PostReceive(&m_recvSge, 1);
+            }
+
+            NdTestClientBase::Connect(v4Src, v4Dst, 0, 0);
+
+            // get peer queue depth
+            ULONG len = 0;
+            if (m_pConnector->GetPrivateData(nullptr, &len) != ND_BUFFER_OVERFLOW ||
+                len < sizeof(m_peerQueueDepth))
+            {
+                LOG_FAILURE_AND_EXIT(L"GetPrivateData failed\n", __LINE__);
+            }
+
+            void *tmpBuf = malloc(len);
+            if (tmpBuf == nullptr)
+            {
+                LOG_FAILURE_AND_EXIT(L"Failed to allocate memory\n", __LINE__);
+            }
+
+            HRESULT hr = m_pConnector->GetPrivateData(tmpBuf, &len);
+            if (ND_SUCCESS != hr)
+            {
+                free(tmpBuf);
+                LOG_FAILURE_AND_EXIT(L"Failed to GetPrivateData\n", __LINE__);
+            }
+
+#pragma warning( suppress : 6001 6011 )
+            m_peerQueueDepth = m_nCredits = *((ULONG*)tmpBuf);
+            if (len >= sizeof(ServerInfo))
+            {
+                m_pRun->m_pServerInfo[m_tId] = *static_cast<ServerInfo *>(tmpBuf);
+            }
+            free(tmpBuf);
+
+            NdTestClientBase::CompleteConnect();
+        }
+
+        // warmup
+        m_pRun->m_pBarrier->Wait();
+        SendMessages(x_WarmupIterations, x_HdrLen);
+        m_pRun->m_pBarrier->Wait();
+
+        ThreadResult *pResults = &m_pRun->m_pResults[m_tId * x_nSizes];
+        Timer timer;
+        CpuMonitor cpu;
+        DWORD iSize = 0;
+        for (ULONG szXfer = 1; szXfer <= x_MaxXfer; szXfer <<= 1, iSize++)
+        {
+            ULONG iterations = x_MaxIterations;
+            if (iterations > (x_MaxVolume / szXfer))
+            {
+                iterations = x_MaxVolume / szXfer;
+            }
+
+            m_pRun->m_pBarrier->Wait();
+            if (m_tId == 0)
+            {
+                cpu.Start();
+            }
+            timer.Start();
+
+            HRESULT hr = SendMessages(iterations, szXfer);
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_AND_EXIT(L"Connection unexpectedly aborted.", __LINE__);
+            }
+
+            timer.End();
+            m_pRun->m_pBarrier->Wait();
+            if (m_tId == 0)
+            {
+                cpu.End();
+                m_pRun->m_cpu[iSize] = cpu.Report();
+            }
+
+            pResults[iSize].m_iterations = iterations;
+            pResults[iSize].m_elapsedUs = timer.Report();
+        }
+
+        if (m_pRun->m_bWrite)
+        {
+            // send terminate message
+            NdTestBase::Send(nullptr, 0, 0);
+            WaitForCompletion();
+        }
+
+        //tear down
+        NdTestBase::Shutdown();
+    }
+
+    // Keeps up to m_maxOutstanding messages in flight until iters have been
+    // sent and, for Sends, the server has acknowledged receiving them.
+    HRESULT SendMessages(ULONG iters, ULONG msgSize)
+    {
+        HRESULT hr = ND_SUCCESS;
+        bool bGotSyncAck = false, bSyncSent = false;
+        DWORD flags = msgSize < m_inlineSizeThreshold ? ND_OP_FLAG_INLINE : 0;
+        m_sendSge.BufferLength = msgSize;
+
+        auto processCompletion = [&](ND2_RESULT *pResult)
+        {
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            hr = pResult->Status;
+            switch (hr)
+            {
+            case ND_SUCCESS:
+                if (pResult->RequestType == Nd2RequestTypeReceive)
+                {
+                    if (pResult->BytesTransferred == 0)
+                    {
+                        // sync msg
+                        bGotSyncAck = true;
+                    }
+                    else
+                    {
+                        // got flow control message, update credits
+                        m_nCredits += (m_peerQueueDepth / 2);
+                    }
+                    NdTestBase::PostReceive(&m_recvSge, 1);
+                }
+                else
+                {
+                    m_numOutstanding--;
+                }
+                __fallthrough;
+
+            case ND_CANCELED:
+                break;
+
+            default:
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    hr,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+        };
+
+        ND2_RESULT results[x_ResultsPerCall];
+        for (;;)
+        {
+            if (m_pRun->m_bWrite)
+            {
+                while (iters > 0 && m_numOutstanding < m_maxOutstanding)
+                {
+                    NdTestBase::Write(&m_sendSge, 1, m_remoteAddress, m_remoteToken, flags);
+                    m_numOutstanding++; iters--;
+                }
+
+                // The connection is reliable, so a completed write has landed.
+                if (iters == 0 && m_numOutstanding == 0)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                while (m_nCredits > 0 && iters > 0 && m_numOutstanding < m_maxOutstanding)
+                {
+                    NdTestBase::Send(&m_sendSge, 1, flags);
+                    m_nCredits--; iters--;
+                    m_numOutstanding++;
+                }
+
+                // SYNC after the last message, so that the timing covers
+                // their delivery rather than just their posting.
+                if (iters == 0 && !bSyncSent && m_nCredits > 0 && m_numOutstanding < m_maxOutstanding)
+                {
+                    NdTestBase::Send(nullptr, 0, 0);
+                    m_nCredits--;
+                    m_numOutstanding++;
+                    bSyncSent = true;
+                }
+
+                if (bGotSyncAck && m_numOutstanding == 0)
+                {
+                    break;
+                }
+            }
+
+            WaitForCompletions(results, x_ResultsPerCall, processCompletion, m_pRun->m_bBlocking);
+            if (hr != ND_SUCCESS)
+            {
+                break;
+            }
+        }
+        return hr;
+    }
+
+private:
+    DWORD m_tId;
+    MsgRateRun *m_pRun;
+    char *m_pBuf = nullptr;
+    ND2_SGE m_sendSge = { 0 };
+    ND2_SGE m_recvSge = { 0 };
+    DWORD m_queueDepth = 0;
+    DWORD m_inlineSizeThreshold = 0;
+    ULONG m_maxOutstanding = 0;
+    ULONG m_numOutstanding = 0;
+    ULONG m_nCredits = 0;
+    ULONG m_peerQueueDepth = 0;
+    UINT64 m_remoteAddress = 0;
+    UINT32 m_remoteToken = 0;
+};
+
+DWORD WINAPI ServerThread(void *param)
+{
+    ThreadParam *threadParam = static_cast<ThreadParam *>(param);
+    MsgRateRun *pRun = threadParam->m_pRun;
+    PinThread(threadParam->m_tId);
+
+    NdMsgRateServer server(pRun->m_bWrite, pRun->m_bBlocking);
+    server.RunTest(ConnectionAddress(*pRun, threadParam->m_tId), 0, 1);
+    return 0;
+}
+
+DWORD WINAPI ClientThread(void *param)
+{
+    ThreadParam *threadParam = static_cast<ThreadParam *>(param);
+    MsgRateRun *pRun = threadParam->m_pRun;
+    PinThread(threadParam->m_tId);
+
+    NdMsgRateClient client(threadParam->m_tId, pRun);
+    client.RunTest(pRun->m_v4Src, ConnectionAddress(*pRun, threadParam->m_tId), 0, 1);
+    return 0;
+}
+
+void RunThreads(MsgRateRun *pRun, LPTHREAD_START_ROUTINE threadFn)
+{
+    HANDLE* hThreads = new (std::nothrow) HANDLE[pRun->m_nThreads];
+    ThreadParam *params = new (std::nothrow) ThreadParam[pRun->m_nThreads];
+    if (hThreads == nullptr || params == nullptr)
+    {
+        LOG_FAILURE_AND_EXIT(L"Failed to allocate memory for threads\n", __LINE__);
+    }
+
+    for (DWORD i = 0; i < pRun->m_nThreads; i++)
+    {
+        params[i].m_tId = i;
+        params[i].m_pRun = pRun;
+        hThreads[i] = CreateThread(nullptr, 0, threadFn, &params[i], 0, nullptr);
+        if (hThreads[i] == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"CreateThread failed\n", __LINE__);
+        }
+    }
+
+    // Wait for the threads to exit.
+    for (DWORD i = 0; i < pRun->m_nThreads; i++)
+    {
+#pragma warning(push)
+#pragma warning(disable: 6387) //hThreads[i] is already nullptr checked
+        WaitForSingleObject(hThreads[i], INFINITE);
+        CloseHandle(hThreads[i]);
+#pragma warning(pop)
+    }
+
+    delete[] hThreads;
+    delete[] params;
+}
+
+void ReportResults(const MsgRateRun& run, ResultReport& report)
+{
+    report.AddMetadata("Processors", CpuMonitor::CpuCount());
+    report.AddMetadata("TimerFrequency", Timer::Frequency());
+    report.AddMetadata("Connections", run.m_nThreads);
+    report.AddMetadata("Operation", run.m_bWrite ? "write" : "send");
+    report.AddMetadata("CqMode", run.m_bBlocking ? "blocking" : "polling");
+    report.AddMetadata("Pipeline", run.m_nPipeline);
+    report.AddMetadata("QueueDepth", run.m_queueDepth);
+
+    // A shared receive queue is reported by every connection, while each
+    // connection has receives of its own otherwise.
+    ULONGLONG serverRecvs = 0;
+    ULONGLONG serverRecvBytes = 0;
+    for (DWORD i = 0; i < run.m_nThreads; i++)
+    {
+        const ServerInfo& info = run.m_pServerInfo[i];
+        if (info.m_bShared)
+        {
+            serverRecvs = info.m_recvs;
+            serverRecvBytes = static_cast<ULONGLONG>(info.m_recvs) * info.m_recvLength;
+            break;
+        }
+        serverRecvs += info.m_recvs;
+        serverRecvBytes += static_cast<ULONGLONG>(info.m_recvs) * info.m_recvLength;
+    }
+    report.AddMetadata("ReceiveQueue", run.m_bSrq ? "shared" : "per-connection");
+    report.AddMetadata("ServerRecvs", serverRecvs);
+    report.AddMetadata("ServerRecvBytes", serverRecvBytes);
+    report.AddAdapterInfo(run.m_adapterInfo);
+
+    // CPU is system wide, so the per-thread rows repeat that of the size.
+    report.AddColumn("Thread", 7);
+    report.AddColumn("Size", 9);
+    report.AddColumn("Iter", 9);
+    report.AddColumn("Msgs/Sec", 12);
+    report.AddColumn("Bytes/Sec", 13);
+    report.AddColumn("CPU", 7, 2);
+
+    DWORD iSize = 0;
+    for (ULONG szXfer = 1; szXfer <= x_MaxXfer; szXfer <<= 1, iSize++)
+    {
+        // All connections start together, so the slowest one bounds the
+        // interval over which the aggregate was achieved.
+        double totalMsgs = 0;
+        double maxElapsedUs = 0;
+        for (DWORD i = 0; i < run.m_nThreads; i++)
+        {
+            const ThreadResult& result = run.m_pResults[i * x_nSizes + iSize];
+            totalMsgs += result.m_iterations;
+            maxElapsedUs = max(maxElapsedUs, result.m_elapsedUs);
+        }
+
+        double msgRate = totalMsgs / (maxElapsedUs / 1000000);
+        report.Value("all");
+        report.Value(szXfer);
+        report.Value(run.m_pResults[iSize].m_iterations);
+        report.Value(msgRate);
+        report.Value(msgRate * szXfer);
+        report.Value(run.m_cpu[iSize]);
+        report.EndRow();
+
+        for (DWORD i = 0; i < run.m_nThreads; i++)
+        {
+            const ThreadResult& result = run.m_pResults[i * x_nSizes + iSize];
+            msgRate = result.m_iterations / (result.m_elapsedUs / 1000000);
+
+            char thread[16];
+            sprintf_s(thread, "%u", i);
+            report.Value(thread);
+            report.Value(szXfer);
+            report.Value(result.m_iterations);
+            report.Value(msgRate);
+            report.Value(msgRate * szXfer);
+            report.Value(run.m_cpu[iSize]);
+            report.EndRow();
+        }
+    }
+    report.End();
+}
+
+int __cdecl _tmain(int argc, TCHAR* argv[])
+{
+    bool bServer = false;
+    bool bClient = false;
+    bool bPolling = false;
+    MsgRateRun run = { 0 };
+    run.m_nThreads = 1;
+    run.m_nPipeline = 128;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
+
+    INIT_LOG(TESTNAME);
+
+    WSADATA wsaData;
+    int ret = ::WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (ret != 0)
+    {
+        printf("Failed to initialize Windows Sockets: %d\n", ret);
+        exit(__LINE__);
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        TCHAR *arg = argv[i];
+        if ((wcscmp(arg, L"-s") == 0) || (wcscmp(arg, L"-S") == 0))
+        {
+            bServer = true;
+        }
+        else if ((wcscmp(arg, L"-c") == 0) || (wcscmp(arg, L"-C") == 0))
+        {
+            bClient = true;
+        }
+        else if ((wcscmp(arg, L"-p") == 0) || (wcscmp(arg, L"-P") == 0))
+        {
+            bPolling = true;
+        }
+        else if ((wcscmp(arg, L"-b") == 0) || (wcscmp(arg, L"-B") == 0))
+        {
+            run.m_bBlocking = true;
+        }
+        else if ((wcscmp(arg, L"-w") == 0) || (wcscmp(arg, L"--write") == 0))
+        {
+            run.m_bWrite = true;
+        }
+        else if ((wcscmp(arg, L"-t") == 0) || (wcscmp(arg, L"--threads") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            run.m_nThreads = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-q") == 0) || (wcscmp(arg, L"-Q") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            run.m_nPipeline = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-r") == 0) || (wcscmp(arg, L"--srq") == 0))
+        {
+            run.m_bSrq = true;
+            // The depth is optional; the address is always last.
+            if (i < argc - 2 && _istdigit(argv[i + 1][0]))
+            {
+                run.m_srqDepth = _ttol(argv[++i]);
+            }
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
+        else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
+        {
+            RedirectLogsToFile(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-h") == 0) || (wcscmp(arg, L"--help") == 0))
+        {
+            ShowUsage();
+            exit(0);
+        }
+    }
+
+    // ip address is last parameter
+    int len = sizeof(run.m_v4Server);
+    WSAStringToAddress(argv[argc - 1], AF_INET, nullptr,
+        reinterpret_cast<struct sockaddr*>(&run.m_v4Server), &len);
+
+    if ((bClient && bServer) || (!bClient && !bServer))
+    {
+        printf("Exactly one of client (c or "
+            "server (s) must be specified.\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (run.m_v4Server.sin_addr.s_addr == 0)
+    {
+        printf("Bad address.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (run.m_v4Server.sin_port == 0)
+    {
+        run.m_v4Server.sin_port = htons(x_DefaultPort);
+    }
+
+    if (bPolling && run.m_bBlocking)
+    {
+        printf("Exactly one of blocking (b or polling (p) must be specified.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (run.m_nThreads == 0 || run.m_nThreads > x_MaxThreads ||
+        (!run.m_bSrq && ntohs(run.m_v4Server.sin_port) + run.m_nThreads - 1 > USHRT_MAX))
+    {
+        printf("Invalid number of threads.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (run.m_bSrq && run.m_bWrite)
+    {
+        printf("The shared receive queue (r) only applies to Sends.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (run.m_nPipeline == 0)
+    {
+        printf("Invalid pipeline limit.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    HRESULT hr = NdStartup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x", __LINE__);
+    }
+
+    if (bServer)
+    {
+        if (run.m_bSrq)
+        {
+            NdMsgRateSrqServer server(run.m_nThreads, run.m_bBlocking);
+            server.RunTest(run.m_v4Server, run.m_srqDepth, 1);
+        }
+        else
+        {
+            RunThreads(&run, &ServerThread);
+        }
+    }
+    else
+    {
+        SIZE_T srcLen = sizeof(run.m_v4Src);
+        hr = NdResolveAddress(
+            (const struct sockaddr*)&run.m_v4Server,
+            sizeof(run.m_v4Server),
+            (struct sockaddr*)&run.m_v4Src,
+            &srcLen);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
+        }
+
+        ThreadBarrier barrier(run.m_nThreads);
+        run.m_pBarrier = &barrier;
+        run.m_pResults = new (std::nothrow) ThreadResult[run.m_nThreads * x_nSizes];
+        run.m_pServerInfo = new (std::nothrow) ServerInfo[run.m_nThreads]();
+        if (run.m_pResults == nullptr || run.m_pServerInfo == nullptr)
+        {
+            LOG_FAILURE_AND_EXIT(L"Failed to allocate results.", __LINE__);
+        }
+
+        ResultReport report;
+        report.Init("ndmsgrate", reportFormat, reportFile);
+
+        RunThreads(&run, &ClientThread);
+        ReportResults(run, report);
+        delete[] run.m_pResults;
+        delete[] run.m_pServerInfo;
+    }
+
+    hr = NdCleanup();
+    if (FAILED(hr))
+    {
+        LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdCleanup failed with %08x", __LINE__);
+    }
+
+    END_LOG(TESTNAME);
+    _fcloseall();
+    WSACleanup();
+    return 0;
+}
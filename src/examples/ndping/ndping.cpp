@@ -7,6 +7,10 @@
 
 #include "ndcommon.h"
 #include "ndtestutil.h"
+#include "ndsgl.h"
+#include "ndsend.h"
+#include "ndsignal.h"
+#include "ndcredit.h"
 #include <logging.h>
 
 const USHORT x_DefaultPort = 54324;
@@ -14,6 +18,42 @@ const SIZE_T x_MaxXfer = (4 * 1024 * 1024);
 const ULONG  x_HdrLen = 40;
 const SIZE_T x_MaxVolume = (500 * x_MaxXfer);
 const SIZE_T x_MaxIterations = 500000;
+const ULONG x_DefaultResultsPerCall = 16;
+const ULONG x_MaxResultsPerCall = 64;
+const DWORD x_MaxLayoutSge = 16;
+// Message rate test: messages of up to x_MaxRateXfer bytes split over 1, 2,
+// 4 and up to x_MaxRateSge SGEs.
+const DWORD x_MaxRateSge = 8;
+const ULONG x_MinRateXfer = 8;
+const ULONG x_MaxRateXfer = 512;
+// Credit channel mode: each receive has a buffer of its own, so the depth
+// and message size are capped to bound the memory.
+const DWORD x_ChannelDepth = 256;
+const ULONG x_MaxChannelXfer = 64 * 1024;
+
+// How the client sets up the SGEs of each send.
+enum SgeSetup
+{
+    // PrepareSge once per message size
+    SgeSetupPerSize,
+    // PrepareSge for every message
+    SgeSetupPerMessage,
+    // precomputed SgeLayout, only the lengths are set for every message
+    SgeSetupLayout
+};
+
+const char* SgeSetupName(SgeSetup sgeSetup)
+{
+    switch (sgeSetup)
+    {
+    case SgeSetupPerMessage:
+        return "message";
+    case SgeSetupLayout:
+        return "layout";
+    default:
+        return "size";
+    }
+}
 
 const LPCWSTR TESTNAME = L"ndping.exe";
 
@@ -27,9 +67,26 @@ void ShowUsage()
         "\t-p            - Polling I/O (poll on the CQ) (default)\n"
         "\t-n <nSge>     - Number of scatter/gather entries per transfer (default: 1)\n"
         "\t-q <pipeline> - Pipeline limit of <pipeline> requests\n"
+        "\t-g <results>  - Completions harvested per GetResults call (default: %u, max: %u)\n"
+        "\t-i <interval> - Ask for a completion on every <interval>th send only, and compare\n"
+        "\t                the message rate with signaling every send (client only)\n"
+        "\t-r            - Message rate of small messages over 1 to %u SGEs, with and without\n"
+        "\t                coalescing them into one inline segment (client only)\n"
+        "\t-k            - Flow control with the ndtestutil credit channel instead of the\n"
+        "\t                ping protocol, messages up to %u bytes (both sides)\n"
+        "\t-t <sgl>      - Send SGE setup: size (built per message size, default), message\n"
+        "\t                (built for every message) or layout (precomputed, client only, max\n"
+        "\t                nSge: %u)\n"
+        LARGE_PAGES_USAGE
+        REPORT_USAGE
         "\t-l <logFile>  - Log output to a file named <logFile>\n"
         "<ip>            - IPv4 Address\n"
         "<port>          - Port number, (default: %hu)\n",
+        x_DefaultResultsPerCall,
+        x_MaxResultsPerCall,
+        x_MaxRateSge,
+        x_MaxChannelXfer,
+        x_MaxLayoutSge,
         x_DefaultPort
     );
 }
@@ -38,10 +95,13 @@ class NdPingServer : public NdTestServerBase
 {
 public:
 
-    NdPingServer(char *pBuf, bool useEvents) :
-        m_pBuf(pBuf),
-        m_bUseEvents(useEvents)
-    {}
+    NdPingServer(bool useEvents, ULONG nResultsPerCall, bool bLargePages, bool bCreditChannel) :
+        m_bUseEvents(useEvents),
+        m_nResultsPerCall(nResultsPerCall),
+        m_bCreditChannel(bCreditChannel)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdPingServer()
     {
@@ -57,18 +117,48 @@ public:
         _In_ DWORD nSge)
     {
         NdPingServer::Init(v4Src);
-        NdTestBase::CreateMR();
-        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen, ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::AllocPooledBuffer(x_MaxXfer + x_HdrLen, &m_DataBuf);
+        m_pBuf = static_cast<char *>(m_DataBuf.Sge.Buffer);
 
         ND2_ADAPTER_INFO adapterInfo = { 0 };
         NdTestBase::GetAdapterInfo(&adapterInfo);
         m_queueDepth = min(adapterInfo.MaxCompletionQueueDepth, adapterInfo.MaxReceiveQueueDepth);
         m_queueDepth = (queueDepth != 0) ? min(queueDepth, m_queueDepth) : m_queueDepth;
         m_inlineSizeThreshold = adapterInfo.InlineRequestThreshold;
+        if (m_bCreditChannel)
+        {
+            // Room on the CQ for the sends as well as the receives.
+            m_queueDepth = min(m_queueDepth, x_ChannelDepth);
+            m_queueDepth = min(m_queueDepth, adapterInfo.MaxCompletionQueueDepth / 2);
+        }
 
-        NdTestBase::CreateCQ(m_queueDepth);
+        NdTestBase::CreateCQ(m_bCreditChannel ? 2 * m_queueDepth : m_queueDepth);
         NdTestBase::CreateConnector();
         NdTestBase::CreateQueuePair(m_queueDepth, nSge, m_inlineSizeThreshold);
+        NdTestBase::InitSender(&m_sender, adapterInfo, nSge);
+
+        if (m_bCreditChannel)
+        {
+            // Posts the receives.
+            HRESULT hr = m_channel.Init(m_pQp, m_pBufPool, m_queueDepth, m_queueDepth, nSge, x_MaxChannelXfer);
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"CreditChannel::Init failed with %08x", __LINE__);
+            }
+
+            NdTestServerBase::CreateListener();
+            NdTestServerBase::Listen(v4Src);
+            NdTestServerBase::GetConnectionRequest();
+
+            ULONG credits = m_channel.InitialCredits();
+            NdTestServerBase::Accept(0, 0, &credits, sizeof(credits));
+            ReceiveMessages();
+
+            NdTestBase::Shutdown();
+            return;
+        }
+
         NdTestServerBase::CreateListener();
         NdTestServerBase::Listen(v4Src);
         NdTestServerBase::GetConnectionRequest();
@@ -80,7 +170,7 @@ public:
         }
 
         m_nSge = NdTestBase::PrepareSge(m_sgl, nSge,
-            m_pBuf, x_MaxXfer, x_HdrLen, m_pMr->GetLocalToken());
+            m_pBuf, x_MaxXfer, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
         for (DWORD i = 0; i < m_queueDepth; i++)
         {
             NdTestBase::PostReceive(m_sgl, m_nSge);
@@ -101,27 +191,30 @@ public:
         ND2_SGE creditSge;
         creditSge.Buffer = m_pBuf;
         creditSge.BufferLength = 1;
-        creditSge.MemoryRegionToken = m_pMr->GetLocalToken();
+        creditSge.MemoryRegionToken = m_DataBuf.Sge.MemoryRegionToken;
 
         SIZE_T threshold = m_queueDepth / 2;
         HRESULT hr = ND_SUCCESS;
-        do
+        auto processCompletion = [&](ND2_RESULT *pResult)
         {
-            ND2_RESULT ndRes;
-            WaitForCompletion(&ndRes, m_bUseEvents);
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
 
-            hr = ndRes.Status;
+            hr = pResult->Status;
             switch (hr)
             {
             case ND_SUCCESS:
                 // Ignore send completions
-                if (ndRes.RequestType == Nd2RequestTypeSend)
+                if (pResult->RequestType == Nd2RequestTypeSend)
                 {
                     break;
                 }
 
                 // Check for SYNC
-                if (ndRes.BytesTransferred == 0)
+                if (pResult->BytesTransferred == 0)
                 {
                     // ack SYNC message
                     NdTestBase::Send(nullptr, 0, 0);
@@ -133,8 +226,7 @@ public:
                 // Check if credit update is needed.
                 if (--threshold == 0)
                 {
-                    NdTestBase::Send(&creditSge, 1,
-                        creditSge.BufferLength < m_inlineSizeThreshold ? ND_OP_FLAG_INLINE : 0);
+                    NdTestBase::Send(&creditSge, 1, m_sender.InlineFlag(creditSge.BufferLength));
                     threshold = m_queueDepth / 2;
                 }
 
@@ -148,6 +240,65 @@ public:
                     L"INDCompletionQueue::GetResults returned result with %08x.",
                     __LINE__);
             }
+        };
+
+        ND2_RESULT results[x_MaxResultsPerCall];
+        do
+        {
+            WaitForCompletions(results, m_nResultsPerCall, processCompletion, m_bUseEvents);
+        } while (hr == ND_SUCCESS);
+    }
+
+    //ReceivePings over a CreditChannel, which does the flow control
+    void ReceiveMessages()
+    {
+        HRESULT hr = ND_SUCCESS;
+        ULONG nAcks = 0;
+        auto processCompletion = [&](ND2_RESULT *pResult)
+        {
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            const void *pMessage;
+            ULONG len;
+            hr = m_channel.Complete(pResult, &pMessage, &len);
+            switch (hr)
+            {
+            case ND_SUCCESS:
+                // An empty message is the client's SYNC
+                if (pMessage != nullptr && len == 0)
+                {
+                    nAcks++;
+                }
+                __fallthrough;
+            case ND_CANCELED:
+                break;
+
+            default:
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    hr,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+        };
+
+        ND2_RESULT results[x_MaxResultsPerCall];
+        do
+        {
+            WaitForCompletions(results, m_nResultsPerCall, processCompletion, m_bUseEvents);
+            for (; hr == ND_SUCCESS && nAcks != 0 && m_channel.CanSend(); nAcks--)
+            {
+                hr = m_channel.Send(nullptr, nullptr, 0, m_sender.InlineFlag(CreditChannel::x_HeaderLen));
+                LogIfErrorExit(hr, ND_SUCCESS, "CreditChannel::Send failed", __LINE__);
+            }
+            if (hr == ND_SUCCESS)
+            {
+                hr = m_channel.Flush();
+                LogIfErrorExit(hr, ND_SUCCESS, "CreditChannel::Flush failed", __LINE__);
+            }
         } while (hr == ND_SUCCESS);
     }
 
@@ -155,19 +306,33 @@ private:
     DWORD m_queueDepth = 0;
     ND2_SGE* m_sgl = nullptr;
     DWORD m_nSge = 0;
+    PooledBuffer m_DataBuf = {};
     char *m_pBuf = nullptr;
     bool m_bUseEvents = false;
+    ULONG m_nResultsPerCall = x_DefaultResultsPerCall;
     DWORD m_inlineSizeThreshold = 0;
+    QpSender m_sender;
+    bool m_bCreditChannel = false;
+    CreditChannel m_channel;
 };
 
 class NdPingClient : public NdTestClientBase
 {
 public:
-    NdPingClient(char *pBuf, bool bUseEvents, size_t nPipeline) :
-        m_pBuf(pBuf),
+    NdPingClient(bool bUseEvents, size_t nPipeline, ULONG nResultsPerCall, bool bLargePages,
+        SgeSetup sgeSetup, bool bRateTest, ULONG signalInterval, bool bCreditChannel,
+        ResultReport& report) :
+        m_maxOutSends(nPipeline),
         m_bUseEvents(bUseEvents),
-        m_maxOutSends(nPipeline)
-    {}
+        m_nResultsPerCall(nResultsPerCall),
+        m_SgeSetup(sgeSetup),
+        m_bRateTest(bRateTest),
+        m_signalInterval(signalInterval),
+        m_bCreditChannel(bCreditChannel),
+        m_Report(report)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdPingClient()
     {
@@ -189,19 +354,58 @@ public:
     {
         NdTestBase::Init(v4Src);
 
-        NdTestBase::CreateMR();
-        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen,
-            ND_MR_FLAG_ALLOW_LOCAL_WRITE, ND_SUCCESS, "Register memory failed");
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::AllocPooledBuffer(x_MaxXfer + x_HdrLen, &m_DataBuf,
+            ND_SUCCESS, "Register memory failed");
+        m_pBuf = static_cast<char *>(m_DataBuf.Sge.Buffer);
 
         ND2_ADAPTER_INFO adapterInfo;
         NdTestBase::GetAdapterInfo(&adapterInfo);
         m_queueDepth = min(adapterInfo.MaxCompletionQueueDepth, adapterInfo.MaxInitiatorQueueDepth);
         m_queueDepth = (queueDepth != 0) ? min(queueDepth, m_queueDepth) : m_queueDepth;
         m_inlineSizeThreshold = adapterInfo.InlineRequestThreshold;
+        if (m_bRateTest)
+        {
+            nMaxSge = min(max(nMaxSge, x_MaxRateSge), adapterInfo.MaxInitiatorSge);
+        }
+        if (m_bCreditChannel)
+        {
+            // The channel's header takes an SGE of every send, and the CQ
+            // needs room for the receives as well as the sends.
+            if (adapterInfo.MaxInitiatorSge < 2)
+            {
+                LOG_FAILURE_AND_EXIT(L"The credit channel needs two initiator SGEs.", __LINE__);
+            }
+            nMaxSge = min(nMaxSge, adapterInfo.MaxInitiatorSge - 1);
+            m_queueDepth = min(m_queueDepth, x_ChannelDepth);
+            m_queueDepth = min(m_queueDepth, adapterInfo.MaxCompletionQueueDepth / 2);
+        }
 
-        NdTestBase::CreateCQ(m_queueDepth);
+        NdTestBase::CreateCQ(m_bCreditChannel ? 2 * m_queueDepth : m_queueDepth);
         NdTestBase::CreateConnector();
-        NdTestBase::CreateQueuePair(m_queueDepth, nMaxSge, m_inlineSizeThreshold);
+        NdTestBase::CreateQueuePair(m_queueDepth, m_bCreditChannel ? nMaxSge + 1 : nMaxSge,
+            m_inlineSizeThreshold);
+
+        NdTestBase::InitSender(&m_sender, adapterInfo, nMaxSge);
+        NdTestBase::InitSender(&m_coalescingSender, adapterInfo, nMaxSge, 1, true);
+
+        HRESULT hr = m_sendQueue.Init(m_queueDepth, m_signalInterval);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"SignaledSendQueue::Init failed with %08x", __LINE__);
+        }
+        m_signalInterval = m_sendQueue.SignalInterval();
+
+        if (m_bCreditChannel)
+        {
+            // Only the server's acks and credit updates come back.
+            hr = m_channel.Init(m_pQp, m_pBufPool, static_cast<ULONG>(min(m_maxOutSends, m_queueDepth)),
+                m_queueDepth, nMaxSge + 1, 0);
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"CreditChannel::Init failed with %08x", __LINE__);
+            }
+        }
 
         NdTestClientBase::Connect(v4Src, v4Dst, 0, 0);
 
@@ -219,7 +423,7 @@ public:
             LOG_FAILURE_AND_EXIT(L"Failed to allocate memory\n", __LINE__);
         }
 
-        HRESULT hr = m_pConnector->GetPrivateData(tmpBuf, &len);
+        hr = m_pConnector->GetPrivateData(tmpBuf, &len);
         if (ND_SUCCESS != hr)
         {
             free(tmpBuf);
@@ -231,6 +435,7 @@ public:
 #pragma warning( suppress : 6001 6011 )
         m_peerQueueDepth = m_nCredits = *((ULONG*)tmpBuf);
         free(tmpBuf);
+        m_channel.SetPeerCredits(m_peerQueueDepth);
 
         NdTestClientBase::CompleteConnect();
 
@@ -243,27 +448,77 @@ public:
         }
 
         m_numRecvSge = NdTestBase::PrepareSge(m_recvSgl, nMaxSge,
-            m_pBuf, x_MaxXfer, x_HdrLen, m_pMr->GetLocalToken());
+            m_pBuf, x_MaxXfer, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
+
+        m_nMaxSge = nMaxSge;
+        if (m_SgeSetup == SgeSetupLayout)
+        {
+            hr = m_sendLayout.AddSplit(m_pBuf, x_MaxXfer + x_HdrLen, x_HdrLen,
+                nMaxSge, m_DataBuf.Sge.MemoryRegionToken);
+            if (SUCCEEDED(hr))
+            {
+                hr = m_sendLayout.Validate(adapterInfo.MaxInitiatorSge);
+            }
+            if (FAILED(hr))
+            {
+                LOG_FAILURE_HRESULT_AND_EXIT(hr, L"Invalid send SGE layout, %08x", __LINE__);
+            }
+        }
 
-        printf("Using %u processors. Sender Frequency is %I64d\n\n"
-            " %9s %9s %9s %7s %11s\n",
-            CpuMonitor::CpuCount(),
-            Timer::Frequency(),
-            "Size", "Iter", "Latency", "CPU", "Bytes/Sec"
-        );
+        m_Report.AddMetadata("Processors", CpuMonitor::CpuCount());
+        m_Report.AddMetadata("TimerFrequency", Timer::Frequency());
+        m_Report.AddMetadata("CqMode", m_bUseEvents ? "blocking" : "polling");
+        m_Report.AddMetadata("QueueDepth", m_queueDepth);
+        m_Report.AddMetadata("PeerQueueDepth", m_peerQueueDepth);
+        m_Report.AddMetadata("Pipeline", m_maxOutSends);
+        m_Report.AddMetadata("nSge", nMaxSge);
+        m_Report.AddMetadata("ResultsPerCall", m_nResultsPerCall);
+        m_Report.AddMetadata("LargePages", m_bLargePages ? "requested" : "no");
+        m_Report.AddMetadata("SgeSetup", SgeSetupName(m_SgeSetup));
+        m_Report.AddMetadata("SignalInterval", m_signalInterval);
+        m_Report.AddMetadata("FlowControl", m_bCreditChannel ? "channel" : "ping");
+        m_Report.AddAdapterInfo(adapterInfo);
 
         // warmup iterations
         DWORD numSendSges = NdTestBase::PrepareSge(m_sendSgl, nMaxSge,
-            m_pBuf, x_HdrLen, x_HdrLen, m_pMr->GetLocalToken());
+            m_pBuf, x_HdrLen, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
         SendPings(1000, numSendSges, x_HdrLen);
         Sleep(1000);
 
+        if (m_bRateTest)
+        {
+            RunRateTest();
+            m_Report.End();
+            NdTestBase::Shutdown();
+            return;
+        }
+
+        // With selective signaling, each size is run twice: signaling every
+        // send, then every m_signalInterval'th send.
+        bool bCompareSignaling = (m_signalInterval > 1);
+        m_Report.AddColumn("Size", 9);
+        if (bCompareSignaling)
+        {
+            m_Report.AddColumn("Signal", 6);
+        }
+        m_Report.AddColumn("Iter", 9);
+        m_Report.AddColumn("Latency", 9, 2);
+        m_Report.AddColumn("CPU", 7, 2);
+        m_Report.AddColumn("Bytes/Sec", 11);
+        if (bCompareSignaling)
+        {
+            m_Report.AddColumn("Msgs/Sec", 11);
+            m_Report.AddColumn("Gain", 6, 2, "x");
+        }
+        ResultsPerCallHistogram::AddColumns(m_Report);
+
         Timer timer;
         CpuMonitor cpu;
-        for (ULONG szXfer = 1; szXfer <= x_MaxXfer; szXfer <<= 1)
+        ULONG maxXfer = m_bCreditChannel ? x_MaxChannelXfer : x_MaxXfer;
+        for (ULONG szXfer = 1; szXfer <= maxXfer; szXfer <<= 1)
         {
             numSendSges = NdTestBase::PrepareSge(m_sendSgl, nMaxSge,
-                m_pBuf, szXfer, x_HdrLen, m_pMr->GetLocalToken());
+                m_pBuf, szXfer, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
 
             ULONG iterations = x_MaxIterations;
             if (iterations > (x_MaxVolume / szXfer))
@@ -271,33 +526,110 @@ public:
                 iterations = x_MaxVolume / szXfer;
             }
 
-            cpu.Start();
-            timer.Start();
-            HRESULT hr = SendPings(iterations, numSendSges, szXfer);
-            if (FAILED(hr))
+            double signalAllRate = 0;
+            for (int pass = bCompareSignaling ? 0 : 1; pass < 2; pass++)
             {
-                LOG_FAILURE_AND_EXIT(L"Connection unexpectedly aborted.", __LINE__);
-            }
+                m_sendQueue.SetSignalInterval(pass == 0 ? 1 : m_signalInterval);
+
+                m_ResultsPerCall.Reset();
+                cpu.Start();
+                timer.Start();
+                HRESULT hr = SendPings(iterations, numSendSges, szXfer);
+                if (FAILED(hr))
+                {
+                    LOG_FAILURE_AND_EXIT(L"Connection unexpectedly aborted.", __LINE__);
+                }
 
-            timer.End();
-            cpu.End();
+                timer.End();
+                cpu.End();
 
-            printf(
-                " %9ul %9ul %9.2f %7.2f %11.0f\n",
-                szXfer,
-                iterations,
-                timer.Report() / iterations,
-                cpu.Report(),
-                (double) szXfer * iterations / (timer.Report() / 1000000)
-            );
+                double msgRate = iterations / (timer.Report() / 1000000);
+                if (pass == 0)
+                {
+                    signalAllRate = msgRate;
+                }
+
+                m_Report.Value(szXfer);
+                if (bCompareSignaling)
+                {
+                    m_Report.Value(m_sendQueue.SignalInterval());
+                }
+                m_Report.Value(iterations);
+                m_Report.Value(timer.Report() / iterations);
+                m_Report.Value(cpu.Report());
+                m_Report.Value((double) szXfer * msgRate);
+                if (bCompareSignaling)
+                {
+                    m_Report.Value(msgRate);
+                    m_Report.Value(msgRate / signalAllRate);
+                }
+                m_ResultsPerCall.Report(m_Report);
+                m_Report.EndRow();
+            }
         }
+        m_Report.End();
 
         //tear down
         NdTestBase::Shutdown();
     }
 
+    //message rate of small messages split over 1, 2, 4 and 8 SGEs, posted as
+    //they are and with their segments coalesced into one inline segment
+    void RunRateTest()
+    {
+        m_Report.AddColumn("SGEs", 5);
+        m_Report.AddColumn("Size", 9);
+        m_Report.AddColumn("Coalesce", 8);
+        m_Report.AddColumn("Iter", 9);
+        m_Report.AddColumn("Msgs/Sec", 11);
+        m_Report.AddColumn("CPU", 7, 2);
+
+        Timer timer;
+        CpuMonitor cpu;
+        DWORD maxSge = min(x_MaxRateSge, m_nMaxSge);
+        for (DWORD nSge = 1; nSge <= maxSge; nSge <<= 1)
+        {
+            for (ULONG szXfer = max(x_MinRateXfer, nSge); szXfer <= x_MaxRateXfer; szXfer <<= 1)
+            {
+                // nSge segments of the same size
+                DWORD numSendSges = NdTestBase::PrepareSge(m_sendSgl, nSge,
+                    m_pBuf, szXfer, szXfer / nSge, m_DataBuf.Sge.MemoryRegionToken);
+
+                for (int coalesce = 0; coalesce < 2; coalesce++)
+                {
+                    m_pSender = coalesce ? &m_coalescingSender : &m_sender;
+
+                    ULONG iterations = x_MaxIterations;
+                    cpu.Start();
+                    timer.Start();
+                    HRESULT hr = SendPings(iterations, numSendSges, szXfer);
+                    if (FAILED(hr))
+                    {
+                        LOG_FAILURE_AND_EXIT(L"Connection unexpectedly aborted.", __LINE__);
+                    }
+                    timer.End();
+                    cpu.End();
+
+                    m_Report.Value(static_cast<ULONG>(numSendSges));
+                    m_Report.Value(szXfer);
+                    m_Report.Value(coalesce ? "yes" : "no");
+                    m_Report.Value(iterations);
+                    m_Report.Value(iterations / (timer.Report() / 1000000));
+                    m_Report.Value(cpu.Report());
+                    m_Report.EndRow();
+                }
+            }
+        }
+        m_pSender = &m_sender;
+    }
+
     HRESULT SendPings(size_t iters, DWORD nSge, DWORD msgSize)
     {
+        if (m_bCreditChannel)
+        {
+            return SendMessages(iters, nSge, msgSize);
+        }
+
         HRESULT hr = ND_SUCCESS;
         bool bGotSyncAck = false, bSyncSent = false;
 
@@ -309,11 +641,61 @@ public:
         maxOutSends = (maxOutSends > iters) ? iters : maxOutSends;
         maxOutSends = (maxOutSends > m_queueDepth) ? m_queueDepth : maxOutSends;
 
-        do
+        auto processCompletion = [&](ND2_RESULT *pResult)
         {
-            SIZE_T nResults;
-            ND2_RESULT ndRes;
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            hr = pResult->Status;
+            switch (hr)
+            {
+            case ND_SUCCESS:
+                if (pResult->RequestType == Nd2RequestTypeReceive)
+                {
+                    if (pResult->BytesTransferred == 0)
+                    {
+                        // sync msg
+                        bGotSyncAck = true;
+                    }
+                    else
+                    {
+                        // got flow control message, update credits
+                        m_nCredits += (m_peerQueueDepth / 2);
+                        NdTestBase::PostReceive(m_recvSgl, m_numRecvSge);
+                    }
+                }
+                else
+                {
+                    // Only signaled sends complete, each frees the entries
+                    // of the silent sends before it.
+                    m_sendQueue.Complete();
+                    // send Ack msg if we have sent all the messages
+                    if (iters == 0 && !bSyncSent)
+                    {
+                        NdTestBase::Send(nullptr, 0, m_sendQueue.Next(true));
+                        m_nCredits--;
+                        bSyncSent = true;
+                    }
+                }
+                __fallthrough;
+
+            case ND_CANCELED:
+                break;
+
+            default:
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    hr,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+        };
 
+        ND2_RESULT results[x_MaxResultsPerCall];
+        do
+        {
             // send whaterver possible
             size_t numDone = BlastSend(iters, maxOutSends, nSge, msgSize);
             iters -= numDone;
@@ -323,56 +705,81 @@ public:
                 WaitForEventNotification();
             }
 
-            do
+            // A short batch means the CQ was drained.
+            while (PollCompletions(results, m_nResultsPerCall, processCompletion) == m_nResultsPerCall &&
+                hr == ND_SUCCESS);
+
+        } while ((!bGotSyncAck) && hr == ND_SUCCESS);
+        return hr;
+    }
+
+    //SendPings over a CreditChannel, which does the flow control. An empty
+    //message and the server's echo of it end the run
+    HRESULT SendMessages(size_t iters, DWORD nSge, DWORD msgSize)
+    {
+        HRESULT hr = ND_SUCCESS;
+        bool bGotSyncAck = false, bSyncSent = false;
+        ULONG flags = m_sender.InlineFlag(CreditChannel::x_HeaderLen + msgSize);
+
+        auto processCompletion = [&](ND2_RESULT *pResult)
+        {
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            const void *pMessage;
+            ULONG len;
+            hr = m_channel.Complete(pResult, &pMessage, &len);
+            switch (hr)
             {
-                nResults = m_pCq->GetResults(&ndRes, 1);
-                if (nResults == 0)
+            case ND_SUCCESS:
+                // The server only sends the sync ack.
+                if (pMessage != nullptr)
                 {
-                    break;
+                    bGotSyncAck = true;
                 }
+                __fallthrough;
+            case ND_CANCELED:
+                break;
 
-                hr = ndRes.Status;
-                switch (hr)
-                {
-                case ND_SUCCESS:
-                    if (ndRes.RequestType == Nd2RequestTypeReceive)
-                    {
-                        if (ndRes.BytesTransferred == 0)
-                        {
-                            // sync msg
-                            bGotSyncAck = true;
-                        }
-                        else
-                        {
-                            // got flow control message, update credits
-                            m_nCredits += (m_peerQueueDepth / 2);
-                            NdTestBase::PostReceive(m_recvSgl, m_numRecvSge);
-                        }
-                    }
-                    else
-                    {
-                        m_numOutSends--;
-                        // send Ack msg if we have sent all the messages
-                        if (iters == 0 && !bSyncSent)
-                        {
-                            NdTestBase::Send(nullptr, 0, 0);
-                            m_numOutSends++;
-                            m_nCredits--;
-                            bSyncSent = true;
-                        }
-                    }
-                    __fallthrough;
+            default:
+                LOG_FAILURE_HRESULT_AND_EXIT(
+                    hr,
+                    L"INDCompletionQueue::GetResults returned result with %08x.",
+                    __LINE__);
+            }
+        };
 
-                case ND_CANCELED:
-                    break;
+        ND2_RESULT results[x_MaxResultsPerCall];
+        do
+        {
+            for (; iters > 0 && m_channel.CanSend(); iters--)
+            {
+                hr = m_channel.Send(nullptr, m_sendSgl, nSge, flags);
+                LogIfErrorExit(hr, ND_SUCCESS, "CreditChannel::Send failed", __LINE__);
+            }
+            if (iters == 0 && !bSyncSent && m_channel.CanSend())
+            {
+                hr = m_channel.Send(nullptr, nullptr, 0, m_sender.InlineFlag(CreditChannel::x_HeaderLen));
+                LogIfErrorExit(hr, ND_SUCCESS, "CreditChannel::Send failed", __LINE__);
+                bSyncSent = true;
+            }
+            if (!m_channel.CanSend() || bSyncSent)
+            {
+                hr = m_channel.Flush();
+                LogIfErrorExit(hr, ND_SUCCESS, "CreditChannel::Flush failed", __LINE__);
+            }
 
-                default:
-                    LOG_FAILURE_HRESULT_AND_EXIT(
-                        hr,
-                        L"INDCompletionQueue::GetResults returned result with %08x.",
-                        __LINE__);
-                }
-            } while (nResults != 0);
+            if (m_bUseEvents)
+            {
+                WaitForEventNotification();
+            }
+
+            // A short batch means the CQ was drained.
+            while (PollCompletions(results, m_nResultsPerCall, processCompletion) == m_nResultsPerCall &&
+                hr == ND_SUCCESS);
 
         } while ((!bGotSyncAck) && hr == ND_SUCCESS);
         return hr;
@@ -381,26 +788,59 @@ public:
     size_t BlastSend(size_t iters, size_t maxOutSends, DWORD nSge, DWORD msgSize)
     {
         size_t numSent = 0;
-        while (m_nCredits != 0 && iters > 0 && m_numOutSends < maxOutSends)
+        while (m_nCredits != 0 && iters > 0 && m_sendQueue.Outstanding() < maxOutSends)
         {
-            NdTestBase::Send(m_sendSgl, nSge, msgSize < m_inlineSizeThreshold ? ND_OP_FLAG_INLINE : 0);
+            const ND2_SGE *pSgl = m_sendSgl;
+            switch (m_SgeSetup)
+            {
+            case SgeSetupPerMessage:
+                nSge = NdTestBase::PrepareSge(m_sendSgl, m_nMaxSge,
+                    m_pBuf, msgSize, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
+                break;
+            case SgeSetupLayout:
+                nSge = m_sendLayout.SetLength(msgSize);
+                pSgl = m_sendLayout.Sgl();
+                break;
+            default:
+                break;
+            }
+
+            // The last send of the run, and the one that fills the pipeline,
+            // must report back.
+            ULONG flags = m_sendQueue.Next(
+                iters == 1 || m_sendQueue.Outstanding() + 1 == maxOutSends);
+            HRESULT hr = m_pSender->Send(nullptr, pSgl, nSge, flags);
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Send failed", __LINE__);
             m_nCredits--; iters--;
-            numSent++; m_numOutSends++;
+            numSent++;
         }
         return numSent;
     }
 
 private:
+    PooledBuffer m_DataBuf = {};
     char *m_pBuf = nullptr;
     DWORD m_queueDepth = 0;
     size_t m_maxOutSends = 0;
-    size_t m_numOutSends = 0;
     bool m_bUseEvents = false;
+    ULONG m_nResultsPerCall = x_DefaultResultsPerCall;
     ULONG m_nCredits = 0;
     ULONG m_peerQueueDepth = 0;
     ND2_SGE *m_sendSgl = nullptr, *m_recvSgl = nullptr;
     DWORD m_numRecvSge = 0;
+    DWORD m_nMaxSge = 0;
+    SgeSetup m_SgeSetup = SgeSetupPerSize;
+    SgeLayout<x_MaxLayoutSge> m_sendLayout;
+    bool m_bRateTest = false;
+    QpSender m_sender;
+    QpSender m_coalescingSender;
+    QpSender *m_pSender = &m_sender;
+    ULONG m_signalInterval = 1;
+    SignaledSendQueue m_sendQueue;
+    bool m_bCreditChannel = false;
+    CreditChannel m_channel;
     DWORD m_inlineSizeThreshold = 0;
+    ResultReport& m_Report;
 };
 
 int __cdecl _tmain(int argc, TCHAR* argv[])
@@ -411,7 +851,15 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     DWORD nSge = 1;
     bool bPolling = false;
     bool bBlocking = false;
+    bool bLargePages = false;
+    SgeSetup sgeSetup = SgeSetupPerSize;
+    bool bRateTest = false;
+    ULONG signalInterval = 1;
+    bool bCreditChannel = false;
     SIZE_T nPipeline = 128;
+    ULONG nResultsPerCall = x_DefaultResultsPerCall;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
 
     INIT_LOG(TESTNAME);
 
@@ -460,6 +908,79 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             }
             nPipeline = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-g") == 0) || (wcscmp(arg, L"-G") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            nResultsPerCall = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-i") == 0) || (wcscmp(arg, L"--signal") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            signalInterval = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-k") == 0) || (wcscmp(arg, L"--credit") == 0))
+        {
+            bCreditChannel = true;
+        }
+        else if ((wcscmp(arg, L"-r") == 0) || (wcscmp(arg, L"--rate") == 0))
+        {
+            bRateTest = true;
+        }
+        else if ((wcscmp(arg, L"-t") == 0) || (wcscmp(arg, L"--sgl") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            TCHAR *mode = argv[++i];
+            if (_wcsicmp(mode, L"size") == 0)
+            {
+                sgeSetup = SgeSetupPerSize;
+            }
+            else if (_wcsicmp(mode, L"message") == 0)
+            {
+                sgeSetup = SgeSetupPerMessage;
+            }
+            else if (_wcsicmp(mode, L"layout") == 0)
+            {
+                sgeSetup = SgeSetupLayout;
+            }
+            else
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-L") == 0) || (wcscmp(arg, L"--largePages") == 0))
+        {
+            bLargePages = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
         {
             RedirectLogsToFile(argv[++i]);
@@ -510,21 +1031,43 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         exit(__LINE__);
     }
 
+    if (bRateTest && sgeSetup != SgeSetupPerSize)
+    {
+        printf("The message rate test (r) sets up its own SGEs, it can't be combined with (t).\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (bCreditChannel && (bRateTest || sgeSetup != SgeSetupPerSize || signalInterval > 1))
+    {
+        printf("The credit channel (k) posts its own sends, it can't be combined with (r), (t) or (i).\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (signalInterval == 0)
+    {
+        printf("Invalid signal interval\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (nResultsPerCall == 0 || nResultsPerCall > x_MaxResultsPerCall)
+    {
+        printf("Invalid number of completions per call.\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
     HRESULT hr = NdStartup();
     if (FAILED(hr))
     {
         LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x", __LINE__);
     }
 
-    char *pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
-    if (!pBuf)
-    {
-        LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
-    }
     if (bServer)
     {
-#pragma warning (suppress: 6001) // ignore unitialized memory warning for pBuf
-        NdPingServer server(pBuf, bBlocking);
+        NdPingServer server(bBlocking, nResultsPerCall, bLargePages, bCreditChannel);
         server.RunTest(v4Server, 0, nSge);
     }
     else
@@ -538,16 +1081,17 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             &len);
         if (FAILED(hr))
         {
-            HeapFree(GetProcessHeap(), 0, pBuf);
             LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
         }
 
-#pragma warning (suppress: 6001) // ignore unitialized memory warning for pBuf
-        NdPingClient client(pBuf, bBlocking, nPipeline);
+        ResultReport report;
+        report.Init("ndping", reportFormat, reportFile);
+
+        NdPingClient client(bBlocking, nPipeline, nResultsPerCall, bLargePages, sgeSetup, bRateTest,
+            signalInterval, bCreditChannel, report);
         client.RunTest(v4Src, v4Server, 0, nSge);
     }
 
-    HeapFree(GetProcessHeap(), 0, pBuf);
     hr = NdCleanup();
     if (FAILED(hr))
     {
@@ -6,6 +6,8 @@
 
 #include "ndcommon.h"
 #include "ndtestutil.h"
+#include "ndsrq.h"
+#include "ndsend.h"
 #include "logging.h"
 #include <functional>
 
@@ -14,6 +16,8 @@ const DWORD x_MaxXfer = (4 * 1024 * 1024);
 const DWORD x_HdrLen = 40;
 const SIZE_T x_MaxVolume = (500 * x_MaxXfer);
 const DWORD x_MaxIterations = 100000;
+// Shared receive queue entries; only one ping is in flight at a time.
+const DWORD x_DefaultSrqDepth = 8;
 const LPCWSTR TESTNAME = L"ndpingpong.exe";
 
 void ShowUsage()
@@ -24,11 +28,20 @@ void ShowUsage()
         "\t-c            - Start as client (connect to server IP/Port)\n"
         "\t-b            - Blocking I/O (wait for CQ notification)\n"
         "\t-p            - Polling I/O (poll on the CQ) (default)\n"
+        "\t-a [maxSpin]  - Adaptive I/O (poll on the CQ for up to <maxSpin> us,\n"
+        "\t                then wait for CQ notification) (default maxSpin: %u)\n"
         "\t-n <nSge>     - Number of scatter/gather entries per transfer (default: 1)\n"
         "\t-q <pipeline> - Pipeline limit of <pipeline> requests\n"
+        "\t-d <histFile> - Dump the raw round trip histograms to a file named <histFile> (client only)\n"
+        "\t-r [srqDepth] - Post receives on a shared receive queue of <srqDepth> entries, refilled\n"
+        "\t                when half of them are left (server only) (default srqDepth: %u)\n"
+        LARGE_PAGES_USAGE
+        REPORT_USAGE
         "\t-l <logFile>  - Log output to a file named <logFile>\n"
         "<ip>            - IPv4 Address\n"
         "<port>          - Port number, (default: %hu)\n",
+        CqPoller::x_DefaultMaxSpinUs,
+        x_DefaultSrqDepth,
         x_DefaultPort
     );
 }
@@ -37,10 +50,14 @@ class NdPingPongServer : public NdTestServerBase
 {
 public:
 
-    NdPingPongServer(char *pBuf, bool useEvents) :
-        m_pBuf(pBuf),
-        m_bUseEvents(useEvents)
-    {}
+    //srqDepth of 0 posts the receives on the queue pair
+    NdPingPongServer(CqWaitMode waitMode, ULONG maxSpinUs, bool bLargePages, DWORD srqDepth) :
+        m_WaitMode(waitMode),
+        m_MaxSpinUs(maxSpinUs),
+        m_srqDepth(srqDepth)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdPingPongServer()
     {
@@ -61,8 +78,9 @@ public:
         _In_ DWORD nSge)
     {
         NdPingPongServer::Init(v4Src);
-        NdTestBase::CreateMR();
-        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen, ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::AllocPooledBuffer(x_MaxXfer + x_HdrLen, &m_DataBuf);
+        m_pBuf = static_cast<char *>(m_DataBuf.Sge.Buffer);
 
         ND2_ADAPTER_INFO adapterInfo = { 0 };
         NdTestBase::GetAdapterInfo(&adapterInfo);
@@ -72,8 +90,17 @@ public:
         m_inlineThreshold = adapterInfo.InlineRequestThreshold;
 
         NdTestBase::CreateCQ(m_queueDepth);
+        m_Poller.Init(m_pCq, m_WaitMode, m_MaxSpinUs);
         NdTestBase::CreateConnector();
-        NdTestBase::CreateQueuePair(m_queueDepth, nSge, m_inlineThreshold);
+        if (m_srqDepth != 0)
+        {
+            CreateSrqQueuePair(adapterInfo, nSge);
+        }
+        else
+        {
+            NdTestBase::CreateQueuePair(m_queueDepth, nSge, m_inlineThreshold);
+        }
+        NdTestBase::InitSender(&m_sender, adapterInfo, nSge);
 
         NdTestServerBase::CreateListener();
         NdTestServerBase::Listen(v4Src);
@@ -90,8 +117,8 @@ public:
 
         // prepare recv sge's and post recvs
         m_nRecvSge = NdTestBase::PrepareSge(m_recvSgl, nSge,
-            m_pBuf, x_MaxXfer, x_HdrLen, m_pMr->GetLocalToken());
-        for (size_t i = 0; i < m_queueDepth; i++)
+            m_pBuf, x_MaxXfer, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
+        for (size_t i = 0; m_srqDepth == 0 && i < m_queueDepth; i++)
         {
             NdTestBase::PostReceive(m_recvSgl, m_nRecvSge, &m_bRecvCompleted);
         }
@@ -117,20 +144,59 @@ public:
         NdTestBase::Shutdown();
     }
 
+    // The shared receive queue takes whole messages, so its receives need a
+    // single SGE whatever nSge is.
+    void CreateSrqQueuePair(const ND2_ADAPTER_INFO& adapterInfo, DWORD nSge)
+    {
+        if (adapterInfo.MaxSharedReceiveQueueDepth == 0)
+        {
+            LOG_FAILURE_AND_EXIT(L"Adapter does not support shared receive queues.", __LINE__);
+        }
+        m_srqDepth = min(m_srqDepth, adapterInfo.MaxSharedReceiveQueueDepth);
+
+        HRESULT hr = m_Srq.Init(m_pAdapter, m_hAdapterFile, m_pBufPool, m_srqDepth,
+            x_MaxXfer + x_HdrLen, m_srqDepth / 2);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"SharedReceiveQueue::Init failed with %08x", __LINE__);
+        }
+
+        hr = m_pAdapter->CreateQueuePairWithSrq(
+            IID_IND2QueuePair,
+            m_pCq,
+            m_pCq,
+            m_Srq.Srq(),
+            nullptr,
+            m_queueDepth,
+            nSge,
+            m_inlineThreshold,
+            reinterpret_cast<VOID**>(&m_pQp)
+        );
+        LogIfErrorExit(hr, ND_SUCCESS, "CreateQueuePairWithSrq failed", __LINE__);
+    }
+
     void Pong(DWORD nIters, DWORD len)
     {
         // prepare send sge
         DWORD nSendSge = NdTestBase::PrepareSge(m_sendSgl, m_nMaxSge,
-            m_pBuf, len, x_HdrLen, m_pMr->GetLocalToken());
-        DWORD txFlags = len < m_inlineThreshold ? ND_OP_FLAG_INLINE : 0;
+            m_pBuf, len, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
 
         DWORD nResults = 0;
         bool bCancelled = false;
-        const std::function<void(ND2_RESULT *)> processCompletionFn = [&bCancelled](ND2_RESULT *pComp)
+        const std::function<void(ND2_RESULT *)> processCompletionFn = [this, &bCancelled](ND2_RESULT *pComp)
         {
             if (pComp->Status == ND_SUCCESS)
             {
-                *(reinterpret_cast<bool *>(pComp->RequestContext)) = true;
+                if (m_srqDepth != 0 && pComp->RequestType == Nd2RequestTypeReceive)
+                {
+                    // The context of a shared receive is its slot.
+                    m_Srq.Complete(pComp);
+                    m_bRecvCompleted = true;
+                }
+                else
+                {
+                    *(reinterpret_cast<bool *>(pComp->RequestContext)) = true;
+                }
             }
             else if (pComp->Status == ND_CANCELED)
             {
@@ -147,27 +213,45 @@ public:
             // wait for recv
             while (!m_bRecvCompleted && !bCancelled)
             {
-                WaitForCompletion(processCompletionFn, m_bUseEvents);
+                m_Poller.WaitForCompletion(processCompletionFn);
             }
             m_bRecvCompleted = false;
-            NdTestBase::PostReceive(m_recvSgl, m_nRecvSge, &m_bRecvCompleted);
+            if (m_srqDepth == 0)
+            {
+                NdTestBase::PostReceive(m_recvSgl, m_nRecvSge, &m_bRecvCompleted);
+            }
 
             // send pong and wait for send completion
-            NdTestBase::Send(m_sendSgl, nSendSge, txFlags, &m_bSendCompleted);
+            HRESULT hr = m_sender.Send(&m_bSendCompleted, m_sendSgl, nSendSge, 0);
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Send failed", __LINE__);
+
+            // Refill while the pong is on its way, not on the ping's path.
+            if (m_srqDepth != 0)
+            {
+                hr = m_Srq.Poll();
+                LogIfErrorExit(hr, ND_SUCCESS, "Refilling the shared receive queue failed", __LINE__);
+            }
+
             while (!m_bSendCompleted && !bCancelled)
             {
-                WaitForCompletion(processCompletionFn, m_bUseEvents);
+                m_Poller.WaitForCompletion(processCompletionFn);
             }
             m_bSendCompleted = false;
         }
     }
 
 private:
+    PooledBuffer m_DataBuf = {};
     char *m_pBuf = nullptr;
     ND2_SGE* m_sendSgl = nullptr;
     ND2_SGE* m_recvSgl = nullptr;
     DWORD m_nMaxSge = 0, m_nRecvSge = 0, m_queueDepth = 0, m_inlineThreshold = 0;
-    bool m_bUseEvents = false;
+    CqWaitMode m_WaitMode = CqWaitPoll;
+    ULONG m_MaxSpinUs = CqPoller::x_DefaultMaxSpinUs;
+    CqPoller m_Poller;
+    QpSender m_sender;
+    DWORD m_srqDepth = 0;
+    SharedReceiveQueue m_Srq;
     bool m_bSendCompleted = false;
     bool m_bRecvCompleted = false;
 };
@@ -175,10 +259,15 @@ private:
 class NdPingPongClient : public NdTestClientBase
 {
 public:
-    NdPingPongClient(char *pBuf, bool bUseEvents) :
-        m_pBuf(pBuf),
-        m_bUseEvents(bUseEvents)
-    {}
+    NdPingPongClient(CqWaitMode waitMode, ULONG maxSpinUs, bool bLargePages, FILE *pHistFile,
+        ResultReport& report) :
+        m_WaitMode(waitMode),
+        m_MaxSpinUs(maxSpinUs),
+        m_pHistFile(pHistFile),
+        m_Report(report)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdPingPongClient()
     {
@@ -201,9 +290,10 @@ public:
     {
         NdTestBase::Init(v4Src);
 
-        NdTestBase::CreateMR();
-        NdTestBase::RegisterDataBuffer(m_pBuf, x_MaxXfer + x_HdrLen,
-            ND_MR_FLAG_ALLOW_LOCAL_WRITE, ND_SUCCESS, "Register memory failed");
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        NdTestBase::AllocPooledBuffer(x_MaxXfer + x_HdrLen, &m_DataBuf,
+            ND_SUCCESS, "Register memory failed");
+        m_pBuf = static_cast<char *>(m_DataBuf.Sge.Buffer);
 
         ND2_ADAPTER_INFO adapterInfo;
         NdTestBase::GetAdapterInfo(&adapterInfo);
@@ -213,8 +303,10 @@ public:
         m_inlineThreshold = adapterInfo.InlineRequestThreshold;
 
         NdTestBase::CreateCQ(m_queueDepth);
+        m_Poller.Init(m_pCq, m_WaitMode, m_MaxSpinUs);
         NdTestBase::CreateConnector();
         NdTestBase::CreateQueuePair(m_queueDepth, nMaxSge, m_inlineThreshold);
+        NdTestBase::InitSender(&m_sender, adapterInfo, nMaxSge);
 
         NdTestClientBase::Connect(v4Src, v4Dst, 0, 0);
         NdTestClientBase::CompleteConnect();
@@ -230,17 +322,28 @@ public:
 
         // prepare recv sge's and post recvs
         m_nRecvSge = NdTestBase::PrepareSge(m_recvSgl, nMaxSge,
-            m_pBuf, x_MaxXfer, x_HdrLen, m_pMr->GetLocalToken());
+            m_pBuf, x_MaxXfer, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
         for (size_t i = 0; i < m_queueDepth; i++)
         {
             NdTestBase::PostReceive(m_recvSgl, m_nRecvSge, &m_bRecvCompleted);
         }
 
-        printf("Using %u processors. Sender Frequency is %I64d\n\n"
-            " %9s %9s %9s %7s %11s\n",
-            CpuMonitor::CpuCount(),
-            Timer::Frequency(),
-            "Size", "Iter", "Latency", "CPU", "Bytes/Sec");
+        m_Report.AddMetadata("Processors", CpuMonitor::CpuCount());
+        m_Report.AddMetadata("TimerFrequency", Timer::Frequency());
+        m_Report.AddMetadata("CqMode", CqWaitModeName(m_WaitMode));
+        m_Report.AddMetadata("Latencies", "half round trips in microseconds");
+        m_Report.AddMetadata("QueueDepth", m_queueDepth);
+        m_Report.AddMetadata("nSge", nMaxSge);
+        m_Report.AddMetadata("LargePages", m_bLargePages ? "requested" : "no");
+        m_Report.AddAdapterInfo(adapterInfo);
+
+        m_Report.AddColumn("Size", 9);
+        m_Report.AddColumn("Iter", 9);
+        m_Report.AddColumn("Latency", 9, 2);
+        m_Report.AddColumn("CPU", 7, 2);
+        m_Report.AddColumn("Bytes/Sec", 11);
+        m_Report.AddColumn("Blocked", 7, 1, "%");
+        LatencyHistogram::AddColumns(m_Report);
 
         // warmup iterations
         Ping(1000, x_HdrLen);
@@ -254,6 +357,8 @@ public:
                 iterations = x_MaxVolume / szXfer;
             }
 
+            m_Poller.ResetCounters();
+            m_Latency.Reset();
             m_Cpu.Start();
             m_Timer.Start();
 
@@ -266,13 +371,22 @@ public:
             double bytesSec = 2.0 * szXfer * iterations / (m_Timer.Report() / 1000000.0);
             // Factor of 2 to account for half-round trip latency.
             double latency = (m_Timer.Report() / iterations) / 2.0;
-            printf(" %9ul %9ul %9.2f %7.2f %11.0f\n",
-                szXfer,
-                iterations,
-                latency,
-                m_Cpu.Report(),
-                bytesSec);
+            // Blocked is the percentage of CQ waits that blocked on Notify.
+            m_Report.Value(szXfer);
+            m_Report.Value(iterations);
+            m_Report.Value(latency);
+            m_Report.Value(m_Cpu.Report());
+            m_Report.Value(bytesSec);
+            m_Report.Value(m_Poller.BlockedPercent());
+            m_Latency.Report(m_Report, 2);
+            m_Report.EndRow();
+
+            if (m_pHistFile != nullptr)
+            {
+                m_Latency.Dump(m_pHistFile, szXfer);
+            }
         }
+        m_Report.End();
 
         //tear down
         NdTestBase::Shutdown();
@@ -282,8 +396,7 @@ public:
     {
         // prepare send sge
         DWORD nSendSge = NdTestBase::PrepareSge(m_sendSgl, m_nMaxSge,
-            m_pBuf, len, x_HdrLen, m_pMr->GetLocalToken());
-        DWORD txFlags = len < m_inlineThreshold ? ND_OP_FLAG_INLINE : 0;
+            m_pBuf, len, x_HdrLen, m_DataBuf.Sge.MemoryRegionToken);
 
         DWORD nResults = 0;
         bool bCancelled = false;
@@ -305,33 +418,44 @@ public:
 
         for (DWORD i = 0; i < nIters; i++)
         {
+            LONGLONG start = Timer::Now();
+
             // send ping and wait for completion
-            NdTestBase::Send(m_sendSgl, nSendSge, txFlags, &m_bSendCompleted);
+            HRESULT hr = m_sender.Send(&m_bSendCompleted, m_sendSgl, nSendSge, 0);
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Send failed", __LINE__);
             while (!m_bSendCompleted && !bCancelled)
             {
-                WaitForCompletion(processCompletionFn, m_bUseEvents);
+                m_Poller.WaitForCompletion(processCompletionFn);
             }
             m_bSendCompleted = false;
 
             // recv pong and repost
             while (!m_bRecvCompleted && !bCancelled)
             {
-                WaitForCompletion(processCompletionFn, m_bUseEvents);
+                m_Poller.WaitForCompletion(processCompletionFn);
             }
             m_bRecvCompleted = false;
+            m_Latency.Record(Timer::Now() - start);
             NdTestBase::PostReceive(m_recvSgl, m_nRecvSge, &m_bRecvCompleted);
         }
     }
 
 private:
+    PooledBuffer m_DataBuf = {};
     char *m_pBuf = nullptr;
     DWORD m_queueDepth = 0, m_inlineThreshold = 0;
     ND2_SGE* m_sendSgl = nullptr;
     ND2_SGE* m_recvSgl = nullptr;
     DWORD m_nMaxSge = 0, m_nRecvSge = 0;
-    bool m_bUseEvents = false;
+    CqWaitMode m_WaitMode = CqWaitPoll;
+    ULONG m_MaxSpinUs = CqPoller::x_DefaultMaxSpinUs;
+    CqPoller m_Poller;
+    QpSender m_sender;
     bool m_bSendCompleted = false;
     bool m_bRecvCompleted = false;
+    FILE *m_pHistFile = nullptr;
+    LatencyHistogram m_Latency;
+    ResultReport& m_Report;
 
     Timer m_Timer;
     CpuMonitor m_Cpu;
@@ -345,6 +469,13 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     LONG queueDepth = 64;
     bool bPolling = false;
     bool bBlocking = false;
+    bool bAdaptive = false;
+    bool bLargePages = false;
+    ULONG maxSpinUs = CqPoller::x_DefaultMaxSpinUs;
+    DWORD srqDepth = 0;
+    TCHAR *histFileName = nullptr;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
     struct sockaddr_in v4Server = { 0 };
 
     INIT_LOG(TESTNAME);
@@ -375,6 +506,15 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         {
             bBlocking = true;
         }
+        else if ((wcscmp(arg, L"-a") == 0) || (wcscmp(arg, L"-A") == 0))
+        {
+            bAdaptive = true;
+            // The spin limit is optional; the address is always last.
+            if (i < argc - 2 && _istdigit(argv[i + 1][0]))
+            {
+                maxSpinUs = _ttol(argv[++i]);
+            }
+        }
         else if ((wcscmp(arg, L"-n") == 0) || (wcscmp(arg, L"-N") == 0))
         {
             if (i == argc - 2)
@@ -393,6 +533,45 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             }
             queueDepth = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-d") == 0) || (wcscmp(arg, L"--histFile") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            histFileName = argv[++i];
+        }
+        else if ((wcscmp(arg, L"-r") == 0) || (wcscmp(arg, L"--srq") == 0))
+        {
+            srqDepth = x_DefaultSrqDepth;
+            // The depth is optional; the address is always last.
+            if (i < argc - 2 && _istdigit(argv[i + 1][0]))
+            {
+                srqDepth = _ttol(argv[++i]);
+            }
+        }
+        else if ((wcscmp(arg, L"-L") == 0) || (wcscmp(arg, L"--largePages") == 0))
+        {
+            bLargePages = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
         {
             RedirectLogsToFile(argv[++i]);
@@ -430,9 +609,9 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         v4Server.sin_port = htons(x_DefaultPort);
     }
 
-    if ((bPolling && bBlocking))
+    if ((bPolling && bBlocking) || (bPolling && bAdaptive) || (bBlocking && bAdaptive))
     {
-        printf("Exactly one of blocking (b or polling (p) must be specified.\n\n");
+        printf("At most one of blocking (b), polling (p) or adaptive (a) may be specified.\n\n");
         ShowUsage();
         exit(__LINE__);
     }
@@ -444,22 +623,17 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         exit(__LINE__);
     }
 
+    CqWaitMode waitMode = bBlocking ? CqWaitBlock : (bAdaptive ? CqWaitAdaptive : CqWaitPoll);
+
     HRESULT hr = NdStartup();
     if (FAILED(hr))
     {
         LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdStartup failed with %08x", __LINE__);
     }
 
-    char *pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
-    if (!pBuf)
-    {
-        LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
-    }
-
     if (bServer)
     {
-#pragma warning (suppress: 6001) // no need to initialize pBuf
-        NdPingPongServer server(pBuf, bBlocking);
+        NdPingPongServer server(waitMode, maxSpinUs, bLargePages, srqDepth);
         server.RunTest(v4Server, 0, nSge);
     }
     else
@@ -473,15 +647,31 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             &len);
         if (FAILED(hr))
         {
-            HeapFree(GetProcessHeap(), 0, pBuf);
             LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
         }
-#pragma warning (suppress: 6001) // no need to initialize pBuf
-        NdPingPongClient client(pBuf, bBlocking);
+
+        FILE *pHistFile = nullptr;
+        if (histFileName != nullptr)
+        {
+            if (_wfopen_s(&pHistFile, histFileName, L"w") != 0)
+            {
+                LOG_FAILURE_AND_EXIT(L"Failed to open histogram file.", __LINE__);
+            }
+            LatencyHistogram::DumpHeader(pHistFile);
+        }
+
+        ResultReport report;
+        report.Init("ndpingpong", reportFormat, reportFile);
+
+        NdPingPongClient client(waitMode, maxSpinUs, bLargePages, pHistFile, report);
         client.RunTest(v4Src, v4Server, 0, nSge);
+
+        if (pHistFile != nullptr)
+        {
+            fclose(pHistFile);
+        }
     }
 
-    HeapFree(GetProcessHeap(), 0, pBuf);
     hr = NdCleanup();
     if (FAILED(hr))
     {
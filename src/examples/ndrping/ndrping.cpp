@@ -12,6 +12,8 @@
 
 #include "ndcommon.h"
 #include "ndtestutil.h"
+#include "ndsignal.h"
+#include "ndsend.h"
 #include <logging.h>
 
 const USHORT x_DefaultPort = 54326;
@@ -19,6 +21,8 @@ const SIZE_T x_MaxXfer = (4 * 1024 * 1024);
 const SIZE_T x_HdrLen = 40;
 const SIZE_T x_MaxVolume = (500 * x_MaxXfer);
 const SIZE_T x_MaxIterations = 500000;
+const ULONG x_DefaultResultsPerCall = 16;
+const ULONG x_MaxResultsPerCall = 64;
 
 const LPCWSTR TESTNAME = L"ndrping.exe";
 
@@ -39,9 +43,18 @@ void ShowUsage()
         "\t-r            - Use RMA Read (client only)\n"
         "\t-n <nSge>     - Number of scatter/gather entries per transfer (default: 1)\n"
         "\t-q <pipeline> - Pipeline limit of <pipeline> requests\n"
+        "\t-g <results>  - Completions harvested per GetResults call (client only, default: %u, max: %u)\n"
+        "\t-i <interval> - Ask for a completion on every <interval>th request only, and compare\n"
+        "\t                the message rate with signaling every request (client only)\n"
+        "\t-k            - Split writes above the adapter's large request threshold into chunks\n"
+        "\t                (client only)\n"
+        LARGE_PAGES_USAGE
+        REPORT_USAGE
         "\t-l <logFile>  - Log output to a file named <logFile>\n"
         "<ip>            - IPv4 Address\n"
         "<port>          - Port number, (default: %hu)\n",
+        x_DefaultResultsPerCall,
+        x_MaxResultsPerCall,
         x_DefaultPort
     );
 }
@@ -56,9 +69,11 @@ struct PeerInfo
 class NdrPingServer : public NdTestServerBase
 {
 public:
-    NdrPingServer(bool opRead) :
+    NdrPingServer(bool opRead, bool bLargePages) :
         m_opRead(opRead)
-    {}
+    {
+        m_bLargePages = bLargePages;
+    }
 
     void RunTest(const struct sockaddr_in& v4Src, DWORD queueDepth, DWORD /*nSge */)
     {
@@ -78,7 +93,7 @@ public:
         NdTestBase::CreateQueuePair(min(adapterInfo.MaxCompletionQueueDepth, adapterInfo.MaxReceiveQueueDepth), 1);
 
         NdTestBase::CreateMR();
-        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
+        m_pBuf = static_cast<char *>(AllocDataBuffer(x_MaxXfer + x_HdrLen, m_bLargePages));
         if (!m_pBuf)
         {
             LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
@@ -126,7 +141,7 @@ public:
     {
         if (m_pBuf != nullptr)
         {
-            HeapFree(GetProcessHeap(), 0, m_pBuf);
+            FreeDataBuffer(m_pBuf);
         }
     }
 
@@ -139,16 +154,23 @@ private:
 class NdrPingClient : public NdTestClientBase
 {
 public:
-    NdrPingClient(bool bUseBlocking, bool opRead) :
+    NdrPingClient(bool bUseBlocking, bool opRead, ULONG nResultsPerCall, bool bLargePages,
+        ULONG signalInterval, bool bChunkWrites, ResultReport& report) :
+        m_opRead(opRead),
         m_bUseBlocking(bUseBlocking),
-        m_opRead(opRead)
-    {}
+        m_bChunkWrites(bChunkWrites),
+        m_nResultsPerCall(nResultsPerCall),
+        m_signalInterval(signalInterval),
+        m_Report(report)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdrPingClient()
     {
         if (m_pBuf != nullptr)
         {
-            HeapFree(GetProcessHeap(), 0, m_pBuf);
+            FreeDataBuffer(m_pBuf);
         }
 
         if (m_Sgl != nullptr)
@@ -157,20 +179,25 @@ public:
         }
     }
 
-    DWORD IssuePings(ULONG& iters, DWORD nSge, bool bRead, DWORD flags)
+    DWORD IssuePings(ULONG& iters, DWORD nSge, bool bRead, ULONG maxOutstanding)
     {
         DWORD numIssued = 0;
-        while (m_availCredits > 0 && iters > 0)
+        while (m_sendQueue.Outstanding() < maxOutstanding && iters > 0)
         {
+            // The last request of the run, and the one that fills the
+            // pipeline, must report back.
+            DWORD opFlags = m_sendQueue.Next(
+                iters == 1 || m_sendQueue.Outstanding() + 1 == maxOutstanding);
             if (bRead)
             {
-                NdTestBase::Read(m_Sgl, nSge, m_remoteAddress, m_remoteToken, flags, READ_CTXT);
+                NdTestBase::Read(m_Sgl, nSge, m_remoteAddress, m_remoteToken, opFlags, READ_CTXT);
             }
             else
             {
-                NdTestBase::Write(m_Sgl, nSge, m_remoteAddress, m_remoteToken, flags, WRITE_CTXT);
+                HRESULT hr = m_sender.Write(WRITE_CTXT, m_Sgl, nSge, m_remoteAddress, m_remoteToken, opFlags);
+                LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Write failed", __LINE__);
             }
-            m_availCredits--; iters--;
+            iters--;
             numIssued++;
         }
         return numIssued;
@@ -180,21 +207,29 @@ public:
     {
         HRESULT hr = ND_SUCCESS;
         DWORD numIssued = 0, numCompleted = 0;
-        DWORD writeFlags = (!bRead && size < m_inlineThreshold) ? ND_OP_FLAG_INLINE : 0;
-        numIssued = IssuePings(iterations, nSge, bRead, writeFlags);
-        do
+        // A chunked write takes a send queue entry per chunk, so fewer of
+        // them fit in the pipeline.
+        ULONG maxOutstanding = bRead ? m_queueDepth :
+            max(m_queueDepth / m_sender.WriteRequests(size), static_cast<ULONG>(1));
+        auto processCompletion = [&](ND2_RESULT *pResult)
         {
-            ND2_RESULT ndRes;
-            WaitForCompletion(&ndRes, bUseEvents);
-            hr = ndRes.Status;
+            // Entries behind the first failure were flushed along with it.
+            if (hr != ND_SUCCESS)
+            {
+                return;
+            }
+
+            hr = pResult->Status;
             switch (hr)
             {
             case ND_SUCCESS:
-                if (ndRes.RequestContext != (bRead ? READ_CTXT : WRITE_CTXT))
+                if (pResult->RequestContext != (bRead ? READ_CTXT : WRITE_CTXT))
                 {
                     LOG_FAILURE_AND_EXIT(L"Invalid completion context\n", __LINE__);
                 }
-                numCompleted++; m_availCredits++;
+                // Only signaled requests complete, each frees the entries
+                // of the silent requests before it.
+                numCompleted += m_sendQueue.Complete();
                 break;
 
             case ND_CANCELED:
@@ -204,7 +239,16 @@ public:
                 LOG_FAILURE_HRESULT_AND_EXIT(
                     hr, L"INDCompletionQueue::GetResults returned result with %08x.", __LINE__);
             }
-            numIssued += IssuePings(iterations, nSge, bRead, writeFlags);
+        };
+
+        ND2_RESULT results[x_MaxResultsPerCall];
+        numIssued = IssuePings(iterations, nSge, bRead, maxOutstanding);
+        do
+        {
+            // Refill the pipeline once per harvested batch, rather than once
+            // per completion.
+            WaitForCompletions(results, m_nResultsPerCall, processCompletion, bUseEvents);
+            numIssued += IssuePings(iterations, nSge, bRead, maxOutstanding);
         } while ((numIssued != numCompleted || iterations != 0) && hr == ND_SUCCESS);
     }
 
@@ -231,7 +275,7 @@ public:
         }
 
         NdTestBase::CreateMR();
-        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen));
+        m_pBuf = static_cast<char *>(AllocDataBuffer(x_MaxXfer + x_HdrLen, m_bLargePages));
         if (!m_pBuf)
         {
             LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
@@ -249,6 +293,8 @@ public:
         NdTestBase::CreateCQ(m_queueDepth);
         NdTestBase::CreateConnector();
         NdTestBase::CreateQueuePair(min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth), nSge, m_inlineThreshold);
+        NdTestBase::InitSender(&m_sender, adapterInfo, m_nMaxSge,
+            m_bChunkWrites ? min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth) : 1);
 
         ND2_SGE sge;
         sge.Buffer = m_pBuf;
@@ -270,14 +316,43 @@ public:
             m_queueDepth = min(m_queueDepth, pInfo->m_nIncomingReadLimit);
         }
 
-        printf("Using %u processors. Sender Frequency is %I64d\n\n"
-            " %9s %9s %9s %7s %11s\n",
-            CpuMonitor::CpuCount(),
-            Timer::Frequency(),
-            "Size", "Iter", "Latency", "CPU", "Bytes/Sec"
-        );
-
-        m_availCredits = m_queueDepth;
+        HRESULT hr = m_sendQueue.Init(m_queueDepth, m_signalInterval);
+        if (FAILED(hr))
+        {
+            LOG_FAILURE_HRESULT_AND_EXIT(hr, L"SignaledSendQueue::Init failed with %08x", __LINE__);
+        }
+        m_signalInterval = m_sendQueue.SignalInterval();
+
+        m_Report.AddMetadata("Processors", CpuMonitor::CpuCount());
+        m_Report.AddMetadata("TimerFrequency", Timer::Frequency());
+        m_Report.AddMetadata("CqMode", m_bUseBlocking ? "blocking" : "polling");
+        m_Report.AddMetadata("Operation", m_opRead ? "read" : "write");
+        m_Report.AddMetadata("QueueDepth", m_queueDepth);
+        m_Report.AddMetadata("nSge", m_nMaxSge);
+        m_Report.AddMetadata("ResultsPerCall", m_nResultsPerCall);
+        m_Report.AddMetadata("LargePages", m_bLargePages ? "requested" : "no");
+        m_Report.AddMetadata("SignalInterval", m_signalInterval);
+        m_Report.AddMetadata("ChunkWrites", m_bChunkWrites ? "yes" : "no");
+        m_Report.AddAdapterInfo(adapterInfo);
+
+        // With selective signaling, each size is run twice: signaling every
+        // request, then every m_signalInterval'th request.
+        bool bCompareSignaling = (m_signalInterval > 1);
+        m_Report.AddColumn("Size", 9);
+        if (bCompareSignaling)
+        {
+            m_Report.AddColumn("Signal", 6);
+        }
+        m_Report.AddColumn("Iter", 9);
+        m_Report.AddColumn("Latency", 9, 2);
+        m_Report.AddColumn("CPU", 7, 2);
+        m_Report.AddColumn("Bytes/Sec", 11);
+        if (bCompareSignaling)
+        {
+            m_Report.AddColumn("Msgs/Sec", 11);
+            m_Report.AddColumn("Gain", 6, 2, "x");
+        }
+        ResultsPerCallHistogram::AddColumns(m_Report);
 
         // warmup
         DWORD nSgesUsed = NdTestBase::PrepareSge(m_Sgl, m_nMaxSge, m_pBuf, x_HdrLen, x_HdrLen, m_pMr->GetLocalToken());
@@ -296,23 +371,45 @@ public:
 
             nSgesUsed = NdTestBase::PrepareSge(m_Sgl, m_nMaxSge, m_pBuf, szXfer, x_HdrLen, m_pMr->GetLocalToken());
 
-            cpu.Start();
-            timer.Start();
+            double signalAllRate = 0;
+            for (int pass = bCompareSignaling ? 0 : 1; pass < 2; pass++)
+            {
+                m_sendQueue.SetSignalInterval(pass == 0 ? 1 : m_signalInterval);
 
-            DoPings(szXfer, iterations, nSgesUsed, m_opRead, m_bUseBlocking);
+                m_ResultsPerCall.Reset();
+                cpu.Start();
+                timer.Start();
 
-            timer.End();
-            cpu.End();
+                DoPings(szXfer, iterations, nSgesUsed, m_opRead, m_bUseBlocking);
 
-            printf(
-                " %9ul %9ul %9.2f %7.2f %11.0f\n",
-                szXfer,
-                iterations,
-                timer.Report() / iterations,
-                cpu.Report(),
-                (double) szXfer * iterations / (timer.Report() / 1000000)
-            );
+                timer.End();
+                cpu.End();
+
+                double msgRate = iterations / (timer.Report() / 1000000);
+                if (pass == 0)
+                {
+                    signalAllRate = msgRate;
+                }
+
+                m_Report.Value(szXfer);
+                if (bCompareSignaling)
+                {
+                    m_Report.Value(m_sendQueue.SignalInterval());
+                }
+                m_Report.Value(iterations);
+                m_Report.Value(timer.Report() / iterations);
+                m_Report.Value(cpu.Report());
+                m_Report.Value((double) szXfer * msgRate);
+                if (bCompareSignaling)
+                {
+                    m_Report.Value(msgRate);
+                    m_Report.Value(msgRate / signalAllRate);
+                }
+                m_ResultsPerCall.Report(m_Report);
+                m_Report.EndRow();
+            }
         }
+        m_Report.End();
 
         // send terminate message
         NdTestBase::Send(nullptr, 0, 0);
@@ -325,13 +422,18 @@ private:
     char *m_pBuf = nullptr;
     bool m_opRead = false;
     bool m_bUseBlocking = false;
+    bool m_bChunkWrites = false;
+    ULONG m_nResultsPerCall = x_DefaultResultsPerCall;
     ND2_SGE *m_Sgl = nullptr;
     ULONG m_queueDepth = 0;
-    ULONG m_availCredits = 0;
+    ULONG m_signalInterval = 1;
+    SignaledSendQueue m_sendQueue;
+    QpSender m_sender;
     ULONG m_nMaxSge = 0;
     ULONG m_inlineThreshold = 0;
     UINT64 m_remoteAddress = 0;
     UINT32 m_remoteToken = 0;
+    ResultReport& m_Report;
 };
 
 int __cdecl _tmain(int argc, TCHAR* argv[])
@@ -344,7 +446,13 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     bool bBlocking = false;
     bool bOpRead = false;
     bool bOpWrite = false;
+    bool bLargePages = false;
     SIZE_T nPipeline = 128;
+    ULONG nResultsPerCall = x_DefaultResultsPerCall;
+    ULONG signalInterval = 1;
+    bool bChunkWrites = false;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
 
     INIT_LOG(TESTNAME);
 
@@ -401,6 +509,49 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             }
             nPipeline = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-g") == 0) || (wcscmp(arg, L"-G") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            nResultsPerCall = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-i") == 0) || (wcscmp(arg, L"--signal") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            signalInterval = _ttol(argv[++i]);
+        }
+        else if ((wcscmp(arg, L"-k") == 0) || (wcscmp(arg, L"--chunk") == 0))
+        {
+            bChunkWrites = true;
+        }
+        else if ((wcscmp(arg, L"-L") == 0) || (wcscmp(arg, L"--largePages") == 0))
+        {
+            bLargePages = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
         {
             RedirectLogsToFile(argv[++i]);
@@ -463,6 +614,20 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         exit(__LINE__);
     }
 
+    if (signalInterval == 0)
+    {
+        printf("Invalid signal interval\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
+    if (nResultsPerCall == 0 || nResultsPerCall > x_MaxResultsPerCall)
+    {
+        printf("Invalid number of completions per call\n\n");
+        ShowUsage();
+        exit(__LINE__);
+    }
+
     HRESULT hr = NdStartup();
     if (FAILED(hr))
     {
@@ -471,7 +636,7 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
 
     if (bServer)
     {
-        NdrPingServer server(bOpRead);
+        NdrPingServer server(bOpRead, bLargePages);
         server.RunTest(v4Server, 0, nSge);
     }
     else
@@ -485,7 +650,11 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
         }
 
-        NdrPingClient client(bBlocking, bOpRead);
+        ResultReport report;
+        report.Init("ndrping", reportFormat, reportFile);
+
+        NdrPingClient client(bBlocking, bOpRead, nResultsPerCall, bLargePages, signalInterval,
+            bChunkWrites, report);
         client.RunTest(v4Src, v4Server, 0, nSge);
     }
 
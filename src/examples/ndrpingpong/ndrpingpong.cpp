@@ -7,6 +7,7 @@
 
 #include "ndcommon.h"
 #include "ndtestutil.h"
+#include "ndsend.h"
 #include <logging.h>
 
 const USHORT x_DefaultPort = 54327;
@@ -38,6 +39,10 @@ void ShowUsage()
         "\t-p            - Polling I/O (poll on the CQ) (default)\n"
         "\t-n <nSge>     - Number of scatter/gather entries per transfer (default: 1)\n"
         "\t-q <pipeline> - Pipeline limit of <pipeline> requests\n"
+        "\t-d <histFile> - Dump the raw round trip histograms to a file named <histFile> (client only)\n"
+        "\t-k            - Split writes above the adapter's large request threshold into chunks\n"
+        LARGE_PAGES_USAGE
+        REPORT_USAGE
         "\t-l <logFile>  - Log output to a file named <logFile>\n"
         "<ip>            - IPv4 Address\n"
         "<port>          - Port number, (default: %hu)\n",
@@ -54,9 +59,11 @@ struct PeerInfo
 class NdrPingPongServer : public NdTestServerBase
 {
 public:
-    NdrPingPongServer(bool blocking) :
-        m_blocking(blocking)
+    NdrPingPongServer(bool blocking, bool bLargePages, bool bChunkWrites) :
+        m_blocking(blocking),
+        m_bChunkWrites(bChunkWrites)
     {
+        m_bLargePages = bLargePages;
     }
 
     void DoPongs(ULONG szXfer, ULONG iters, bool isWarmup)
@@ -66,7 +73,6 @@ public:
 
         DWORD nSge = NdTestBase::PrepareSge(m_sgl, m_nMaxSge, m_pBuf,
             szXfer, x_HdrLen, m_pMr->GetLocalToken());
-        DWORD flags = szXfer < m_inlineThreshold ? ND_OP_FLAG_INLINE : 0;
 
         bool bCancelled = false;
         while (iters > 0 && !bCancelled)
@@ -76,7 +82,8 @@ public:
 
             // reset contents and send back
             m_pBuf[szXfer - 1] = serverVal;
-            NdTestBase::Write(m_sgl, nSge, m_remoteAddress, m_remoteToken, flags, WRITE_CTXT);
+            HRESULT hr = m_sender.Write(WRITE_CTXT, m_sgl, nSge, m_remoteAddress, m_remoteToken, 0);
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Write failed", __LINE__);
             iters--;
 
             WaitForCompletion([&](ND2_RESULT *pCompletion)
@@ -130,9 +137,13 @@ public:
         NdTestBase::CreateConnector();
         NdTestBase::CreateQueuePair(min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth),
             nSge, m_inlineThreshold);
+        // The pings and pongs go one write at a time, so a chunked write
+        // may take the whole send queue.
+        NdTestBase::InitSender(&m_sender, adapterInfo, m_nMaxSge,
+            m_bChunkWrites ? min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth) : 1);
 
         NdTestBase::CreateMR();
-        m_pBuf = static_cast<char*>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen + 2 * sizeof(PeerInfo)));
+        m_pBuf = static_cast<char*>(AllocDataBuffer(x_MaxXfer + x_HdrLen + 2 * sizeof(PeerInfo), m_bLargePages));
         if (!m_pBuf)
         {
             LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
@@ -210,7 +221,7 @@ public:
     {
         if (m_pBuf != nullptr)
         {
-            HeapFree(GetProcessHeap(), 0, m_pBuf);
+            FreeDataBuffer(m_pBuf);
         }
 
         if (m_sgl != nullptr)
@@ -222,10 +233,12 @@ public:
 private:
     char *m_pBuf = nullptr;
     bool m_blocking = false;
+    bool m_bChunkWrites = false;
     bool m_termReceived = true;
     ULONG m_queueDepth = 0;
     ULONG m_inlineThreshold = 0;
     ULONG m_nMaxSge = 0;
+    QpSender m_sender;
     UINT64 m_remoteAddress = 0;
     UINT32 m_remoteToken = 0;
     ND2_SGE *m_sgl = nullptr;
@@ -234,15 +247,21 @@ private:
 class NdrPingPongClient : public NdTestClientBase
 {
 public:
-    NdrPingPongClient(bool bUseBlocking) :
-        m_bUseBlocking(bUseBlocking)
-    {}
+    NdrPingPongClient(bool bUseBlocking, bool bLargePages, bool bChunkWrites, FILE *pHistFile,
+        ResultReport& report) :
+        m_bUseBlocking(bUseBlocking),
+        m_bChunkWrites(bChunkWrites),
+        m_pHistFile(pHistFile),
+        m_Report(report)
+    {
+        m_bLargePages = bLargePages;
+    }
 
     ~NdrPingPongClient()
     {
         if (m_pBuf != nullptr)
         {
-            HeapFree(GetProcessHeap(), 0, m_pBuf);
+            FreeDataBuffer(m_pBuf);
         }
 
         if (m_Sgl != nullptr)
@@ -256,19 +275,22 @@ public:
         char clientVal = isWarmup ? CLIENT_WRMUP_VAL : CLIENT_TEST_VAL;
         char serverVal = isWarmup ? SERVER_WRMUP_VAL : SERVER_TEST_VAL;
 
-        DWORD flags = szXfer < m_inlineThreshold ? ND_OP_FLAG_INLINE : 0;
         bool doPongs = true;
         DWORD nSge = NdTestBase::PrepareSge(m_Sgl, m_nMaxSge, m_pBuf,
             szXfer, x_HdrLen, m_pMr->GetLocalToken());
 
         while (iters > 0)
         {
+            LONGLONG start = Timer::Now();
+
             // set contents and issue rdma
             m_pBuf[szXfer - 1] = clientVal;
-            NdTestBase::Write(m_Sgl, nSge, m_remoteAddress, m_remoteToken, flags, WRITE_CTXT);
+            HRESULT hr = m_sender.Write(WRITE_CTXT, m_Sgl, nSge, m_remoteAddress, m_remoteToken, 0);
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2QueuePair::Write failed", __LINE__);
 
             // wait until incoming RMA
             while ((m_pBuf[szXfer - 1]) != serverVal);
+            m_Latency.Record(Timer::Now() - start);
             WaitForCompletion();
             iters--;
         }
@@ -298,7 +320,7 @@ public:
         m_inlineThreshold = adapterInfo.InlineRequestThreshold;
 
         NdTestBase::CreateMR();
-        m_pBuf = static_cast<char *>(HeapAlloc(GetProcessHeap(), 0, x_MaxXfer + x_HdrLen + 2 * sizeof(PeerInfo)));
+        m_pBuf = static_cast<char *>(AllocDataBuffer(x_MaxXfer + x_HdrLen + 2 * sizeof(PeerInfo), m_bLargePages));
         if (!m_pBuf)
         {
             LOG_FAILURE_AND_EXIT(L"Failed to allocate data buffer.", __LINE__);
@@ -317,6 +339,10 @@ public:
         NdTestBase::CreateConnector();
         NdTestBase::CreateQueuePair(min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth),
             nSge, m_inlineThreshold);
+        // The pings and pongs go one write at a time, so a chunked write
+        // may take the whole send queue.
+        NdTestBase::InitSender(&m_sender, adapterInfo, m_nMaxSge,
+            m_bChunkWrites ? min(m_queueDepth, adapterInfo.MaxReceiveQueueDepth) : 1);
 
         // post reveive for peerInfo message
         ND2_SGE sge = { 0 };
@@ -365,12 +391,22 @@ public:
         m_remoteToken = pInfo->m_remoteToken;
         m_remoteAddress = pInfo->m_remoteAddress;
 
-        printf("Using %u processors. Sender Frequency is %I64d\n\n"
-            " %9s %9s %9s %7s %11s\n",
-            CpuMonitor::CpuCount(),
-            Timer::Frequency(),
-            "Size", "Iter", "Latency", "CPU", "Bytes/Sec"
-        );
+        m_Report.AddMetadata("Processors", CpuMonitor::CpuCount());
+        m_Report.AddMetadata("TimerFrequency", Timer::Frequency());
+        m_Report.AddMetadata("CqMode", m_bUseBlocking ? "blocking" : "polling");
+        m_Report.AddMetadata("Latencies", "round trips in microseconds");
+        m_Report.AddMetadata("QueueDepth", m_queueDepth);
+        m_Report.AddMetadata("nSge", m_nMaxSge);
+        m_Report.AddMetadata("LargePages", m_bLargePages ? "requested" : "no");
+        m_Report.AddMetadata("ChunkWrites", m_bChunkWrites ? "yes" : "no");
+        m_Report.AddAdapterInfo(adapterInfo);
+
+        m_Report.AddColumn("Size", 9);
+        m_Report.AddColumn("Iter", 9);
+        m_Report.AddColumn("Latency", 9, 2);
+        m_Report.AddColumn("CPU", 7, 2);
+        m_Report.AddColumn("Bytes/Sec", 11);
+        LatencyHistogram::AddColumns(m_Report);
 
         // warmup
         DoPings(x_HdrLen, 1000, true);
@@ -386,6 +422,7 @@ public:
                 iterations = x_MaxVolume / szXfer;
             }
 
+            m_Latency.Reset();
             cpu.Start();
             timer.Start();
 
@@ -394,15 +431,20 @@ public:
             timer.End();
             cpu.End();
 
-            printf(
-                " %9ul %9ul %9.2f %7.2f %11.0f\n",
-                szXfer,
-                iterations,
-                timer.Report() / iterations,
-                cpu.Report(),
-                (double) szXfer * iterations / (timer.Report() / 1000000)
-            );
+            m_Report.Value(szXfer);
+            m_Report.Value(iterations);
+            m_Report.Value(timer.Report() / iterations);
+            m_Report.Value(cpu.Report());
+            m_Report.Value((double) szXfer * iterations / (timer.Report() / 1000000));
+            m_Latency.Report(m_Report);
+            m_Report.EndRow();
+
+            if (m_pHistFile != nullptr)
+            {
+                m_Latency.Dump(m_pHistFile, szXfer);
+            }
         }
+        m_Report.End();
 
         // send terminate message
         NdTestBase::Send(nullptr, 0, 0);
@@ -428,12 +470,17 @@ public:
 private:
     char *m_pBuf = nullptr;
     bool m_bUseBlocking = false;
+    bool m_bChunkWrites = false;
     ND2_SGE *m_Sgl = nullptr;
     ULONG m_nMaxSge = 0;
     ULONG m_queueDepth = 0;
     UINT64 m_remoteAddress = 0;
     UINT32 m_remoteToken = 0;
     ULONG m_inlineThreshold = 0;
+    QpSender m_sender;
+    FILE *m_pHistFile = nullptr;
+    LatencyHistogram m_Latency;
+    ResultReport& m_Report;
 };
 
 int __cdecl _tmain(int argc, TCHAR* argv[])
@@ -446,7 +493,12 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     bool bBlocking = false;
     bool bOpRead = false;
     bool bOpWrite = false;
+    bool bLargePages = false;
+    bool bChunkWrites = false;
     SIZE_T nPipeline = 128;
+    TCHAR *histFileName = nullptr;
+    ReportFormat reportFormat = ReportFormatTable;
+    TCHAR *reportFile = nullptr;
 
     INIT_LOG(TESTNAME);
 
@@ -495,6 +547,40 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             }
             nPipeline = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-d") == 0) || (wcscmp(arg, L"--histFile") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            histFileName = argv[++i];
+        }
+        else if ((wcscmp(arg, L"-k") == 0) || (wcscmp(arg, L"--chunk") == 0))
+        {
+            bChunkWrites = true;
+        }
+        else if ((wcscmp(arg, L"-L") == 0) || (wcscmp(arg, L"--largePages") == 0))
+        {
+            bLargePages = true;
+        }
+        else if ((wcscmp(arg, L"-f") == 0) || (wcscmp(arg, L"--format") == 0))
+        {
+            if (i == argc - 2 || !ParseReportFormat(argv[++i], &reportFormat))
+            {
+                ShowUsage();
+                exit(-1);
+            }
+        }
+        else if ((wcscmp(arg, L"-o") == 0) || (wcscmp(arg, L"--output") == 0))
+        {
+            if (i == argc - 2)
+            {
+                ShowUsage();
+                exit(-1);
+            }
+            reportFile = argv[++i];
+        }
         else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
         {
             RedirectLogsToFile(argv[++i]);
@@ -565,7 +651,7 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
 
     if (bServer)
     {
-        NdrPingPongServer server(bBlocking);
+        NdrPingPongServer server(bBlocking, bLargePages, bChunkWrites);
         server.RunTest(v4Server, 0, nSge);
     }
     else
@@ -579,8 +665,26 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
         }
 
-        NdrPingPongClient client(bBlocking);
+        FILE *pHistFile = nullptr;
+        if (histFileName != nullptr)
+        {
+            if (_wfopen_s(&pHistFile, histFileName, L"w") != 0)
+            {
+                LOG_FAILURE_AND_EXIT(L"Failed to open histogram file.", __LINE__);
+            }
+            LatencyHistogram::DumpHeader(pHistFile);
+        }
+
+        ResultReport report;
+        report.Init("ndrpingpong", reportFormat, reportFile);
+
+        NdrPingPongClient client(bBlocking, bLargePages, bChunkWrites, pHistFile, report);
         client.RunTest(v4Src, v4Server, 0, nSge);
+
+        if (pHistFile != nullptr)
+        {
+            fclose(pHistFile);
+        }
     }
 
     hr = NdCleanup();
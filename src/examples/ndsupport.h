@@ -63,6 +63,22 @@ NdResolveAddress(
     );
 
 
+//
+// Resolves nAddresses remote addresses at once.  Identical routes are only
+// looked up once.  pResults receives the status of each entry, with the same
+// meaning as for NdResolveAddress; pLocalAddresses is only valid for entries
+// that succeeded.  Returns ND_SUCCESS if every entry was resolved, or the
+// status of the first entry that failed.
+//
+HRESULT ND_HELPER_API
+NdResolveAddresses(
+    _In_ SIZE_T nAddresses,
+    _In_reads_(nAddresses) const SOCKADDR_INET* pRemoteAddresses,
+    _Out_writes_(nAddresses) SOCKADDR_INET* pLocalAddresses,
+    _Out_writes_(nAddresses) HRESULT* pResults
+    );
+
+
 HRESULT ND_HELPER_API
 NdCheckAddress(
     _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
@@ -86,6 +102,67 @@ NdOpenV1Adapter(
     _Deref_out_ INDAdapter** ppIAdapter
     );
 
+
+//
+// Statistics
+//
+typedef struct _ND_UPDATE_STATISTICS
+{
+    // Provider catalog and address list changes processed.
+    ULONG64 Updates;
+    // Updates that left the address list unchanged.
+    ULONG64 UnchangedUpdates;
+    ULONG64 ProvidersAdded;
+    ULONG64 ProvidersRemoved;
+    ULONG64 AddressesAdded;
+    ULONG64 AddressesRemoved;
+    // Addresses added and removed by the most recent update.
+    ULONG LastAddressesAdded;
+    ULONG LastAddressesRemoved;
+    // Provider and address objects constructed, and heap allocations made
+    // for them and the address tables.  Once the pools have warmed up,
+    // refreshing an unchanged address list makes no heap allocations.
+    ULONG64 ObjectAllocations;
+    ULONG64 HeapAllocations;
+} ND_UPDATE_STATISTICS;
+
+HRESULT ND_HELPER_API
+NdQueryUpdateStatistics(
+    _Out_ ND_UPDATE_STATISTICS* pStats
+    );
+
+typedef struct _ND_ROUTE_CACHE_STATISTICS
+{
+    // NdResolveAddress calls answered from the route cache, and calls that
+    // required a route lookup.
+    ULONG64 Hits;
+    ULONG64 Misses;
+    // Times the cache was flushed due to address changes.
+    ULONG64 Flushes;
+    ULONG Entries;
+} ND_ROUTE_CACHE_STATISTICS;
+
+HRESULT ND_HELPER_API
+NdQueryRouteCacheStatistics(
+    _Out_ ND_ROUTE_CACHE_STATISTICS* pStats
+    );
+
+//
+// Adapter opens answered from the adapter cache, and opens that went to the
+// provider.  The cache is enabled by setting ND_ADAPTER_CACHE=1 in the
+// environment before calling NdStartup.
+//
+typedef struct _ND_ADAPTER_CACHE_STATISTICS
+{
+    ULONG64 Hits;
+    ULONG64 Misses;
+} ND_ADAPTER_CACHE_STATISTICS;
+
+HRESULT ND_HELPER_API
+NdQueryAdapterCacheStatistics(
+    _Out_ ND_ADAPTER_CACHE_STATISTICS* pStats
+    );
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
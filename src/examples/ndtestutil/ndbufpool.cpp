@@ -0,0 +1,508 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndbufpool.h"
+
+// Bytes a thread moves to or from the shared lists at a time, per class.
+static const SIZE_T x_BatchBytes = 256 * 1024;
+static const ULONG x_MaxBatch = 32;
+
+// Large pages need the lock memory privilege, which administrators have but
+// is disabled by default.
+static bool EnableLockMemoryPrivilege()
+{
+    HANDLE hToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    // AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED if the
+    // account doesn't hold the privilege.
+    bool bEnabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, nullptr, nullptr) &&
+        GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(hToken);
+    return bEnabled;
+}
+
+void* AllocDataBuffer(SIZE_T len, bool bLargePages, bool *pbLargePages)
+{
+    void *pBuf = nullptr;
+    if (bLargePages)
+    {
+        static const bool s_bLockMemory = EnableLockMemoryPrivilege();
+        SIZE_T largePageSize = GetLargePageMinimum();
+        if (s_bLockMemory && largePageSize != 0)
+        {
+            // Can still fail once physical memory is fragmented, in which
+            // case the buffer falls back to small pages.
+            pBuf = VirtualAlloc(
+                nullptr,
+                (len + largePageSize - 1) & ~(largePageSize - 1),
+                MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                PAGE_READWRITE);
+        }
+    }
+
+    if (pbLargePages != nullptr)
+    {
+        *pbLargePages = (pBuf != nullptr);
+    }
+
+    if (pBuf == nullptr)
+    {
+        pBuf = VirtualAlloc(nullptr, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    }
+    return pBuf;
+}
+
+void FreeDataBuffer(void *pBuf)
+{
+    if (pBuf != nullptr)
+    {
+        VirtualFree(pBuf, 0, MEM_RELEASE);
+    }
+}
+
+RegisteredBufferPool::RegisteredBufferPool() :
+    m_pAdapter(nullptr),
+    m_hAdapterFile(nullptr),
+    m_MrFlags(0),
+    m_RegionSize(x_DefaultRegionSize),
+    m_bLargePages(false),
+    m_TlsIndex(TLS_OUT_OF_INDEXES),
+    m_hEvent(nullptr),
+    m_pRegions(nullptr),
+    m_pLargeRegions(nullptr),
+    m_pSlab(nullptr),
+    m_pSlabEnd(nullptr),
+    m_pSlabRegion(nullptr),
+    m_pCaches(nullptr),
+    m_RegisteredBytes(0)
+{
+    RtlZeroMemory(&m_Ov, sizeof(m_Ov));
+    RtlZeroMemory(m_Classes, sizeof(m_Classes));
+    InitializeCriticalSection(&m_Lock);
+}
+
+RegisteredBufferPool::~RegisteredBufferPool()
+{
+    while (m_pCaches != nullptr)
+    {
+        ThreadCache *pCache = m_pCaches;
+        m_pCaches = pCache->m_pNext;
+        delete pCache;
+    }
+
+    while (m_pRegions != nullptr)
+    {
+        Region *pRegion = m_pRegions;
+        m_pRegions = pRegion->m_pNext;
+        DeregisterRegion(pRegion);
+    }
+
+    while (m_pLargeRegions != nullptr)
+    {
+        Region *pRegion = m_pLargeRegions;
+        m_pLargeRegions = pRegion->m_pNext;
+        DeregisterRegion(pRegion);
+    }
+
+    if (m_TlsIndex != TLS_OUT_OF_INDEXES)
+    {
+        TlsFree(m_TlsIndex);
+    }
+
+    if (m_pAdapter != nullptr)
+    {
+        m_pAdapter->Release();
+    }
+
+    if (m_hEvent != nullptr)
+    {
+        CloseHandle(m_hEvent);
+    }
+    DeleteCriticalSection(&m_Lock);
+}
+
+HRESULT RegisteredBufferPool::Init(
+    IND2Adapter *pAdapter,
+    HANDLE hAdapterFile,
+    ULONG mrFlags,
+    SIZE_T regionSize,
+    bool bLargePages)
+{
+    if (pAdapter == nullptr || m_pAdapter != nullptr)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_TlsIndex = TlsAlloc();
+    if (m_TlsIndex == TLS_OUT_OF_INDEXES)
+    {
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+
+    m_hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_hEvent == nullptr)
+    {
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+    // Keep registrations off any IOCP the adapter file is bound to.
+    m_Ov.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<SIZE_T>(m_hEvent) | 0x1);
+
+    // Regions hold whole slabs.
+    if (regionSize < x_SlabSize)
+    {
+        regionSize = x_SlabSize;
+    }
+    m_RegionSize = regionSize & ~(x_SlabSize - 1);
+
+    pAdapter->AddRef();
+    m_pAdapter = pAdapter;
+    m_hAdapterFile = hAdapterFile;
+    m_MrFlags = mrFlags;
+    m_bLargePages = bLargePages;
+    return ND_SUCCESS;
+}
+
+HRESULT RegisteredBufferPool::Alloc(SIZE_T len, PooledBuffer *pBuffer)
+{
+    if (m_pAdapter == nullptr || pBuffer == nullptr || len == 0 || len > ULONG_MAX)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    if (len > x_SlabSize)
+    {
+        return AllocLarge(len, pBuffer);
+    }
+
+    ThreadCache *pCache = GetThreadCache();
+    if (pCache == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    ULONG sizeClass = ClassOf(len);
+    if (pCache->m_pFree[sizeClass] == nullptr)
+    {
+        HRESULT hr = Refill(sizeClass, pCache);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    FreeBlock *pBlock = pCache->m_pFree[sizeClass];
+    pCache->m_pFree[sizeClass] = pBlock->m_pNext;
+    pCache->m_nFree[sizeClass]--;
+
+    pBuffer->Sge.Buffer = pBlock;
+    pBuffer->Sge.BufferLength = static_cast<ULONG>(len);
+    pBuffer->Sge.MemoryRegionToken = pBlock->m_LocalToken;
+    pBuffer->RemoteToken = pBlock->m_RemoteToken;
+    pBuffer->SizeClass = sizeClass;
+    return ND_SUCCESS;
+}
+
+void RegisteredBufferPool::Free(const PooledBuffer& buffer)
+{
+    if (buffer.SizeClass == x_LargeClass)
+    {
+        FreeLarge(buffer.Sge.Buffer);
+        return;
+    }
+
+    // The tokens travel with the free buffer, so Alloc doesn't have to
+    // look up the region it came from.
+    FreeBlock *pBlock = static_cast<FreeBlock*>(buffer.Sge.Buffer);
+    pBlock->m_LocalToken = buffer.Sge.MemoryRegionToken;
+    pBlock->m_RemoteToken = buffer.RemoteToken;
+
+    ULONG sizeClass = buffer.SizeClass;
+    ThreadCache *pCache = GetThreadCache();
+    if (pCache == nullptr)
+    {
+        EnterCriticalSection(&m_Lock);
+        pBlock->m_pNext = m_Classes[sizeClass].m_pFree;
+        m_Classes[sizeClass].m_pFree = pBlock;
+        LeaveCriticalSection(&m_Lock);
+        return;
+    }
+
+    pBlock->m_pNext = pCache->m_pFree[sizeClass];
+    pCache->m_pFree[sizeClass] = pBlock;
+
+    ULONG batch = BatchOf(sizeClass);
+    if (++pCache->m_nFree[sizeClass] > 2 * batch)
+    {
+        Drain(sizeClass, pCache, batch);
+    }
+}
+
+void RegisteredBufferPool::FlushThreadCache()
+{
+    if (m_TlsIndex == TLS_OUT_OF_INDEXES)
+    {
+        return;
+    }
+
+    ThreadCache *pCache = static_cast<ThreadCache*>(TlsGetValue(m_TlsIndex));
+    if (pCache == nullptr)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < x_nClasses; i++)
+    {
+        Drain(i, pCache, pCache->m_nFree[i]);
+    }
+}
+
+RegisteredBufferPool::ThreadCache* RegisteredBufferPool::GetThreadCache()
+{
+    ThreadCache *pCache = static_cast<ThreadCache*>(TlsGetValue(m_TlsIndex));
+    if (pCache != nullptr)
+    {
+        return pCache;
+    }
+
+    pCache = new (std::nothrow) ThreadCache();
+    if (pCache == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (!TlsSetValue(m_TlsIndex, pCache))
+    {
+        delete pCache;
+        return nullptr;
+    }
+
+    EnterCriticalSection(&m_Lock);
+    pCache->m_pNext = m_pCaches;
+    m_pCaches = pCache;
+    LeaveCriticalSection(&m_Lock);
+    return pCache;
+}
+
+HRESULT RegisteredBufferPool::Refill(ULONG sizeClass, ThreadCache *pCache)
+{
+    SizeClass& sc = m_Classes[sizeClass];
+    SIZE_T blockSize = static_cast<SIZE_T>(1) << (sizeClass + x_MinClassShift);
+    ULONG batch = BatchOf(sizeClass);
+    HRESULT hr = ND_SUCCESS;
+
+    EnterCriticalSection(&m_Lock);
+
+    ULONG n = 0;
+    while (n < batch && sc.m_pFree != nullptr)
+    {
+        FreeBlock *pBlock = sc.m_pFree;
+        sc.m_pFree = pBlock->m_pNext;
+        pBlock->m_pNext = pCache->m_pFree[sizeClass];
+        pCache->m_pFree[sizeClass] = pBlock;
+        n++;
+    }
+
+    if (n == 0)
+    {
+        // Nothing freed to reuse, carve new buffers from the class's slab.
+        if (sc.m_pCarve == sc.m_pCarveEnd)
+        {
+            hr = NewSlab(sizeClass);
+        }
+
+        while (SUCCEEDED(hr) && n < batch && sc.m_pCarve != sc.m_pCarveEnd)
+        {
+            FreeBlock *pBlock = reinterpret_cast<FreeBlock*>(sc.m_pCarve);
+            sc.m_pCarve += blockSize;
+            pBlock->m_LocalToken = sc.m_LocalToken;
+            pBlock->m_RemoteToken = sc.m_RemoteToken;
+            pBlock->m_pNext = pCache->m_pFree[sizeClass];
+            pCache->m_pFree[sizeClass] = pBlock;
+            n++;
+        }
+    }
+
+    LeaveCriticalSection(&m_Lock);
+
+    pCache->m_nFree[sizeClass] += n;
+    return hr;
+}
+
+void RegisteredBufferPool::Drain(ULONG sizeClass, ThreadCache *pCache, ULONG nBlocks)
+{
+    if (nBlocks == 0)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&m_Lock);
+    for (ULONG i = 0; i < nBlocks && pCache->m_pFree[sizeClass] != nullptr; i++)
+    {
+        FreeBlock *pBlock = pCache->m_pFree[sizeClass];
+        pCache->m_pFree[sizeClass] = pBlock->m_pNext;
+        pCache->m_nFree[sizeClass]--;
+        pBlock->m_pNext = m_Classes[sizeClass].m_pFree;
+        m_Classes[sizeClass].m_pFree = pBlock;
+    }
+    LeaveCriticalSection(&m_Lock);
+}
+
+// Called with the lock held.
+HRESULT RegisteredBufferPool::NewSlab(ULONG sizeClass)
+{
+    if (m_pSlab == m_pSlabEnd)
+    {
+        Region *pRegion;
+        HRESULT hr = RegisterRegion(m_RegionSize, &pRegion);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        pRegion->m_pNext = m_pRegions;
+        m_pRegions = pRegion;
+
+        m_pSlab = pRegion->m_pBase;
+        m_pSlabEnd = pRegion->m_pBase + pRegion->m_Size;
+        m_pSlabRegion = pRegion;
+    }
+
+    SizeClass& sc = m_Classes[sizeClass];
+    sc.m_pCarve = m_pSlab;
+    sc.m_pCarveEnd = m_pSlab + x_SlabSize;
+    sc.m_LocalToken = m_pSlabRegion->m_pMr->GetLocalToken();
+    sc.m_RemoteToken = m_pSlabRegion->m_pMr->GetRemoteToken();
+    m_pSlab += x_SlabSize;
+    return ND_SUCCESS;
+}
+
+HRESULT RegisteredBufferPool::AllocLarge(SIZE_T len, PooledBuffer *pBuffer)
+{
+    Region *pRegion;
+    EnterCriticalSection(&m_Lock);
+    HRESULT hr = RegisterRegion(len, &pRegion);
+    if (SUCCEEDED(hr))
+    {
+        pRegion->m_pNext = m_pLargeRegions;
+        m_pLargeRegions = pRegion;
+    }
+    LeaveCriticalSection(&m_Lock);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    pBuffer->Sge.Buffer = pRegion->m_pBase;
+    pBuffer->Sge.BufferLength = static_cast<ULONG>(len);
+    pBuffer->Sge.MemoryRegionToken = pRegion->m_pMr->GetLocalToken();
+    pBuffer->RemoteToken = pRegion->m_pMr->GetRemoteToken();
+    pBuffer->SizeClass = x_LargeClass;
+    return ND_SUCCESS;
+}
+
+void RegisteredBufferPool::FreeLarge(void *pBuf)
+{
+    EnterCriticalSection(&m_Lock);
+    Region **ppRegion = &m_pLargeRegions;
+    while (*ppRegion != nullptr && (*ppRegion)->m_pBase != pBuf)
+    {
+        ppRegion = &(*ppRegion)->m_pNext;
+    }
+    Region *pRegion = *ppRegion;
+    if (pRegion != nullptr)
+    {
+        *ppRegion = pRegion->m_pNext;
+        DeregisterRegion(pRegion);
+    }
+    LeaveCriticalSection(&m_Lock);
+}
+
+// Called with the lock held, which also guards m_Ov.
+HRESULT RegisteredBufferPool::RegisterRegion(SIZE_T size, Region **ppRegion)
+{
+    Region *pRegion = new (std::nothrow) Region();
+    if (pRegion == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    pRegion->m_pBase = static_cast<char*>(AllocDataBuffer(size, m_bLargePages));
+    if (pRegion->m_pBase == nullptr)
+    {
+        delete pRegion;
+        return ND_NO_MEMORY;
+    }
+    pRegion->m_Size = size;
+
+    HRESULT hr = m_pAdapter->CreateMemoryRegion(
+        IID_IND2MemoryRegion,
+        m_hAdapterFile,
+        reinterpret_cast<VOID**>(&pRegion->m_pMr)
+    );
+    if (FAILED(hr))
+    {
+        FreeDataBuffer(pRegion->m_pBase);
+        delete pRegion;
+        return hr;
+    }
+
+    hr = pRegion->m_pMr->Register(pRegion->m_pBase, size, m_MrFlags, &m_Ov);
+    if (hr == ND_PENDING)
+    {
+        hr = pRegion->m_pMr->GetOverlappedResult(&m_Ov, TRUE);
+    }
+    if (FAILED(hr))
+    {
+        pRegion->m_pMr->Release();
+        FreeDataBuffer(pRegion->m_pBase);
+        delete pRegion;
+        return hr;
+    }
+
+    m_RegisteredBytes += size;
+    *ppRegion = pRegion;
+    return ND_SUCCESS;
+}
+
+void RegisteredBufferPool::DeregisterRegion(Region *pRegion)
+{
+    HRESULT hr = pRegion->m_pMr->Deregister(&m_Ov);
+    if (hr == ND_PENDING)
+    {
+        pRegion->m_pMr->GetOverlappedResult(&m_Ov, TRUE);
+    }
+    pRegion->m_pMr->Release();
+    FreeDataBuffer(pRegion->m_pBase);
+    m_RegisteredBytes -= pRegion->m_Size;
+    delete pRegion;
+}
+
+ULONG RegisteredBufferPool::ClassOf(SIZE_T len)
+{
+    ULONG sizeClass = 0;
+    while ((static_cast<SIZE_T>(1) << (sizeClass + x_MinClassShift)) < len)
+    {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+ULONG RegisteredBufferPool::BatchOf(ULONG sizeClass)
+{
+    SIZE_T batch = x_BatchBytes >> (sizeClass + x_MinClassShift);
+    if (batch > x_MaxBatch)
+    {
+        return x_MaxBatch;
+    }
+    return batch == 0 ? 1 : static_cast<ULONG>(batch);
+}
@@ -0,0 +1,140 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_BUFPOOL
+#define _ND_BUFPOOL
+
+#include "ndcommon.h"
+
+//allocate a page aligned buffer of at least len bytes to register, backed
+//by large pages if bLargePages is set and the process can get them, which
+//*pbLargePages reports. Returns nullptr on failure, free with FreeDataBuffer
+void* AllocDataBuffer(SIZE_T len, bool bLargePages, bool *pbLargePages = nullptr);
+void FreeDataBuffer(void *pBuf);
+
+//usage line for the examples' large page option
+#define LARGE_PAGES_USAGE \
+    "\t-L            - Back registered buffers with large pages (needs the lock pages privilege)\n"
+
+//a buffer handed out by RegisteredBufferPool, pass it back to Free unchanged
+struct PooledBuffer
+{
+    // Buffer, requested length and local token, ready to post.
+    ND2_SGE Sge;
+    UINT32 RemoteToken;
+    ULONG SizeClass;
+};
+
+//
+// Pool of pre-registered buffers.  Memory is registered in a few large
+// regions that are carved into slabs, each slab serving one power-of-two
+// size class from 64 bytes to 4MB, so that no buffer needs to be registered
+// on the data path.  Each thread keeps a short free list per size class and
+// only takes the pool lock to move a batch of buffers to or from the shared
+// lists.  Larger requests get a region of their own.
+//
+class RegisteredBufferPool
+{
+public:
+    static const ULONG x_MinClassShift = 6;
+    static const ULONG x_MaxClassShift = 22;
+    static const ULONG x_nClasses = x_MaxClassShift - x_MinClassShift + 1;
+    // SizeClass of buffers that got a region of their own.
+    static const ULONG x_LargeClass = x_nClasses;
+    static const SIZE_T x_SlabSize = static_cast<SIZE_T>(1) << x_MaxClassShift;
+    static const SIZE_T x_DefaultRegionSize = 8 * x_SlabSize;
+
+private:
+    // Header of a free buffer, so free buffers carry their tokens.
+    struct FreeBlock
+    {
+        FreeBlock *m_pNext;
+        UINT32 m_LocalToken;
+        UINT32 m_RemoteToken;
+    };
+
+    struct Region
+    {
+        Region *m_pNext;
+        char *m_pBase;
+        SIZE_T m_Size;
+        IND2MemoryRegion *m_pMr;
+    };
+
+    struct SizeClass
+    {
+        FreeBlock *m_pFree;
+        // Not yet handed out part of the slab being carved.
+        char *m_pCarve;
+        char *m_pCarveEnd;
+        UINT32 m_LocalToken;
+        UINT32 m_RemoteToken;
+    };
+
+    struct ThreadCache
+    {
+        ThreadCache *m_pNext;
+        FreeBlock *m_pFree[x_nClasses];
+        ULONG m_nFree[x_nClasses];
+    };
+
+    IND2Adapter *m_pAdapter;
+    HANDLE m_hAdapterFile;
+    ULONG m_MrFlags;
+    SIZE_T m_RegionSize;
+    bool m_bLargePages;
+    DWORD m_TlsIndex;
+    CRITICAL_SECTION m_Lock;
+    HANDLE m_hEvent;
+    OVERLAPPED m_Ov;
+
+    SizeClass m_Classes[x_nClasses];
+    Region *m_pRegions;
+    Region *m_pLargeRegions;
+    // Not yet carved part of the newest region.
+    char *m_pSlab;
+    char *m_pSlabEnd;
+    Region *m_pSlabRegion;
+    ThreadCache *m_pCaches;
+    SIZE_T m_RegisteredBytes;
+
+public:
+    RegisteredBufferPool();
+    ~RegisteredBufferPool();
+
+    //takes a reference on the adapter until the pool is destroyed,
+    //mrFlags are the ND_MR_FLAG_* access flags of every buffer, bLargePages
+    //backs the regions with large pages where possible
+    HRESULT Init(
+        IND2Adapter *pAdapter,
+        HANDLE hAdapterFile,
+        ULONG mrFlags,
+        SIZE_T regionSize = x_DefaultRegionSize,
+        bool bLargePages = false);
+
+    HRESULT Alloc(SIZE_T len, PooledBuffer *pBuffer);
+    void Free(const PooledBuffer& buffer);
+
+    //return the calling thread's cached buffers to the shared lists, e.g.
+    //before the thread exits
+    void FlushThreadCache();
+
+    SIZE_T RegisteredBytes() const { return m_RegisteredBytes; }
+
+private:
+    ThreadCache* GetThreadCache();
+    HRESULT Refill(ULONG sizeClass, ThreadCache *pCache);
+    void Drain(ULONG sizeClass, ThreadCache *pCache, ULONG nBlocks);
+    HRESULT NewSlab(ULONG sizeClass);
+    HRESULT AllocLarge(SIZE_T len, PooledBuffer *pBuffer);
+    void FreeLarge(void *pBuf);
+    HRESULT RegisterRegion(SIZE_T size, Region **ppRegion);
+    void DeregisterRegion(Region *pRegion);
+
+    static ULONG ClassOf(SIZE_T len);
+    static ULONG BatchOf(ULONG sizeClass);
+};
+
+#endif
@@ -0,0 +1,243 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndcredit.h"
+
+CreditChannel::CreditChannel() :
+    m_pQp(nullptr),
+    m_pPool(nullptr),
+    m_SendDepth(0),
+    m_RecvDepth(0),
+    m_MaxSge(0),
+    m_SlotSize(0),
+    m_RepostBatch(0),
+    m_UpdateThreshold(0),
+    m_RecvRing(),
+    m_HeaderRing(),
+    m_pSgl(nullptr),
+    m_SendCredits(0),
+    m_nOutstandingSends(0),
+    m_SendHead(0),
+    m_RecvHead(0),
+    m_nConsumed(0),
+    m_CreditsToReturn(0),
+    m_nUpdates(0)
+{
+}
+
+CreditChannel::~CreditChannel()
+{
+    if (m_RecvRing.Sge.Buffer != nullptr)
+    {
+        m_pPool->Free(m_RecvRing);
+    }
+    if (m_HeaderRing.Sge.Buffer != nullptr)
+    {
+        m_pPool->Free(m_HeaderRing);
+    }
+    delete[] m_pSgl;
+}
+
+HRESULT CreditChannel::Init(
+    IND2QueuePair *pQp,
+    RegisteredBufferPool *pPool,
+    ULONG sendDepth,
+    ULONG recvDepth,
+    ULONG maxSge,
+    ULONG maxMessage,
+    ULONG repostBatch)
+{
+    if (pQp == nullptr || pPool == nullptr || m_pQp != nullptr ||
+        sendDepth == 0 || recvDepth <= x_ReservedCredits || maxSge == 0)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_pSgl = new (std::nothrow) ND2_SGE[maxSge];
+    if (m_pSgl == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    m_pPool = pPool;
+    // Keep the slots cache line aligned.
+    m_SlotSize = (x_HeaderLen + maxMessage + 63) / 64 * 64;
+    HRESULT hr = pPool->Alloc(static_cast<SIZE_T>(m_SlotSize) * recvDepth, &m_RecvRing);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    hr = pPool->Alloc(static_cast<SIZE_T>(x_HeaderLen) * sendDepth, &m_HeaderRing);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    m_pQp = pQp;
+    m_SendDepth = sendDepth;
+    m_RecvDepth = recvDepth;
+    m_MaxSge = maxSge;
+    m_RepostBatch = (repostBatch != 0) ? min(repostBatch, recvDepth) : (recvDepth + 3) / 4;
+    m_UpdateThreshold = recvDepth / 2;
+
+    // Post every receive as if consumed, without owing the credits for them.
+    m_nConsumed = recvDepth;
+    hr = Repost(1);
+    m_CreditsToReturn = 0;
+    return hr;
+}
+
+HRESULT CreditChannel::Send(void *requestContext, const ND2_SGE *pSgl, ULONG nSge, ULONG flags)
+{
+    if (nSge >= m_MaxSge)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+    if (!CanSend())
+    {
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+
+    HRESULT hr = Repost(m_RepostBatch);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    return PostSend(requestContext, MessageData, pSgl, nSge, flags);
+}
+
+HRESULT CreditChannel::Complete(const ND2_RESULT *pResult, const void **ppMessage, ULONG *pLength)
+{
+    *ppMessage = nullptr;
+    *pLength = 0;
+
+    // The message handed out by the previous call is done with.
+    HRESULT hr = Repost(m_RepostBatch);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (pResult->Status != ND_SUCCESS)
+    {
+        return pResult->Status;
+    }
+
+    switch (pResult->RequestType)
+    {
+    case Nd2RequestTypeSend:
+        m_nOutstandingSends--;
+        break;
+
+    case Nd2RequestTypeReceive:
+    {
+        char *pSlot = static_cast<char *>(m_RecvRing.Sge.Buffer) +
+            static_cast<SIZE_T>(m_SlotSize) * m_RecvHead;
+        m_RecvHead = (m_RecvHead + 1) % m_RecvDepth;
+        m_nConsumed++;
+
+        if (pResult->BytesTransferred < x_HeaderLen)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+        const CreditHeader *pHeader = reinterpret_cast<const CreditHeader *>(pSlot);
+        m_SendCredits += pHeader->Credits;
+        if (pHeader->Type == MessageData)
+        {
+            *ppMessage = pSlot + x_HeaderLen;
+            *pLength = pResult->BytesTransferred - x_HeaderLen;
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+    return ND_SUCCESS;
+}
+
+HRESULT CreditChannel::Flush()
+{
+    HRESULT hr = Repost(1);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // An update may take the reserved credit.
+    if (m_CreditsToReturn < m_UpdateThreshold ||
+        m_SendCredits == 0 ||
+        m_nOutstandingSends == m_SendDepth)
+    {
+        return ND_SUCCESS;
+    }
+
+    hr = PostSend(nullptr, MessageUpdate, nullptr, 0, 0);
+    if (SUCCEEDED(hr))
+    {
+        m_nUpdates++;
+    }
+    return hr;
+}
+
+HRESULT CreditChannel::PostSend(
+    void *requestContext,
+    MessageType type,
+    const ND2_SGE *pSgl,
+    ULONG nSge,
+    ULONG flags)
+{
+    CreditHeader *pHeader = static_cast<CreditHeader *>(m_HeaderRing.Sge.Buffer) + m_SendHead;
+    pHeader->Credits = m_CreditsToReturn;
+    pHeader->Type = type;
+
+    m_pSgl[0].Buffer = pHeader;
+    m_pSgl[0].BufferLength = x_HeaderLen;
+    m_pSgl[0].MemoryRegionToken = m_HeaderRing.Sge.MemoryRegionToken;
+    for (ULONG i = 0; i < nSge; i++)
+    {
+        m_pSgl[i + 1] = pSgl[i];
+    }
+
+    HRESULT hr = m_pQp->Send(requestContext, m_pSgl, nSge + 1, flags);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    m_SendCredits--;
+    m_CreditsToReturn = 0;
+    m_nOutstandingSends++;
+    m_SendHead = (m_SendHead + 1) % m_SendDepth;
+    return ND_SUCCESS;
+}
+
+HRESULT CreditChannel::Repost(ULONG minBatch)
+{
+    if (m_nConsumed == 0 || m_nConsumed < minBatch)
+    {
+        return ND_SUCCESS;
+    }
+
+    ULONG iSlot = (m_RecvHead + m_RecvDepth - m_nConsumed) % m_RecvDepth;
+    ND2_SGE sge;
+    sge.BufferLength = m_SlotSize;
+    sge.MemoryRegionToken = m_RecvRing.Sge.MemoryRegionToken;
+    while (m_nConsumed != 0)
+    {
+        sge.Buffer = static_cast<char *>(m_RecvRing.Sge.Buffer) + static_cast<SIZE_T>(m_SlotSize) * iSlot;
+        HRESULT hr = m_pQp->Receive(nullptr, &sge, 1);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        iSlot = (iSlot + 1) % m_RecvDepth;
+        m_nConsumed--;
+        m_CreditsToReturn++;
+    }
+    return ND_SUCCESS;
+}
@@ -0,0 +1,129 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_CREDIT
+#define _ND_CREDIT
+
+#include "ndcommon.h"
+#include "ndbufpool.h"
+
+//header in front of every message on a CreditChannel
+struct CreditHeader
+{
+    // Receives the sender reposted since its previous message, handed back
+    // to the peer as send credits.
+    UINT32 Credits;
+    // CreditChannel::MessageType.
+    UINT32 Type;
+};
+
+//
+// Message channel over a connected queue pair with credit-based flow
+// control, so that a side never sends to a receive queue with nothing
+// posted on it.
+//
+// Each side starts with as many credits as the peer posts receives,
+// exchanged by the test, e.g. in the connection's private data.  Sending a
+// message takes a credit.  Consumed receives are reposted in batches, and
+// the credits for them ride back on the header of the next message.  A
+// side with nothing to send calls Flush, which sends a credit update of its
+// own only once the peer is owed half the receive depth.  The last credit
+// is kept for such updates, so two sides that both run out of data credits
+// can still hand credits back.
+//
+// Every receive buffer and header comes from a RegisteredBufferPool, which
+// must outlive the channel.  The channel relies on the queue pair reporting
+// completions in the order requests were posted, and on every send
+// reporting a completion.
+//
+class CreditChannel
+{
+public:
+    static const ULONG x_HeaderLen = sizeof(CreditHeader);
+    static const ULONG x_ReservedCredits = 1;
+
+    enum MessageType
+    {
+        MessageData,
+        MessageUpdate
+    };
+
+private:
+    IND2QueuePair *m_pQp;
+    RegisteredBufferPool *m_pPool;
+    ULONG m_SendDepth;
+    ULONG m_RecvDepth;
+    ULONG m_MaxSge;
+    ULONG m_SlotSize;
+    ULONG m_RepostBatch;
+    ULONG m_UpdateThreshold;
+
+    // One receive slot of header and message per receive.
+    PooledBuffer m_RecvRing;
+    // One header per send queue entry, kept until the send completes.
+    PooledBuffer m_HeaderRing;
+    ND2_SGE *m_pSgl;
+
+    ULONG m_SendCredits;
+    ULONG m_nOutstandingSends;
+    ULONG m_SendHead;
+    ULONG m_RecvHead;
+    // Completed receives that were not reposted yet.
+    ULONG m_nConsumed;
+    ULONG m_CreditsToReturn;
+
+    ULONGLONG m_nUpdates;
+
+public:
+    CreditChannel();
+    ~CreditChannel();
+
+    //posts recvDepth receives of maxMessage bytes each, so call it before
+    //connecting. sendDepth and maxSge are the initiator limits the queue
+    //pair was created with; one SGE of each send carries the header.
+    //repostBatch of 0 reposts a quarter of the receive depth at a time
+    HRESULT Init(
+        IND2QueuePair *pQp,
+        RegisteredBufferPool *pPool,
+        ULONG sendDepth,
+        ULONG recvDepth,
+        ULONG maxSge,
+        ULONG maxMessage,
+        ULONG repostBatch = 0);
+
+    //credits to give the peer before the first message
+    ULONG InitialCredits() const { return m_RecvDepth; }
+    //the peer's InitialCredits()
+    void SetPeerCredits(ULONG credits) { m_SendCredits = credits; }
+
+    bool CanSend() const
+    {
+        return m_SendCredits > x_ReservedCredits && m_nOutstandingSends < m_SendDepth;
+    }
+
+    //send a message of up to maxSge - 1 SGEs, fails with
+    //ND_INSUFFICIENT_RESOURCES unless CanSend()
+    HRESULT Send(void *requestContext, const ND2_SGE *pSgl, ULONG nSge, ULONG flags);
+
+    //handle a completion of the queue pair. For a received message,
+    //*ppMessage and *pLength describe it until the next call into the
+    //channel; they are nullptr and 0 for everything else. Returns the
+    //completion's status
+    HRESULT Complete(const ND2_RESULT *pResult, const void **ppMessage, ULONG *pLength);
+
+    //call when there is nothing to send: reposts all consumed receives and
+    //returns their credits in an update once enough are owed
+    HRESULT Flush();
+
+    ULONG SendCredits() const { return m_SendCredits; }
+    //credit updates sent without a message
+    ULONGLONG Updates() const { return m_nUpdates; }
+
+private:
+    HRESULT PostSend(void *requestContext, MessageType type, const ND2_SGE *pSgl, ULONG nSge, ULONG flags);
+    HRESULT Repost(ULONG minBatch);
+};
+
+#endif
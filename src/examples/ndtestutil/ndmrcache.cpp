@@ -0,0 +1,471 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndmrcache.h"
+
+MrCache::MrCache() :
+    m_pAdapter(nullptr),
+    m_hAdapterFile(nullptr),
+    m_hEvent(nullptr),
+    m_pRoot(nullptr),
+    m_pLruHead(nullptr),
+    m_pLruTail(nullptr),
+    m_IdleBudget(x_DefaultIdleBudget),
+    m_IdleBytes(0),
+    m_nHits(0),
+    m_nMisses(0),
+    m_nEvictions(0)
+{
+    RtlZeroMemory(&m_Ov, sizeof(m_Ov));
+    InitializeCriticalSection(&m_Lock);
+}
+
+MrCache::~MrCache()
+{
+    TreeDestroy(m_pRoot);
+    m_pRoot = nullptr;
+    m_pLruHead = m_pLruTail = nullptr;
+
+    if (m_pAdapter != nullptr)
+    {
+        m_pAdapter->Release();
+    }
+
+    if (m_hEvent != nullptr)
+    {
+        CloseHandle(m_hEvent);
+    }
+    DeleteCriticalSection(&m_Lock);
+}
+
+HRESULT MrCache::Init(IND2Adapter *pAdapter, HANDLE hAdapterFile, SIZE_T idleBudget)
+{
+    if (pAdapter == nullptr || m_pAdapter != nullptr)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_hEvent == nullptr)
+    {
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+    m_Ov.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<SIZE_T>(m_hEvent) | 0x1);
+
+    pAdapter->AddRef();
+    m_pAdapter = pAdapter;
+    m_hAdapterFile = hAdapterFile;
+    m_IdleBudget = idleBudget;
+    return ND_SUCCESS;
+}
+
+HRESULT MrCache::Acquire(const void *pBuf, SIZE_T len, ULONG flags, MrCacheEntry **ppEntry)
+{
+    ULONG_PTR start = reinterpret_cast<ULONG_PTR>(pBuf);
+    if (m_pAdapter == nullptr || ppEntry == nullptr || pBuf == nullptr || len == 0 ||
+        len > ~static_cast<ULONG_PTR>(0) - start - x_PageSize)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+    ULONG_PTR end = start + len;
+
+    HRESULT hr = ND_SUCCESS;
+    EnterCriticalSection(&m_Lock);
+
+    MrCacheEntry *pEntry = TreeFindCovering(m_pRoot, start, end, flags);
+    if (pEntry != nullptr)
+    {
+        if (pEntry->m_nRefs++ == 0)
+        {
+            LruRemove(pEntry);
+        }
+        m_nHits++;
+    }
+    else
+    {
+        m_nMisses++;
+
+        // Register whole pages, so that neighbouring buffers on the same
+        // pages hit the same registration.
+        ULONG_PTR regStart = start & ~(x_PageSize - 1);
+        ULONG_PTR regEnd = (end + x_PageSize - 1) & ~(x_PageSize - 1);
+        hr = Register(regStart, regEnd, flags, &pEntry);
+        if (hr == ND_INSUFFICIENT_RESOURCES || hr == ND_NO_MEMORY)
+        {
+            // Give back the idle registrations and try once more.
+            TrimIdle(0);
+            hr = Register(regStart, regEnd, flags, &pEntry);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            pEntry->m_nRefs = 1;
+            m_pRoot = TreeInsert(m_pRoot, pEntry);
+        }
+    }
+
+    LeaveCriticalSection(&m_Lock);
+
+    *ppEntry = SUCCEEDED(hr) ? pEntry : nullptr;
+    return hr;
+}
+
+void MrCache::Release(MrCacheEntry *pEntry)
+{
+    EnterCriticalSection(&m_Lock);
+    if (--pEntry->m_nRefs == 0)
+    {
+        if (pEntry->m_bStale)
+        {
+            Deregister(pEntry);
+        }
+        else
+        {
+            LruInsert(pEntry);
+            TrimIdle(m_IdleBudget);
+        }
+    }
+    LeaveCriticalSection(&m_Lock);
+}
+
+void MrCache::Invalidate(const void *pBuf, SIZE_T len)
+{
+    ULONG_PTR start = reinterpret_cast<ULONG_PTR>(pBuf);
+    ULONG_PTR end = start + len;
+
+    EnterCriticalSection(&m_Lock);
+    MrCacheEntry *pEntry;
+    while ((pEntry = TreeFindOverlapping(m_pRoot, start, end)) != nullptr)
+    {
+        if (pEntry->m_nRefs == 0)
+        {
+            Evict(pEntry);
+        }
+        else
+        {
+            // Still in use: stop handing it out, deregister on last release.
+            m_pRoot = TreeRemove(m_pRoot, pEntry);
+            pEntry->m_bStale = true;
+        }
+    }
+    LeaveCriticalSection(&m_Lock);
+}
+
+void MrCache::Flush()
+{
+    EnterCriticalSection(&m_Lock);
+    TrimIdle(0);
+    LeaveCriticalSection(&m_Lock);
+}
+
+HRESULT MrCache::Register(ULONG_PTR start, ULONG_PTR end, ULONG flags, MrCacheEntry **ppEntry)
+{
+    MrCacheEntry *pEntry = new (std::nothrow) MrCacheEntry();
+    if (pEntry == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    HRESULT hr = m_pAdapter->CreateMemoryRegion(
+        IID_IND2MemoryRegion,
+        m_hAdapterFile,
+        reinterpret_cast<VOID**>(&pEntry->m_pMr)
+    );
+    if (FAILED(hr))
+    {
+        delete pEntry;
+        return hr;
+    }
+
+    hr = pEntry->m_pMr->Register(reinterpret_cast<void *>(start), end - start, flags, &m_Ov);
+    if (hr == ND_PENDING)
+    {
+        hr = pEntry->m_pMr->GetOverlappedResult(&m_Ov, TRUE);
+    }
+    if (FAILED(hr))
+    {
+        pEntry->m_pMr->Release();
+        delete pEntry;
+        return hr;
+    }
+
+    pEntry->m_Start = start;
+    pEntry->m_End = end;
+    pEntry->m_Flags = flags;
+    *ppEntry = pEntry;
+    return ND_SUCCESS;
+}
+
+void MrCache::Deregister(MrCacheEntry *pEntry)
+{
+    // Nothing useful can be done if this fails: the region is released
+    // either way.
+    HRESULT hr = pEntry->m_pMr->Deregister(&m_Ov);
+    if (hr == ND_PENDING)
+    {
+        pEntry->m_pMr->GetOverlappedResult(&m_Ov, TRUE);
+    }
+    pEntry->m_pMr->Release();
+    delete pEntry;
+}
+
+void MrCache::Evict(MrCacheEntry *pEntry)
+{
+    LruRemove(pEntry);
+    m_pRoot = TreeRemove(m_pRoot, pEntry);
+    Deregister(pEntry);
+    m_nEvictions++;
+}
+
+void MrCache::TrimIdle(SIZE_T budget)
+{
+    while (m_IdleBytes > budget && m_pLruHead != nullptr)
+    {
+        Evict(m_pLruHead);
+    }
+}
+
+void MrCache::LruInsert(MrCacheEntry *pEntry)
+{
+    pEntry->m_pPrev = m_pLruTail;
+    pEntry->m_pNext = nullptr;
+    if (m_pLruTail != nullptr)
+    {
+        m_pLruTail->m_pNext = pEntry;
+    }
+    else
+    {
+        m_pLruHead = pEntry;
+    }
+    m_pLruTail = pEntry;
+    m_IdleBytes += pEntry->m_End - pEntry->m_Start;
+}
+
+void MrCache::LruRemove(MrCacheEntry *pEntry)
+{
+    if (pEntry->m_pPrev != nullptr)
+    {
+        pEntry->m_pPrev->m_pNext = pEntry->m_pNext;
+    }
+    else
+    {
+        m_pLruHead = pEntry->m_pNext;
+    }
+
+    if (pEntry->m_pNext != nullptr)
+    {
+        pEntry->m_pNext->m_pPrev = pEntry->m_pPrev;
+    }
+    else
+    {
+        m_pLruTail = pEntry->m_pPrev;
+    }
+
+    pEntry->m_pPrev = pEntry->m_pNext = nullptr;
+    m_IdleBytes -= pEntry->m_End - pEntry->m_Start;
+}
+
+//
+// The interval tree is an AVL tree ordered by start address (ties broken by
+// entry address), where each node also tracks the largest end address in
+// its subtree so that searches can skip subtrees that end too early.
+//
+int MrCache::TreeHeight(const MrCacheEntry *pNode)
+{
+    return (pNode == nullptr) ? 0 : pNode->m_Height;
+}
+
+void MrCache::TreeUpdate(MrCacheEntry *pNode)
+{
+    pNode->m_Height = 1 + max(TreeHeight(pNode->m_pLeft), TreeHeight(pNode->m_pRight));
+    pNode->m_MaxEnd = pNode->m_End;
+    if (pNode->m_pLeft != nullptr)
+    {
+        pNode->m_MaxEnd = max(pNode->m_MaxEnd, pNode->m_pLeft->m_MaxEnd);
+    }
+    if (pNode->m_pRight != nullptr)
+    {
+        pNode->m_MaxEnd = max(pNode->m_MaxEnd, pNode->m_pRight->m_MaxEnd);
+    }
+}
+
+MrCacheEntry* MrCache::TreeRotateLeft(MrCacheEntry *pNode)
+{
+    MrCacheEntry *pRight = pNode->m_pRight;
+    pNode->m_pRight = pRight->m_pLeft;
+    pRight->m_pLeft = pNode;
+    TreeUpdate(pNode);
+    TreeUpdate(pRight);
+    return pRight;
+}
+
+MrCacheEntry* MrCache::TreeRotateRight(MrCacheEntry *pNode)
+{
+    MrCacheEntry *pLeft = pNode->m_pLeft;
+    pNode->m_pLeft = pLeft->m_pRight;
+    pLeft->m_pRight = pNode;
+    TreeUpdate(pNode);
+    TreeUpdate(pLeft);
+    return pLeft;
+}
+
+MrCacheEntry* MrCache::TreeBalance(MrCacheEntry *pNode)
+{
+    TreeUpdate(pNode);
+    int balance = TreeHeight(pNode->m_pLeft) - TreeHeight(pNode->m_pRight);
+    if (balance > 1)
+    {
+        if (TreeHeight(pNode->m_pLeft->m_pLeft) < TreeHeight(pNode->m_pLeft->m_pRight))
+        {
+            pNode->m_pLeft = TreeRotateLeft(pNode->m_pLeft);
+        }
+        return TreeRotateRight(pNode);
+    }
+    if (balance < -1)
+    {
+        if (TreeHeight(pNode->m_pRight->m_pRight) < TreeHeight(pNode->m_pRight->m_pLeft))
+        {
+            pNode->m_pRight = TreeRotateRight(pNode->m_pRight);
+        }
+        return TreeRotateLeft(pNode);
+    }
+    return pNode;
+}
+
+static bool TreeLess(const MrCacheEntry *pEntry, ULONG_PTR start, const MrCacheEntry *pNode, ULONG_PTR nodeStart)
+{
+    return start < nodeStart ||
+        (start == nodeStart && reinterpret_cast<ULONG_PTR>(pEntry) < reinterpret_cast<ULONG_PTR>(pNode));
+}
+
+MrCacheEntry* MrCache::TreeInsert(MrCacheEntry *pNode, MrCacheEntry *pEntry)
+{
+    if (pNode == nullptr)
+    {
+        pEntry->m_pLeft = pEntry->m_pRight = nullptr;
+        TreeUpdate(pEntry);
+        return pEntry;
+    }
+
+    if (TreeLess(pEntry, pEntry->m_Start, pNode, pNode->m_Start))
+    {
+        pNode->m_pLeft = TreeInsert(pNode->m_pLeft, pEntry);
+    }
+    else
+    {
+        pNode->m_pRight = TreeInsert(pNode->m_pRight, pEntry);
+    }
+    return TreeBalance(pNode);
+}
+
+MrCacheEntry* MrCache::TreeRemoveMin(MrCacheEntry *pNode, MrCacheEntry **ppMin)
+{
+    if (pNode->m_pLeft == nullptr)
+    {
+        *ppMin = pNode;
+        return pNode->m_pRight;
+    }
+    pNode->m_pLeft = TreeRemoveMin(pNode->m_pLeft, ppMin);
+    return TreeBalance(pNode);
+}
+
+MrCacheEntry* MrCache::TreeRemove(MrCacheEntry *pNode, MrCacheEntry *pEntry)
+{
+    if (pNode == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (pNode == pEntry)
+    {
+        if (pNode->m_pRight == nullptr)
+        {
+            return pNode->m_pLeft;
+        }
+
+        MrCacheEntry *pMin;
+        MrCacheEntry *pRight = TreeRemoveMin(pNode->m_pRight, &pMin);
+        pMin->m_pLeft = pNode->m_pLeft;
+        pMin->m_pRight = pRight;
+        pEntry->m_pLeft = pEntry->m_pRight = nullptr;
+        return TreeBalance(pMin);
+    }
+
+    if (TreeLess(pEntry, pEntry->m_Start, pNode, pNode->m_Start))
+    {
+        pNode->m_pLeft = TreeRemove(pNode->m_pLeft, pEntry);
+    }
+    else
+    {
+        pNode->m_pRight = TreeRemove(pNode->m_pRight, pEntry);
+    }
+    return TreeBalance(pNode);
+}
+
+MrCacheEntry* MrCache::TreeFindCovering(
+    MrCacheEntry *pNode,
+    ULONG_PTR start,
+    ULONG_PTR end,
+    ULONG flags)
+{
+    if (pNode == nullptr || pNode->m_MaxEnd < end)
+    {
+        return nullptr;
+    }
+
+    MrCacheEntry *pFound = TreeFindCovering(pNode->m_pLeft, start, end, flags);
+    if (pFound != nullptr)
+    {
+        return pFound;
+    }
+
+    // This node and everything to its right start too late.
+    if (pNode->m_Start > start)
+    {
+        return nullptr;
+    }
+
+    if (pNode->m_End >= end && (flags & ~pNode->m_Flags) == 0)
+    {
+        return pNode;
+    }
+    return TreeFindCovering(pNode->m_pRight, start, end, flags);
+}
+
+MrCacheEntry* MrCache::TreeFindOverlapping(MrCacheEntry *pNode, ULONG_PTR start, ULONG_PTR end)
+{
+    if (pNode == nullptr || pNode->m_MaxEnd <= start)
+    {
+        return nullptr;
+    }
+
+    MrCacheEntry *pFound = TreeFindOverlapping(pNode->m_pLeft, start, end);
+    if (pFound != nullptr)
+    {
+        return pFound;
+    }
+
+    if (pNode->m_Start >= end)
+    {
+        return nullptr;
+    }
+
+    if (pNode->m_End > start)
+    {
+        return pNode;
+    }
+    return TreeFindOverlapping(pNode->m_pRight, start, end);
+}
+
+void MrCache::TreeDestroy(MrCacheEntry *pNode)
+{
+    if (pNode == nullptr)
+    {
+        return;
+    }
+    TreeDestroy(pNode->m_pLeft);
+    TreeDestroy(pNode->m_pRight);
+    Deregister(pNode);
+}
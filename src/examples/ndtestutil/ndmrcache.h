@@ -0,0 +1,144 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_MRCACHE
+#define _ND_MRCACHE
+
+#include "ndcommon.h"
+
+class MrCache;
+
+//
+// A registration handed out by MrCache.  It covers at least the range it
+// was acquired for, and stays registered until released back to the cache.
+//
+class MrCacheEntry
+{
+    friend class MrCache;
+
+private:
+    IND2MemoryRegion *m_pMr;
+    // Registered range [m_Start, m_End), rounded out to whole pages.
+    ULONG_PTR m_Start;
+    ULONG_PTR m_End;
+    ULONG m_Flags;
+    LONG m_nRefs;
+    // Deregister once the last reference is released, e.g. after the
+    // range was invalidated while still in use.
+    bool m_bStale;
+
+    // Interval tree links, keyed by m_Start.  m_MaxEnd is the largest
+    // m_End in the subtree.
+    MrCacheEntry *m_pLeft;
+    MrCacheEntry *m_pRight;
+    ULONG_PTR m_MaxEnd;
+    int m_Height;
+
+    // LRU list of unreferenced entries, oldest first.
+    MrCacheEntry *m_pPrev;
+    MrCacheEntry *m_pNext;
+
+public:
+    IND2MemoryRegion* MemoryRegion() const { return m_pMr; }
+    UINT32 GetLocalToken() const { return m_pMr->GetLocalToken(); }
+    UINT32 GetRemoteToken() const { return m_pMr->GetRemoteToken(); }
+};
+
+//
+// User-mode registration (pin-down) cache.  Acquire looks up a registration
+// that already covers the requested range and has at least the requested
+// access flags, and only registers new memory on a miss.  Registrations are
+// reference counted; once released they are kept registered, and the least
+// recently used ones are deregistered when the unreferenced registrations
+// exceed the idle budget.
+//
+// The cache cannot see memory being freed: callers must Invalidate a range
+// before releasing the memory back to the system.  Misses register under
+// the cache lock, so concurrent misses are serialized.
+//
+class MrCache
+{
+public:
+    static const SIZE_T x_PageSize = 4096;
+    static const SIZE_T x_DefaultIdleBudget = 64 * 1024 * 1024;
+
+private:
+    IND2Adapter *m_pAdapter;
+    HANDLE m_hAdapterFile;
+    CRITICAL_SECTION m_Lock;
+    // The low bit of the event handle is set so that registrations don't
+    // complete to an IOCP the adapter file may be bound to.
+    HANDLE m_hEvent;
+    OVERLAPPED m_Ov;
+
+    MrCacheEntry *m_pRoot;
+    MrCacheEntry *m_pLruHead;
+    MrCacheEntry *m_pLruTail;
+    SIZE_T m_IdleBudget;
+    SIZE_T m_IdleBytes;
+
+    ULONGLONG m_nHits;
+    ULONGLONG m_nMisses;
+    ULONGLONG m_nEvictions;
+
+public:
+    MrCache();
+    ~MrCache();
+
+    //takes a reference on the adapter until the cache is destroyed,
+    //idleBudget bounds the bytes kept registered but unreferenced
+    HRESULT Init(
+        IND2Adapter *pAdapter,
+        HANDLE hAdapterFile,
+        SIZE_T idleBudget = x_DefaultIdleBudget);
+
+    //return a registration covering [pBuf, pBuf + len) with at least the
+    //given ND_MR_FLAG_* access flags
+    HRESULT Acquire(
+        const void *pBuf,
+        SIZE_T len,
+        ULONG flags,
+        MrCacheEntry **ppEntry);
+
+    //drop a reference returned by Acquire
+    void Release(MrCacheEntry *pEntry);
+
+    //forget the registrations overlapping [pBuf, pBuf + len), must be
+    //called before that memory is freed
+    void Invalidate(const void *pBuf, SIZE_T len);
+
+    //deregister all unreferenced registrations
+    void Flush();
+
+    ULONGLONG Hits() const { return m_nHits; }
+    ULONGLONG Misses() const { return m_nMisses; }
+    ULONGLONG Evictions() const { return m_nEvictions; }
+    SIZE_T IdleBytes() const { return m_IdleBytes; }
+
+private:
+    HRESULT Register(ULONG_PTR start, ULONG_PTR end, ULONG flags, MrCacheEntry **ppEntry);
+    void Deregister(MrCacheEntry *pEntry);
+    void Evict(MrCacheEntry *pEntry);
+    void TrimIdle(SIZE_T budget);
+
+    void LruInsert(MrCacheEntry *pEntry);
+    void LruRemove(MrCacheEntry *pEntry);
+
+    static MrCacheEntry* TreeInsert(MrCacheEntry *pNode, MrCacheEntry *pEntry);
+    static MrCacheEntry* TreeRemove(MrCacheEntry *pNode, MrCacheEntry *pEntry);
+    static MrCacheEntry* TreeRemoveMin(MrCacheEntry *pNode, MrCacheEntry **ppMin);
+    static MrCacheEntry* TreeBalance(MrCacheEntry *pNode);
+    static MrCacheEntry* TreeRotateLeft(MrCacheEntry *pNode);
+    static MrCacheEntry* TreeRotateRight(MrCacheEntry *pNode);
+    static void TreeUpdate(MrCacheEntry *pNode);
+    static int TreeHeight(const MrCacheEntry *pNode);
+    static MrCacheEntry* TreeFindCovering(
+        MrCacheEntry *pNode, ULONG_PTR start, ULONG_PTR end, ULONG flags);
+    static MrCacheEntry* TreeFindOverlapping(
+        MrCacheEntry *pNode, ULONG_PTR start, ULONG_PTR end);
+    void TreeDestroy(MrCacheEntry *pNode);
+};
+
+#endif
@@ -0,0 +1,315 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndreport.h"
+#include "ndtestutil.h"
+
+bool ParseReportFormat(const TCHAR *name, ReportFormat *pFormat)
+{
+    if (_wcsicmp(name, L"table") == 0)
+    {
+        *pFormat = ReportFormatTable;
+    }
+    else if (_wcsicmp(name, L"csv") == 0)
+    {
+        *pFormat = ReportFormatCsv;
+    }
+    else if (_wcsicmp(name, L"json") == 0)
+    {
+        *pFormat = ReportFormatJson;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+ResultReport::ResultReport() :
+    m_TestName(""),
+    m_Format(ReportFormatTable),
+    m_pFile(stdout),
+    m_bCloseFile(false),
+    m_nMetadata(0),
+    m_nColumns(0),
+    m_bStarted(false),
+    m_bEnded(false),
+    m_nRows(0),
+    m_iColumn(0)
+{
+}
+
+ResultReport::~ResultReport()
+{
+    End();
+    if (m_bCloseFile)
+    {
+        fclose(m_pFile);
+    }
+}
+
+void ResultReport::Init(const char *testName, ReportFormat format, const TCHAR *fileName)
+{
+    m_TestName = testName;
+    m_Format = format;
+    if (fileName != nullptr)
+    {
+        if (_wfopen_s(&m_pFile, fileName, L"w") != 0)
+        {
+            LogErrorExit("Failed to open result file.\n", __LINE__);
+        }
+        m_bCloseFile = true;
+    }
+}
+
+ResultReport::Metadata* ResultReport::NextMetadata(const char *name)
+{
+    if (m_bStarted || m_nMetadata == x_MaxMetadata)
+    {
+        LogErrorExit("Too many or late report metadata.\n", __LINE__);
+    }
+
+    Metadata *pMetadata = &m_Metadata[m_nMetadata++];
+    pMetadata->m_Name = name;
+    return pMetadata;
+}
+
+void ResultReport::AddMetadata(const char *name, const char *value)
+{
+    Metadata *pMetadata = NextMetadata(name);
+    strncpy_s(pMetadata->m_Value, value, _TRUNCATE);
+    pMetadata->m_bNumber = false;
+}
+
+void ResultReport::AddMetadata(const char *name, ULONGLONG value)
+{
+    Metadata *pMetadata = NextMetadata(name);
+    sprintf_s(pMetadata->m_Value, "%I64u", value);
+    pMetadata->m_bNumber = true;
+}
+
+void ResultReport::AddAdapterInfo(const ND2_ADAPTER_INFO& info)
+{
+    char value[x_MaxValueLen];
+    sprintf_s(value, "%04x", info.VendorId);
+    AddMetadata("VendorId", value);
+    sprintf_s(value, "%04x", info.DeviceId);
+    AddMetadata("DeviceId", value);
+    sprintf_s(value, "%016I64x", info.AdapterId);
+    AddMetadata("AdapterId", value);
+    sprintf_s(value, "%08x", info.AdapterFlags);
+    AddMetadata("AdapterFlags", value);
+
+    AddMetadata("MaxTransferLength", info.MaxTransferLength);
+    AddMetadata("MaxInitiatorSge", info.MaxInitiatorSge);
+    AddMetadata("MaxReceiveSge", info.MaxReceiveSge);
+    AddMetadata("MaxReadSge", info.MaxReadSge);
+    AddMetadata("MaxInlineDataSize", info.MaxInlineDataSize);
+    AddMetadata("InlineRequestThreshold", info.InlineRequestThreshold);
+    AddMetadata("LargeRequestThreshold", info.LargeRequestThreshold);
+    AddMetadata("MaxInboundReadLimit", info.MaxInboundReadLimit);
+    AddMetadata("MaxOutboundReadLimit", info.MaxOutboundReadLimit);
+    AddMetadata("MaxReceiveQueueDepth", info.MaxReceiveQueueDepth);
+    AddMetadata("MaxInitiatorQueueDepth", info.MaxInitiatorQueueDepth);
+    AddMetadata("MaxCompletionQueueDepth", info.MaxCompletionQueueDepth);
+}
+
+void ResultReport::AddColumn(const char *name, int width, int precision, const char *suffix)
+{
+    if (m_bStarted || m_nColumns == x_MaxColumns)
+    {
+        LogErrorExit("Too many or late report columns.\n", __LINE__);
+    }
+
+    Column& column = m_Columns[m_nColumns++];
+    column.m_Name = name;
+    column.m_Width = width;
+    column.m_Precision = precision;
+    column.m_Suffix = suffix;
+}
+
+void ResultReport::WriteString(const char *text)
+{
+    fputc('"', m_pFile);
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        if (*p == '"' || (*p == '\\' && m_Format == ReportFormatJson))
+        {
+            // JSON escapes with a backslash, CSV by doubling the quote.
+            fputc(m_Format == ReportFormatJson ? '\\' : '"', m_pFile);
+        }
+        fputc(*p, m_pFile);
+    }
+    fputc('"', m_pFile);
+}
+
+void ResultReport::Start()
+{
+    m_bStarted = true;
+    switch (m_Format)
+    {
+    case ReportFormatTable:
+        for (ULONG i = 0; i < m_nMetadata; i++)
+        {
+            fprintf(m_pFile, "%s: %s\n", m_Metadata[i].m_Name, m_Metadata[i].m_Value);
+        }
+        fprintf(m_pFile, "\n");
+        for (ULONG i = 0; i < m_nColumns; i++)
+        {
+            fprintf(m_pFile, " %*s", m_Columns[i].m_Width, m_Columns[i].m_Name);
+        }
+        fprintf(m_pFile, "\n");
+        break;
+
+    case ReportFormatCsv:
+        fprintf(m_pFile, "# Test: %s\n", m_TestName);
+        for (ULONG i = 0; i < m_nMetadata; i++)
+        {
+            fprintf(m_pFile, "# %s: %s\n", m_Metadata[i].m_Name, m_Metadata[i].m_Value);
+        }
+        for (ULONG i = 0; i < m_nColumns; i++)
+        {
+            fprintf(m_pFile, i == 0 ? "%s" : ",%s", m_Columns[i].m_Name);
+        }
+        fprintf(m_pFile, "\n");
+        break;
+
+    case ReportFormatJson:
+        fprintf(m_pFile, "{\n  \"test\": ");
+        WriteString(m_TestName);
+        fprintf(m_pFile, ",\n  \"metadata\": {");
+        for (ULONG i = 0; i < m_nMetadata; i++)
+        {
+            fprintf(m_pFile, i == 0 ? "\n    " : ",\n    ");
+            WriteString(m_Metadata[i].m_Name);
+            fprintf(m_pFile, ": ");
+            if (m_Metadata[i].m_bNumber)
+            {
+                fprintf(m_pFile, "%s", m_Metadata[i].m_Value);
+            }
+            else
+            {
+                WriteString(m_Metadata[i].m_Value);
+            }
+        }
+        fprintf(m_pFile, "\n  },\n  \"results\": [");
+        break;
+    }
+}
+
+const ResultReport::Column& ResultReport::NextColumn()
+{
+    if (!m_bStarted)
+    {
+        Start();
+    }
+
+    if (m_iColumn == m_nColumns)
+    {
+        LogErrorExit("Too many values in report row.\n", __LINE__);
+    }
+
+    const Column& column = m_Columns[m_iColumn];
+    switch (m_Format)
+    {
+    case ReportFormatCsv:
+        if (m_iColumn != 0)
+        {
+            fputc(',', m_pFile);
+        }
+        break;
+
+    case ReportFormatJson:
+        fprintf(m_pFile, m_iColumn == 0 ?
+            (m_nRows == 0 ? "\n    { " : ",\n    { ") : ", ");
+        WriteString(column.m_Name);
+        fprintf(m_pFile, ": ");
+        break;
+
+    default:
+        break;
+    }
+
+    m_iColumn++;
+    return column;
+}
+
+void ResultReport::WriteValue(const char *text, bool bQuote)
+{
+    const Column& column = NextColumn();
+    if (m_Format == ReportFormatTable)
+    {
+        char value[x_MaxValueLen];
+        sprintf_s(value, "%s%s", text, column.m_Suffix);
+        fprintf(m_pFile, " %*s", column.m_Width, value);
+    }
+    else if (bQuote)
+    {
+        WriteString(text);
+    }
+    else
+    {
+        fprintf(m_pFile, "%s", text);
+    }
+}
+
+void ResultReport::Value(ULONGLONG value)
+{
+    char text[x_MaxValueLen];
+    sprintf_s(text, "%I64u", value);
+    WriteValue(text, false);
+}
+
+void ResultReport::Value(double value)
+{
+    char text[x_MaxValueLen];
+    sprintf_s(text, "%.*f", m_iColumn < m_nColumns ? m_Columns[m_iColumn].m_Precision : 0, value);
+    WriteValue(text, false);
+}
+
+void ResultReport::Value(const char *value)
+{
+    // CSV only needs quotes around separators and quotes.
+    WriteValue(value, m_Format == ReportFormatJson || strpbrk(value, ",\"") != nullptr);
+}
+
+void ResultReport::EndRow()
+{
+    if (m_iColumn != m_nColumns)
+    {
+        LogErrorExit("Too few values in report row.\n", __LINE__);
+    }
+
+    fprintf(m_pFile, m_Format == ReportFormatJson ? " }" : "\n");
+    fflush(m_pFile);
+    m_iColumn = 0;
+    m_nRows++;
+}
+
+void ResultReport::End()
+{
+    if (m_bEnded)
+    {
+        return;
+    }
+    m_bEnded = true;
+
+    // Nothing to report, e.g. on the server side of a test.
+    if (m_nColumns == 0)
+    {
+        return;
+    }
+
+    if (!m_bStarted)
+    {
+        Start();
+    }
+
+    if (m_Format == ReportFormatJson)
+    {
+        fprintf(m_pFile, "\n  ]\n}\n");
+    }
+    fflush(m_pFile);
+}
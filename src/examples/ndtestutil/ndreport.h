@@ -0,0 +1,111 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_REPORT
+#define _ND_REPORT
+
+#include "ndcommon.h"
+#include <stdio.h>
+
+//how a ResultReport writes its results
+enum ReportFormat
+{
+    ReportFormatTable,  // fixed-width columns for people
+    ReportFormatCsv,    // '#' metadata lines, a header line, one line per row
+    ReportFormatJson    // one object with "metadata" and a "results" array
+};
+
+//parse "table", "csv" or "json", returns false for anything else
+bool ParseReportFormat(const TCHAR *name, ReportFormat *pFormat);
+
+//usage lines for the -f and -o options, shared by all the tests
+#define REPORT_USAGE \
+    "\t-f <format>   - Result format: table (default), csv or json\n" \
+    "\t-o <file>     - Write results to a file named <file> (default: stdout)\n"
+
+//
+// Result rows of a benchmark, with the metadata of the run that produced
+// them.  Metadata and columns are declared up front; the first row writes
+// them out, and rows are then streamed as they are produced, so a failed
+// run still leaves the rows it completed.
+//
+class ResultReport
+{
+public:
+    static const ULONG x_MaxMetadata = 48;
+    static const ULONG x_MaxColumns = 32;
+    static const ULONG x_MaxValueLen = 64;
+
+private:
+    struct Metadata
+    {
+        const char *m_Name;
+        char m_Value[x_MaxValueLen];
+        bool m_bNumber;
+    };
+
+    struct Column
+    {
+        const char *m_Name;
+        int m_Width;
+        // Digits after the decimal point for doubles.
+        int m_Precision;
+        // Appended to the values in table format only, e.g. "%".
+        const char *m_Suffix;
+    };
+
+    const char *m_TestName;
+    ReportFormat m_Format;
+    FILE *m_pFile;
+    bool m_bCloseFile;
+
+    Metadata m_Metadata[x_MaxMetadata];
+    ULONG m_nMetadata;
+    Column m_Columns[x_MaxColumns];
+    ULONG m_nColumns;
+
+    bool m_bStarted;
+    bool m_bEnded;
+    ULONG m_nRows;
+    ULONG m_iColumn;
+
+public:
+    ResultReport();
+    ~ResultReport();
+
+    //fileName may be nullptr to write to stdout
+    void Init(const char *testName, ReportFormat format, const TCHAR *fileName);
+
+    ReportFormat Format() const { return m_Format; }
+
+    //describe the run, must be called before the first row
+    void AddMetadata(const char *name, const char *value);
+    void AddMetadata(const char *name, ULONGLONG value);
+    void AddAdapterInfo(const ND2_ADAPTER_INFO& info);
+
+    //declare the next column, must be called before the first row
+    void AddColumn(const char *name, int width, int precision = 0, const char *suffix = "");
+
+    //values of the current row, in column order
+    void Value(ULONG value) { Value(static_cast<ULONGLONG>(value)); }
+    void Value(ULONGLONG value);
+    void Value(double value);
+    void Value(const char *value);
+
+    //finish the current row
+    void EndRow();
+
+    //finish the report, e.g. close the JSON object
+    void End();
+
+private:
+    void Start();
+    Metadata* NextMetadata(const char *name);
+    const Column& NextColumn();
+    void WriteValue(const char *text, bool bQuote);
+    void WriteString(const char *text);
+};
+
+#endif
@@ -0,0 +1,191 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndsend.h"
+
+QpSender::QpSender() :
+    m_pQp(nullptr),
+    m_InlineThreshold(0),
+    m_LargeThreshold(0),
+    m_MaxSge(0),
+    m_MaxWriteRequests(1),
+    m_bCoalesce(false),
+    m_pInlineBuf(nullptr),
+    m_pChunkSgl(nullptr),
+    m_nCoalesced(0),
+    m_nChunks(0)
+{
+    RtlZeroMemory(&m_InlineSge, sizeof(m_InlineSge));
+}
+
+QpSender::~QpSender()
+{
+    delete[] m_pInlineBuf;
+    delete[] m_pChunkSgl;
+}
+
+HRESULT QpSender::Init(
+    IND2QueuePair *pQp,
+    const ND2_ADAPTER_INFO& adapterInfo,
+    ULONG maxSge,
+    bool bCoalesce,
+    ULONG maxWriteRequests)
+{
+    if (pQp == nullptr || maxSge == 0 || maxWriteRequests == 0 || m_pQp != nullptr)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_pChunkSgl = new (std::nothrow) ND2_SGE[maxSge];
+    if (m_pChunkSgl == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    m_InlineThreshold = adapterInfo.InlineRequestThreshold;
+    if (bCoalesce && m_InlineThreshold > 1)
+    {
+        m_pInlineBuf = new (std::nothrow) char[m_InlineThreshold];
+        if (m_pInlineBuf == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+        m_InlineSge.Buffer = m_pInlineBuf;
+        m_bCoalesce = true;
+    }
+
+    m_pQp = pQp;
+    m_LargeThreshold = adapterInfo.LargeRequestThreshold;
+    m_MaxSge = maxSge;
+    m_MaxWriteRequests = maxWriteRequests;
+    return ND_SUCCESS;
+}
+
+HRESULT QpSender::Send(void *requestContext, const ND2_SGE *pSgl, ULONG nSge, ULONG flags)
+{
+    ULONG len = Length(pSgl, nSge);
+    flags |= InlineFlag(len);
+    if (nSge > 1 && (flags & ND_OP_FLAG_INLINE) != 0 && Coalesce(pSgl, nSge, len))
+    {
+        return m_pQp->Send(requestContext, &m_InlineSge, 1, flags);
+    }
+    return m_pQp->Send(requestContext, pSgl, nSge, flags);
+}
+
+HRESULT QpSender::Write(
+    void *requestContext,
+    const ND2_SGE *pSgl,
+    ULONG nSge,
+    UINT64 remoteAddress,
+    UINT32 remoteToken,
+    ULONG flags)
+{
+    ULONG len = Length(pSgl, nSge);
+    ULONG nChunks = WriteRequests(len);
+    if (nChunks > 1)
+    {
+        return WriteChunks(requestContext, pSgl, nSge, len, nChunks, remoteAddress, remoteToken, flags);
+    }
+
+    flags |= InlineFlag(len);
+    if (nSge > 1 && (flags & ND_OP_FLAG_INLINE) != 0 && Coalesce(pSgl, nSge, len))
+    {
+        return m_pQp->Write(requestContext, &m_InlineSge, 1, remoteAddress, remoteToken, flags);
+    }
+    return m_pQp->Write(requestContext, pSgl, nSge, remoteAddress, remoteToken, flags);
+}
+
+bool QpSender::Coalesce(const ND2_SGE *pSgl, ULONG nSge, ULONG len)
+{
+    if (!m_bCoalesce)
+    {
+        return false;
+    }
+
+    char *pDst = m_pInlineBuf;
+    for (ULONG i = 0; i < nSge; i++)
+    {
+        CopyMemory(pDst, pSgl[i].Buffer, pSgl[i].BufferLength);
+        pDst += pSgl[i].BufferLength;
+    }
+    m_InlineSge.BufferLength = len;
+    m_nCoalesced++;
+    return true;
+}
+
+HRESULT QpSender::WriteChunks(
+    void *requestContext,
+    const ND2_SGE *pSgl,
+    ULONG nSge,
+    ULONG len,
+    ULONG nChunks,
+    UINT64 remoteAddress,
+    UINT32 remoteToken,
+    ULONG flags)
+{
+    // A chunk spans at most nSge of the caller's segments.
+    if (nSge > m_MaxSge)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    // Chunks grow past the threshold when capped by m_MaxWriteRequests.
+    ULONG maxChunkLen = (len + nChunks - 1) / nChunks;
+    ULONG iSge = 0;
+    ULONG sgeOffset = 0;
+    ULONG offset = 0;
+    while (offset < len)
+    {
+        ULONG chunkLen = min(len - offset, maxChunkLen);
+        ULONG nChunkSge = 0;
+        for (ULONG left = chunkLen; left != 0;)
+        {
+            ULONG segLen = min(left, pSgl[iSge].BufferLength - sgeOffset);
+            if (segLen != 0)
+            {
+                m_pChunkSgl[nChunkSge].Buffer = static_cast<char *>(pSgl[iSge].Buffer) + sgeOffset;
+                m_pChunkSgl[nChunkSge].BufferLength = segLen;
+                m_pChunkSgl[nChunkSge].MemoryRegionToken = pSgl[iSge].MemoryRegionToken;
+                nChunkSge++;
+                left -= segLen;
+                sgeOffset += segLen;
+            }
+            if (sgeOffset == pSgl[iSge].BufferLength)
+            {
+                iSge++;
+                sgeOffset = 0;
+            }
+        }
+
+        // Only the last chunk reports its completion; an error on any of
+        // them is still reported.
+        bool bLast = (offset + chunkLen == len);
+        HRESULT hr = m_pQp->Write(
+            bLast ? requestContext : nullptr,
+            m_pChunkSgl,
+            nChunkSge,
+            remoteAddress + offset,
+            remoteToken,
+            bLast ? flags : (flags | ND_OP_FLAG_SILENT_SUCCESS));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_nChunks++;
+        offset += chunkLen;
+    }
+    return ND_SUCCESS;
+}
+
+ULONG QpSender::Length(const ND2_SGE *pSgl, ULONG nSge)
+{
+    ULONG len = 0;
+    for (ULONG i = 0; i < nSge; i++)
+    {
+        len += pSgl[i].BufferLength;
+    }
+    return len;
+}
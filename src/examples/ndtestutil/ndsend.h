@@ -0,0 +1,103 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_SEND
+#define _ND_SEND
+
+#include "ndcommon.h"
+
+//
+// Posts sends and writes on a queue pair, shaping each request from the
+// adapter's thresholds so that the tests don't have to:
+//
+//  - Requests below InlineRequestThreshold are posted inline.  With
+//    coalescing enabled, the segments of a multi-SGE inline request are
+//    first gathered into one buffer, so the adapter copies one segment.
+//  - If the caller allows a write more than one send queue entry, writes
+//    above LargeRequestThreshold are split into chunks of that size, or into
+//    as many chunks as allowed if that is fewer, posted back to back.  All
+//    chunks but the last are posted silently, so the write still completes
+//    once.  Sends are never split, since that would change the message
+//    boundaries the receiver sees.
+//
+class QpSender
+{
+private:
+    IND2QueuePair *m_pQp;
+    ULONG m_InlineThreshold;
+    ULONG m_LargeThreshold;
+    ULONG m_MaxSge;
+    ULONG m_MaxWriteRequests;
+    bool m_bCoalesce;
+    // Inline data is copied when the request is posted, so the coalescing
+    // buffer is reused right away and needs no registration.
+    char *m_pInlineBuf;
+    ND2_SGE m_InlineSge;
+    ND2_SGE *m_pChunkSgl;
+
+    ULONGLONG m_nCoalesced;
+    ULONGLONG m_nChunks;
+
+public:
+    QpSender();
+    ~QpSender();
+
+    //pQp must outlive the sender, maxSge is the initiator SGE limit the
+    //queue pair was created with, maxWriteRequests the most send queue
+    //entries one write may take (1 posts every write as one request)
+    HRESULT Init(
+        IND2QueuePair *pQp,
+        const ND2_ADAPTER_INFO& adapterInfo,
+        ULONG maxSge,
+        bool bCoalesce,
+        ULONG maxWriteRequests = 1);
+
+    //ND_OP_FLAG_INLINE if a request of len bytes should be posted inline
+    ULONG InlineFlag(ULONG len) const
+    {
+        return len < m_InlineThreshold ? ND_OP_FLAG_INLINE : 0;
+    }
+
+    //send queue entries a write of len bytes takes
+    ULONG WriteRequests(ULONG len) const
+    {
+        if (m_LargeThreshold == 0 || len <= m_LargeThreshold)
+        {
+            return 1;
+        }
+        return min((len + m_LargeThreshold - 1) / m_LargeThreshold, m_MaxWriteRequests);
+    }
+
+    HRESULT Send(void *requestContext, const ND2_SGE *pSgl, ULONG nSge, ULONG flags);
+
+    HRESULT Write(
+        void *requestContext,
+        const ND2_SGE *pSgl,
+        ULONG nSge,
+        UINT64 remoteAddress,
+        UINT32 remoteToken,
+        ULONG flags);
+
+    //requests whose segments were gathered into one
+    ULONGLONG Coalesced() const { return m_nCoalesced; }
+    //requests posted for split writes
+    ULONGLONG Chunks() const { return m_nChunks; }
+
+private:
+    bool Coalesce(const ND2_SGE *pSgl, ULONG nSge, ULONG len);
+    HRESULT WriteChunks(
+        void *requestContext,
+        const ND2_SGE *pSgl,
+        ULONG nSge,
+        ULONG len,
+        ULONG nChunks,
+        UINT64 remoteAddress,
+        UINT32 remoteToken,
+        ULONG flags);
+
+    static ULONG Length(const ND2_SGE *pSgl, ULONG nSge);
+};
+
+#endif
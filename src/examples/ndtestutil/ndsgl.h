@@ -0,0 +1,111 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_SGL
+#define _ND_SGL
+
+#include "ndcommon.h"
+
+//
+// Scatter/gather list for a fixed layout of segments in registered memory,
+// e.g. a header followed by payload segments.  The buffer addresses and
+// tokens are filled in once when the layout is built, and the layout is
+// checked against the adapter's SGE limit once, so that posting a message
+// only has to patch the segment lengths.
+//
+// MaxSge bounds the number of segments, so the list needs no allocation.
+//
+template<DWORD MaxSge>
+class SgeLayout
+{
+    static_assert(MaxSge > 0, "SgeLayout needs room for at least one segment");
+
+private:
+    ND2_SGE m_Sgl[MaxSge];
+    // Most bytes each segment can hold.
+    ULONG m_SegmentSize[MaxSge];
+    DWORD m_nSegments;
+    ULONGLONG m_Capacity;
+
+public:
+    SgeLayout() :
+        m_nSegments(0),
+        m_Capacity(0)
+    {}
+
+    //forget all segments
+    void Reset()
+    {
+        m_nSegments = 0;
+        m_Capacity = 0;
+    }
+
+    //append a segment of up to segmentSize bytes at pBuf
+    HRESULT Add(void *pBuf, ULONG segmentSize, UINT32 memoryToken)
+    {
+        if (m_nSegments == MaxSge || segmentSize == 0)
+        {
+            return ND_INVALID_PARAMETER;
+        }
+
+        m_Sgl[m_nSegments].Buffer = pBuf;
+        m_Sgl[m_nSegments].BufferLength = segmentSize;
+        m_Sgl[m_nSegments].MemoryRegionToken = memoryToken;
+        m_SegmentSize[m_nSegments] = segmentSize;
+        m_nSegments++;
+        m_Capacity += segmentSize;
+        return ND_SUCCESS;
+    }
+
+    //the layout NdTestBase::PrepareSge builds: up to nSge segments of
+    //segmentSize bytes each, the last one holding the rest of the buffer
+    HRESULT AddSplit(char *pBuf, ULONG len, ULONG segmentSize, DWORD nSge, UINT32 memoryToken)
+    {
+        HRESULT hr = ND_SUCCESS;
+        while (len != 0 && nSge != 0 && SUCCEEDED(hr))
+        {
+            ULONG segLen = (nSge == 1) ? len : min(len, segmentSize);
+            hr = Add(pBuf, segLen, memoryToken);
+            pBuf += segLen;
+            len -= segLen;
+            nSge--;
+        }
+        return hr;
+    }
+
+    //check the layout against the adapter's limit for the queue it is
+    //posted to, MaxInitiatorSge or MaxReceiveSge
+    HRESULT Validate(ULONG maxSge) const
+    {
+        return (m_nSegments != 0 && m_nSegments <= maxSge) ? ND_SUCCESS : ND_INVALID_PARAMETER;
+    }
+
+    //fill the segments in order with len bytes, len must not exceed
+    //Capacity(). Returns the number of SGEs to post
+    DWORD SetLength(ULONG len)
+    {
+        DWORD i = 0;
+        while (len != 0 && i < m_nSegments)
+        {
+            ULONG segLen = min(len, m_SegmentSize[i]);
+            m_Sgl[i].BufferLength = segLen;
+            len -= segLen;
+            i++;
+        }
+        return i;
+    }
+
+    //set each segment's length, e.g. a header and a payload of a given size
+    void SetSegmentLength(DWORD iSegment, ULONG len)
+    {
+        m_Sgl[iSegment].BufferLength = len;
+    }
+
+    const ND2_SGE* Sgl() const { return m_Sgl; }
+    DWORD Count() const { return m_nSegments; }
+    ULONGLONG Capacity() const { return m_Capacity; }
+};
+
+#endif
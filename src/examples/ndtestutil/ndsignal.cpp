@@ -0,0 +1,75 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndsignal.h"
+
+SignaledSendQueue::SignaledSendQueue() :
+    m_Depth(0),
+    m_SignalInterval(1),
+    m_nOutstanding(0),
+    m_nUnsignaled(0),
+    m_pCovered(nullptr),
+    m_Head(0),
+    m_nSignaled(0)
+{
+}
+
+SignaledSendQueue::~SignaledSendQueue()
+{
+    delete[] m_pCovered;
+}
+
+HRESULT SignaledSendQueue::Init(ULONG depth, ULONG signalInterval)
+{
+    if (depth == 0 || m_pCovered != nullptr)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    // At most one signaled request per entry.
+    m_pCovered = new (std::nothrow) ULONG[depth];
+    if (m_pCovered == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    m_Depth = depth;
+    SetSignalInterval(signalInterval);
+    return ND_SUCCESS;
+}
+
+void SignaledSendQueue::SetSignalInterval(ULONG signalInterval)
+{
+    m_SignalInterval = (signalInterval == 0) ? 1 : min(signalInterval, m_Depth);
+}
+
+ULONG SignaledSendQueue::Next(bool bSignal)
+{
+    m_nOutstanding++;
+    m_nUnsignaled++;
+    if (!bSignal && m_nUnsignaled < m_SignalInterval && m_nOutstanding < m_Depth)
+    {
+        return ND_OP_FLAG_SILENT_SUCCESS;
+    }
+
+    m_pCovered[(m_Head + m_nSignaled) % m_Depth] = m_nUnsignaled;
+    m_nSignaled++;
+    m_nUnsignaled = 0;
+    return 0;
+}
+
+ULONG SignaledSendQueue::Complete()
+{
+    if (m_nSignaled == 0)
+    {
+        return 0;
+    }
+
+    ULONG nFreed = m_pCovered[m_Head];
+    m_Head = (m_Head + 1) % m_Depth;
+    m_nSignaled--;
+    m_nOutstanding -= nFreed;
+    return nFreed;
+}
@@ -0,0 +1,63 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_SIGNAL
+#define _ND_SIGNAL
+
+#include "ndcommon.h"
+
+//
+// Send queue occupancy for a queue pair that only asks for a completion on
+// every Nth request, posting the others with ND_OP_FLAG_SILENT_SUCCESS.
+//
+// Requests on a send queue complete in order, so the completion of a
+// signaled request also frees the entries of the silent requests posted
+// before it.  The queue remembers how many entries each outstanding
+// signaled request covers and hands them back when its completion is
+// reaped.  A request is signaled early when it takes the last free entry,
+// so the queue can't fill up with requests that will never report back.
+//
+// A silent request that fails still generates a completion with the error;
+// the tests treat any such completion as fatal.
+//
+class SignaledSendQueue
+{
+private:
+    ULONG m_Depth;
+    ULONG m_SignalInterval;
+    ULONG m_nOutstanding;
+    // Requests posted since the last signaled one.
+    ULONG m_nUnsignaled;
+    // Entries freed by each outstanding signaled request, oldest first.
+    ULONG *m_pCovered;
+    ULONG m_Head;
+    ULONG m_nSignaled;
+
+public:
+    SignaledSendQueue();
+    ~SignaledSendQueue();
+
+    //depth is the initiator queue depth the queue pair was created with,
+    //signalInterval is clamped to [1, depth]; 1 signals every request
+    HRESULT Init(ULONG depth, ULONG signalInterval);
+
+    //takes effect from the next request
+    void SetSignalInterval(ULONG signalInterval);
+    ULONG SignalInterval() const { return m_SignalInterval; }
+
+    ULONG Outstanding() const { return m_nOutstanding; }
+    ULONG Available() const { return m_Depth - m_nOutstanding; }
+
+    //take an entry for the next request, Available() must not be 0.
+    //Returns the flags to post it with, 0 or ND_OP_FLAG_SILENT_SUCCESS.
+    //bSignal forces a completion, e.g. for the last request of a run
+    ULONG Next(bool bSignal = false);
+
+    //the completion of a signaled request was reaped, returns the number
+    //of entries it frees
+    ULONG Complete();
+};
+
+#endif
@@ -0,0 +1,197 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#include "ndsrq.h"
+
+SharedReceiveQueue::SharedReceiveQueue() :
+    m_pSrq(nullptr),
+    m_pPool(nullptr),
+    m_Depth(0),
+    m_SlotSize(0),
+    m_LowWatermark(0),
+    m_Slots(),
+    m_pFree(nullptr),
+    m_nFree(0),
+    m_hEvent(nullptr),
+    m_bArmed(false),
+    m_nNotifications(0),
+    m_nRefills(0)
+{
+    RtlZeroMemory(&m_Ov, sizeof(m_Ov));
+}
+
+SharedReceiveQueue::~SharedReceiveQueue()
+{
+    if (m_bArmed)
+    {
+        // The Notify request must complete before its event is closed.
+        m_pSrq->CancelOverlappedRequests();
+        m_pSrq->GetOverlappedResult(&m_Ov, TRUE);
+    }
+
+    if (m_hEvent != nullptr)
+    {
+        CloseHandle(m_hEvent);
+    }
+
+    if (m_pSrq != nullptr)
+    {
+        m_pSrq->Release();
+    }
+
+    if (m_Slots.Sge.Buffer != nullptr)
+    {
+        m_pPool->Free(m_Slots);
+    }
+    delete[] m_pFree;
+}
+
+HRESULT SharedReceiveQueue::Init(
+    IND2Adapter *pAdapter,
+    HANDLE hAdapterFile,
+    RegisteredBufferPool *pPool,
+    ULONG depth,
+    ULONG slotSize,
+    ULONG lowWatermark)
+{
+    if (pAdapter == nullptr || pPool == nullptr || m_pSrq != nullptr ||
+        depth == 0 || slotSize == 0 || lowWatermark > depth)
+    {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_pFree = new (std::nothrow) void*[depth];
+    if (m_pFree == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+
+    m_hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_hEvent == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+    // With the low bit set, the completion isn't queued to a completion port.
+    m_Ov.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(m_hEvent) | 1);
+
+    m_pPool = pPool;
+    // Keep the slots cache line aligned.
+    m_SlotSize = (slotSize + 63) / 64 * 64;
+    HRESULT hr = pPool->Alloc(static_cast<SIZE_T>(m_SlotSize) * depth, &m_Slots);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    m_Depth = depth;
+    m_LowWatermark = (lowWatermark != 0) ? lowWatermark : max(depth / 4, static_cast<ULONG>(1));
+    hr = pAdapter->CreateSharedReceiveQueue(
+        IID_IND2SharedReceiveQueue,
+        hAdapterFile,
+        m_Depth,
+        1,
+        m_LowWatermark,
+        0,
+        0,
+        reinterpret_cast<VOID**>(&m_pSrq)
+    );
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // Post every slot as if its receive had completed.
+    for (ULONG i = 0; i < m_Depth; i++)
+    {
+        m_pFree[i] = static_cast<char *>(m_Slots.Sge.Buffer) + static_cast<SIZE_T>(m_SlotSize) * i;
+    }
+    m_nFree = m_Depth;
+    hr = Refill();
+    m_nRefills = 0;
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    return Arm();
+}
+
+void* SharedReceiveQueue::Complete(const ND2_RESULT *pResult)
+{
+    m_pFree[m_nFree++] = pResult->RequestContext;
+    return pResult->RequestContext;
+}
+
+HRESULT SharedReceiveQueue::Refill()
+{
+    if (m_nFree == 0)
+    {
+        return ND_SUCCESS;
+    }
+
+    ND2_SGE sge;
+    sge.BufferLength = m_SlotSize;
+    sge.MemoryRegionToken = m_Slots.Sge.MemoryRegionToken;
+    while (m_nFree != 0)
+    {
+        // The slot is its own request context.
+        sge.Buffer = m_pFree[m_nFree - 1];
+        HRESULT hr = m_pSrq->Receive(sge.Buffer, &sge, 1);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        m_nFree--;
+    }
+    m_nRefills++;
+    return ND_SUCCESS;
+}
+
+HRESULT SharedReceiveQueue::Poll()
+{
+    if (m_bArmed)
+    {
+        HRESULT hr = m_pSrq->GetOverlappedResult(&m_Ov, FALSE);
+        if (hr == ND_PENDING)
+        {
+            return ND_SUCCESS;
+        }
+
+        m_bArmed = false;
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        m_nNotifications++;
+    }
+
+    HRESULT hr = Refill();
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    return Arm();
+}
+
+//arm Notify unless already armed; a Notify that completes right away is
+//handled by the next Poll
+HRESULT SharedReceiveQueue::Arm()
+{
+    if (m_bArmed)
+    {
+        return ND_SUCCESS;
+    }
+
+    HRESULT hr = m_pSrq->Notify(&m_Ov);
+    if (hr == ND_PENDING)
+    {
+        m_bArmed = true;
+        return ND_SUCCESS;
+    }
+    if (SUCCEEDED(hr))
+    {
+        m_nNotifications++;
+    }
+    return hr;
+}
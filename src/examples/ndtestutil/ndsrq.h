@@ -0,0 +1,93 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#ifndef _ND_SRQ
+#define _ND_SRQ
+
+#include "ndcommon.h"
+#include "ndbufpool.h"
+
+//
+// Shared receive queue with its receive buffers, for a server that takes
+// the receives of many queue pairs from one pool instead of posting a full
+// receive queue per connection.
+//
+// Every receive gets a slot of its own, carved from a single buffer of the
+// RegisteredBufferPool, which must outlive the queue.  A completed receive
+// hands its slot back through Complete; the slot is only reposted by the
+// next Refill.  Poll keeps a Notify request armed with the low watermark as
+// threshold, and refills the queue once the number of posted receives falls
+// below it.  Notify completes asynchronously, so a sender that must never
+// find the queue empty still needs flow control, with the receiver calling
+// Refill before it hands out credits.
+//
+// The Notify request is kept off any completion port the adapter file is
+// bound to, so the queue can also be used by tests driven by one.
+//
+class SharedReceiveQueue
+{
+private:
+    IND2SharedReceiveQueue *m_pSrq;
+    RegisteredBufferPool *m_pPool;
+    ULONG m_Depth;
+    ULONG m_SlotSize;
+    ULONG m_LowWatermark;
+
+    PooledBuffer m_Slots;
+    // Slots of completed receives that were not reposted yet.
+    void **m_pFree;
+    ULONG m_nFree;
+
+    OVERLAPPED m_Ov;
+    // m_Ov.hEvent is this event with the low bit set.
+    HANDLE m_hEvent;
+    bool m_bArmed;
+    ULONGLONG m_nNotifications;
+    ULONGLONG m_nRefills;
+
+public:
+    SharedReceiveQueue();
+    ~SharedReceiveQueue();
+
+    //creates the queue on the adapter and posts depth receives of slotSize
+    //bytes each. A lowWatermark of 0 refills once a quarter of the depth is
+    //left posted, at least 1; a lowWatermark of depth refills after every
+    //receive
+    HRESULT Init(
+        IND2Adapter *pAdapter,
+        HANDLE hAdapterFile,
+        RegisteredBufferPool *pPool,
+        ULONG depth,
+        ULONG slotSize,
+        ULONG lowWatermark = 0);
+
+    //for CreateQueuePairWithSrq
+    IND2SharedReceiveQueue* Srq() const { return m_pSrq; }
+
+    //handle the completion of a receive of this queue, returns the slot the
+    //data landed in; it stays valid until the next Refill or Poll
+    void* Complete(const ND2_RESULT *pResult);
+
+    //repost every completed receive
+    HRESULT Refill();
+
+    //refill if the low watermark notification fired, then rearm it
+    HRESULT Poll();
+
+    ULONG Depth() const { return m_Depth; }
+    ULONG SlotSize() const { return m_SlotSize; }
+    ULONG Posted() const { return m_Depth - m_nFree; }
+    //memory behind the posted receives
+    SIZE_T ReceiveBytes() const { return static_cast<SIZE_T>(m_SlotSize) * m_Depth; }
+    //low watermark notifications that fired
+    ULONGLONG Notifications() const { return m_nNotifications; }
+    //refills that reposted at least one receive
+    ULONGLONG Refills() const { return m_nRefills; }
+
+private:
+    HRESULT Arm();
+};
+
+#endif
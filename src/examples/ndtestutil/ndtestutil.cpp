@@ -14,7 +14,9 @@ NdTestBase::NdTestBase() :
     m_pConnector(nullptr),
     m_hAdapterFile(nullptr),
     m_Buf(nullptr),
-    m_pMw(nullptr)
+    m_pMw(nullptr),
+    m_pBufPool(nullptr),
+    m_bLargePages(false)
 {
     RtlZeroMemory(&m_Ov, sizeof(m_Ov));
 }
@@ -22,6 +24,9 @@ NdTestBase::NdTestBase() :
 //tear down
 NdTestBase::~NdTestBase()
 {
+    // The pool's regions are registered on the adapter file.
+    delete m_pBufPool;
+
     if (m_pMr != nullptr)
     {
         m_pMr->Release();
@@ -62,10 +67,7 @@ NdTestBase::~NdTestBase()
         CloseHandle(m_Ov.hEvent);
     }
 
-    if (m_Buf != nullptr)
-    {
-        delete[] m_Buf;
-    }
+    FreeDataBuffer(m_Buf);
 }
 
 void NdTestBase::CreateMR(HRESULT expectedResult, const char* errorMessage)
@@ -86,7 +88,7 @@ void NdTestBase::RegisterDataBuffer(
     const char* errorMessage)
 {
     m_Buf_Len = bufferLength;
-    m_Buf = new (std::nothrow) char[m_Buf_Len];
+    m_Buf = AllocDataBuffer(m_Buf_Len, m_bLargePages);
     if (m_Buf == nullptr)
     {
         printf("Failed to allocate buffer.\n");
@@ -117,6 +119,30 @@ void NdTestBase::RegisterDataBuffer(
     LogIfErrorExit(hr, expectedResult, errorMessage, __LINE__);
 }
 
+void NdTestBase::CreateBufferPool(ULONG mrFlags, HRESULT expectedResult, const char* errorMessage)
+{
+    m_pBufPool = new (std::nothrow) RegisteredBufferPool();
+    if (m_pBufPool == nullptr)
+    {
+        printf("Failed to allocate buffer pool.\n");
+        exit(__LINE__);
+    }
+
+    HRESULT hr = m_pBufPool->Init(
+        m_pAdapter, m_hAdapterFile, mrFlags, RegisteredBufferPool::x_DefaultRegionSize, m_bLargePages);
+    LogIfErrorExit(hr, expectedResult, errorMessage, __LINE__);
+}
+
+void NdTestBase::AllocPooledBuffer(
+    SIZE_T bufferLength,
+    PooledBuffer *pBuffer,
+    HRESULT expectedResult,
+    const char* errorMessage)
+{
+    HRESULT hr = m_pBufPool->Alloc(bufferLength, pBuffer);
+    LogIfErrorExit(hr, expectedResult, errorMessage, __LINE__);
+}
+
 void NdTestBase::CreateMW(HRESULT expectedResult, const char* errorMessage)
 {
     HRESULT hr = m_pAdapter->CreateMemoryWindow(
@@ -236,6 +262,19 @@ void NdTestBase::CreateQueuePair(
     UNUSED(receiveQueueDepth);
 }
 
+void NdTestBase::InitSender(
+    QpSender *pSender,
+    const ND2_ADAPTER_INFO& adapterInfo,
+    ULONG maxSge,
+    ULONG maxWriteRequests,
+    bool bCoalesce,
+    HRESULT expectedResult,
+    const char* errorMessage)
+{
+    HRESULT hr = pSender->Init(m_pQp, adapterInfo, maxSge, bCoalesce, maxWriteRequests);
+    LogIfErrorExit(hr, expectedResult, errorMessage, __LINE__);
+}
+
 void NdTestBase::Init(_In_ const struct sockaddr_in& v4Src)
 {
     HRESULT hr = NdOpenAdapter(
@@ -316,7 +355,10 @@ void NdTestBase::DisconnectConnector()
 
 void NdTestBase::DeregisterMemory()
 {
-    m_pMr->Deregister(&m_Ov);
+    if (m_pMr != nullptr)
+    {
+        m_pMr->Deregister(&m_Ov);
+    }
 }
 
 void NdTestBase::GetResult(HRESULT expectedResult, const char* errorMessage)
@@ -605,3 +647,295 @@ void NdTestClientBase::CompleteConnect(HRESULT expectedResult, const char* error
     }
     LogIfErrorExit(hr, expectedResult, errorMessage, __LINE__);
 }
+
+CqPoller::CqPoller() :
+    m_pCq(nullptr),
+    m_Mode(CqWaitPoll),
+    m_bArmed(false),
+    m_Freq(Timer::Frequency()),
+    m_MaxSpin(0),
+    m_MinSpin(0),
+    m_SpinBudget(0),
+    m_AvgGap(0),
+    m_LastCompletion(0),
+    m_nWaits(0),
+    m_nBlocks(0)
+{
+    RtlZeroMemory(&m_Ov, sizeof(m_Ov));
+}
+
+CqPoller::~CqPoller()
+{
+    if (m_bArmed)
+    {
+        // The Notify request must complete before its event is closed.
+        m_pCq->CancelOverlappedRequests();
+        m_pCq->GetOverlappedResult(&m_Ov, TRUE);
+    }
+
+    if (m_Ov.hEvent != nullptr)
+    {
+        CloseHandle(m_Ov.hEvent);
+    }
+
+    if (m_pCq != nullptr)
+    {
+        m_pCq->Release();
+    }
+}
+
+void CqPoller::Init(IND2CompletionQueue *pCq, CqWaitMode mode, ULONG maxSpinUs)
+{
+    m_pCq = pCq;
+    m_pCq->AddRef();
+    m_Mode = mode;
+
+    m_Ov.hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_Ov.hEvent == nullptr)
+    {
+        LogErrorExit("Failed to allocate event for CQ notifications.\n", __LINE__);
+    }
+
+    m_MaxSpin = (m_Freq * maxSpinUs) / 1000000;
+    // Always probe for a little while, so that the budget can grow back
+    // once completions speed up again.
+    m_MinSpin = m_MaxSpin / 16;
+    m_SpinBudget = m_MaxSpin;
+    m_AvgGap = m_MaxSpin / 2;
+    m_LastCompletion = Now();
+}
+
+LONGLONG CqPoller::Now() const
+{
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void CqPoller::OnCompletion(LONGLONG now)
+{
+    // Exponentially weighted average of the time between completions.
+    LONGLONG gap = now - m_LastCompletion;
+    m_LastCompletion = now;
+    m_AvgGap += (gap - m_AvgGap) / 8;
+
+    m_SpinBudget = 2 * m_AvgGap;
+    if (m_SpinBudget > m_MaxSpin)
+    {
+        m_SpinBudget = m_MinSpin;
+    }
+}
+
+//arm Notify unless already armed; returns false if it completed immediately
+bool CqPoller::Arm()
+{
+    if (m_bArmed)
+    {
+        return true;
+    }
+
+    HRESULT hr = m_pCq->Notify(ND_CQ_NOTIFY_ANY, &m_Ov);
+    if (hr != ND_PENDING)
+    {
+        LogIfErrorExit(hr, ND_SUCCESS, "IND2CompletionQueue::Notify failed", __LINE__);
+        return false;
+    }
+    m_bArmed = true;
+    return true;
+}
+
+ULONG CqPoller::GetResults(ND2_RESULT *pResults, ULONG nResults)
+{
+    m_nWaits++;
+    for (;;)
+    {
+        ULONG n = m_pCq->GetResults(pResults, nResults);
+        if (n != 0)
+        {
+            OnCompletion(Now());
+            return n;
+        }
+
+        switch (m_Mode)
+        {
+        case CqWaitPoll:
+            continue;
+
+        case CqWaitAdaptive:
+        {
+            LONGLONG now = Now();
+            LONGLONG deadline = now + m_SpinBudget;
+            do
+            {
+                YieldProcessor();
+                n = m_pCq->GetResults(pResults, nResults);
+                now = Now();
+                if (n != 0)
+                {
+                    OnCompletion(now);
+                    return n;
+                }
+            } while (now < deadline);
+        }
+        __fallthrough;
+
+        case CqWaitBlock:
+            if (!Arm())
+            {
+                continue;
+            }
+
+            // A completion may have arrived between the last poll and arming
+            // Notify.  If so, leave the request armed for the next wait.
+            n = m_pCq->GetResults(pResults, nResults);
+            if (n != 0)
+            {
+                OnCompletion(Now());
+                return n;
+            }
+
+            HRESULT hr = m_pCq->GetOverlappedResult(&m_Ov, TRUE);
+            m_bArmed = false;
+            LogIfErrorExit(hr, ND_SUCCESS, "IND2CompletionQueue::Notify failed", __LINE__);
+            m_nBlocks++;
+            break;
+        }
+    }
+}
+
+void CqPoller::WaitForCompletion(const std::function<void(ND2_RESULT *)>& processCompletionFn)
+{
+    ND2_RESULT ndRes;
+    GetResults(&ndRes, 1);
+    processCompletionFn(&ndRes);
+}
+
+double CqPoller::BlockedPercent() const
+{
+    return (m_nWaits == 0) ? 0.0 : (100.0 * m_nBlocks) / m_nWaits;
+}
+
+double CqPoller::SpinBudgetUs() const
+{
+    return (m_SpinBudget * 1000000.0) / m_Freq;
+}
+
+void CqPoller::ResetCounters()
+{
+    m_nWaits = 0;
+    m_nBlocks = 0;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    LARGE_INTEGER freq;
+    ::QueryPerformanceFrequency(&freq);
+    m_Freq = freq.QuadPart;
+    Reset();
+}
+
+void LatencyHistogram::Reset()
+{
+    RtlZeroMemory(m_Buckets, sizeof(m_Buckets));
+    m_Count = 0;
+    m_Max = 0;
+}
+
+LONGLONG LatencyHistogram::BucketLow(ULONG bucket)
+{
+    if (bucket < 2 * x_SubBuckets)
+    {
+        return bucket;
+    }
+
+    ULONG shift = bucket / x_SubBuckets - 1;
+    return static_cast<LONGLONG>(x_SubBuckets + bucket % x_SubBuckets) << shift;
+}
+
+LONGLONG LatencyHistogram::BucketHigh(ULONG bucket)
+{
+    if (bucket < 2 * x_SubBuckets)
+    {
+        return bucket;
+    }
+
+    ULONG shift = bucket / x_SubBuckets - 1;
+    return BucketLow(bucket) + (static_cast<LONGLONG>(1) << shift) - 1;
+}
+
+double LatencyHistogram::TicksToUs(LONGLONG ticks) const
+{
+    return (ticks * 1000000.0) / m_Freq;
+}
+
+double LatencyHistogram::ValueAtPercentile(double percentile) const
+{
+    if (m_Count == 0)
+    {
+        return 0.0;
+    }
+
+    // Rank of the sample that the percentile refers to, counting from 1.
+    ULONGLONG rank = static_cast<ULONGLONG>((percentile / 100.0) * m_Count + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    ULONGLONG seen = 0;
+    for (ULONG i = 0; i < x_nBuckets; i++)
+    {
+        seen += m_Buckets[i];
+        if (seen >= rank)
+        {
+            // Report the top of the bucket, as HDR histograms do, but
+            // never more than the largest sample.
+            return TicksToUs(min(BucketHigh(i), m_Max));
+        }
+    }
+    return TicksToUs(m_Max);
+}
+
+double LatencyHistogram::Max() const
+{
+    return TicksToUs(m_Max);
+}
+
+void LatencyHistogram::AddColumns(ResultReport& report)
+{
+    report.AddColumn("p50", 9, 2);
+    report.AddColumn("p90", 9, 2);
+    report.AddColumn("p99", 9, 2);
+    report.AddColumn("p99.9", 9, 2);
+    report.AddColumn("Max", 9, 2);
+}
+
+void LatencyHistogram::Report(ResultReport& report, ULONG divisor) const
+{
+    const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+    for (ULONG i = 0; i < _countof(percentiles); i++)
+    {
+        report.Value(ValueAtPercentile(percentiles[i]) / divisor);
+    }
+    report.Value(Max() / divisor);
+}
+
+void LatencyHistogram::DumpHeader(FILE *pFile)
+{
+    fprintf(pFile, "Size,LowUs,HighUs,Count\n");
+}
+
+void LatencyHistogram::Dump(FILE *pFile, ULONG size) const
+{
+    for (ULONG i = 0; i < x_nBuckets; i++)
+    {
+        if (m_Buckets[i] != 0)
+        {
+            fprintf(pFile, "%lu,%.3f,%.3f,%I64u\n",
+                size,
+                TicksToUs(BucketLow(i)),
+                TicksToUs(BucketHigh(i) + 1),
+                m_Buckets[i]);
+        }
+    }
+}
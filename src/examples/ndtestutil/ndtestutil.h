@@ -4,6 +4,9 @@
 //
 
 #include "ndcommon.h"
+#include "ndreport.h"
+#include "ndbufpool.h"
+#include "ndsend.h"
 #include <stdio.h>
 #include <functional>
 
@@ -70,6 +73,280 @@ inline void LogInfo(
 }
 
 
+//
+// Distribution of the number of results returned by GetResults calls that
+// returned any, in power-of-two buckets: 1, 2-3, 4-7, 8-15 and 16+.
+//
+class ResultsPerCallHistogram
+{
+public:
+    static const ULONG x_nBuckets = 5;
+
+private:
+    ULONGLONG m_Buckets[x_nBuckets];
+    ULONGLONG m_nCalls;
+    ULONGLONG m_nResults;
+
+public:
+    ResultsPerCallHistogram()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for (ULONG i = 0; i < x_nBuckets; i++)
+        {
+            m_Buckets[i] = 0;
+        }
+        m_nCalls = 0;
+        m_nResults = 0;
+    }
+
+    void Add(ULONG nResults)
+    {
+        ULONG bucket = 0;
+        while (bucket < x_nBuckets - 1 && nResults >= (2UL << bucket))
+        {
+            bucket++;
+        }
+        m_Buckets[bucket]++;
+        m_nCalls++;
+        m_nResults += nResults;
+    }
+
+    double Average() const
+    {
+        return (m_nCalls == 0) ? 0.0 : static_cast<double>(m_nResults) / m_nCalls;
+    }
+
+    //columns matching Report
+    static void AddColumns(ResultReport& report)
+    {
+        report.AddColumn("Res/Call", 8, 2);
+        report.AddColumn("1", 6, 1, "%");
+        report.AddColumn("2-3", 6, 1, "%");
+        report.AddColumn("4-7", 6, 1, "%");
+        report.AddColumn("8-15", 6, 1, "%");
+        report.AddColumn("16+", 6, 1, "%");
+    }
+
+    //average, then the percentage of calls in each bucket
+    void Report(ResultReport& report) const
+    {
+        report.Value(Average());
+        for (ULONG i = 0; i < x_nBuckets; i++)
+        {
+            report.Value((m_nCalls == 0) ? 0.0 : (100.0 * m_Buckets[i]) / m_nCalls);
+        }
+    }
+};
+
+
+//
+// Log-linear (HDR-style) histogram of latencies in QueryPerformanceCounter
+// ticks.  Each power of two is split into x_SubBuckets linear buckets, so a
+// recorded value is reported within 1/x_SubBuckets of its true value.  The
+// buckets are a fixed array, so Record never allocates.
+//
+class LatencyHistogram
+{
+public:
+    static const ULONG x_SubBucketBits = 6;
+    static const ULONG x_SubBuckets = 1 << x_SubBucketBits;
+    // Values of 2^x_MaxBits ticks or more are counted in the last bucket.
+    static const ULONG x_MaxBits = 40;
+    static const ULONG x_nBuckets = (x_MaxBits - x_SubBucketBits + 1) * x_SubBuckets;
+
+private:
+    ULONGLONG m_Buckets[x_nBuckets];
+    ULONGLONG m_Count;
+    LONGLONG m_Max;
+    LONGLONG m_Freq;
+
+public:
+    LatencyHistogram();
+
+    void Reset();
+
+    void Record(LONGLONG ticks)
+    {
+        if (ticks < 0)
+        {
+            ticks = 0;
+        }
+        if (ticks > m_Max)
+        {
+            m_Max = ticks;
+        }
+
+        ULONG shift = 0;
+        while ((ticks >> shift) >= 2 * x_SubBuckets)
+        {
+            shift++;
+        }
+
+        ULONG bucket = (shift == 0) ?
+            static_cast<ULONG>(ticks) :
+            (shift + 1) * x_SubBuckets + static_cast<ULONG>(ticks >> shift) - x_SubBuckets;
+        if (bucket >= x_nBuckets)
+        {
+            bucket = x_nBuckets - 1;
+        }
+        m_Buckets[bucket]++;
+        m_Count++;
+    }
+
+    ULONGLONG Count() const { return m_Count; }
+
+    //value in microseconds below which percentile % of the samples fall
+    double ValueAtPercentile(double percentile) const;
+
+    //largest recorded value in microseconds
+    double Max() const;
+
+    //columns matching Report
+    static void AddColumns(ResultReport& report);
+
+    //p50, p90, p99, p99.9 and max, each divided by divisor (e.g. 2 for
+    //half round trips)
+    void Report(ResultReport& report, ULONG divisor = 1) const;
+
+    //column names matching Dump
+    static void DumpHeader(FILE *pFile);
+
+    //one "size,lowUs,highUs,count" line per non-empty bucket
+    void Dump(FILE *pFile, ULONG size) const;
+
+private:
+    static LONGLONG BucketLow(ULONG bucket);
+    static LONGLONG BucketHigh(ULONG bucket);
+    double TicksToUs(LONGLONG ticks) const;
+};
+
+
+//
+// Spinning barrier that can be reused for every step of a multi-threaded
+// run, so that all threads start and finish each step together.
+//
+class ThreadBarrier
+{
+public:
+    ThreadBarrier(DWORD nThreads) :
+        m_nThreads(static_cast<LONG>(nThreads))
+    {}
+
+    void Wait()
+    {
+        LONG generation = InterlockedCompareExchange(&m_Generation, 0, 0);
+        if (InterlockedIncrement(&m_nArrived) == m_nThreads)
+        {
+            InterlockedExchange(&m_nArrived, 0);
+            InterlockedIncrement(&m_Generation);
+            return;
+        }
+
+        while (InterlockedCompareExchange(&m_Generation, 0, 0) == generation)
+        {
+            YieldProcessor();
+        }
+    }
+
+private:
+    LONG m_nThreads;
+    volatile LONG m_nArrived = 0;
+    volatile LONG m_Generation = 0;
+};
+
+
+//how a CqPoller waits for completions
+enum CqWaitMode
+{
+    CqWaitPoll,         // busy-poll GetResults
+    CqWaitBlock,        // arm Notify and block whenever the CQ is empty
+    CqWaitAdaptive      // spin for an adaptive budget, then arm Notify and block
+};
+
+inline const char* CqWaitModeName(CqWaitMode mode)
+{
+    switch (mode)
+    {
+    case CqWaitPoll:
+        return "polling";
+    case CqWaitBlock:
+        return "blocking";
+    default:
+        return "adaptive";
+    }
+}
+
+//
+// Waits for completions on a CQ.  In adaptive mode the poller spins on
+// GetResults for up to the spin budget before arming Notify and blocking.
+// The budget tracks twice the average time between completions while that
+// is within maxSpinUs, so the poller doesn't block while completions arrive
+// that fast.  Beyond maxSpinUs the budget drops to a short probe of
+// maxSpinUs / 16 rather than to maxSpinUs, since spinning that long would
+// mostly be wasted.
+//
+class CqPoller
+{
+public:
+    static const ULONG x_DefaultMaxSpinUs = 50;
+
+private:
+    IND2CompletionQueue *m_pCq;
+    CqWaitMode m_Mode;
+    OVERLAPPED m_Ov;
+    // Notify request outstanding on m_Ov.
+    bool m_bArmed;
+
+    // Timestamps and spin budgets are in performance counter ticks.
+    LONGLONG m_Freq;
+    LONGLONG m_MaxSpin;
+    LONGLONG m_MinSpin;
+    LONGLONG m_SpinBudget;
+    LONGLONG m_AvgGap;
+    LONGLONG m_LastCompletion;
+
+    ULONGLONG m_nWaits;
+    ULONGLONG m_nBlocks;
+
+public:
+    CqPoller();
+    ~CqPoller();
+
+    //takes a reference on the CQ until the poller is destroyed
+    void Init(
+        IND2CompletionQueue *pCq,
+        CqWaitMode mode,
+        ULONG maxSpinUs = x_DefaultMaxSpinUs);
+
+    //wait for at least one completion and return up to nResults of them
+    ULONG GetResults(
+        ND2_RESULT *pResults,
+        ULONG nResults);
+
+    //wait for a completion and pass it to processCompletionFn
+    void WaitForCompletion(
+        const std::function<void(ND2_RESULT *)>& processCompletionFn);
+
+    //waits that had to block, as a percentage of all waits
+    double BlockedPercent() const;
+
+    //current spin budget in microseconds
+    double SpinBudgetUs() const;
+
+    //clear the wait counters, e.g. between benchmark runs
+    void ResetCounters();
+
+private:
+    LONGLONG Now() const;
+    void OnCompletion(LONGLONG now);
+    bool Arm();
+};
+
+
 //base class
 class NdTestBase
 {
@@ -83,7 +360,11 @@ protected:
     DWORD m_Buf_Len = 0;
     void* m_Buf;
     IND2MemoryWindow* m_pMw;
+    RegisteredBufferPool *m_pBufPool;
+    // Back the data buffers and buffer pool with large pages where possible.
+    bool m_bLargePages;
     OVERLAPPED m_Ov;
+    ResultsPerCallHistogram m_ResultsPerCall;
 
 protected:
     NdTestBase();
@@ -128,6 +409,19 @@ protected:
         HRESULT expectedResult = ND_SUCCESS,
         const char* errorMessage = "IND2MemoryRegion::Register failed");
 
+    //create a pool of pre-registered data buffers, must call after init
+    void CreateBufferPool(
+        ULONG mrFlags,
+        HRESULT expectedResult = ND_SUCCESS,
+        const char* errorMessage = "RegisteredBufferPool::Init failed");
+
+    //take a registered data buffer from the pool
+    void AllocPooledBuffer(
+        SIZE_T bufferLength,
+        PooledBuffer *pBuffer,
+        HRESULT expectedResult = ND_SUCCESS,
+        const char* errorMessage = "RegisteredBufferPool::Alloc failed");
+
     //create completion queue for given depth
     void CreateCQ(
         DWORD depth,
@@ -163,6 +457,18 @@ protected:
         HRESULT expectedResult = ND_SUCCESS,
         const char* errorMessage = "IND2Adapter::CreateQueuePair failed");
 
+    //Initialize a sender on the queue pair, must call after CreateQueuePair
+    //A write takes up to maxWriteRequests send queue entries, so a caller
+    //that allows more than 1 must leave that many free for each write
+    void InitSender(
+        QpSender *pSender,
+        const ND2_ADAPTER_INFO& adapterInfo,
+        ULONG maxSge,
+        ULONG maxWriteRequests = 1,
+        bool bCoalesce = false,
+        HRESULT expectedResult = ND_SUCCESS,
+        const char* errorMessage = "QpSender::Init failed");
+
     //Disconnect Connector and release it
     //No error check
     void DisconnectConnector();
@@ -252,6 +558,49 @@ protected:
     // wait for CQ entry and check context
     void WaitForCompletionAndCheckContext(void *expectedContext);
 
+    // Harvest up to nResults CQ entries into pResults with a single
+    // GetResults call and pass each to processCompletionFn, without waiting.
+    // Returns the number of entries harvested.
+    template<typename ProcessCompletionFn>
+    ULONG PollCompletions(
+        ND2_RESULT *pResults,
+        ULONG nResults,
+        const ProcessCompletionFn& processCompletionFn)
+    {
+        ULONG n = static_cast<ULONG>(m_pCq->GetResults(pResults, nResults));
+        if (n != 0)
+        {
+            m_ResultsPerCall.Add(n);
+            for (ULONG i = 0; i < n; i++)
+            {
+                processCompletionFn(&pResults[i]);
+            }
+        }
+        return n;
+    }
+
+    // Like PollCompletions, but waits for at least one CQ entry.
+    template<typename ProcessCompletionFn>
+    ULONG WaitForCompletions(
+        ND2_RESULT *pResults,
+        ULONG nResults,
+        const ProcessCompletionFn& processCompletionFn,
+        bool bBlocking)
+    {
+        for (;;)
+        {
+            ULONG n = PollCompletions(pResults, nResults, processCompletionFn);
+            if (n != 0)
+            {
+                return n;
+            }
+            if (bBlocking)
+            {
+                WaitForEventNotification();
+            }
+        }
+    }
+
     //bind buffer to MW
     void Bind(
         DWORD bufferLength,
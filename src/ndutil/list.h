@@ -46,12 +46,57 @@
 //
 //  class ListHelper
 //
+//  Converts between an item and its link.  By default the
+//  link is the m_link member of T, located with offsetof,
+//  which requires T to be standard-layout.
+//
 //---------------------------------------------------------
 template<class T>
 class ListHelper
 {
 public:
-    enum { Offset = FIELD_OFFSET(T, m_link) };
+    static LIST_ENTRY* item2entry(T& item)
+    {
+        return ((LIST_ENTRY*)(PVOID)((PCHAR)&item + FIELD_OFFSET(T, m_link)));
+    }
+
+    static T& entry2item(LIST_ENTRY* pEntry)
+    {
+        return *((T*)(PVOID)((PCHAR)pEntry - FIELD_OFFSET(T, m_link)));
+    }
+};
+
+
+//---------------------------------------------------------
+//
+//  class ListLink, ListLinkHelper
+//
+//  Items that are not standard-layout, e.g. have virtual
+//  functions, derive from ListLink instead and specialize
+//  ListHelper as ListLinkHelper.  The link is then reached
+//  through the base class conversion, which is valid for
+//  any layout.
+//
+//---------------------------------------------------------
+struct ListLink
+{
+    LIST_ENTRY m_link;
+};
+
+
+template<class T>
+class ListLinkHelper
+{
+public:
+    static LIST_ENTRY* item2entry(T& item)
+    {
+        return &static_cast<ListLink&>(item).m_link;
+    }
+
+    static T& entry2item(LIST_ENTRY* pEntry)
+    {
+        return static_cast<T&>(*CONTAINING_RECORD(pEntry, ListLink, m_link));
+    }
 };
 
 
@@ -60,7 +105,7 @@ public:
 //  class List
 //
 //---------------------------------------------------------
-template<class T, int Offset = ListHelper<T>::Offset>
+template<class T, class Helper = ListHelper<T> >
 class List
 {
 private:
@@ -106,7 +151,7 @@ private:
 public:
 
     //
-    // class List<T, Offset>::iterator
+    // class List<T, Helper>::iterator
     //
     class iterator
     {
@@ -168,37 +213,37 @@ public:
 //  IMPLEMENTATION
 //
 //---------------------------------------------------------
-template<class T, int Offset>
-inline List<T, Offset>::List()
+template<class T, class Helper>
+inline List<T, Helper>::List()
 {
     m_head.Flink = &m_head;
     m_head.Blink = &m_head;
 }
 
 #if DBG
-template<class T, int Offset>
-inline List<T, Offset>::~List()
+template<class T, class Helper>
+inline List<T, Helper>::~List()
 {
     ASSERT_BENIGN(empty());
 }
 #endif
 
-template<class T, int Offset>
-inline LIST_ENTRY* List<T, Offset>::item2entry(T& item)
+template<class T, class Helper>
+inline LIST_ENTRY* List<T, Helper>::item2entry(T& item)
 {
-    return ((LIST_ENTRY*)(PVOID)((PCHAR)&item + Offset));
+    return Helper::item2entry(item);
 }
 
 
-template<class T, int Offset>
-inline T& List<T, Offset>::entry2item(LIST_ENTRY* pEntry)
+template<class T, class Helper>
+inline T& List<T, Helper>::entry2item(LIST_ENTRY* pEntry)
 {
-    return *((T*)(PVOID)((PCHAR)pEntry - Offset));
+    return Helper::entry2item(pEntry);
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::InsertBefore(LIST_ENTRY* pNext, LIST_ENTRY* pEntry)
+template<class T, class Helper>
+inline void List<T, Helper>::InsertBefore(LIST_ENTRY* pNext, LIST_ENTRY* pEntry)
 {
     pEntry->Flink = pNext;
     pEntry->Blink = pNext->Blink;
@@ -207,8 +252,8 @@ inline void List<T, Offset>::InsertBefore(LIST_ENTRY* pNext, LIST_ENTRY* pEntry)
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::InsertAfter(LIST_ENTRY* pPrev, LIST_ENTRY* pEntry)
+template<class T, class Helper>
+inline void List<T, Helper>::InsertAfter(LIST_ENTRY* pPrev, LIST_ENTRY* pEntry)
 {
     pEntry->Blink = pPrev;
     pEntry->Flink = pPrev->Flink;
@@ -217,8 +262,8 @@ inline void List<T, Offset>::InsertAfter(LIST_ENTRY* pPrev, LIST_ENTRY* pEntry)
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::RemoveEntry(LIST_ENTRY* pEntry)
+template<class T, class Helper>
+inline void List<T, Helper>::RemoveEntry(LIST_ENTRY* pEntry)
 {
     LIST_ENTRY* Blink = pEntry->Blink;
     LIST_ENTRY* Flink = pEntry->Flink;
@@ -230,37 +275,37 @@ inline void List<T, Offset>::RemoveEntry(LIST_ENTRY* pEntry)
 }
 
 
-template<class T, int Offset>
-inline typename List<T, Offset>::iterator List<T, Offset>::begin() const
+template<class T, class Helper>
+inline typename List<T, Helper>::iterator List<T, Helper>::begin() const
 {
     return iterator(m_head.Flink);
 }
 
 
-template<class T, int Offset>
-inline typename List<T, Offset>::iterator List<T, Offset>::end() const
+template<class T, class Helper>
+inline typename List<T, Helper>::iterator List<T, Helper>::end() const
 {
     return iterator(const_cast<LIST_ENTRY*>(&m_head));
 }
 
 
-template<class T, int Offset>
-inline bool List<T, Offset>::empty() const
+template<class T, class Helper>
+inline bool List<T, Helper>::empty() const
 {
     return (m_head.Flink == &m_head);
 }
 
 
-template<class T, int Offset>
-inline T& List<T, Offset>::front() const
+template<class T, class Helper>
+inline T& List<T, Helper>::front() const
 {
     ASSERT(!empty());
     return entry2item(m_head.Flink);
 }
 
 
-template<class T, int Offset>
-inline T& List<T, Offset>::back() const
+template<class T, class Helper>
+inline T& List<T, Helper>::back() const
 {
     ASSERT(!empty());
     return entry2item(m_head.Blink);
@@ -268,8 +313,8 @@ inline T& List<T, Offset>::back() const
 
 
 #pragma prefast(disable:28194, "Linking the item into the list aliases the memory.");
-template<class T, int Offset>
-inline void List<T, Offset>::push_front(_Inout_ __drv_aliasesMem T* item)
+template<class T, class Helper>
+inline void List<T, Helper>::push_front(_Inout_ __drv_aliasesMem T* item)
 {
     LIST_ENTRY* pEntry = item2entry(*item);
     InsertAfter(&m_head, pEntry);
@@ -277,32 +322,32 @@ inline void List<T, Offset>::push_front(_Inout_ __drv_aliasesMem T* item)
 
 
 #pragma prefast(disable:28194, "Linking the item into the list aliases the memory.");
-template<class T, int Offset>
-inline void List<T, Offset>::push_back(_Inout_ __drv_aliasesMem T* item)
+template<class T, class Helper>
+inline void List<T, Helper>::push_back(_Inout_ __drv_aliasesMem T* item)
 {
     LIST_ENTRY* pEntry = item2entry(*item);
     InsertBefore(&m_head, pEntry);
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::pop_front()
+template<class T, class Helper>
+inline void List<T, Helper>::pop_front()
 {
     ASSERT(!empty());
     RemoveEntry(m_head.Flink);
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::pop_back()
+template<class T, class Helper>
+inline void List<T, Helper>::pop_back()
 {
     ASSERT(!empty());
     RemoveEntry(m_head.Blink);
 }
 
 
-template<class T, int Offset>
-inline typename List<T, Offset>::iterator List<T, Offset>::insert(iterator it, T& item)
+template<class T, class Helper>
+inline typename List<T, Helper>::iterator List<T, Helper>::insert(iterator it, T& item)
 {
     LIST_ENTRY* pEntry = item2entry(item);
     LIST_ENTRY* pNext = item2entry(*it);
@@ -311,8 +356,8 @@ inline typename List<T, Offset>::iterator List<T, Offset>::insert(iterator it, T
 }
 
 
-template<class T, int Offset>
-inline typename List<T, Offset>::iterator List<T, Offset>::erase(iterator it)
+template<class T, class Helper>
+inline typename List<T, Helper>::iterator List<T, Helper>::erase(iterator it)
 {
     ASSERT(it != end());
     iterator next = it;
@@ -322,8 +367,8 @@ inline typename List<T, Offset>::iterator List<T, Offset>::erase(iterator it)
 }
 
 
-template<class T, int Offset>
-inline void List<T, Offset>::remove(T& item)
+template<class T, class Helper>
+inline void List<T, Helper>::remove(T& item)
 {
     ASSERT(&item != &*end());
     LIST_ENTRY* pEntry = item2entry(item);
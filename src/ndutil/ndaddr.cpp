@@ -42,12 +42,12 @@ namespace NetworkDirect
         switch (pAddr->sa_family)
         {
         case AF_INET:
-            return reinterpret_cast<const struct sockaddr_in*>(pAddr)->sin_addr.S_un.S_addr ==
-                m_Addr.Ipv4.sin_addr.S_un.S_addr;
+            return reinterpret_cast<const struct sockaddr_in*>(pAddr)->sin_addr.s_addr ==
+                m_Addr.Ipv4.sin_addr.s_addr;
 
         case AF_INET6:
-            return (::memcmp(reinterpret_cast<const sockaddr_in6*>(pAddr)->sin6_addr.u.Byte,
-                m_Addr.Ipv6.sin6_addr.u.Byte, sizeof(m_Addr.Ipv6.sin6_addr)) == 0);
+            return (::memcmp(reinterpret_cast<const sockaddr_in6*>(pAddr)->sin6_addr.s6_addr,
+                m_Addr.Ipv6.sin6_addr.s6_addr, sizeof(m_Addr.Ipv6.sin6_addr)) == 0);
 
         default:
             return false;
@@ -55,6 +55,42 @@ namespace NetworkDirect
     }
 
 
+    //
+    // FNV-1a over the address family and IP address bytes.
+    //
+    ULONG Address::Hash(_In_ const struct sockaddr* pAddr)
+    {
+        const BYTE* pBytes;
+        SIZE_T len;
+
+        switch (pAddr->sa_family)
+        {
+        case AF_INET:
+            pBytes = reinterpret_cast<const BYTE*>(
+                &reinterpret_cast<const struct sockaddr_in*>(pAddr)->sin_addr);
+            len = sizeof(struct in_addr);
+            break;
+
+        case AF_INET6:
+            pBytes = reinterpret_cast<const BYTE*>(
+                &reinterpret_cast<const struct sockaddr_in6*>(pAddr)->sin6_addr);
+            len = sizeof(struct in6_addr);
+            break;
+
+        default:
+            return 0;
+        }
+
+        ULONG hash = 2166136261;
+        hash = (hash ^ pAddr->sa_family) * 16777619;
+        for (SIZE_T i = 0; i < len; i++)
+        {
+            hash = (hash ^ pBytes[i]) * 16777619;
+        }
+        return hash;
+    }
+
+
     SIZE_T Address::CopySockaddr(_Out_writes_(len) BYTE* pBuf, _In_ SIZE_T len) const
     {
         switch (m_Addr.si_family)
@@ -82,4 +118,187 @@ namespace NetworkDirect
         }
     }
 
+
+
+    AddressIndex::AddressIndex() :
+        m_pList(nullptr),
+        m_ppSlots(nullptr),
+        m_nSlots(0),
+        m_nAllocs(0)
+    {
+    }
+
+
+    AddressIndex::~AddressIndex()
+    {
+        Clear();
+    }
+
+
+    void AddressIndex::Clear()
+    {
+        if (m_ppSlots != nullptr)
+        {
+            ::HeapFree(ghHeap, 0, m_ppSlots);
+            m_ppSlots = nullptr;
+        }
+        m_nSlots = 0;
+    }
+
+
+    HRESULT AddressIndex::Build(_In_ const List<Address>& list)
+    {
+        m_pList = &list;
+
+        ULONG nEntries = 0;
+        for (List<Address>::iterator pAddr = list.begin();
+            pAddr != list.end();
+            ++pAddr)
+        {
+            nEntries++;
+        }
+
+        if (m_ppSlots != nullptr)
+        {
+            ::ZeroMemory(m_ppSlots, sizeof(*m_ppSlots) * m_nSlots);
+        }
+
+        if (nEntries == 0)
+        {
+            return S_OK;
+        }
+
+        //
+        // Keep the load factor at or below one half so probe sequences stay
+        // short.
+        //
+        ULONG nSlots = 16;
+        while (nSlots < nEntries * 2)
+        {
+            if (nSlots > (ULONG_MAX / 2))
+            {
+                Clear();
+                return ND_NO_MEMORY;
+            }
+            nSlots <<= 1;
+        }
+
+        if (m_nSlots < nSlots)
+        {
+            Clear();
+
+            m_ppSlots = static_cast<const Address**>(
+                ::HeapAlloc(ghHeap, HEAP_ZERO_MEMORY, sizeof(*m_ppSlots) * nSlots));
+            if (m_ppSlots == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
+            m_nSlots = nSlots;
+            m_nAllocs++;
+        }
+
+        //
+        // Inserting in list order keeps entries for the same address in list
+        // order along their probe sequence.
+        //
+        for (List<Address>::iterator pAddr = list.begin();
+            pAddr != list.end();
+            ++pAddr)
+        {
+            ULONG slot = pAddr->Hash() & (m_nSlots - 1);
+            while (m_ppSlots[slot] != nullptr)
+            {
+                slot = (slot + 1) & (m_nSlots - 1);
+            }
+            m_ppSlots[slot] = &*pAddr;
+        }
+
+        return S_OK;
+    }
+
+
+    const Address* AddressIndex::Find(
+        _In_ const struct sockaddr* pAddr,
+        _Inout_ ULONG* pPos
+    ) const
+    {
+        if (m_ppSlots == nullptr)
+        {
+            return Scan(pAddr, pPos);
+        }
+
+        //
+        // *pPos is the number of slots already probed.
+        //
+        ULONG hash = Address::Hash(pAddr);
+        for (ULONG i = *pPos; i < m_nSlots; i++)
+        {
+            const Address* pEntry = m_ppSlots[(hash + i) & (m_nSlots - 1)];
+            if (pEntry == nullptr)
+            {
+                break;
+            }
+
+            if (pEntry->Matches(pAddr))
+            {
+                *pPos = i + 1;
+                return pEntry;
+            }
+        }
+
+        *pPos = m_nSlots;
+        return nullptr;
+    }
+
+
+    bool AddressIndex::Contains(_In_ const Address& addr) const
+    {
+        ULONG pos = 0;
+        for (const Address* pEntry = Find(addr.Sockaddr(), &pos);
+            pEntry != nullptr;
+            pEntry = Find(addr.Sockaddr(), &pos))
+        {
+            if (pEntry->GetProvider() == addr.GetProvider())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    const Address* AddressIndex::Scan(
+        _In_ const struct sockaddr* pAddr,
+        _Inout_ ULONG* pPos
+    ) const
+    {
+        if (m_pList == nullptr)
+        {
+            return nullptr;
+        }
+
+        //
+        // *pPos is the number of list entries already visited.
+        //
+        ULONG i = 0;
+        for (List<Address>::iterator pEntry = m_pList->begin();
+            pEntry != m_pList->end();
+            ++pEntry, ++i)
+        {
+            if (i < *pPos)
+            {
+                continue;
+            }
+
+            if (pEntry->Matches(pAddr))
+            {
+                *pPos = i + 1;
+                return &*pEntry;
+            }
+        }
+
+        *pPos = i;
+        return nullptr;
+    }
+
 } // namespace NetworkDirect
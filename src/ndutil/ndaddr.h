@@ -26,10 +26,66 @@ namespace NetworkDirect
         bool Matches(const struct sockaddr* pMatchAddr) const;
         Provider* GetProvider() const { return m_pProvider; }
 
+        //
+        // Hash of the IP address bytes.  Ports, flow info and scope IDs are
+        // ignored, consistent with Matches.
+        //
+        static ULONG Hash(_In_ const struct sockaddr* pAddr);
+        ULONG Hash() const { return Hash(Sockaddr()); }
+
         short AF() const { return m_Addr.si_family; };
+        const struct sockaddr* Sockaddr() const { return reinterpret_cast<const struct sockaddr*>(&m_Addr); }
         SIZE_T CopySockaddr(_Out_writes_(len) BYTE* pBuf, _In_ SIZE_T len) const;
 
     };
 
+
+    //
+    // Open-addressing hash index over a List<Address>, using linear probing.
+    // Addresses served by several providers have one entry per provider, and
+    // entries for the same address are found in list order.
+    //
+    // The index does not own the addresses, and is rebuilt from the list
+    // whenever the list changes.  The slot array is kept across rebuilds when
+    // it is large enough.  If it can't be allocated, lookups fall back to
+    // scanning the list.
+    //
+    class AddressIndex
+    {
+        const List<Address>* m_pList;
+        const Address** m_ppSlots;
+        // Number of slots, always a power of two.
+        ULONG m_nSlots;
+        // Number of slot arrays allocated.
+        ULONG64 m_nAllocs;
+
+    public:
+        AddressIndex(void);
+        ~AddressIndex(void);
+
+        HRESULT Build(_In_ const List<Address>& list);
+
+        ULONG64 AllocCount() const { return m_nAllocs; }
+
+        //
+        // Returns the next address matching pAddr, or nullptr if there are no
+        // more.  Set *pPos to zero to start a lookup.
+        //
+        const Address* Find(
+            _In_ const struct sockaddr* pAddr,
+            _Inout_ ULONG* pPos
+        ) const;
+
+        //
+        // Returns true if the index has an entry for the same address and
+        // provider as addr.
+        //
+        bool Contains(_In_ const Address& addr) const;
+
+    private:
+        void Clear(void);
+        const Address* Scan(_In_ const struct sockaddr* pAddr, _Inout_ ULONG* pPos) const;
+    };
+
 } // namespace NetworkDirect
 
@@ -6,9 +6,12 @@
 
 #include "precomp.h"
 #include "ndsupport.h"
+#include "ndnotify.h"
 #include "ndaddr.h"
+#include "ndroute.h"
 #include "ndprov.h"
 #include "ndfrmwrk.h"
+#include "ndloopback.h"
 
 
 namespace NetworkDirect
@@ -36,55 +39,124 @@ namespace NetworkDirect
     NetworkDirect::Framework* gpFramework = nullptr;
 
 
-    Framework::Framework() :
-        m_hIocp(nullptr),
-        m_hProviderChange(nullptr),
-        m_Socket(INVALID_SOCKET),
-        m_nRef(0)
+    AddressTable::AddressTable(
+        _In_ FixedPool* pPool
+    ) :
+        m_pPool(pPool)
     {
-        InitializeCriticalSection(&m_lock);
-        ::ZeroMemory(m_Ov, sizeof(m_Ov));
     }
 
 
-    Framework::~Framework()
+    AddressTable::~AddressTable()
+    {
+        Reset();
+    }
+
+
+    void
+        AddressTable::Reset()
     {
         while (!m_NdAddrList.empty())
         {
             Address* pAddr = &m_NdAddrList.front();
             m_NdAddrList.pop_front();
-            delete pAddr;
+            pAddr->~Address();
+            m_pPool->Free(pAddr);
         }
 
         while (!m_NdV1AddrList.empty())
         {
             Address* pAddr = &m_NdV1AddrList.front();
             m_NdV1AddrList.pop_front();
-            delete pAddr;
+            pAddr->~Address();
+            m_pPool->Free(pAddr);
+        }
+    }
+
+
+    bool
+        AddressTable::Contains(
+            _In_ const struct sockaddr* pAddress
+        ) const
+    {
+        ULONG pos = 0;
+        if (m_NdAddrIndex.Find(pAddress, &pos) != nullptr)
+        {
+            return true;
+        }
+
+        pos = 0;
+        return m_NdV1AddrIndex.Find(pAddress, &pos) != nullptr;
+    }
+
+
+    Framework::Framework() :
+        m_pNotify(nullptr),
+        m_hWatcher(nullptr),
+        m_ProviderPool(max(sizeof(NdProvider), sizeof(NdV1Provider)), 16),
+        m_AddressPool(sizeof(Address), 64),
+        m_pLoopbackProvider(nullptr),
+        m_pAddrTable(nullptr),
+        m_pSpareTable(nullptr),
+        m_pProtocols(nullptr),
+        m_cbProtocols(0),
+        m_pAddrList(nullptr),
+        m_cbAddrList(0),
+        m_nHeapAllocs(0),
+        m_nRef(0)
+    {
+        InitializeCriticalSection(&m_lock);
+        ::ZeroMemory(&m_Stats, sizeof(m_Stats));
+        ::ZeroMemory(&m_AdapterCacheStats, sizeof(m_AdapterCacheStats));
+    }
+
+
+    Framework::~Framework()
+    {
+        if (m_hWatcher != nullptr)
+        {
+            m_pNotify->Shutdown();
+            ::WaitForSingleObject(m_hWatcher, INFINITE);
+            ::CloseHandle(m_hWatcher);
         }
 
-        FlushProviders();
+        if (m_pNotify != nullptr)
+        {
+            delete m_pNotify;
+        }
+
+        if (m_pAddrTable != nullptr)
+        {
+            delete m_pAddrTable;
+        }
+
+        if (m_pSpareTable != nullptr)
+        {
+            delete m_pSpareTable;
+        }
+
+        FlushProviders(true);
 
         while (!m_ProviderList.empty())
         {
             Provider* pProvider = &m_ProviderList.front();
             m_ProviderList.pop_front();
-            delete pProvider;
+            DestroyProvider(pProvider);
         }
 
-        if (m_hProviderChange != nullptr)
+        if (m_pLoopbackProvider != nullptr)
         {
-            ::CloseHandle(m_hProviderChange);
+            delete m_pLoopbackProvider;
         }
 
-        if (m_Socket != INVALID_SOCKET)
+        if (m_pProtocols != nullptr)
         {
-            ::closesocket(m_Socket);
+            ::HeapFree(ghHeap, 0, m_pProtocols);
         }
 
-        if (m_hIocp != nullptr)
+        if (m_pAddrList != nullptr)
         {
-            ::CloseHandle(m_hIocp);
+            ::HeapFree(ghHeap, 0, m_pAddrList);
         }
 
         DeleteCriticalSection(&m_lock);
@@ -92,7 +164,9 @@ namespace NetworkDirect
 
 
     HRESULT
-        Framework::Init()
+        Framework::Init(
+            _In_opt_ NotificationSource* pNotify
+        )
     {
         int ret;
         WSADATA data;
@@ -102,68 +176,71 @@ namespace NetworkDirect
         ret = ::WSAStartup(MAKEWORD(2, 2), &data);
         if (ret != 0)
         {
+            if (pNotify != nullptr)
+            {
+                delete pNotify;
+            }
             return HRESULT_FROM_WIN32(ret);
         }
 
-        // Create an IOCP to get all the different notifications:
-        // - provider change
-        // - address change
-        m_hIocp = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
-        if (m_hIocp == nullptr)
-        {
-            return HRESULT_FROM_WIN32(::GetLastError());
-        }
-
-        // Create a socket for address changes.
-        m_Socket = ::WSASocketW(AF_INET, SOCK_STREAM, 0, nullptr, 0, WSA_FLAG_OVERLAPPED);
-        if (m_Socket == INVALID_SOCKET)
+        if (pNotify == nullptr)
         {
-            return HRESULT_FROM_WIN32(::WSAGetLastError());
+#ifdef _WIN32
+            pNotify = new WsaNotificationSource();
+#else
+            pNotify = new PosixNotificationSource();
+#endif
+            if (pNotify == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
         }
+        m_pNotify = pNotify;
 
-        // Bind the socket change handle to the IOCP.
-        HANDLE hIocp = ::CreateIoCompletionPort(
-            reinterpret_cast<HANDLE>(m_Socket), m_hIocp, ND_NOTIFY_ADDR_CHANGE, 0);
-        if (hIocp != m_hIocp)
+        HRESULT hr = m_pNotify->Init();
+        if (FAILED(hr))
         {
-            return HRESULT_FROM_WIN32(::GetLastError());
+            return hr;
         }
 
-        // Get provider change notification handle.
-        ret = ::WSAProviderConfigChange(&m_hProviderChange, nullptr, nullptr);
-        if (ret != 0)
+        if (NdLoopbackProvider::IsEnabled())
         {
-            return HRESULT_FROM_WIN32(::WSAGetLastError());
+            m_pLoopbackProvider = new NdLoopbackProvider();
+            if (m_pLoopbackProvider == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
         }
 
-        // Bind the provider change handle to the IOCP.
-        __analysis_assume(m_hProviderChange != nullptr);
-        hIocp = ::CreateIoCompletionPort(
-            m_hProviderChange, m_hIocp, ND_NOTIFY_PROVIDER_CHANGE, 0);
-        if (hIocp != m_hIocp)
+        //
+        // Build and publish the provider and address lists before returning.
+        // The lookup paths read the published table without m_lock, so a
+        // first scan left to ProcessUpdates would let every caller but the
+        // one processing it find no table right after NdStartup.
+        //
         {
-            return HRESULT_FROM_WIN32(::GetLastError());
+            Lock lock(&m_lock);
+            ProcessNotification(ND_NOTIFY_PROVIDER_CHANGE);
         }
 
-        // Request address change notification.
-        DWORD BytesRet;
-        ret = ::WSAIoctl(m_Socket, SIO_ADDRESS_LIST_CHANGE, nullptr, 0, nullptr,
-            0, &BytesRet, &m_Ov[ND_NOTIFY_ADDR_CHANGE], nullptr);
-        if (ret != 0 && WSAGetLastError() != WSA_IO_PENDING)
+        if (IsWatcherEnabled())
         {
-            return HRESULT_FROM_WIN32(::WSAGetLastError());
+            m_hWatcher = ::CreateThread(nullptr, 0, WatcherThread, this, 0, nullptr);
+            if (m_hWatcher == nullptr)
+            {
+                return HRESULT_FROM_WIN32(::GetLastError());
+            }
         }
+        return S_OK;
+    }
 
-        // Generate a provider change notification, so that the next call that
-        // looks at the provider catalog will update it first.
-        ret = ::PostQueuedCompletionStatus(m_hIocp, 0, ND_NOTIFY_PROVIDER_CHANGE,
-            &m_Ov[ND_NOTIFY_PROVIDER_CHANGE]);
-        if (ret == FALSE)
-        {
-            return HRESULT_FROM_WIN32(::GetLastError());
-        }
 
-        return S_OK;
+    bool
+        Framework::IsWatcherEnabled()
+    {
+        WCHAR value[8];
+        DWORD len = ::GetEnvironmentVariableW(L"ND_BACKGROUND_WATCHER", value, _countof(value));
+        return len > 0 && len < _countof(value) && value[0] == L'1';
     }
 
 
@@ -200,21 +277,22 @@ namespace NetworkDirect
         // Sync our provider and address lists
         ProcessUpdates();
 
-        Lock lock(&m_lock);
+        RcuReadLock rcu(&m_Rcu);
+        const AddressTable* pTable = m_pAddrTable;
 
         // Calculate the size of the buffer we need.  We count the number of v4 and
         // v6 addresses.
         SIZE_T nV4 = 0;
         SIZE_T nV6 = 0;
 
-        if ((flags & ND_QUERY_EXCLUDE_NDv2_ADDRESSES) == 0)
+        if (pTable != nullptr && (flags & ND_QUERY_EXCLUDE_NDv2_ADDRESSES) == 0)
         {
-            CountAddresses(m_NdAddrList, &nV4, &nV6);
+            CountAddresses(pTable->m_NdAddrList, &nV4, &nV6);
         }
 
-        if ((flags & ND_QUERY_EXCLUDE_NDv1_ADDRESSES) == 0)
+        if (pTable != nullptr && (flags & ND_QUERY_EXCLUDE_NDv1_ADDRESSES) == 0)
         {
-            CountAddresses(m_NdV1AddrList, &nV4, &nV6);
+            CountAddresses(pTable->m_NdV1AddrList, &nV4, &nV6);
         }
 
         if (nV4 == 0 && nV6 == 0)
@@ -235,19 +313,18 @@ namespace NetworkDirect
 
         BYTE* pBuf = reinterpret_cast<BYTE*>(
             &pAddressList->Address[(nV4 + nV6)]);
-        SIZE_T cbRemaining = *pcbAddressList -
-            FIELD_OFFSET(SOCKET_ADDRESS_LIST, Address[(nV4 + nV6)]);
+        SIZE_T cbRemaining = *pcbAddressList - (pBuf - reinterpret_cast<BYTE*>(pAddressList));
 
         pAddressList->iAddressCount = 0;
 
         if ((flags & ND_QUERY_EXCLUDE_NDv2_ADDRESSES) == 0)
         {
-            CopyAddressList(m_NdAddrList, pAddressList, &pBuf, &cbRemaining);
+            CopyAddressList(pTable->m_NdAddrList, pAddressList, &pBuf, &cbRemaining);
         }
 
         if ((flags & ND_QUERY_EXCLUDE_NDv1_ADDRESSES) == 0)
         {
-            CopyAddressList(m_NdV1AddrList, pAddressList, &pBuf, &cbRemaining);
+            CopyAddressList(pTable->m_NdV1AddrList, pAddressList, &pBuf, &cbRemaining);
         }
 
         return S_OK;
@@ -262,84 +339,168 @@ namespace NetworkDirect
             _Inout_ SIZE_T* pcbLocalAddress
         )
     {
+        HRESULT hr = ValidateAddress(pRemoteAddress, cbRemoteAddress);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
         //
         // Sync our provider and address lists
         //
         ProcessUpdates();
 
-        Lock lock(&m_lock);
+        SOCKADDR_INET local;
+        hr = QueryRoute(pRemoteAddress, &local);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        SIZE_T len = (local.si_family == AF_INET) ?
+            sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        if (*pcbLocalAddress < len)
+        {
+            *pcbLocalAddress = len;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        RtlCopyMemory(pLocalAddress, &local, len);
+        *pcbLocalAddress = len;
 
         //
-        // Cap to max DWORD value.  This has the added benefit of zeroing the upper
-        // bits on 64-bit platforms, so that the returned value is correct.
+        // We found a local address.  Now make sure that the we have a provider
+        // that supports it.
         //
-        if (*pcbLocalAddress > UINT_MAX)
+        RcuReadLock rcu(&m_Rcu);
+        const AddressTable* pTable = m_pAddrTable;
+        if (pTable != nullptr && pTable->Contains(pLocalAddress))
         {
-            *pcbLocalAddress = UINT_MAX;
+            return S_OK;
         }
 
+        return ND_INVALID_ADDRESS;
+    }
+
+
+    HRESULT
+        Framework::ResolveAddresses(
+            _In_ SIZE_T nAddresses,
+            _In_reads_(nAddresses) const SOCKADDR_INET* pRemoteAddresses,
+            _Out_writes_(nAddresses) SOCKADDR_INET* pLocalAddresses,
+            _Out_writes_(nAddresses) HRESULT* pResults
+        )
+    {
         //
-        // We store the original length so we can distinguish from different
-        // errors that return WSAEFAULT.
+        // Sync our provider and address lists
         //
-        SIZE_T len = *pcbLocalAddress;
-        int ret = ::WSAIoctl(
-            m_Socket,
-            SIO_ROUTING_INTERFACE_QUERY,
-            const_cast<sockaddr*>(pRemoteAddress),
-            static_cast<DWORD>(cbRemoteAddress),
-            pLocalAddress,
-            static_cast<DWORD>(len),
-            reinterpret_cast<DWORD*>(pcbLocalAddress),
-            nullptr,
-            nullptr
-        );
+        ProcessUpdates();
 
-        if (ret == SOCKET_ERROR)
+        for (SIZE_T i = 0; i < nAddresses; i++)
         {
-            switch (::GetLastError())
+            pResults[i] = ValidateAddress(
+                reinterpret_cast<const struct sockaddr*>(&pRemoteAddresses[i]),
+                sizeof(pRemoteAddresses[i])
+            );
+            if (SUCCEEDED(pResults[i]))
             {
-            case WSAEFAULT:
-                if (len < *pcbLocalAddress)
-                {
-                    return ND_BUFFER_OVERFLOW;
-                }
-                __fallthrough;
-            default:
-                return ND_UNSUCCESSFUL;
-            case WSAEINVAL:
-                return ND_INVALID_ADDRESS;
-            case WSAENETUNREACH:
-            case WSAENETDOWN:
-                return ND_NETWORK_UNREACHABLE;
+                pResults[i] = ND_PENDING;
             }
         }
 
         //
-        // We found a local address.  Now make sure that the we have a provider
-        // that supports it.
+        // Answer what we can from the route cache in a single pass, then look
+        // up the remaining routes.  Each lookup populates the cache, so later
+        // entries that share its route are answered from the cache.
         //
-        for (List<Address>::iterator pAddr = m_NdAddrList.begin();
-            pAddr != m_NdAddrList.end();
-            ++pAddr)
+        m_RouteCache.Lookup(nAddresses, pRemoteAddresses, pLocalAddresses, pResults);
+
+        for (SIZE_T i = 0; i < nAddresses; i++)
         {
-            if (pAddr->Matches(pLocalAddress))
+            if (pResults[i] == ND_PENDING)
             {
-                return S_OK;
+                pResults[i] = QueryRoute(
+                    reinterpret_cast<const struct sockaddr*>(&pRemoteAddresses[i]),
+                    &pLocalAddresses[i]
+                );
             }
         }
 
-        for (List<Address>::iterator pAddr = m_NdV1AddrList.begin();
-            pAddr != m_NdV1AddrList.end();
-            ++pAddr)
+        //
+        // Now make sure that we have a provider for each local address.
+        //
+        HRESULT hr = ND_SUCCESS;
+        RcuReadLock rcu(&m_Rcu);
+        const AddressTable* pTable = m_pAddrTable;
+        for (SIZE_T i = 0; i < nAddresses; i++)
         {
-            if (pAddr->Matches(pLocalAddress))
+            if (SUCCEEDED(pResults[i]) &&
+                (pTable == nullptr || !pTable->Contains(
+                    reinterpret_cast<const struct sockaddr*>(&pLocalAddresses[i]))))
+            {
+                pResults[i] = ND_INVALID_ADDRESS;
+            }
+
+            if (FAILED(pResults[i]) && hr == ND_SUCCESS)
             {
-                return S_OK;
+                hr = pResults[i];
             }
         }
+        return hr;
+    }
 
-        return ND_INVALID_ADDRESS;
+
+    //
+    // Returns the local address used to reach pRemoteAddress, from the route
+    // cache if possible.
+    //
+    HRESULT
+        Framework::QueryRoute(
+            _In_ const struct sockaddr* pRemoteAddress,
+            _Out_ SOCKADDR_INET* pLocalAddress
+        )
+    {
+        if (m_RouteCache.Lookup(pRemoteAddress, pLocalAddress))
+        {
+            return ND_SUCCESS;
+        }
+
+        //
+        // Read the epoch before the lookup, so that a result that predates an
+        // address change isn't cached.
+        //
+        LONG epoch = m_RouteCache.Epoch();
+
+        SOCKADDR_INET dest;
+        ::ZeroMemory(&dest, sizeof(dest));
+        if (pRemoteAddress->sa_family == AF_INET)
+        {
+            dest.Ipv4 = *reinterpret_cast<const struct sockaddr_in*>(pRemoteAddress);
+        }
+        else
+        {
+            dest.Ipv6 = *reinterpret_cast<const struct sockaddr_in6*>(pRemoteAddress);
+        }
+
+        MIB_IPFORWARD_ROW2 route;
+        DWORD ret = ::GetBestRoute2(
+            nullptr, 0, nullptr, &dest, 0, &route, pLocalAddress);
+        switch (ret)
+        {
+        case NO_ERROR:
+            break;
+        case ERROR_INVALID_PARAMETER:
+            return ND_INVALID_ADDRESS;
+        case ERROR_NOT_FOUND:
+        case ERROR_NETWORK_UNREACHABLE:
+        case ERROR_HOST_UNREACHABLE:
+            return ND_NETWORK_UNREACHABLE;
+        default:
+            return ND_UNSUCCESSFUL;
+        }
+
+        m_RouteCache.Insert(epoch, pRemoteAddress, route, *pLocalAddress);
+        return ND_SUCCESS;
     }
 
 
@@ -362,25 +523,11 @@ namespace NetworkDirect
         //
         ProcessUpdates();
 
-        Lock lock(&m_lock);
-        for (List<Address>::iterator pAddr = m_NdAddrList.begin();
-            pAddr != m_NdAddrList.end();
-            ++pAddr)
+        RcuReadLock rcu(&m_Rcu);
+        const AddressTable* pTable = m_pAddrTable;
+        if (pTable != nullptr && pTable->Contains(pAddress))
         {
-            if (pAddr->Matches(pAddress))
-            {
-                return ND_SUCCESS;
-            }
-        }
-
-        for (List<Address>::iterator pAddr = m_NdV1AddrList.begin();
-            pAddr != m_NdV1AddrList.end();
-            ++pAddr)
-        {
-            if (pAddr->Matches(pAddress))
-            {
-                return ND_SUCCESS;
-            }
+            return ND_SUCCESS;
         }
 
         return ND_INVALID_ADDRESS;
@@ -408,30 +555,36 @@ namespace NetworkDirect
         //
         ProcessUpdates();
 
-        Lock lock(&m_lock);
-        const List<Address>* pList;
+        //
+        // The provider is called inside the read-side section so that the
+        // address table, and the providers it references, stay alive.
+        //
+        RcuReadLock rcu(&m_Rcu);
+        const AddressTable* pTable = m_pAddrTable;
+        if (pTable == nullptr)
+        {
+            return ND_INVALID_ADDRESS;
+        }
+
+        const AddressIndex* pIndex;
         if (InlineIsEqualGUID(iid, IID_INDAdapter))
         {
-            pList = &m_NdV1AddrList;
+            pIndex = &pTable->m_NdV1AddrIndex;
         }
         else
         {
-            pList = &m_NdAddrList;
+            pIndex = &pTable->m_NdAddrIndex;
         }
 
         //
         // Find the provider for the given address.
         //
         hr = ND_INVALID_ADDRESS;
-        for (List<Address>::iterator pAddr = pList->begin();
-            pAddr != pList->end();
-            ++pAddr)
+        ULONG pos = 0;
+        for (const Address* pAddr = pIndex->Find(pAddress, &pos);
+            pAddr != nullptr;
+            pAddr = pIndex->Find(pAddress, &pos))
         {
-            if (!pAddr->Matches(pAddress))
-            {
-                continue;
-            }
-
             ASSERT(pAddr->GetProvider() != nullptr);
             hr = pAddr->GetProvider()->OpenAdapter(
                 iid,
@@ -454,7 +607,53 @@ namespace NetworkDirect
         Framework::FlushProvidersForUser()
     {
         Lock lock(&m_lock);
-        FlushProviders();
+        FlushAdapterCaches();
+        FlushProviders(true);
+    }
+
+
+    void
+        Framework::QueryUpdateStatistics(
+            _Out_ ND_UPDATE_STATISTICS* pStats
+        )
+    {
+        ProcessUpdates();
+
+        Lock lock(&m_lock);
+        *pStats = m_Stats;
+        pStats->ObjectAllocations =
+            m_ProviderPool.AllocCount() + m_AddressPool.AllocCount();
+        pStats->HeapAllocations =
+            m_ProviderPool.SlabCount() + m_AddressPool.SlabCount() + m_nHeapAllocs;
+    }
+
+
+    void
+        Framework::QueryRouteCacheStatistics(
+            _Out_ ND_ROUTE_CACHE_STATISTICS* pStats
+        )
+    {
+        ProcessUpdates();
+        m_RouteCache.QueryStatistics(pStats);
+    }
+
+
+    void
+        Framework::QueryAdapterCacheStatistics(
+            _Out_ ND_ADAPTER_CACHE_STATISTICS* pStats
+        )
+    {
+        ProcessUpdates();
+
+        Lock lock(&m_lock);
+        *pStats = m_AdapterCacheStats;
+        for (List<Provider>::iterator pProv = m_ProviderList.begin();
+            pProv != m_ProviderList.end();
+            ++pProv)
+        {
+            pStats->Hits += pProv->AdapterCacheHits();
+            pStats->Misses += pProv->AdapterCacheMisses();
+        }
     }
 
 
@@ -534,7 +733,7 @@ namespace NetworkDirect
         for (int i = 0; i < addrList.iAddressCount; i++)
         {
             // We only handle IPv4 and IPv6 addresses.
-            if (addrList.Address[i].iSockaddrLength < sizeof(struct sockaddr))
+            if (addrList.Address[i].iSockaddrLength < static_cast<INT>(sizeof(struct sockaddr)))
             {
                 continue;
             }
@@ -543,7 +742,7 @@ namespace NetworkDirect
             {
             case AF_INET:
                 if (addrList.Address[i].iSockaddrLength <
-                    sizeof(struct sockaddr_in))
+                    static_cast<INT>(sizeof(struct sockaddr_in)))
                 {
                     continue;
                 }
@@ -551,7 +750,7 @@ namespace NetworkDirect
 
             case AF_INET6:
                 if (addrList.Address[i].iSockaddrLength <
-                    sizeof(struct sockaddr_in6))
+                    static_cast<INT>(sizeof(struct sockaddr_in6)))
                 {
                     continue;
                 }
@@ -561,16 +760,32 @@ namespace NetworkDirect
                 continue;
             }
 
-            Address* pAddr =
-                new Address(*addrList.Address[i].lpSockaddr, prov);
-            if (pAddr != nullptr)
+            void* pMem = m_AddressPool.Alloc();
+            if (pMem != nullptr)
             {
-                pList->push_back(pAddr);
+                pList->push_back(
+                    new (pMem) Address(*addrList.Address[i].lpSockaddr, prov));
             }
         }
     }
 
 
+    void
+        Framework::BuildIndex(
+            _In_ const List<Address>& list,
+            _Inout_ AddressIndex* pIndex
+        )
+    {
+        //
+        // If the index can't be allocated, lookups fall back to scanning the
+        // list, so there is nothing to undo.
+        //
+        ULONG64 nAllocs = pIndex->AllocCount();
+        pIndex->Build(list);
+        m_nHeapAllocs += pIndex->AllocCount() - nAllocs;
+    }
+
+
     void
         Framework::CopyAddressList(
             _In_ const List<Address>& list,
@@ -609,106 +824,193 @@ namespace NetworkDirect
     void
         Framework::ProcessUpdates()
     {
-        BOOL ret;
+        //
+        // When the watcher thread is running it applies changes as they are
+        // reported, so there is nothing to do here.
+        //
+        if (m_hWatcher != nullptr)
+        {
+            return;
+        }
 
-        // Check the IOCP for completion of any of our requests.
-        do
+        // Check for any pending notifications.  m_lock is only taken when a
+        // notification is pending, so callers on the lookup paths don't
+        // serialize with each other.
+        ND_NOTIFY_TYPE type;
+        while (m_pNotify->GetNotification(0, &type) == ND_SUCCESS)
         {
-            DWORD len;
-            ULONG_PTR key;
-            OVERLAPPED* pOv;
-            INT status;
-            DWORD bytesRet;
+            Lock lock(&m_lock);
+            ProcessNotification(type);
+        }
+    }
 
-            ret = ::GetQueuedCompletionStatus(m_hIocp, &len, &key, &pOv, 0);
 
-            if (ret == TRUE)
-            {
-                Lock lock(&m_lock);
+    //
+    // Must be called with m_lock held.
+    //
+    void
+        Framework::ProcessNotification(
+            _In_ ND_NOTIFY_TYPE type
+        )
+    {
+        switch (type)
+        {
+        case ND_NOTIFY_PROVIDER_CHANGE:
+            ProcessProviderChange();
+            break;
 
-                switch (key)
-                {
-                case ND_NOTIFY_PROVIDER_CHANGE:
-                    // Issue the next request for protocol catalog changes,
-                    // in case things change while we are processing this event.
-                    status = ::WSAProviderConfigChange(
-                        &m_hProviderChange, &m_Ov[ND_NOTIFY_PROVIDER_CHANGE], nullptr);
-                    ASSERT(status == 0 || ::WSAGetLastError() == WSA_IO_PENDING);
-
-                    ProcessProviderChange();
-                    break;
+        case ND_NOTIFY_ADDR_CHANGE:
+            ProcessAddressChange();
+            break;
+
+        default:
+            ASSERT(type == ND_NOTIFY_PROVIDER_CHANGE ||
+                type == ND_NOTIFY_ADDR_CHANGE);
+            break;
+        }
 
-                case ND_NOTIFY_ADDR_CHANGE:
-                    // Issue the next request for address changes, in case
-                    // things change while we are processing this event.
-                    status = ::WSAIoctl(m_Socket, SIO_ADDRESS_LIST_CHANGE, nullptr, 0, nullptr,
-                        0, &bytesRet, &m_Ov[ND_NOTIFY_ADDR_CHANGE], nullptr);
-                    ASSERT(status == 0);
+        FlushProviders(false);
+    }
 
-                    ProcessAddressChange();
-                    break;
 
-                default:
-                    ASSERT(key == ND_NOTIFY_PROVIDER_CHANGE ||
-                        key == ND_NOTIFY_ADDR_CHANGE);
-                    break;
-                }
+    DWORD WINAPI
+        Framework::WatcherThread(
+            _In_ void* pContext
+        )
+    {
+        Framework* pFramework = static_cast<Framework*>(pContext);
+
+        ND_NOTIFY_TYPE type;
+        for (;;)
+        {
+            HRESULT hr = pFramework->m_pNotify->GetNotification(INFINITE, &type);
+            if (hr == ND_CANCELED)
+            {
+                break;
+            }
 
-                FlushProviders();
+            if (hr != ND_SUCCESS)
+            {
+                continue;
             }
-            // TODO: Should we re-issue requests if they have failed?
-            // What if (can?) they immediately fail again to the IOCP?
-            // We'd end up stuck in this loop.
 
-        } while (ret == TRUE ||
-            (::GetLastError() != WAIT_TIMEOUT /*&&
-            ::GetLastError() != ERROR_ABANDONED_WAIT*/));
+            Lock lock(&pFramework->m_lock);
+            pFramework->ProcessNotification(type);
+        }
+        return 0;
     }
 
 
-    void
-        Framework::ProcessProviderChange()
+    //
+    // Enumerates the provider catalog into m_pProtocols.  The buffer is kept
+    // between updates, so the catalog is usually enumerated in a single call.
+    //
+    HRESULT
+        Framework::EnumProtocols(
+            _Out_ DWORD* pnProtocols
+        )
     {
-        // Enumerate the provider catalog, and rebuild our list of providers.
-        DWORD len = 0;
+        DWORD len = m_cbProtocols;
         INT err;
-        INT ret = ::WSCEnumProtocols(nullptr, nullptr, &len, &err);
-        ASSERT(ret == SOCKET_ERROR);
-        ASSERT(err == WSAENOBUFS);
-        if (ret != SOCKET_ERROR || err != WSAENOBUFS)
+        INT ret = ::WSCEnumProtocols(nullptr, m_pProtocols, &len, &err);
+        if (ret == SOCKET_ERROR)
         {
-            return;
+            if (err != WSAENOBUFS)
+            {
+                return HRESULT_FROM_WIN32(err);
+            }
+
+            // We try only once - if the required buffer size changes then our
+            // request for provider changes will get completed and we'll come back
+            ASSERT((len % sizeof(WSAPROTOCOL_INFOW)) == 0);
+            if (m_pProtocols != nullptr)
+            {
+                ::HeapFree(ghHeap, 0, m_pProtocols);
+                m_cbProtocols = 0;
+            }
+
+            m_pProtocols = static_cast<WSAPROTOCOL_INFOW*>(::HeapAlloc(
+                ghHeap,
+                0,
+                len
+            ));
+            if (m_pProtocols == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
+            m_cbProtocols = len;
+            m_nHeapAllocs++;
+
+            ret = ::WSCEnumProtocols(nullptr, m_pProtocols, &len, &err);
+            if (ret == SOCKET_ERROR)
+            {
+                return HRESULT_FROM_WIN32(err);
+            }
         }
 
-        // We try only once - if the required buffer size changes then our
-        // request for provider changes will get completed and we'll come back
-        ASSERT((len % sizeof(WSAPROTOCOL_INFOW)) == 0);
-        WSAPROTOCOL_INFOW* pProtocols = static_cast<WSAPROTOCOL_INFOW*>(::HeapAlloc(
-            ghHeap,
-            0,
-            len
-        ));
-        if (pProtocols == nullptr)
+        *pnProtocols = static_cast<DWORD>(ret);
+        return S_OK;
+    }
+
+
+    //
+    // Queries the provider's address list into m_pAddrList, growing the
+    // buffer if needed.
+    //
+    HRESULT
+        Framework::QueryProviderAddresses(
+            _In_ Provider& prov
+        )
+    {
+        ULONG len = m_cbAddrList;
+        HRESULT hr = prov.QueryAddressList(m_pAddrList, &len);
+        if (hr != ND_BUFFER_OVERFLOW)
         {
-            return;
+            return hr;
         }
 
-        ret = ::WSCEnumProtocols(nullptr, pProtocols, &len, &err);
-        if (ret == SOCKET_ERROR)
+        // If the allocated buffer is not large enough, our request for
+        // address change notifcation will pick up the change.
+        if (m_pAddrList != nullptr)
+        {
+            ::HeapFree(ghHeap, 0, m_pAddrList);
+            m_cbAddrList = 0;
+        }
+
+        m_pAddrList =
+            static_cast<SOCKET_ADDRESS_LIST*>(::HeapAlloc(ghHeap, 0, len));
+        if (m_pAddrList == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+        m_cbAddrList = len;
+        m_nHeapAllocs++;
+
+        return prov.QueryAddressList(m_pAddrList, &len);
+    }
+
+
+    void
+        Framework::ProcessProviderChange()
+    {
+        // Enumerate the provider catalog, and rebuild our list of providers.
+        DWORD nProtocols;
+        HRESULT hr = EnumProtocols(&nProtocols);
+        if (FAILED(hr))
         {
-            ::HeapFree(ghHeap, 0, pProtocols);
             return;
         }
+        WSAPROTOCOL_INFOW* pProtocols = m_pProtocols;
 
         // Mark all existing providers inactive.
         for (List<Provider>::iterator pProv = m_ProviderList.begin();
             pProv != m_ProviderList.end();
             ++pProv)
         {
-            pProv->MarkInactive();
+            pProv->BeginUpdate();
         }
 
-        for (DWORD i = 0; i < len / sizeof(WSAPROTOCOL_INFOW); i++)
+        for (DWORD i = 0; i < nProtocols; i++)
         {
             if ((pProtocols[i].dwServiceFlags1 & ND_SERVICE_FLAGS1) !=
                 ND_SERVICE_FLAGS1)
@@ -780,31 +1082,45 @@ namespace NetworkDirect
             }
 
             // New provider, add it to the list.
+            void* pMem = m_ProviderPool.Alloc();
+            if (pMem == nullptr)
+            {
+                continue;
+            }
+
             Provider* pProvider;
             if (pProtocols[i].iVersion == ND_VERSION_1)
             {
-                pProvider = new NdV1Provider();
+                pProvider = new (pMem) NdV1Provider();
             }
             else
             {
-                pProvider = new NdProvider();
-            }
-
-            if (pProvider == nullptr)
-            {
-                continue;
+                pProvider = new (pMem) NdProvider();
             }
 
-            HRESULT hr = pProvider->Init(pProtocols[i].ProviderId);
+            hr = pProvider->Init(pProtocols[i].ProviderId);
             if (FAILED(hr))
             {
-                delete pProvider;
+                DestroyProvider(pProvider);
                 continue;
             }
 
             m_ProviderList.push_back(pProvider);
         }
-        ::HeapFree(ghHeap, 0, pProtocols);
+
+        for (List<Provider>::iterator pProv = m_ProviderList.begin();
+            pProv != m_ProviderList.end();
+            ++pProv)
+        {
+            if (pProv->IsActive() && !pProv->WasActive())
+            {
+                m_Stats.ProvidersAdded++;
+            }
+            else if (!pProv->IsActive() && pProv->WasActive())
+            {
+                m_Stats.ProvidersRemoved++;
+            }
+        }
 
         // We now have an up-to-date provider list.  Populate the address table.
         ProcessAddressChange();
@@ -814,24 +1130,36 @@ namespace NetworkDirect
     void
         Framework::ProcessAddressChange()
     {
-        // Remove all existing addresses.
-        while (!m_NdAddrList.empty())
+        m_Stats.Updates++;
+
+        //
+        // Build a new table from scratch, reusing the spare table if there is
+        // one.  If we can't allocate one, publish an empty table rather than
+        // keep the old one, as it may reference providers that are no longer
+        // active.
+        //
+        AddressTable* pTable = m_pSpareTable;
+        m_pSpareTable = nullptr;
+        if (pTable == nullptr)
         {
-            Address* pAddr = &m_NdAddrList.front();
-            m_NdAddrList.pop_front();
-            delete pAddr;
+            pTable = new AddressTable(&m_AddressPool);
+            if (pTable == nullptr)
+            {
+                PublishAddressTable(nullptr);
+                m_RouteCache.Flush();
+                FlushAdapterCaches();
+                return;
+            }
+            m_nHeapAllocs++;
         }
 
-        while (!m_NdV1AddrList.empty())
+        if (m_pLoopbackProvider != nullptr &&
+            SUCCEEDED(QueryProviderAddresses(*m_pLoopbackProvider)))
         {
-            Address* pAddr = &m_NdV1AddrList.front();
-            m_NdV1AddrList.pop_front();
-            delete pAddr;
+            BuildAddressList(*m_pLoopbackProvider, *m_pAddrList,
+                &pTable->m_NdAddrList);
         }
 
-        SOCKET_ADDRESS_LIST* pAddrList = nullptr;
-        ULONG len = 0;
-
         for (List<Provider>::iterator pProv = m_ProviderList.begin();
             pProv != m_ProviderList.end();
             ++pProv)
@@ -841,52 +1169,158 @@ namespace NetworkDirect
                 continue;
             }
 
-            HRESULT hr = pProv->QueryAddressList(pAddrList, &len);
-            if (hr == ND_BUFFER_OVERFLOW)
-            {
-                if (pAddrList != nullptr)
-                {
-                    ::HeapFree(ghHeap, 0, pAddrList);
-                }
-
-                // If the allocated buffer is not large enough, our request for
-                // address change notifcation will pick up the change.
-                pAddrList =
-                    static_cast<SOCKET_ADDRESS_LIST*>(::HeapAlloc(ghHeap, 0, len));
-                if (pAddrList == nullptr)
-                {
-                    continue;
-                }
-
-                hr = pProv->QueryAddressList(pAddrList, &len);
-            }
-
+            HRESULT hr = QueryProviderAddresses(*pProv);
             if (FAILED(hr))
             {
                 continue;
             }
 
-            __analysis_assume(pAddrList);
+            __analysis_assume(m_pAddrList);
 
             if (pProv->GetVersion() == ND_VERSION_1)
             {
-                BuildAddressList(*pProv, *pAddrList, &m_NdV1AddrList);
+                BuildAddressList(*pProv, *m_pAddrList, &pTable->m_NdV1AddrList);
             }
             else
             {
-                BuildAddressList(*pProv, *pAddrList, &m_NdAddrList);
+                BuildAddressList(*pProv, *m_pAddrList, &pTable->m_NdAddrList);
+            }
+        }
+
+        BuildIndex(pTable->m_NdAddrList, &pTable->m_NdAddrIndex);
+        BuildIndex(pTable->m_NdV1AddrList, &pTable->m_NdV1AddrIndex);
+
+        //
+        // Diff the new table against the current one.  Address changes that
+        // don't affect ND providers are common, and keeping the current table
+        // spares readers the switch and us the grace period.
+        //
+        AddressTable* pOldTable = m_pAddrTable;
+        ULONG nAdded =
+            CountMissing(pTable->m_NdAddrList,
+                pOldTable != nullptr ? &pOldTable->m_NdAddrIndex : nullptr) +
+            CountMissing(pTable->m_NdV1AddrList,
+                pOldTable != nullptr ? &pOldTable->m_NdV1AddrIndex : nullptr);
+        ULONG nRemoved = 0;
+        if (pOldTable != nullptr)
+        {
+            nRemoved =
+                CountMissing(pOldTable->m_NdAddrList, &pTable->m_NdAddrIndex) +
+                CountMissing(pOldTable->m_NdV1AddrList, &pTable->m_NdV1AddrIndex);
+        }
+
+        m_Stats.LastAddressesAdded = nAdded;
+        m_Stats.LastAddressesRemoved = nRemoved;
+        m_Stats.AddressesAdded += nAdded;
+        m_Stats.AddressesRemoved += nRemoved;
+
+        if (pOldTable != nullptr && nAdded == 0 && nRemoved == 0)
+        {
+            m_Stats.UnchangedUpdates++;
+            RecycleAddressTable(pTable);
+
+            //
+            // The ND addresses are the same, but the best route to a peer may
+            // not be: another interface's address or a route changed.
+            //
+            m_RouteCache.Flush();
+            return;
+        }
+
+        PublishAddressTable(pTable);
+
+        //
+        // Any address change can move the best route, including new ND
+        // addresses that become the better source, so cached routes always
+        // go.  Cached adapters can only refer to addresses that went away or
+        // moved to another provider, which both show up as removed.  Flush
+        // after publishing, so that lookups can't repopulate the caches from
+        // the old table.
+        //
+        m_RouteCache.Flush();
+        if (nRemoved != 0)
+        {
+            FlushAdapterCaches();
+        }
+    }
+
+
+    //
+    // Returns the number of entries in list that have no entry with the same
+    // address and provider in pIndex.
+    //
+    ULONG
+        Framework::CountMissing(
+            _In_ const List<Address>& list,
+            _In_opt_ const AddressIndex* pIndex
+        )
+    {
+        ULONG nMissing = 0;
+        for (List<Address>::iterator pAddr = list.begin();
+            pAddr != list.end();
+            ++pAddr)
+        {
+            if (pIndex == nullptr || !pIndex->Contains(*pAddr))
+            {
+                nMissing++;
             }
         }
+        return nMissing;
+    }
+
 
-        if (pAddrList != nullptr)
+    //
+    // Swaps in a new address table and frees the old one once no reader can
+    // still be using it.  Must be called with m_lock held.
+    //
+    void
+        Framework::PublishAddressTable(
+            _In_opt_ AddressTable* pTable
+        )
+    {
+        AddressTable* pOldTable = static_cast<AddressTable*>(
+            ::InterlockedExchangePointer(
+                reinterpret_cast<void* volatile*>(&m_pAddrTable), pTable)
+            );
+        if (pOldTable == nullptr)
         {
-            ::HeapFree(ghHeap, 0, pAddrList);
+            return;
         }
+
+        m_Rcu.Synchronize();
+        RecycleAddressTable(pOldTable);
     }
 
 
+    //
+    // Keeps a table that no reader can see for the next update to rebuild.
+    // Must be called with m_lock held.
+    //
     void
-        Framework::FlushProviders()
+        Framework::RecycleAddressTable(
+            _In_ AddressTable* pTable
+        )
+    {
+        if (m_pSpareTable != nullptr)
+        {
+            delete pTable;
+            return;
+        }
+
+        pTable->Reset();
+        m_pSpareTable = pTable;
+    }
+
+
+    //
+    // Unloads provider DLLs that are not in use, and removes inactive providers
+    // once unloaded.  Active providers keep their DLL and provider object
+    // loaded between calls unless unloadActive is set.
+    //
+    void
+        Framework::FlushProviders(
+            _In_ bool unloadActive
+        )
     {
         List<Provider>::iterator iter = m_ProviderList.begin();
         while (iter != m_ProviderList.end())
@@ -897,65 +1331,120 @@ namespace NetworkDirect
             //
             ++iter;
 
+            if (pProv->IsActive() == false)
+            {
+                pProv->FlushAdapterCache();
+            }
+            else if (unloadActive == false)
+            {
+                continue;
+            }
+
             if (pProv->TryUnload() == true && pProv->IsActive() == false)
             {
                 m_ProviderList.remove(*pProv);
-                delete pProv;
+                DestroyProvider(pProv);
             }
         }
     }
 
-} // namespace NetworkDirect
 
+    void
+        Framework::FlushAdapterCaches()
+    {
+        for (List<Provider>::iterator pProv = m_ProviderList.begin();
+            pProv != m_ProviderList.end();
+            ++pProv)
+        {
+            pProv->FlushAdapterCache();
+        }
+    }
 
-//
-// Initialization
-//
-using namespace NetworkDirect;
 
-EXTERN_C HRESULT ND_HELPER_API
-NdStartup(
-    VOID
-)
-{
-    LONG init;
-    do
+    //
+    // Destroys a catalog provider and returns it to the pool.
+    //
+    void
+        Framework::DestroyProvider(
+            _In_ Provider* pProv
+        )
     {
-        init = ::InterlockedCompareExchange(&gInitializing, 1, 0);
-    } while (init == 1);
+        m_AdapterCacheStats.Hits += pProv->AdapterCacheHits();
+        m_AdapterCacheStats.Misses += pProv->AdapterCacheMisses();
 
-    if (gpFramework == nullptr)
+        pProv->~Provider();
+        m_ProviderPool.Free(pProv);
+    }
+
+
+    HRESULT
+        Startup(
+            _In_opt_ NotificationSource* pNotify
+        )
     {
-        ghHeap = ::HeapCreate(0, 0, 0);
-        if (ghHeap == nullptr)
+        LONG init;
+        do
         {
-            ::InterlockedDecrement(&gInitializing);
-            return HRESULT_FROM_WIN32(::GetLastError());
-        }
+            init = ::InterlockedCompareExchange(&gInitializing, 1, 0);
+        } while (init == 1);
 
-        gpFramework = new NetworkDirect::Framework();
         if (gpFramework == nullptr)
         {
-            ::HeapDestroy(ghHeap);
-            ghHeap = nullptr;
-            ::InterlockedDecrement(&gInitializing);
-            return ND_NO_MEMORY;
+            ghHeap = ::HeapCreate(0, 0, 0);
+            if (ghHeap == nullptr)
+            {
+                delete pNotify;
+                ::InterlockedDecrement(&gInitializing);
+                return HRESULT_FROM_WIN32(::GetLastError());
+            }
+
+            gpFramework = new NetworkDirect::Framework();
+            if (gpFramework == nullptr)
+            {
+                delete pNotify;
+                ::HeapDestroy(ghHeap);
+                ghHeap = nullptr;
+                ::InterlockedDecrement(&gInitializing);
+                return ND_NO_MEMORY;
+            }
+            HRESULT hr = gpFramework->Init(pNotify);
+            if (FAILED(hr))
+            {
+                delete(gpFramework);
+                gpFramework = nullptr;
+                ::HeapDestroy(ghHeap);
+                ghHeap = nullptr;
+                ::InterlockedDecrement(&gInitializing);
+                return hr;
+            }
         }
-        HRESULT hr = gpFramework->Init();
-        if (FAILED(hr))
+        else if (pNotify != nullptr)
         {
-            delete(gpFramework);
-            gpFramework = nullptr;
-            ::HeapDestroy(ghHeap);
-            ghHeap = nullptr;
+            // The running framework keeps its own source.
+            delete pNotify;
             ::InterlockedDecrement(&gInitializing);
-            return hr;
+            return ND_INVALID_DEVICE_STATE;
         }
+
+        gpFramework->AddRef();
+        ::InterlockedDecrement(&gInitializing);
+        return S_OK;
     }
 
-    gpFramework->AddRef();
-    ::InterlockedDecrement(&gInitializing);
-    return S_OK;
+} // namespace NetworkDirect
+
+
+//
+// Initialization
+//
+using namespace NetworkDirect;
+
+EXTERN_C HRESULT ND_HELPER_API
+NdStartup(
+    VOID
+)
+{
+    return Startup(nullptr);
 }
 
 
@@ -1043,6 +1532,28 @@ NdResolveAddress(
 }
 
 
+EXTERN_C HRESULT ND_HELPER_API
+NdResolveAddresses(
+    _In_ SIZE_T nAddresses,
+    _In_reads_(nAddresses) const SOCKADDR_INET* pRemoteAddresses,
+    _Out_writes_(nAddresses) SOCKADDR_INET* pLocalAddresses,
+    _Out_writes_(nAddresses) HRESULT* pResults
+)
+{
+    if (gpFramework == nullptr)
+    {
+        return ND_DEVICE_NOT_READY;
+    }
+
+    return gpFramework->ResolveAddresses(
+        nAddresses,
+        pRemoteAddresses,
+        pLocalAddresses,
+        pResults
+    );
+}
+
+
 EXTERN_C HRESULT ND_HELPER_API
 NdCheckAddress(
     _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
@@ -1089,3 +1600,48 @@ NdOpenV1Adapter(
         reinterpret_cast<VOID**>(ppIAdapter)
     );
 }
+
+
+EXTERN_C HRESULT ND_HELPER_API
+NdQueryUpdateStatistics(
+    _Out_ ND_UPDATE_STATISTICS* pStats
+)
+{
+    if (gpFramework == nullptr)
+    {
+        return ND_DEVICE_NOT_READY;
+    }
+
+    gpFramework->QueryUpdateStatistics(pStats);
+    return ND_SUCCESS;
+}
+
+
+EXTERN_C HRESULT ND_HELPER_API
+NdQueryRouteCacheStatistics(
+    _Out_ ND_ROUTE_CACHE_STATISTICS* pStats
+)
+{
+    if (gpFramework == nullptr)
+    {
+        return ND_DEVICE_NOT_READY;
+    }
+
+    gpFramework->QueryRouteCacheStatistics(pStats);
+    return ND_SUCCESS;
+}
+
+
+EXTERN_C HRESULT ND_HELPER_API
+NdQueryAdapterCacheStatistics(
+    _Out_ ND_ADAPTER_CACHE_STATISTICS* pStats
+)
+{
+    if (gpFramework == nullptr)
+    {
+        return ND_DEVICE_NOT_READY;
+    }
+
+    gpFramework->QueryAdapterCacheStatistics(pStats);
+    return ND_SUCCESS;
+}
@@ -9,29 +9,88 @@
 namespace NetworkDirect
 {
 
-    enum ND_NOTIFY_TYPE
+    //
+    // Immutable view of the NDv2 and NDv1 address lists.  A table is never
+    // modified once published; changes build a new table and swap it in.
+    // Addresses are allocated from the framework's address pool.
+    //
+    class AddressTable
     {
-        ND_NOTIFY_PROVIDER_CHANGE,
-        ND_NOTIFY_ADDR_CHANGE,
-        ND_NOTIFY_MAX
+        FixedPool* m_pPool;
+
+    public:
+        List<Address> m_NdAddrList;
+        List<Address> m_NdV1AddrList;
+
+        // Hash indexes over the lists above, for lookups by address.
+        AddressIndex m_NdAddrIndex;
+        AddressIndex m_NdV1AddrIndex;
+
+        explicit AddressTable(_In_ FixedPool* pPool);
+        ~AddressTable(void);
+
+        //
+        // Returns the addresses to the pool so the table can be rebuilt.  The
+        // indexes keep their slot arrays, and must be rebuilt before use.
+        //
+        void Reset(void);
+
+        bool Contains(_In_ const struct sockaddr* pAddress) const;
     };
 
 
     class Framework
     {
-        // IOCP for provider and address changes.
-        HANDLE m_hIocp;
-        HANDLE m_hProviderChange;
-        // Socket for address list change and address resolution.
-        SOCKET m_Socket;
-        OVERLAPPED m_Ov[ND_NOTIFY_MAX];
-
-        // Lock protecting the provider and address lists.
+        // Source of provider and address changes.
+        NotificationSource* m_pNotify;
+        // Background thread applying changes, if enabled at startup.  When
+        // not running, changes are polled for on each API call.
+        HANDLE m_hWatcher;
+
+        // Lock serializing changes to the provider list and address table.
         CRITICAL_SECTION m_lock;
 
+        // Pools for catalog providers and addresses, protected by m_lock.
+        // They must outlive every provider and address table.
+        FixedPool m_ProviderPool;
+        FixedPool m_AddressPool;
+
         List<Provider> m_ProviderList;
-        List<Address> m_NdAddrList;
-        List<Address> m_NdV1AddrList;
+        // Loopback provider, present when enabled at startup.  It is not part
+        // of the catalog, so it is kept out of m_ProviderList.
+        Provider* m_pLoopbackProvider;
+
+        // Current address table.  Readers access it without taking m_lock,
+        // inside an RCU read-side section.  May be nullptr if building the
+        // table failed.
+        AddressTable* volatile m_pAddrTable;
+        Rcu m_Rcu;
+
+        // Results of route lookups for ResolveAddress, flushed by each
+        // address change.
+        RouteCache m_RouteCache;
+
+        // Table recycled by the next update: either the last table built
+        // without change, or the previous table once its grace period ended.
+        AddressTable* m_pSpareTable;
+
+        // Buffers for enumerating the provider catalog and querying provider
+        // address lists, kept between updates.
+        WSAPROTOCOL_INFOW* m_pProtocols;
+        DWORD m_cbProtocols;
+        SOCKET_ADDRESS_LIST* m_pAddrList;
+        ULONG m_cbAddrList;
+
+        // Heap allocations made for address tables, index slots and the
+        // buffers above, protected by m_lock.  Pool slabs are counted by the
+        // pools.
+        ULONG64 m_nHeapAllocs;
+
+        // Update counters, protected by m_lock.
+        ND_UPDATE_STATISTICS m_Stats;
+        // Adapter cache counters of providers already destroyed, protected
+        // by m_lock.
+        ND_ADAPTER_CACHE_STATISTICS m_AdapterCacheStats;
 
         volatile LONG m_nRef;
 
@@ -40,7 +99,17 @@ namespace NetworkDirect
         Framework(void);
         ~Framework(void);
 
-        HRESULT Init(void);
+        //
+        // Takes ownership of pNotify if provided; otherwise notifications
+        // come from Winsock.
+        //
+        HRESULT Init(_In_opt_ NotificationSource* pNotify = nullptr);
+
+        //
+        // The background watcher is opt-in: set ND_BACKGROUND_WATCHER=1 in
+        // the environment before calling NdStartup.
+        //
+        static bool IsWatcherEnabled(void);
 
         ULONG AddRef(void);
         ULONG Release(void);
@@ -58,6 +127,13 @@ namespace NetworkDirect
             _Inout_ SIZE_T* pcbLocalAddress
         );
 
+        HRESULT ResolveAddresses(
+            _In_ SIZE_T nAddresses,
+            _In_reads_(nAddresses) const SOCKADDR_INET* pRemoteAddresses,
+            _Out_writes_(nAddresses) SOCKADDR_INET* pLocalAddresses,
+            _Out_writes_(nAddresses) HRESULT* pResults
+        );
+
         HRESULT CheckAddress(
             _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
             _In_ SIZE_T cbAddress
@@ -72,25 +148,41 @@ namespace NetworkDirect
 
         void FlushProvidersForUser();
 
+        void QueryUpdateStatistics(_Out_ ND_UPDATE_STATISTICS* pStats);
+
+        void QueryRouteCacheStatistics(_Out_ ND_ROUTE_CACHE_STATISTICS* pStats);
+
+        void QueryAdapterCacheStatistics(_Out_ ND_ADAPTER_CACHE_STATISTICS* pStats);
+
     private:
         static HRESULT ValidateAddress(
             _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
             _In_ SIZE_T cbAddress
         );
 
+        HRESULT QueryRoute(
+            _In_ const struct sockaddr* pRemoteAddress,
+            _Out_ SOCKADDR_INET* pLocalAddress
+        );
+
         static void CountAddresses(
             _In_ const List<Address>& list,
             _Inout_ SIZE_T* pnV4,
             _Inout_ SIZE_T* pnV6
         );
 
-        static void
+        void
             BuildAddressList(
                 _In_ Provider& prov,
                 _In_ const SOCKET_ADDRESS_LIST& addrList,
                 _Inout_ List<Address>* pList
             );
 
+        void BuildIndex(
+            _In_ const List<Address>& list,
+            _Inout_ AddressIndex* pIndex
+        );
+
         static void CopyAddressList(
             _In_ const List<Address>& list,
             _Inout_ SOCKET_ADDRESS_LIST* pAddressList,
@@ -99,10 +191,33 @@ namespace NetworkDirect
         );
 
         void ProcessUpdates(void);
+        void ProcessNotification(_In_ ND_NOTIFY_TYPE type);
+        static DWORD WINAPI WatcherThread(_In_ void* pContext);
 
         void ProcessProviderChange(void);
         void ProcessAddressChange(void);
-        void FlushProviders(void);
+        void PublishAddressTable(_In_opt_ AddressTable* pTable);
+        void RecycleAddressTable(_In_ AddressTable* pTable);
+        HRESULT EnumProtocols(_Out_ DWORD* pnProtocols);
+        HRESULT QueryProviderAddresses(_In_ Provider& prov);
+
+        static ULONG CountMissing(
+            _In_ const List<Address>& list,
+            _In_opt_ const AddressIndex* pIndex
+        );
+        void FlushProviders(_In_ bool unloadActive);
+        void FlushAdapterCaches(void);
+        void DestroyProvider(_In_ Provider* pProv);
     };
 
+
+    //
+    // NdStartup, with the framework's changes coming from pNotify instead of
+    // the platform's notification source when pNotify is not nullptr.  The
+    // framework takes ownership of pNotify.  Fails with
+    // ND_INVALID_DEVICE_STATE if pNotify is given while the framework is
+    // already started, as the running framework keeps its source.
+    //
+    HRESULT Startup(_In_opt_ NotificationSource* pNotify);
+
 } // namespace NetworkDirect
@@ -0,0 +1,1110 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Loopback provider, adapter, completion queue and memory objects.
+//
+
+#include "precomp.h"
+#include "ndaddr.h"
+#include "ndprov.h"
+#include "ndloopback.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+
+namespace NetworkDirect
+{
+
+    NdLoopbackProvider::NdLoopbackProvider() :
+        Provider(ND_VERSION_2),
+        m_pFabric(nullptr)
+    {
+        InitializeCriticalSection(&m_lock);
+    }
+
+
+    NdLoopbackProvider::~NdLoopbackProvider()
+    {
+        if (m_pFabric != nullptr)
+        {
+            m_pFabric->Release();
+        }
+
+        DeleteCriticalSection(&m_lock);
+    }
+
+
+    //
+    // The framework does not serialize calls into the provider, so the fabric
+    // is created lazily under m_lock.  Only one fabric may exist per process,
+    // as its sections are named after the process ID.
+    //
+    HRESULT
+        NdLoopbackProvider::GetFabric(
+            _Out_ LbFabric** ppFabric
+        )
+    {
+        *ppFabric = m_pFabric;
+        if (*ppFabric != nullptr)
+        {
+            return ND_SUCCESS;
+        }
+
+        Lock lock(&m_lock);
+        if (m_pFabric == nullptr)
+        {
+            LbFabric* pFabric = new LbFabric();
+            if (pFabric == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
+
+            HRESULT hr = pFabric->Init();
+            if (FAILED(hr))
+            {
+                pFabric->Release();
+                return hr;
+            }
+            m_pFabric = pFabric;
+        }
+
+        *ppFabric = m_pFabric;
+        return ND_SUCCESS;
+    }
+
+
+    bool
+        NdLoopbackProvider::IsEnabled()
+    {
+        WCHAR value[8];
+        DWORD len = ::GetEnvironmentVariableW(L"ND_LOOPBACK_PROVIDER", value, _countof(value));
+        return len > 0 && len < _countof(value) && value[0] == L'1';
+    }
+
+
+    HRESULT
+        NdLoopbackProvider::OpenAdapter(
+            _In_ REFIID iid,
+            _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
+            _In_ ULONG cbAddress,
+            _Deref_out_ VOID** ppIAdapter
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2Adapter))
+        {
+            return E_NOINTERFACE;
+        }
+
+        if (cbAddress < sizeof(struct sockaddr) || !LbAdapter::IsLoopback(pAddress))
+        {
+            return ND_INVALID_ADDRESS;
+        }
+
+        LbFabric* pFabric;
+        HRESULT hr = GetFabric(&pFabric);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        LbAdapter* pAdapter = new LbAdapter(pFabric);
+        if (pAdapter == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        hr = pAdapter->Init(pAddress);
+        if (FAILED(hr))
+        {
+            pAdapter->Release();
+            return hr;
+        }
+
+        *ppIAdapter = static_cast<IND2Adapter*>(pAdapter);
+        return ND_SUCCESS;
+    }
+
+
+    ULONG
+        NdLoopbackProvider::AddressCount()
+    {
+        WCHAR value[16];
+        DWORD len = ::GetEnvironmentVariableW(L"ND_LOOPBACK_ADDRESSES", value, _countof(value));
+        if (len == 0 || len >= _countof(value))
+        {
+            return 1;
+        }
+
+        ULONG count = wcstoul(value, nullptr, 10);
+        if (count == 0)
+        {
+            return 1;
+        }
+        return min(count, x_LbMaxAddresses);
+    }
+
+
+    //
+    // Reports ::1 and one or more IPv4 loopback addresses, starting at
+    // 127.0.0.1.
+    //
+    HRESULT
+        NdLoopbackProvider::QueryAddressList(
+            _Out_opt_bytecap_post_bytecount_(*pcbAddressList, *pcbAddressList) SOCKET_ADDRESS_LIST* pAddressList,
+            _Inout_ ULONG* pcbAddressList
+        )
+    {
+        ULONG nV4 = AddressCount();
+        ULONG cbRequired = FIELD_OFFSET(SOCKET_ADDRESS_LIST, Address) +
+            static_cast<ULONG>(sizeof(SOCKET_ADDRESS) * (nV4 + 1)) +
+            static_cast<ULONG>(sizeof(struct sockaddr_in) * nV4) +
+            static_cast<ULONG>(sizeof(struct sockaddr_in6));
+
+        if (pAddressList == nullptr || *pcbAddressList < cbRequired)
+        {
+            *pcbAddressList = cbRequired;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        struct sockaddr_in* pV4 = reinterpret_cast<struct sockaddr_in*>(
+            &pAddressList->Address[nV4 + 1]);
+        for (ULONG i = 0; i < nV4; i++)
+        {
+            ::ZeroMemory(&pV4[i], sizeof(pV4[i]));
+            pV4[i].sin_family = AF_INET;
+            pV4[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+
+            pAddressList->Address[i].lpSockaddr = reinterpret_cast<LPSOCKADDR>(&pV4[i]);
+            pAddressList->Address[i].iSockaddrLength = sizeof(pV4[i]);
+        }
+
+        struct sockaddr_in6* pV6 = reinterpret_cast<struct sockaddr_in6*>(&pV4[nV4]);
+        ::ZeroMemory(pV6, sizeof(*pV6));
+        pV6->sin6_family = AF_INET6;
+        pV6->sin6_addr.s6_addr[15] = 1;
+
+        pAddressList->Address[nV4].lpSockaddr = reinterpret_cast<LPSOCKADDR>(pV6);
+        pAddressList->Address[nV4].iSockaddrLength = sizeof(*pV6);
+
+        pAddressList->iAddressCount = nV4 + 1;
+        *pcbAddressList = cbRequired;
+        return ND_SUCCESS;
+    }
+
+
+    LbAdapter::LbAdapter(
+        _In_ LbFabric* pFabric
+    ) :
+        m_pFabric(pFabric),
+        m_Id(0)
+    {
+        m_pFabric->AddRef();
+        ::ZeroMemory(&m_Address, sizeof(m_Address));
+        InitializeCriticalSection(&m_lock);
+    }
+
+
+    LbAdapter::~LbAdapter()
+    {
+        while (!m_Files.empty())
+        {
+            LbOverlappedFile* pFile = &m_Files.front();
+            m_Files.pop_front();
+            delete pFile;
+        }
+
+        DeleteCriticalSection(&m_lock);
+        m_pFabric->Release();
+    }
+
+
+    HRESULT
+        LbAdapter::Init(
+            _In_ const struct sockaddr* pAddress
+        )
+    {
+        if (pAddress->sa_family == AF_INET)
+        {
+            m_Address.Ipv4 = *reinterpret_cast<const struct sockaddr_in*>(pAddress);
+        }
+        else
+        {
+            m_Address.Ipv6 = *reinterpret_cast<const struct sockaddr_in6*>(pAddress);
+        }
+        m_Address.Ipv4.sin_port = 0;
+        m_Id = m_pFabric->NextId();
+        return ND_SUCCESS;
+    }
+
+
+    bool
+        LbAdapter::IsLoopback(
+            _In_ const struct sockaddr* pAddress
+        )
+    {
+        switch (pAddress->sa_family)
+        {
+        case AF_INET:
+            return (ntohl(reinterpret_cast<const struct sockaddr_in*>(
+                pAddress)->sin_addr.s_addr) >> 24) == 127;
+
+        case AF_INET6:
+            return IN6_IS_ADDR_LOOPBACK(
+                &reinterpret_cast<const struct sockaddr_in6*>(pAddress)->sin6_addr) == TRUE;
+
+        default:
+            return false;
+        }
+    }
+
+
+    ULONG
+        LbAdapter::SockaddrSize(
+            _In_ const SOCKADDR_INET& addr
+        )
+    {
+        return addr.si_family == AF_INET6 ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    }
+
+
+    LbOverlappedFile*
+        LbAdapter::LookupFile(
+            HANDLE hOverlappedFile
+        )
+    {
+        Lock lock(&m_lock);
+        for (List<LbOverlappedFile>::iterator pFile = m_Files.begin();
+            pFile != m_Files.end();
+            ++pFile)
+        {
+            if (pFile->GetHandle() == hOverlappedFile)
+            {
+                return &*pFile;
+            }
+        }
+        return nullptr;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2Adapter, IID_IND2Adapter);
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateOverlappedFile(
+            HANDLE* phOverlappedFile
+        )
+    {
+        LbOverlappedFile* pFile = new LbOverlappedFile();
+        if (pFile == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        HRESULT hr = pFile->Init(m_pFabric->NextId());
+        if (FAILED(hr))
+        {
+            delete pFile;
+            return hr;
+        }
+
+        Lock lock(&m_lock);
+        m_Files.push_back(pFile);
+        *phOverlappedFile = pFile->GetHandle();
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::Query(
+            ND2_ADAPTER_INFO* pInfo,
+            ULONG* pcbInfo
+        )
+    {
+        if (pInfo == nullptr || *pcbInfo < sizeof(*pInfo))
+        {
+            *pcbInfo = sizeof(*pInfo);
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        if (pInfo->InfoVersion != ND_VERSION_2)
+        {
+            return ND_INVALID_PARAMETER;
+        }
+
+        pInfo->VendorId = 0;
+        pInfo->DeviceId = 0;
+        pInfo->AdapterId = m_Id;
+        pInfo->MaxRegistrationSize = ~static_cast<SIZE_T>(0) >> 1;
+        pInfo->MaxWindowSize = ~static_cast<SIZE_T>(0) >> 1;
+        pInfo->MaxInitiatorSge = x_LbMaxSge;
+        pInfo->MaxReceiveSge = x_LbMaxSge;
+        pInfo->MaxReadSge = x_LbMaxSge;
+        pInfo->MaxTransferLength = x_LbMaxTransferLength;
+        pInfo->MaxInlineDataSize = x_LbMaxInlineData;
+        pInfo->MaxInboundReadLimit = x_LbMaxReadLimit;
+        pInfo->MaxOutboundReadLimit = x_LbMaxReadLimit;
+        pInfo->MaxReceiveQueueDepth = x_LbMaxQueueDepth;
+        pInfo->MaxInitiatorQueueDepth = x_LbMaxQueueDepth;
+        pInfo->MaxSharedReceiveQueueDepth = 0;
+        pInfo->MaxCompletionQueueDepth = x_LbMaxCqDepth;
+        pInfo->InlineRequestThreshold = x_LbMaxInlineData;
+        pInfo->LargeRequestThreshold = x_LbLargeRequestThreshold;
+        pInfo->MaxCallerData = x_LbMaxCallerData;
+        pInfo->MaxCalleeData = x_LbMaxCalleeData;
+        pInfo->AdapterFlags = ND_ADAPTER_FLAG_IN_ORDER_DMA_SUPPORTED |
+            ND_ADAPTER_FLAG_LOOPBACK_CONNECTIONS_SUPPORTED;
+
+        *pcbInfo = sizeof(*pInfo);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::QueryAddressList(
+            SOCKET_ADDRESS_LIST* pAddressList,
+            ULONG* pcbAddressList
+        )
+    {
+        ULONG cbAddress = SockaddrSize(m_Address);
+        ULONG cbRequired = FIELD_OFFSET(SOCKET_ADDRESS_LIST, Address[1]) + cbAddress;
+
+        if (pAddressList == nullptr || *pcbAddressList < cbRequired)
+        {
+            *pcbAddressList = cbRequired;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        BYTE* pBuf = reinterpret_cast<BYTE*>(&pAddressList->Address[1]);
+        ::CopyMemory(pBuf, &m_Address, cbAddress);
+        pAddressList->iAddressCount = 1;
+        pAddressList->Address[0].lpSockaddr = reinterpret_cast<LPSOCKADDR>(pBuf);
+        pAddressList->Address[0].iSockaddrLength = cbAddress;
+
+        *pcbAddressList = cbRequired;
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateCompletionQueue(
+            REFIID iid,
+            HANDLE hOverlappedFile,
+            ULONG queueDepth,
+            USHORT /*group*/,
+            KAFFINITY /*affinity*/,
+            VOID** ppCompletionQueue
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2CompletionQueue))
+        {
+            return E_NOINTERFACE;
+        }
+
+        if (queueDepth == 0 || queueDepth > x_LbMaxCqDepth)
+        {
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        LbOverlappedFile* pFile = LookupFile(hOverlappedFile);
+        if (pFile == nullptr)
+        {
+            return ND_INVALID_HANDLE;
+        }
+
+        LbCompletionQueue* pCq = new LbCompletionQueue(this, pFile);
+        if (pCq == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        HRESULT hr = pCq->Init(queueDepth);
+        if (FAILED(hr))
+        {
+            pCq->Release();
+            return hr;
+        }
+
+        *ppCompletionQueue = static_cast<IND2CompletionQueue*>(pCq);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateMemoryRegion(
+            REFIID iid,
+            HANDLE hOverlappedFile,
+            VOID** ppMemoryRegion
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2MemoryRegion))
+        {
+            return E_NOINTERFACE;
+        }
+
+        LbOverlappedFile* pFile = LookupFile(hOverlappedFile);
+        if (pFile == nullptr)
+        {
+            return ND_INVALID_HANDLE;
+        }
+
+        LbMemoryRegion* pMr = new LbMemoryRegion(this, pFile);
+        if (pMr == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        HRESULT hr = pMr->Init();
+        if (FAILED(hr))
+        {
+            pMr->Release();
+            return hr;
+        }
+
+        *ppMemoryRegion = static_cast<IND2MemoryRegion*>(pMr);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateMemoryWindow(
+            REFIID iid,
+            VOID** ppMemoryWindow
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2MemoryWindow))
+        {
+            return E_NOINTERFACE;
+        }
+
+        LbMemoryWindow* pMw = new LbMemoryWindow(this);
+        if (pMw == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        HRESULT hr = pMw->Init();
+        if (FAILED(hr))
+        {
+            pMw->Release();
+            return hr;
+        }
+
+        *ppMemoryWindow = static_cast<IND2MemoryWindow*>(pMw);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateSharedReceiveQueue(
+            REFIID /*iid*/,
+            HANDLE /*hOverlappedFile*/,
+            ULONG /*queueDepth*/,
+            ULONG /*maxRequestSge*/,
+            ULONG /*notifyThreshold*/,
+            USHORT /*group*/,
+            KAFFINITY /*affinity*/,
+            VOID** /*ppSharedReceiveQueue*/
+        )
+    {
+        return ND_NOT_SUPPORTED;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateQueuePair(
+            REFIID iid,
+            IUnknown* pReceiveCompletionQueue,
+            IUnknown* pInitiatorCompletionQueue,
+            VOID* context,
+            ULONG receiveQueueDepth,
+            ULONG initiatorQueueDepth,
+            ULONG maxReceiveRequestSge,
+            ULONG maxInitiatorRequestSge,
+            ULONG inlineDataSize,
+            VOID** ppQueuePair
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2QueuePair))
+        {
+            return E_NOINTERFACE;
+        }
+
+        IND2CompletionQueue* pReceiveCq;
+        HRESULT hr = pReceiveCompletionQueue->QueryInterface(
+            IID_IND2CompletionQueue, reinterpret_cast<void**>(&pReceiveCq));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_2;
+        }
+
+        IND2CompletionQueue* pInitiatorCq;
+        hr = pInitiatorCompletionQueue->QueryInterface(
+            IID_IND2CompletionQueue, reinterpret_cast<void**>(&pInitiatorCq));
+        if (FAILED(hr))
+        {
+            pReceiveCq->Release();
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        LbQueuePair* pQp = new LbQueuePair(
+            this,
+            static_cast<LbCompletionQueue*>(pReceiveCq),
+            static_cast<LbCompletionQueue*>(pInitiatorCq)
+        );
+        pReceiveCq->Release();
+        pInitiatorCq->Release();
+        if (pQp == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        hr = pQp->Init(
+            context,
+            receiveQueueDepth,
+            initiatorQueueDepth,
+            maxReceiveRequestSge,
+            maxInitiatorRequestSge,
+            inlineDataSize
+        );
+        if (FAILED(hr))
+        {
+            pQp->Release();
+            return hr;
+        }
+
+        *ppQueuePair = static_cast<IND2QueuePair*>(pQp);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateQueuePairWithSrq(
+            REFIID /*iid*/,
+            IUnknown* /*pReceiveCompletionQueue*/,
+            IUnknown* /*pInitiatorCompletionQueue*/,
+            IUnknown* /*pSharedReceiveQueue*/,
+            VOID* /*context*/,
+            ULONG /*initiatorQueueDepth*/,
+            ULONG /*maxInitiatorRequestSge*/,
+            ULONG /*inlineDataSize*/,
+            VOID** /*ppQueuePair*/
+        )
+    {
+        return ND_NOT_SUPPORTED;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateConnector(
+            REFIID iid,
+            HANDLE hOverlappedFile,
+            VOID** ppConnector
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2Connector))
+        {
+            return E_NOINTERFACE;
+        }
+
+        LbOverlappedFile* pFile = LookupFile(hOverlappedFile);
+        if (pFile == nullptr)
+        {
+            return ND_INVALID_HANDLE;
+        }
+
+        LbConnector* pConnector = new LbConnector(this, pFile);
+        if (pConnector == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        *ppConnector = static_cast<IND2Connector*>(pConnector);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbAdapter::CreateListener(
+            REFIID iid,
+            HANDLE hOverlappedFile,
+            VOID** ppListener
+        )
+    {
+        if (!InlineIsEqualGUID(iid, IID_IND2Listener))
+        {
+            return E_NOINTERFACE;
+        }
+
+        LbOverlappedFile* pFile = LookupFile(hOverlappedFile);
+        if (pFile == nullptr)
+        {
+            return ND_INVALID_HANDLE;
+        }
+
+        LbListener* pListener = new LbListener(this, pFile);
+        if (pListener == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        *ppListener = static_cast<IND2Listener*>(pListener);
+        return ND_SUCCESS;
+    }
+
+
+    LbCompletionQueue::LbCompletionQueue(
+        _In_ LbAdapter* pAdapter,
+        _In_ LbOverlappedFile* pFile
+    ) :
+        m_pAdapter(pAdapter),
+        m_pFile(pFile),
+        m_Id(0),
+        m_pShm(nullptr)
+    {
+        m_pAdapter->AddRef();
+    }
+
+
+    LbCompletionQueue::~LbCompletionQueue()
+    {
+        m_pAdapter->GetFabric()->CancelRequests(this);
+        m_Section.Close();
+        m_pAdapter->Release();
+    }
+
+
+    HRESULT
+        LbCompletionQueue::Init(
+            ULONG queueDepth
+        )
+    {
+        LbFabric* pFabric = m_pAdapter->GetFabric();
+        m_Id = pFabric->NextId();
+
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Cq", pFabric->GetPid(), m_Id);
+        HRESULT hr = m_Section.Create(name, LbCqShm::Size(queueDepth));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_pShm = static_cast<LbCqShm*>(m_Section.View());
+        m_pShm->Pid = pFabric->GetPid();
+        m_pShm->Depth = queueDepth;
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbCompletionQueue::Push(
+            _In_ LbFabric* pFabric,
+            _Inout_ LbCqShm* pCq,
+            HRESULT status,
+            ULONG bytesTransferred,
+            UINT64 queuePairContext,
+            UINT64 requestContext,
+            ND2_REQUEST_TYPE type,
+            bool solicited
+        )
+    {
+        {
+            LbSpinLock lock(&pCq->Lock);
+            if (pCq->Tail - pCq->Head >= pCq->Depth)
+            {
+                pCq->Overrun = TRUE;
+            }
+            else
+            {
+                LbResultShm* pResult = &pCq->Ring()[pCq->Tail % pCq->Depth];
+                pResult->Status = status;
+                pResult->BytesTransferred = bytesTransferred;
+                pResult->QueuePairContext = queuePairContext;
+                pResult->RequestContext = requestContext;
+                pResult->RequestType = type;
+                MemoryBarrier();
+                pCq->Tail++;
+            }
+        }
+
+        LONG armed = pCq->Armed;
+        if (armed == 0)
+        {
+            return;
+        }
+
+        if (FAILED(status) ||
+            armed == ND_CQ_NOTIFY_ANY + 1 ||
+            (armed == ND_CQ_NOTIFY_SOLICITED + 1 && solicited))
+        {
+            if (::InterlockedCompareExchange(&pCq->Armed, 0, armed) == armed)
+            {
+                pFabric->Wake(pCq->Pid);
+            }
+        }
+    }
+
+
+    bool
+        LbCompletionQueue::CheckRequest(
+            _In_ LbRequest* pRequest,
+            _Out_ HRESULT* pStatus
+        )
+    {
+        *pStatus = ND_SUCCESS;
+
+        //
+        // A producer disarms the queue when it adds a matching entry.
+        //
+        if (m_pShm->Armed == 0)
+        {
+            return true;
+        }
+
+        if (pRequest->m_Param != ND_CQ_NOTIFY_ERRORS &&
+            m_pShm->Head != m_pShm->Tail)
+        {
+            ::InterlockedExchange(&m_pShm->Armed, 0);
+            return true;
+        }
+
+        return false;
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2CompletionQueue, IID_IND2Overlapped);
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::CancelOverlappedRequests()
+    {
+        ::InterlockedExchange(&m_pShm->Armed, 0);
+        m_pAdapter->GetFabric()->CancelRequests(this);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::GetOverlappedResult(
+            OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        return m_pFile->GetResult(pOverlapped, wait);
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::GetNotifyAffinity(
+            USHORT* /*pGroup*/,
+            KAFFINITY* /*pAffinity*/
+        )
+    {
+        return ND_NOT_SUPPORTED;
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::Resize(
+            ULONG /*queueDepth*/
+        )
+    {
+        return ND_NOT_SUPPORTED;
+    }
+
+
+    STDMETHODIMP
+        LbCompletionQueue::Notify(
+            ULONG type,
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (type > ND_CQ_NOTIFY_SOLICITED)
+        {
+            return ND_INVALID_PARAMETER_1;
+        }
+
+        ::InterlockedExchange(&m_pShm->Armed, static_cast<LONG>(type + 1));
+        return m_pAdapter->GetFabric()->QueueRequest(
+            this, m_pFile, pOverlapped, LbRequestNotify, type, nullptr);
+    }
+
+
+    STDMETHODIMP_(ULONG)
+        LbCompletionQueue::GetResults(
+            ND2_RESULT results[],
+            ULONG nResults
+        )
+    {
+        //
+        // Polling an empty queue does not need the lock.
+        //
+        if (m_pShm->Head == m_pShm->Tail)
+        {
+            return 0;
+        }
+
+        LbSpinLock lock(&m_pShm->Lock);
+        ULONG nAvailable = m_pShm->Tail - m_pShm->Head;
+        if (nResults > nAvailable)
+        {
+            nResults = nAvailable;
+        }
+
+        for (ULONG i = 0; i < nResults; i++)
+        {
+            const LbResultShm& result = m_pShm->Ring()[(m_pShm->Head + i) % m_pShm->Depth];
+            results[i].Status = result.Status;
+            results[i].BytesTransferred = result.BytesTransferred;
+            results[i].QueuePairContext = reinterpret_cast<VOID*>(
+                static_cast<ULONG_PTR>(result.QueuePairContext));
+            results[i].RequestContext = reinterpret_cast<VOID*>(
+                static_cast<ULONG_PTR>(result.RequestContext));
+            results[i].RequestType = static_cast<ND2_REQUEST_TYPE>(result.RequestType);
+        }
+        m_pShm->Head += nResults;
+        return nResults;
+    }
+
+
+    LbMemoryRegion::LbMemoryRegion(
+        _In_ LbAdapter* pAdapter,
+        _In_ LbOverlappedFile* pFile
+    ) :
+        m_pAdapter(pAdapter),
+        m_pFile(pFile),
+        m_Index(0),
+        m_pEntry(nullptr)
+    {
+        m_pAdapter->AddRef();
+    }
+
+
+    LbMemoryRegion::~LbMemoryRegion()
+    {
+        if (m_pEntry != nullptr)
+        {
+            m_pAdapter->GetFabric()->FreeMr(m_Index);
+        }
+        m_pAdapter->Release();
+    }
+
+
+    HRESULT
+        LbMemoryRegion::Init()
+    {
+        HRESULT hr = m_pAdapter->GetFabric()->AllocMr(&m_Index);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_pEntry = m_pAdapter->GetFabric()->GetMr(m_Index);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbMemoryRegion::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2MemoryRegion, IID_IND2Overlapped);
+    }
+
+
+    STDMETHODIMP
+        LbMemoryRegion::CancelOverlappedRequests()
+    {
+        //
+        // Registration requests complete before they are returned.
+        //
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbMemoryRegion::GetOverlappedResult(
+            OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        return m_pFile->GetResult(pOverlapped, wait);
+    }
+
+
+    STDMETHODIMP
+        LbMemoryRegion::Register(
+            const VOID* pBuffer,
+            SIZE_T cbBuffer,
+            ULONG flags,
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (pBuffer == nullptr)
+        {
+            return ND_INVALID_PARAMETER;
+        }
+
+        if (cbBuffer == 0)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+        flags &= ~ND_MR_FLAG_DO_NOT_SECURE_VM;
+        if ((flags & ~(ND_MR_FLAG_ALLOW_REMOTE_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ |
+            ND_MR_FLAG_RDMA_READ_SINK)) != 0)
+        {
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        if (m_pEntry->Flags != 0)
+        {
+            return ND_INVALID_DEVICE_STATE;
+        }
+
+        //
+        // Walk the range the way a driver would probe and lock it, so that
+        // bad buffers fail at registration rather than at transfer time.
+        //
+        const BYTE* pCur = static_cast<const BYTE*>(pBuffer);
+        const BYTE* pEnd = pCur + cbBuffer;
+        if (pEnd < pCur)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+#ifdef _WIN32
+        while (pCur < pEnd)
+        {
+            MEMORY_BASIC_INFORMATION info;
+            if (::VirtualQuery(pCur, &info, sizeof(info)) == 0 ||
+                info.State != MEM_COMMIT ||
+                (info.Protect & (PAGE_NOACCESS | PAGE_GUARD)) != 0)
+            {
+                return m_pFile->CompleteNow(pOverlapped, ND_ACCESS_VIOLATION);
+            }
+            pCur = static_cast<const BYTE*>(info.BaseAddress) + info.RegionSize;
+        }
+#else
+        //
+        // msync fails with ENOMEM if any page in the range is unmapped.  It
+        // does not catch PROT_NONE guard pages, which VirtualQuery does.
+        //
+        ULONG_PTR pageMask = static_cast<ULONG_PTR>(::sysconf(_SC_PAGESIZE)) - 1;
+        ULONG_PTR base = reinterpret_cast<ULONG_PTR>(pCur) & ~pageMask;
+        if (::msync(reinterpret_cast<void*>(base),
+            reinterpret_cast<ULONG_PTR>(pEnd) - base, MS_ASYNC) != 0)
+        {
+            return m_pFile->CompleteNow(pOverlapped, ND_ACCESS_VIOLATION);
+        }
+#endif
+
+        m_pEntry->Base = reinterpret_cast<ULONG_PTR>(pBuffer);
+        m_pEntry->Length = cbBuffer;
+        ::InterlockedIncrement(&m_pEntry->Key);
+        ::InterlockedExchange(
+            reinterpret_cast<volatile LONG*>(&m_pEntry->Flags),
+            static_cast<LONG>(flags | x_LbMrValid));
+
+        return m_pFile->CompleteNow(pOverlapped, ND_SUCCESS);
+    }
+
+
+    STDMETHODIMP
+        LbMemoryRegion::Deregister(
+            OVERLAPPED* pOverlapped
+        )
+    {
+        ::InterlockedIncrement(&m_pEntry->Key);
+        ::InterlockedExchange(reinterpret_cast<volatile LONG*>(&m_pEntry->Flags), 0);
+        return m_pFile->CompleteNow(pOverlapped, ND_SUCCESS);
+    }
+
+
+    STDMETHODIMP_(UINT32)
+        LbMemoryRegion::GetLocalToken()
+    {
+        return LbFabric::MakeToken(m_Index, m_pEntry->Key);
+    }
+
+
+    STDMETHODIMP_(UINT32)
+        LbMemoryRegion::GetRemoteToken()
+    {
+        return LbFabric::MakeToken(m_Index, m_pEntry->Key);
+    }
+
+
+    LbMemoryWindow::LbMemoryWindow(
+        _In_ LbAdapter* pAdapter
+    ) :
+        m_pAdapter(pAdapter),
+        m_Index(0),
+        m_pEntry(nullptr)
+    {
+        m_pAdapter->AddRef();
+    }
+
+
+    LbMemoryWindow::~LbMemoryWindow()
+    {
+        if (m_pEntry != nullptr)
+        {
+            m_pAdapter->GetFabric()->FreeMr(m_Index);
+        }
+        m_pAdapter->Release();
+    }
+
+
+    HRESULT
+        LbMemoryWindow::Init()
+    {
+        HRESULT hr = m_pAdapter->GetFabric()->AllocMr(&m_Index);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_pEntry = m_pAdapter->GetFabric()->GetMr(m_Index);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbMemoryWindow::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2MemoryWindow, IID_IND2MemoryWindow);
+    }
+
+
+    STDMETHODIMP_(UINT32)
+        LbMemoryWindow::GetRemoteToken()
+    {
+        return LbFabric::MakeToken(m_Index, m_pEntry->Key);
+    }
+
+} // namespace NetworkDirect
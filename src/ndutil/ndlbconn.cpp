@@ -0,0 +1,959 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Loopback connection management.
+//
+// The active side creates a connection section holding both peers'
+// parameters and queues a reference to it on the listener's section.  The
+// passive side picks it up in GetConnectionRequest, and both sides then move
+// the section through Requested -> Accepted -> Established, waking the peer
+// process after each transition.
+//
+
+#include "precomp.h"
+#include "ndaddr.h"
+#include "ndprov.h"
+#include "ndloopback.h"
+
+
+namespace NetworkDirect
+{
+
+    static USHORT
+        EphemeralPort(
+            _In_ LbFabric* pFabric
+        )
+    {
+        ULONG seed = (pFabric->GetPid() * 31) + pFabric->NextId();
+        return htons(static_cast<USHORT>(49152 + (seed % 16384)));
+    }
+
+
+    static HRESULT
+        CopyAddress(
+            _In_ const SOCKADDR_INET& addr,
+            _Out_writes_bytes_opt_(*pcbAddress) struct sockaddr* pAddress,
+            _Inout_ ULONG* pcbAddress
+        )
+    {
+        ULONG cbAddress = LbAdapter::SockaddrSize(addr);
+        if (pAddress == nullptr || *pcbAddress < cbAddress)
+        {
+            *pcbAddress = cbAddress;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        ::CopyMemory(pAddress, &addr, cbAddress);
+        *pcbAddress = cbAddress;
+        return ND_SUCCESS;
+    }
+
+
+    static HRESULT
+        ParseAddress(
+            _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
+            ULONG cbAddress,
+            _Out_ SOCKADDR_INET* pAddr
+        )
+    {
+        if (pAddress == nullptr || cbAddress < sizeof(struct sockaddr))
+        {
+            return ND_INVALID_ADDRESS;
+        }
+
+        ::ZeroMemory(pAddr, sizeof(*pAddr));
+        switch (pAddress->sa_family)
+        {
+        case AF_INET:
+            if (cbAddress < sizeof(struct sockaddr_in))
+            {
+                return ND_INVALID_ADDRESS;
+            }
+            pAddr->Ipv4 = *reinterpret_cast<const struct sockaddr_in*>(pAddress);
+            break;
+
+        case AF_INET6:
+            if (cbAddress < sizeof(struct sockaddr_in6))
+            {
+                return ND_INVALID_ADDRESS;
+            }
+            pAddr->Ipv6 = *reinterpret_cast<const struct sockaddr_in6*>(pAddress);
+            break;
+
+        default:
+            return ND_INVALID_ADDRESS;
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    LbConnector::LbConnector(
+        _In_ LbAdapter* pAdapter,
+        _In_ LbOverlappedFile* pFile
+    ) :
+        m_pAdapter(pAdapter),
+        m_pFabric(pAdapter->GetFabric()),
+        m_pFile(pFile),
+        m_bBound(false),
+        m_Side(LbConnActive),
+        m_pConn(nullptr),
+        m_pQp(nullptr)
+    {
+        ::ZeroMemory(&m_LocalAddress, sizeof(m_LocalAddress));
+        m_pAdapter->AddRef();
+    }
+
+
+    LbConnector::~LbConnector()
+    {
+        m_pFabric->CancelRequests(this);
+
+        if (m_pConn != nullptr)
+        {
+            LONG state = m_pConn->State;
+            if (state == LbConnRequested || state == LbConnAccepted || state == LbConnEstablished)
+            {
+                Teardown();
+            }
+        }
+
+        if (m_pQp != nullptr)
+        {
+            m_pQp->Release();
+        }
+        m_ListenerSection.Close();
+        m_ConnSection.Close();
+        m_pAdapter->Release();
+    }
+
+
+    void
+        LbConnector::FillSelf(
+            _In_ LbQueuePair* pQp,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            _In_reads_bytes_opt_(cbPrivateData) const VOID* pPrivateData,
+            ULONG cbPrivateData
+        )
+    {
+        LbPeerShm& self = Self();
+        self.Pid = m_pFabric->GetPid();
+        self.QpId = pQp->GetId();
+        self.InboundReadLimit = min(inboundReadLimit, x_LbMaxReadLimit);
+        self.OutboundReadLimit = min(outboundReadLimit, x_LbMaxReadLimit);
+        self.cbPrivateData = cbPrivateData;
+        if (cbPrivateData != 0)
+        {
+            ::CopyMemory(self.PrivateData, pPrivateData, cbPrivateData);
+        }
+    }
+
+
+    void
+        LbConnector::Teardown()
+    {
+        ::InterlockedExchange(&m_pConn->State, LbConnDisconnected);
+        if (m_pQp != nullptr)
+        {
+            m_pQp->Break();
+        }
+        m_pFabric->Wake(Peer().Pid);
+    }
+
+
+    HRESULT
+        LbConnector::AttachIncoming(
+            DWORD pid,
+            ULONG connId
+        )
+    {
+        if (m_pConn != nullptr)
+        {
+            return ND_CONNECTION_ACTIVE;
+        }
+
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Conn", pid, connId);
+        HRESULT hr = m_ConnSection.Open(name);
+        if (FAILED(hr))
+        {
+            return ND_CONNECTION_ABORTED;
+        }
+
+        m_pConn = static_cast<LbConnShm*>(m_ConnSection.View());
+        m_Side = LbConnPassive;
+
+        //
+        // Claim the request so the active side stops watching the listener.
+        //
+        LbSpinLock lock(&m_pConn->Lock);
+        m_pConn->Peer[LbConnPassive].Pid = m_pFabric->GetPid();
+        m_LocalAddress = m_pConn->Peer[LbConnPassive].Address;
+        m_bBound = true;
+        return ND_SUCCESS;
+    }
+
+
+    bool
+        LbConnector::CheckRequest(
+            _In_ LbRequest* pRequest,
+            _Out_ HRESULT* pStatus
+        )
+    {
+        LONG state = m_pConn->State;
+        *pStatus = ND_SUCCESS;
+
+        switch (pRequest->m_Type)
+        {
+        case LbRequestConnect:
+            if (state == LbConnAccepted)
+            {
+                return true;
+            }
+            if (state != LbConnRequested)
+            {
+                *pStatus = ND_CONNECTION_REFUSED;
+                return true;
+            }
+
+            //
+            // Until the passive side claims the request, the listener going
+            // away refuses the connection; afterwards the passive process
+            // going away does.
+            //
+            {
+                const LbListenerShm* pListener =
+                    static_cast<const LbListenerShm*>(m_ListenerSection.View());
+                DWORD passivePid = m_pConn->Peer[LbConnPassive].Pid;
+                if ((passivePid == 0 &&
+                    (pListener->Listening == FALSE || !m_pFabric->IsAlive(pListener->Pid))) ||
+                    (passivePid != 0 && !m_pFabric->IsAlive(passivePid)))
+                {
+                    ::InterlockedExchange(&m_pConn->State, LbConnRejected);
+                    *pStatus = ND_CONNECTION_REFUSED;
+                    return true;
+                }
+            }
+            return false;
+
+        case LbRequestAccept:
+            switch (state)
+            {
+            case LbConnEstablished:
+                return true;
+
+            case LbConnRejected:
+                *pStatus = ND_CONNECTION_REFUSED;
+                return true;
+
+            case LbConnAccepted:
+                if (!m_pFabric->IsAlive(Peer().Pid))
+                {
+                    *pStatus = ND_CONNECTION_REFUSED;
+                    return true;
+                }
+                return false;
+
+            default:
+                *pStatus = ND_CONNECTION_ABORTED;
+                return true;
+            }
+
+        case LbRequestNotifyDisconnect:
+            return state == LbConnDisconnected ||
+                (m_pQp != nullptr && m_pQp->IsInError()) ||
+                !m_pFabric->IsAlive(Peer().Pid);
+
+        default:
+            ASSERT(pRequest->m_Type == LbRequestConnect);
+            return false;
+        }
+    }
+
+
+    STDMETHODIMP
+        LbConnector::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2Connector, IID_IND2Overlapped);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::CancelOverlappedRequests()
+    {
+        m_pFabric->CancelRequests(this);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbConnector::GetOverlappedResult(
+            OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        return m_pFile->GetResult(pOverlapped, wait);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::Bind(
+            const struct sockaddr* pAddress,
+            ULONG cbAddress
+        )
+    {
+        SOCKADDR_INET addr;
+        HRESULT hr = ParseAddress(pAddress, cbAddress, &addr);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        if (!LbAdapter::IsLoopback(pAddress))
+        {
+            return ND_INVALID_ADDRESS;
+        }
+
+        if (m_bBound)
+        {
+            return x_LbStatusAddressAlreadyAssociated;
+        }
+
+        if (addr.Ipv4.sin_port == 0)
+        {
+            addr.Ipv4.sin_port = EphemeralPort(m_pFabric);
+        }
+
+        m_LocalAddress = addr;
+        m_bBound = true;
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbConnector::Connect(
+            IUnknown* pQueuePair,
+            const struct sockaddr* pDestAddress,
+            ULONG cbDestAddress,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            const VOID* pPrivateData,
+            ULONG cbPrivateData,
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (cbPrivateData > x_LbMaxCallerData)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+        if (pPrivateData == nullptr && cbPrivateData != 0)
+        {
+            return ND_INVALID_PARAMETER_6;
+        }
+
+        if (m_pConn != nullptr)
+        {
+            return ND_CONNECTION_ACTIVE;
+        }
+
+        SOCKADDR_INET dest;
+        HRESULT hr = ParseAddress(pDestAddress, cbDestAddress, &dest);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        if (!LbAdapter::IsLoopback(pDestAddress))
+        {
+            return x_LbStatusBadNetworkName;
+        }
+
+        IND2QueuePair* pQp;
+        hr = pQueuePair->QueryInterface(IID_IND2QueuePair, reinterpret_cast<void**>(&pQp));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_1;
+        }
+
+        LbQueuePair* pLbQp = static_cast<LbQueuePair*>(pQp);
+        if (pLbQp->IsConnected())
+        {
+            pQp->Release();
+            return ND_CONNECTION_ACTIVE;
+        }
+
+        if (!m_bBound)
+        {
+            m_LocalAddress = m_pAdapter->GetAddress();
+            m_LocalAddress.Ipv4.sin_port = EphemeralPort(m_pFabric);
+            m_bBound = true;
+        }
+
+        //
+        // Publish the connection request.
+        //
+        ULONG connId = m_pFabric->NextId();
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Conn", m_pFabric->GetPid(), connId);
+        hr = m_ConnSection.Create(name, sizeof(LbConnShm));
+        if (FAILED(hr))
+        {
+            pQp->Release();
+            return hr;
+        }
+
+        m_pConn = static_cast<LbConnShm*>(m_ConnSection.View());
+        m_Side = LbConnActive;
+        m_pQp = pLbQp;
+        m_pConn->State = LbConnRequested;
+        FillSelf(pLbQp, inboundReadLimit, outboundReadLimit, pPrivateData, cbPrivateData);
+        m_pConn->Peer[LbConnActive].Address = m_LocalAddress;
+        m_pConn->Peer[LbConnPassive].Address = dest;
+
+        WCHAR listenerName[x_LbMaxName];
+        LbListener::FormatName(listenerName, _countof(listenerName), dest.Ipv4.sin_port);
+        hr = m_ListenerSection.Open(listenerName);
+        if (FAILED(hr))
+        {
+            m_pConn->State = LbConnRejected;
+            return m_pFile->CompleteNow(pOverlapped, ND_CONNECTION_REFUSED);
+        }
+
+        LbListenerShm* pListener = static_cast<LbListenerShm*>(m_ListenerSection.View());
+        {
+            LbSpinLock lock(&pListener->Lock);
+            if (pListener->Listening == FALSE ||
+                pListener->Tail - pListener->Head >= pListener->Backlog)
+            {
+                hr = ND_CONNECTION_REFUSED;
+            }
+            else
+            {
+                LbConnRef* pRef = &pListener->Requests[pListener->Tail % x_LbMaxBacklog];
+                pRef->Pid = m_pFabric->GetPid();
+                pRef->ConnId = connId;
+                pListener->Tail++;
+            }
+        }
+
+        if (FAILED(hr))
+        {
+            m_pConn->State = LbConnRejected;
+            return m_pFile->CompleteNow(pOverlapped, hr);
+        }
+
+        m_pFabric->Wake(pListener->Pid);
+        return m_pFabric->QueueRequest(this, m_pFile, pOverlapped, LbRequestConnect, 0, nullptr);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::CompleteConnect(
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (m_pConn == nullptr || m_Side != LbConnActive)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        if (m_pConn->State != LbConnAccepted)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        HRESULT hr = m_pQp->ConnectTo(Peer().Pid, Peer().QpId);
+        if (FAILED(hr))
+        {
+            return m_pFile->CompleteNow(pOverlapped, hr);
+        }
+
+        ::InterlockedExchange(&m_pConn->State, LbConnEstablished);
+        m_pFabric->Wake(Peer().Pid);
+        return m_pFile->CompleteNow(pOverlapped, ND_SUCCESS);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::Accept(
+            IUnknown* pQueuePair,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            const VOID* pPrivateData,
+            ULONG cbPrivateData,
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (cbPrivateData > x_LbMaxCalleeData)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+        if (pPrivateData == nullptr && cbPrivateData != 0)
+        {
+            return ND_INVALID_PARAMETER_4;
+        }
+
+        if (m_pConn == nullptr || m_Side != LbConnPassive || m_pQp != nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        IND2QueuePair* pQp;
+        HRESULT hr = pQueuePair->QueryInterface(IID_IND2QueuePair, reinterpret_cast<void**>(&pQp));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_1;
+        }
+
+        LbQueuePair* pLbQp = static_cast<LbQueuePair*>(pQp);
+        if (pLbQp->IsConnected())
+        {
+            pQp->Release();
+            return ND_CONNECTION_ACTIVE;
+        }
+
+        if (m_pConn->State != LbConnRequested)
+        {
+            pQp->Release();
+            return m_pFile->CompleteNow(pOverlapped, ND_CONNECTION_REFUSED);
+        }
+
+        //
+        // Connect the queue pair before publishing the accept so that the
+        // active side can send as soon as it sees it.
+        //
+        hr = pLbQp->ConnectTo(Peer().Pid, Peer().QpId);
+        if (FAILED(hr))
+        {
+            pQp->Release();
+            return m_pFile->CompleteNow(pOverlapped, hr);
+        }
+
+        m_pQp = pLbQp;
+        {
+            LbSpinLock lock(&m_pConn->Lock);
+            FillSelf(pLbQp, inboundReadLimit, outboundReadLimit, pPrivateData, cbPrivateData);
+        }
+
+        if (::InterlockedCompareExchange(&m_pConn->State, LbConnAccepted, LbConnRequested) !=
+            LbConnRequested)
+        {
+            return m_pFile->CompleteNow(pOverlapped, ND_CONNECTION_REFUSED);
+        }
+
+        m_pFabric->Wake(Peer().Pid);
+        return m_pFabric->QueueRequest(this, m_pFile, pOverlapped, LbRequestAccept, 0, nullptr);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::Reject(
+            const VOID* pPrivateData,
+            ULONG cbPrivateData
+        )
+    {
+        if (cbPrivateData > x_LbMaxCalleeData)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        {
+            LbSpinLock lock(&m_pConn->Lock);
+            LbPeerShm& self = Self();
+            self.Pid = m_pFabric->GetPid();
+            self.cbPrivateData = (pPrivateData == nullptr) ? 0 : cbPrivateData;
+            if (self.cbPrivateData != 0)
+            {
+                ::CopyMemory(self.PrivateData, pPrivateData, cbPrivateData);
+            }
+        }
+
+        ::InterlockedExchange(&m_pConn->State, LbConnRejected);
+        m_pFabric->Wake(Peer().Pid);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbConnector::GetReadLimits(
+            ULONG* pInboundReadLimit,
+            ULONG* pOutboundReadLimit
+        )
+    {
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        //
+        // What the peer can issue is what we must accept, and vice versa.
+        //
+        if (pInboundReadLimit != nullptr)
+        {
+            *pInboundReadLimit = Peer().OutboundReadLimit;
+        }
+        if (pOutboundReadLimit != nullptr)
+        {
+            *pOutboundReadLimit = Peer().InboundReadLimit;
+        }
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbConnector::GetPrivateData(
+            VOID* pPrivateData,
+            ULONG* pcbPrivateData
+        )
+    {
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        ULONG cbPrivateData = Peer().cbPrivateData;
+        if (cbPrivateData == 0)
+        {
+            *pcbPrivateData = 0;
+            return ND_SUCCESS;
+        }
+
+        if (pPrivateData == nullptr || *pcbPrivateData < cbPrivateData)
+        {
+            *pcbPrivateData = cbPrivateData;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        ::CopyMemory(pPrivateData, Peer().PrivateData, cbPrivateData);
+        *pcbPrivateData = cbPrivateData;
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbConnector::GetLocalAddress(
+            struct sockaddr* pAddress,
+            ULONG* pcbAddress
+        )
+    {
+        if (!m_bBound)
+        {
+            return ND_INVALID_DEVICE_STATE;
+        }
+        return CopyAddress(m_LocalAddress, pAddress, pcbAddress);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::GetPeerAddress(
+            struct sockaddr* pAddress,
+            ULONG* pcbAddress
+        )
+    {
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+        return CopyAddress(Peer().Address, pAddress, pcbAddress);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::NotifyDisconnect(
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        return m_pFabric->QueueRequest(
+            this, m_pFile, pOverlapped, LbRequestNotifyDisconnect, 0, nullptr);
+    }
+
+
+    STDMETHODIMP
+        LbConnector::Disconnect(
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (m_pConn == nullptr)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        if (m_pConn->State != LbConnDisconnected)
+        {
+            Teardown();
+        }
+        return m_pFile->CompleteNow(pOverlapped, ND_SUCCESS);
+    }
+
+
+    LbListener::LbListener(
+        _In_ LbAdapter* pAdapter,
+        _In_ LbOverlappedFile* pFile
+    ) :
+        m_pAdapter(pAdapter),
+        m_pFabric(pAdapter->GetFabric()),
+        m_pFile(pFile),
+        m_bBound(false),
+        m_pShm(nullptr)
+    {
+        ::ZeroMemory(&m_LocalAddress, sizeof(m_LocalAddress));
+        m_pAdapter->AddRef();
+    }
+
+
+    LbListener::~LbListener()
+    {
+        m_pFabric->CancelRequests(this);
+
+        if (m_pShm != nullptr)
+        {
+            //
+            // Stop listening and let queued requesters know so they refuse
+            // their pending connects.
+            //
+            LbSpinLock lock(&m_pShm->Lock);
+            m_pShm->Listening = FALSE;
+            for (ULONG i = m_pShm->Head; i != m_pShm->Tail; i++)
+            {
+                m_pFabric->Wake(m_pShm->Requests[i % x_LbMaxBacklog].Pid);
+            }
+        }
+
+        m_Section.Close();
+        m_pAdapter->Release();
+    }
+
+
+    void
+        LbListener::FormatName(
+            _Out_writes_z_(cchName) WCHAR* name,
+            SIZE_T cchName,
+            USHORT port
+        )
+    {
+#ifdef _WIN32
+        ::swprintf_s(name, cchName, L"Local\\NdLoopback.Listener.%u", ntohs(port));
+#else
+        ::swprintf(name, cchName, L"/NdLoopback.Listener.%u", ntohs(port));
+#endif
+    }
+
+
+    bool
+        LbListener::PopRequest(
+            _Out_ LbConnRef* pRef
+        )
+    {
+        LbSpinLock lock(&m_pShm->Lock);
+        if (m_pShm->Head == m_pShm->Tail)
+        {
+            return false;
+        }
+
+        *pRef = m_pShm->Requests[m_pShm->Head % x_LbMaxBacklog];
+        m_pShm->Head++;
+        return true;
+    }
+
+
+    bool
+        LbListener::CheckRequest(
+            _In_ LbRequest* pRequest,
+            _Out_ HRESULT* pStatus
+        )
+    {
+        ASSERT(pRequest->m_Type == LbRequestGetConnection);
+
+        //
+        // Requests whose active side already gave up are skipped.
+        //
+        LbConnRef ref;
+        while (PopRequest(&ref))
+        {
+            *pStatus = static_cast<LbConnector*>(pRequest->m_pContext)->AttachIncoming(
+                ref.Pid, ref.ConnId);
+            if (*pStatus != ND_CONNECTION_ABORTED)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    STDMETHODIMP
+        LbListener::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2Listener, IID_IND2Overlapped);
+    }
+
+
+    STDMETHODIMP
+        LbListener::CancelOverlappedRequests()
+    {
+        m_pFabric->CancelRequests(this);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbListener::GetOverlappedResult(
+            OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        return m_pFile->GetResult(pOverlapped, wait);
+    }
+
+
+    STDMETHODIMP
+        LbListener::Bind(
+            const struct sockaddr* pAddress,
+            ULONG cbAddress
+        )
+    {
+        SOCKADDR_INET addr;
+        HRESULT hr = ParseAddress(pAddress, cbAddress, &addr);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        if (!LbAdapter::IsLoopback(pAddress))
+        {
+            return ND_INVALID_ADDRESS;
+        }
+
+        if (m_bBound)
+        {
+            return x_LbStatusAddressAlreadyAssociated;
+        }
+
+        if (addr.Ipv4.sin_port == 0)
+        {
+            addr.Ipv4.sin_port = EphemeralPort(m_pFabric);
+        }
+
+        m_LocalAddress = addr;
+        m_bBound = true;
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbListener::Listen(
+            ULONG backlog
+        )
+    {
+        if (!m_bBound || m_pShm != nullptr)
+        {
+            return ND_INVALID_DEVICE_STATE;
+        }
+
+        WCHAR name[x_LbMaxName];
+        FormatName(name, _countof(name), m_LocalAddress.Ipv4.sin_port);
+        HRESULT hr = m_Section.Create(name, sizeof(LbListenerShm));
+        if (hr == ND_ADDRESS_ALREADY_EXISTS)
+        {
+            //
+            // A requester may still hold the section of a listener that has
+            // gone away; take it over if nobody is listening on it.
+            //
+            hr = m_Section.Open(name);
+            if (SUCCEEDED(hr))
+            {
+                LbListenerShm* pShm = static_cast<LbListenerShm*>(m_Section.View());
+                LbSpinLock lock(&pShm->Lock);
+                if (pShm->Listening != FALSE && m_pFabric->IsAlive(pShm->Pid))
+                {
+                    hr = ND_ADDRESS_ALREADY_EXISTS;
+                }
+                else
+                {
+                    pShm->Head = pShm->Tail;
+                }
+            }
+            if (FAILED(hr))
+            {
+                m_Section.Close();
+                return ND_ADDRESS_ALREADY_EXISTS;
+            }
+        }
+        else if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_pShm = static_cast<LbListenerShm*>(m_Section.View());
+        m_pShm->Pid = m_pFabric->GetPid();
+        m_pShm->Backlog = (backlog == 0 || backlog > x_LbMaxBacklog) ? x_LbMaxBacklog : backlog;
+        ::InterlockedExchange(&m_pShm->Listening, TRUE);
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbListener::GetLocalAddress(
+            struct sockaddr* pAddress,
+            ULONG* pcbAddress
+        )
+    {
+        if (!m_bBound)
+        {
+            return ND_INVALID_DEVICE_STATE;
+        }
+        return CopyAddress(m_LocalAddress, pAddress, pcbAddress);
+    }
+
+
+    STDMETHODIMP
+        LbListener::GetConnectionRequest(
+            IUnknown* pConnector,
+            OVERLAPPED* pOverlapped
+        )
+    {
+        if (m_pShm == nullptr)
+        {
+            return ND_INVALID_DEVICE_STATE;
+        }
+
+        IND2Connector* pNdConnector;
+        HRESULT hr = pConnector->QueryInterface(
+            IID_IND2Connector, reinterpret_cast<void**>(&pNdConnector));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_1;
+        }
+
+        //
+        // Like a hardware provider, the caller keeps the connector alive until
+        // the request completes.
+        //
+        LbConnector* pLbConnector = static_cast<LbConnector*>(pNdConnector);
+        pNdConnector->Release();
+
+        return m_pFabric->QueueRequest(
+            this, m_pFile, pOverlapped, LbRequestGetConnection, 0, pLbConnector);
+    }
+
+} // namespace NetworkDirect
@@ -0,0 +1,1338 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Loopback provider plumbing: named sections, overlapped completion and the
+// per-process fabric.
+//
+
+#include "precomp.h"
+#include "ndaddr.h"
+#include "ndprov.h"
+#include "ndloopback.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#endif
+
+
+namespace NetworkDirect
+{
+
+#ifdef _WIN32
+    HRESULT
+        LbSection::Create(
+            _In_z_ const WCHAR* name,
+            SIZE_T cbSize
+        )
+    {
+        ASSERT(m_hMap == nullptr);
+
+        ULARGE_INTEGER size;
+        size.QuadPart = cbSize;
+        m_hMap = ::CreateFileMappingW(
+            INVALID_HANDLE_VALUE,
+            nullptr,
+            PAGE_READWRITE,
+            size.HighPart,
+            size.LowPart,
+            name
+        );
+        if (m_hMap == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        if (::GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            Close();
+            return ND_ADDRESS_ALREADY_EXISTS;
+        }
+
+        m_pView = ::MapViewOfFile(m_hMap, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (m_pView == nullptr)
+        {
+            HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+            Close();
+            return hr;
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    HRESULT
+        LbSection::Open(
+            _In_z_ const WCHAR* name
+        )
+    {
+        ASSERT(m_hMap == nullptr);
+
+        m_hMap = ::OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name);
+        if (m_hMap == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        m_pView = ::MapViewOfFile(m_hMap, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (m_pView == nullptr)
+        {
+            HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+            Close();
+            return hr;
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbSection::Close()
+    {
+        if (m_pView != nullptr)
+        {
+            ::UnmapViewOfFile(m_pView);
+            m_pView = nullptr;
+        }
+
+        if (m_hMap != nullptr)
+        {
+            ::CloseHandle(m_hMap);
+            m_hMap = nullptr;
+        }
+    }
+#else
+    // Directory in which glibc keeps POSIX shared memory objects.
+    static const char x_LbShmDir[] = "/dev/shm";
+
+
+    //
+    // Section names are ASCII, and shm_open takes a narrow name.
+    //
+    static void
+        NarrowName(
+            _In_z_ const WCHAR* name,
+            _Out_writes_z_(x_LbMaxName) char* narrow
+        )
+    {
+        SIZE_T i;
+        for (i = 0; i < x_LbMaxName - 1 && name[i] != L'\0'; i++)
+        {
+            narrow[i] = static_cast<char>(name[i]);
+        }
+        narrow[i] = '\0';
+    }
+
+
+    HRESULT
+        LbSection::Create(
+            _In_z_ const WCHAR* name,
+            SIZE_T cbSize
+        )
+    {
+        ASSERT(m_pView == nullptr);
+
+        char narrow[x_LbMaxName];
+        NarrowName(name, narrow);
+        int fd = ::shm_open(narrow, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+            if (errno == EEXIST)
+            {
+                return ND_ADDRESS_ALREADY_EXISTS;
+            }
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        //
+        // Growing the object zero-fills it, as CreateFileMapping does.
+        //
+        void* pView = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(cbSize)) == 0)
+        {
+            pView = ::mmap(nullptr, cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        int error = errno;
+        ::close(fd);
+
+        if (pView == MAP_FAILED)
+        {
+            ::shm_unlink(narrow);
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(error));
+        }
+
+        ::strcpy(m_Name, narrow);
+        m_cbView = cbSize;
+        m_pView = pView;
+        return ND_SUCCESS;
+    }
+
+
+    HRESULT
+        LbSection::Open(
+            _In_z_ const WCHAR* name
+        )
+    {
+        ASSERT(m_pView == nullptr);
+
+        char narrow[x_LbMaxName];
+        NarrowName(name, narrow);
+        int fd = ::shm_open(narrow, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        //
+        // An object that its creator has not sized yet is treated as missing.
+        //
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            ::close(fd);
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        }
+
+        SIZE_T cbSize = static_cast<SIZE_T>(info.st_size);
+        void* pView = ::mmap(nullptr, cbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+
+        if (pView == MAP_FAILED)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(error));
+        }
+
+        m_cbView = cbSize;
+        m_pView = pView;
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbSection::Close()
+    {
+        if (m_pView != nullptr)
+        {
+            ::munmap(m_pView, m_cbView);
+            m_pView = nullptr;
+        }
+
+        //
+        // Peers that mapped the section keep their views; later opens fail,
+        // as they do on Windows once the last handle is closed.
+        //
+        if (m_Name[0] != '\0')
+        {
+            ::shm_unlink(m_Name);
+            m_Name[0] = '\0';
+        }
+    }
+
+
+    void
+        LbSection::RemoveStale(
+            DWORD pid
+        )
+    {
+        DIR* pDir = ::opendir(x_LbShmDir);
+        if (pDir == nullptr)
+        {
+            return;
+        }
+
+        //
+        // Listener sections are named after a port rather than a process, and
+        // do not match the pattern.
+        //
+        for (struct dirent* pEntry = ::readdir(pDir); pEntry != nullptr; pEntry = ::readdir(pDir))
+        {
+            unsigned int entryPid;
+            unsigned int id;
+            if (::sscanf(pEntry->d_name, "NdLoopback.%*[^.].%u.%u", &entryPid, &id) != 2 ||
+                entryPid != pid)
+            {
+                continue;
+            }
+
+            char name[x_LbMaxName];
+            if (::snprintf(name, sizeof(name), "/%s", pEntry->d_name) < static_cast<int>(sizeof(name)))
+            {
+                ::shm_unlink(name);
+            }
+        }
+        ::closedir(pDir);
+    }
+#endif
+
+
+    void
+        LbSection::FormatName(
+            _Out_writes_z_(cchName) WCHAR* name,
+            SIZE_T cchName,
+            _In_z_ const WCHAR* kind,
+            DWORD pid,
+            ULONG id
+        )
+    {
+#ifdef _WIN32
+        ::swprintf_s(name, cchName, L"Local\\NdLoopback.%s.%u.%u", kind, pid, id);
+#else
+        ::swprintf(name, cchName, L"/NdLoopback.%ls.%u.%u", kind, pid, id);
+#endif
+    }
+
+
+#ifdef _WIN32
+    LbOverlappedFile::LbOverlappedFile() :
+        m_hFile(INVALID_HANDLE_VALUE),
+        m_hSignal(INVALID_HANDLE_VALUE),
+        m_Scratch(0)
+    {
+        m_link.Flink = &m_link;
+        m_link.Blink = &m_link;
+    }
+
+
+    LbOverlappedFile::~LbOverlappedFile()
+    {
+        //
+        // The application owns m_hFile and closes it with CloseHandle.
+        //
+        if (m_hSignal != INVALID_HANDLE_VALUE)
+        {
+            ::CloseHandle(m_hSignal);
+        }
+    }
+
+
+    HRESULT
+        LbOverlappedFile::Init(
+            ULONG id
+        )
+    {
+        WCHAR name[x_LbMaxName];
+        ::swprintf_s(name, L"\\\\.\\pipe\\NdLoopback.%u.%u", ::GetCurrentProcessId(), id);
+
+        m_hFile = ::CreateNamedPipeW(
+            name,
+            PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            1,
+            0,
+            4096,
+            0,
+            nullptr
+        );
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        m_hSignal = ::CreateFileW(
+            name,
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            OPEN_EXISTING,
+            0,
+            nullptr
+        );
+        if (m_hSignal == INVALID_HANDLE_VALUE)
+        {
+            HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+            ::CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+            return hr;
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbOverlappedFile::Pend(
+            _Inout_ OVERLAPPED* pOverlapped
+        )
+    {
+        pOverlapped->Internal = ND_PENDING;
+        pOverlapped->InternalHigh = 0;
+
+        //
+        // The low bit of hEvent suppresses the IOCP packet; mask it off before
+        // using the handle.
+        //
+        HANDLE hEvent = reinterpret_cast<HANDLE>(
+            reinterpret_cast<ULONG_PTR>(pOverlapped->hEvent) & ~static_cast<ULONG_PTR>(1));
+        if (hEvent != nullptr)
+        {
+            ::ResetEvent(hEvent);
+        }
+    }
+
+
+    void
+        LbOverlappedFile::Complete(
+            _Inout_ OVERLAPPED* pOverlapped,
+            HRESULT status
+        )
+    {
+        //
+        // The ND status travels in Offset; the byte read below only drives
+        // the event, IOCP and file handle signalling.
+        //
+        pOverlapped->Offset = static_cast<DWORD>(status);
+        pOverlapped->OffsetHigh = 0;
+
+        static const BYTE x_Signal = 0;
+        DWORD bytes;
+        if (::WriteFile(m_hSignal, &x_Signal, 1, &bytes, nullptr) == TRUE &&
+            (::ReadFile(m_hFile, &m_Scratch, 1, nullptr, pOverlapped) == TRUE ||
+                ::GetLastError() == ERROR_IO_PENDING))
+        {
+            return;
+        }
+
+        //
+        // The pipe failed, which only happens if the application closed the
+        // overlapped file.  Complete the request in place.
+        //
+        pOverlapped->Internal = static_cast<ULONG_PTR>(status);
+        HANDLE hEvent = reinterpret_cast<HANDLE>(
+            reinterpret_cast<ULONG_PTR>(pOverlapped->hEvent) & ~static_cast<ULONG_PTR>(1));
+        if (hEvent != nullptr)
+        {
+            ::SetEvent(hEvent);
+        }
+    }
+
+
+    HRESULT
+        LbOverlappedFile::CompleteNow(
+            _Inout_ OVERLAPPED* pOverlapped,
+            HRESULT status
+        )
+    {
+        Pend(pOverlapped);
+        Complete(pOverlapped, status);
+        return ND_PENDING;
+    }
+
+
+    HRESULT
+        LbOverlappedFile::GetResult(
+            _Inout_ OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        if (pOverlapped->Internal == ND_PENDING)
+        {
+            if (wait == FALSE)
+            {
+                return ND_PENDING;
+            }
+
+            if (pOverlapped->hEvent == nullptr)
+            {
+                //
+                // Without an event GetOverlappedResult waits on the file handle,
+                // which may still be signalled from an earlier completion.
+                //
+                while (pOverlapped->Internal == ND_PENDING)
+                {
+                    ::WaitForSingleObject(m_hFile, x_LbScanIntervalMs);
+                }
+            }
+        }
+
+        DWORD bytes;
+        if (::GetOverlappedResult(m_hFile, pOverlapped, &bytes, wait) == FALSE &&
+            ::GetLastError() == ERROR_IO_INCOMPLETE)
+        {
+            return ND_PENDING;
+        }
+
+        return static_cast<HRESULT>(pOverlapped->Offset);
+    }
+#else
+    LbOverlappedFile::LbOverlappedFile() :
+        m_hFile(INVALID_HANDLE_VALUE),
+        m_Event(-1)
+    {
+        m_link.Flink = &m_link;
+        m_link.Blink = &m_link;
+    }
+
+
+    LbOverlappedFile::~LbOverlappedFile()
+    {
+        //
+        // The application owns the descriptor in m_hFile and closes it with
+        // close().
+        //
+        if (m_Event >= 0)
+        {
+            ::close(m_Event);
+        }
+    }
+
+
+    HRESULT
+        LbOverlappedFile::Init(
+            ULONG /*id*/
+        )
+    {
+        m_Event = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_Event < 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        //
+        // Completions signal a private descriptor, so that closing the
+        // application's duplicate never leaves them writing to a descriptor
+        // number that has been reused.
+        //
+        int fd = ::fcntl(m_Event, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        m_hFile = reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(fd));
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbOverlappedFile::Pend(
+            _Inout_ OVERLAPPED* pOverlapped
+        )
+    {
+        pOverlapped->Internal = ND_PENDING;
+        pOverlapped->InternalHigh = 0;
+        pOverlapped->Offset = static_cast<DWORD>(ND_PENDING);
+        pOverlapped->OffsetHigh = 0;
+    }
+
+
+    void
+        LbOverlappedFile::Complete(
+            _Inout_ OVERLAPPED* pOverlapped,
+            HRESULT status
+        )
+    {
+        //
+        // The ND status travels in Offset, which GetResult waits on.  The
+        // caller may free the OVERLAPPED as soon as Offset is set, so the
+        // wake below only passes its address to the kernel.
+        //
+        pOverlapped->Internal = static_cast<ULONG_PTR>(static_cast<DWORD>(status));
+        ::InterlockedExchange(
+            reinterpret_cast<volatile LONG*>(&pOverlapped->Offset),
+            static_cast<LONG>(status));
+
+        static const UINT64 x_Signal = 1;
+        ssize_t ret = ::write(m_Event, &x_Signal, sizeof(x_Signal));
+        UNREFERENCED_PARAMETER(ret);
+
+        ::WakeByAddressAll(&pOverlapped->Offset);
+    }
+
+
+    HRESULT
+        LbOverlappedFile::CompleteNow(
+            _Inout_ OVERLAPPED* pOverlapped,
+            HRESULT status
+        )
+    {
+        Pend(pOverlapped);
+        Complete(pOverlapped, status);
+        return ND_PENDING;
+    }
+
+
+    HRESULT
+        LbOverlappedFile::GetResult(
+            _Inout_ OVERLAPPED* pOverlapped,
+            BOOL wait
+        )
+    {
+        volatile LONG* pStatus = reinterpret_cast<volatile LONG*>(&pOverlapped->Offset);
+        LONG pending = ND_PENDING;
+        while (*pStatus == pending)
+        {
+            if (wait == FALSE)
+            {
+                return ND_PENDING;
+            }
+            ::WaitOnAddress(pStatus, &pending, sizeof(pending), INFINITE);
+        }
+
+        return static_cast<HRESULT>(*pStatus);
+    }
+#endif
+
+
+    LbFabric::LbFabric() :
+        m_nRef(1),
+        m_Pid(::GetCurrentProcessId()),
+        m_NextId(0),
+        m_pMrTable(nullptr),
+        m_pFreeMr(nullptr),
+        m_nFreeMr(0),
+        m_nPeers(0),
+#ifdef _WIN32
+        m_hWake(nullptr),
+#else
+        m_Wake(-1),
+#endif
+        m_hThread(nullptr),
+        m_bShutdown(false)
+    {
+        InitializeCriticalSection(&m_lock);
+        InitializeCriticalSection(&m_MrLock);
+        InitializeCriticalSection(&m_PeerLock);
+        ::ZeroMemory(m_Peers, sizeof(m_Peers));
+    }
+
+
+    LbFabric::~LbFabric()
+    {
+        if (m_hThread != nullptr)
+        {
+            m_bShutdown = true;
+            Wake(m_Pid);
+            ::WaitForSingleObject(m_hThread, INFINITE);
+            ::CloseHandle(m_hThread);
+        }
+
+        ASSERT(m_Requests.empty());
+        ASSERT(m_QueuePairs.empty());
+
+        for (ULONG i = 0; i < m_nPeers; i++)
+        {
+#ifdef _WIN32
+            if (m_Peers[i].hProcess != nullptr)
+            {
+                ::CloseHandle(m_Peers[i].hProcess);
+            }
+            if (m_Peers[i].hWake != nullptr)
+            {
+                ::CloseHandle(m_Peers[i].hWake);
+            }
+#else
+            ::close(m_Peers[i].Process);
+#endif
+        }
+
+#ifdef _WIN32
+        if (m_hWake != nullptr)
+        {
+            ::CloseHandle(m_hWake);
+        }
+#else
+        if (m_Wake >= 0)
+        {
+            ::close(m_Wake);
+        }
+#endif
+
+        delete[] m_pFreeMr;
+
+        DeleteCriticalSection(&m_PeerLock);
+        DeleteCriticalSection(&m_MrLock);
+        DeleteCriticalSection(&m_lock);
+    }
+
+
+#ifndef _WIN32
+    //
+    // Abstract socket address of a process's wake doorbell: sun_path starts
+    // with a NUL byte, and the name is not NUL terminated.
+    //
+    static socklen_t
+        WakeAddress(
+            DWORD pid,
+            _Out_ struct sockaddr_un* pAddr
+        )
+    {
+        ::ZeroMemory(pAddr, sizeof(*pAddr));
+        pAddr->sun_family = AF_UNIX;
+        int len = ::snprintf(pAddr->sun_path + 1, sizeof(pAddr->sun_path) - 1,
+            "NdLoopback.Wake.%u", pid);
+        return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+    }
+
+
+    static bool
+        HasExited(
+            int pidfd
+        )
+    {
+        struct pollfd pollFd = { pidfd, POLLIN, 0 };
+        return ::poll(&pollFd, 1, 0) != 0;
+    }
+#endif
+
+
+    HRESULT
+        LbFabric::Init()
+    {
+#ifndef _WIN32
+        LbSection::RemoveStale(m_Pid);
+#endif
+
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Mr", m_Pid, 0);
+        HRESULT hr = m_MrSection.Create(name, sizeof(LbMrTableShm));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        m_pMrTable = static_cast<LbMrTableShm*>(m_MrSection.View());
+
+        m_pFreeMr = new ULONG[x_LbMaxMr];
+        if (m_pFreeMr == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        //
+        // Hand out low indices first; index zero is never used so that a
+        // zero token is always invalid.
+        //
+        for (ULONG i = 1; i < x_LbMaxMr; i++)
+        {
+            m_pFreeMr[m_nFreeMr++] = x_LbMaxMr - i;
+        }
+
+#ifdef _WIN32
+        LbSection::FormatName(name, _countof(name), L"Wake", m_Pid, 0);
+        m_hWake = ::CreateEventW(nullptr, FALSE, FALSE, name);
+        if (m_hWake == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+#else
+        m_Wake = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_Wake < 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        struct sockaddr_un addr;
+        socklen_t cbAddr = WakeAddress(m_Pid, &addr);
+        if (::bind(m_Wake, reinterpret_cast<struct sockaddr*>(&addr), cbAddr) != 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        //
+        // Peers copy to and from this process with process_vm_readv and
+        // process_vm_writev, which Yama's ptrace_scope=1 only allows to
+        // ancestors unless the process names a tracer.  Without Yama the
+        // call fails and same-user peers are allowed anyway.
+        //
+        ::prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+#endif
+
+        m_hThread = ::CreateThread(nullptr, 0, WakeThread, this, 0, nullptr);
+        if (m_hThread == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    ULONG
+        LbFabric::AddRef()
+    {
+        return ::InterlockedIncrement(&m_nRef);
+    }
+
+
+    ULONG
+        LbFabric::Release()
+    {
+        ASSERT(m_nRef > 0);
+
+        ULONG nRef = ::InterlockedDecrement(&m_nRef);
+
+        if (nRef == 0)
+        {
+            delete this;
+        }
+
+        return nRef;
+    }
+
+
+    HRESULT
+        LbFabric::AllocMr(
+            _Out_ ULONG* pIndex
+        )
+    {
+        Lock lock(&m_MrLock);
+        if (m_nFreeMr == 0)
+        {
+            return ND_INSUFFICIENT_RESOURCES;
+        }
+
+        *pIndex = m_pFreeMr[--m_nFreeMr];
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbFabric::FreeMr(
+            ULONG index
+        )
+    {
+        LbMrEntry* pEntry = GetMr(index);
+        ::InterlockedIncrement(&pEntry->Key);
+        pEntry->Flags = 0;
+
+        Lock lock(&m_MrLock);
+        ASSERT(m_nFreeMr < x_LbMaxMr);
+        m_pFreeMr[m_nFreeMr++] = index;
+    }
+
+
+    bool
+        LbFabric::ValidateToken(
+            _In_ const LbMrTableShm* pTable,
+            UINT32 token,
+            UINT64 address,
+            UINT64 length,
+            ULONG requiredFlags
+        )
+    {
+        ULONG index = token >> 16;
+        if (index == 0 || index >= x_LbMaxMr)
+        {
+            return false;
+        }
+
+        const LbMrEntry& entry = pTable->Entries[index];
+        LONG key = entry.Key;
+        if ((static_cast<UINT32>(key) & 0xFFFF) != (token & 0xFFFF))
+        {
+            return false;
+        }
+
+        ULONG flags = entry.Flags;
+        UINT64 base = entry.Base;
+        UINT64 entryLength = entry.Length;
+        MemoryBarrier();
+        if (entry.Key != key)
+        {
+            return false;
+        }
+
+        if (flags == 0 || (flags & requiredFlags) != requiredFlags)
+        {
+            return false;
+        }
+
+        return address >= base &&
+            length <= entryLength &&
+            address - base <= entryLength - length;
+    }
+
+
+    HRESULT
+        LbFabric::Copy(
+            DWORD dstPid,
+            UINT64 dst,
+            DWORD srcPid,
+            UINT64 src,
+            SIZE_T cb
+        )
+    {
+        if (cb == 0)
+        {
+            return ND_SUCCESS;
+        }
+
+#ifdef _WIN32
+        SIZE_T done = 0;
+        BOOL ret;
+        if (dstPid == m_Pid && srcPid == m_Pid)
+        {
+            __try
+            {
+                ::CopyMemory(
+                    reinterpret_cast<void*>(static_cast<ULONG_PTR>(dst)),
+                    reinterpret_cast<const void*>(static_cast<ULONG_PTR>(src)),
+                    cb
+                );
+            }
+            __except (GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+                EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+            {
+                return ND_ACCESS_VIOLATION;
+            }
+            return ND_SUCCESS;
+        }
+        else if (srcPid == m_Pid)
+        {
+            HANDLE hProcess = GetProcess(dstPid, false);
+            if (hProcess == nullptr)
+            {
+                return ND_CONNECTION_ABORTED;
+            }
+            ret = ::WriteProcessMemory(
+                hProcess,
+                reinterpret_cast<void*>(static_cast<ULONG_PTR>(dst)),
+                reinterpret_cast<const void*>(static_cast<ULONG_PTR>(src)),
+                cb,
+                &done
+            );
+        }
+        else
+        {
+            ASSERT(dstPid == m_Pid);
+            HANDLE hProcess = GetProcess(srcPid, false);
+            if (hProcess == nullptr)
+            {
+                return ND_CONNECTION_ABORTED;
+            }
+            ret = ::ReadProcessMemory(
+                hProcess,
+                reinterpret_cast<const void*>(static_cast<ULONG_PTR>(src)),
+                reinterpret_cast<void*>(static_cast<ULONG_PTR>(dst)),
+                cb,
+                &done
+            );
+        }
+
+        if (ret == FALSE || done != cb)
+        {
+            return ND_ACCESS_VIOLATION;
+        }
+        return ND_SUCCESS;
+#else
+        if (dstPid == m_Pid && srcPid == m_Pid)
+        {
+            //
+            // There is no counterpart to the Windows exception handler: the
+            // buffers were checked at registration, and one unmapped since
+            // faults here.
+            //
+            ::CopyMemory(
+                reinterpret_cast<void*>(static_cast<ULONG_PTR>(dst)),
+                reinterpret_cast<const void*>(static_cast<ULONG_PTR>(src)),
+                cb
+            );
+            return ND_SUCCESS;
+        }
+
+        bool bWrite = (srcPid == m_Pid);
+        ASSERT(bWrite || dstPid == m_Pid);
+        DWORD pid = bWrite ? dstPid : srcPid;
+        BYTE* pLocal = reinterpret_cast<BYTE*>(static_cast<ULONG_PTR>(bWrite ? src : dst));
+        BYTE* pRemote = reinterpret_cast<BYTE*>(static_cast<ULONG_PTR>(bWrite ? dst : src));
+
+        //
+        // The pidfd check keeps a recycled process ID from being written to.
+        //
+        if (!IsAlive(pid))
+        {
+            return ND_CONNECTION_ABORTED;
+        }
+
+        //
+        // The kernel may stop short at a page boundary; only a failed call
+        // means a bad buffer.
+        //
+        SIZE_T done = 0;
+        while (done < cb)
+        {
+            struct iovec local = { pLocal + done, cb - done };
+            struct iovec remote = { pRemote + done, cb - done };
+            ssize_t ret = bWrite ?
+                ::process_vm_writev(static_cast<pid_t>(pid), &local, 1, &remote, 1, 0) :
+                ::process_vm_readv(static_cast<pid_t>(pid), &local, 1, &remote, 1, 0);
+            if (ret <= 0)
+            {
+                return (ret < 0 && errno == ESRCH) ? ND_CONNECTION_ABORTED : ND_ACCESS_VIOLATION;
+            }
+            done += static_cast<SIZE_T>(ret);
+        }
+        return ND_SUCCESS;
+#endif
+    }
+
+
+    void
+        LbFabric::Wake(
+            DWORD pid
+        )
+    {
+#ifdef _WIN32
+        if (pid == m_Pid)
+        {
+            ::SetEvent(m_hWake);
+            return;
+        }
+
+        if (pid == 0)
+        {
+            return;
+        }
+
+        HANDLE hWake = GetProcess(pid, true);
+        if (hWake != nullptr)
+        {
+            ::SetEvent(hWake);
+        }
+#else
+        if (pid == 0)
+        {
+            return;
+        }
+
+        //
+        // A full receive buffer means the target already has wakeups queued.
+        //
+        struct sockaddr_un addr;
+        socklen_t cbAddr = WakeAddress(pid, &addr);
+        static const BYTE x_Signal = 0;
+        ::sendto(m_Wake, &x_Signal, sizeof(x_Signal), MSG_DONTWAIT,
+            reinterpret_cast<struct sockaddr*>(&addr), cbAddr);
+#endif
+    }
+
+
+    bool
+        LbFabric::IsAlive(
+            DWORD pid
+        )
+    {
+        if (pid == m_Pid)
+        {
+            return true;
+        }
+
+#ifdef _WIN32
+        HANDLE hProcess = GetProcess(pid, false);
+        return hProcess != nullptr &&
+            ::WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT;
+#else
+        int pidfd = GetProcess(pid);
+        return pidfd >= 0 && !HasExited(pidfd);
+#endif
+    }
+
+
+#ifdef _WIN32
+    HANDLE
+        LbFabric::GetProcess(
+            DWORD pid,
+            bool wake
+        )
+    {
+        Lock lock(&m_PeerLock);
+
+        ULONG i;
+        for (i = 0; i < m_nPeers; i++)
+        {
+            if (m_Peers[i].Pid == pid)
+            {
+                break;
+            }
+        }
+
+        if (i == m_nPeers)
+        {
+            //
+            // Recycle the slot of a peer that has exited when the cache is full.
+            //
+            if (m_nPeers == x_LbMaxPeers)
+            {
+                for (i = 0; i < m_nPeers; i++)
+                {
+                    if (::WaitForSingleObject(m_Peers[i].hProcess, 0) != WAIT_TIMEOUT)
+                    {
+                        break;
+                    }
+                }
+                if (i == m_nPeers)
+                {
+                    return nullptr;
+                }
+                ::CloseHandle(m_Peers[i].hProcess);
+                if (m_Peers[i].hWake != nullptr)
+                {
+                    ::CloseHandle(m_Peers[i].hWake);
+                }
+            }
+            else
+            {
+                m_nPeers++;
+            }
+
+            m_Peers[i].Pid = pid;
+            m_Peers[i].hWake = nullptr;
+            m_Peers[i].hProcess = ::OpenProcess(
+                PROCESS_VM_READ | PROCESS_VM_WRITE | PROCESS_VM_OPERATION | SYNCHRONIZE,
+                FALSE,
+                pid
+            );
+            if (m_Peers[i].hProcess == nullptr)
+            {
+                m_Peers[i] = m_Peers[--m_nPeers];
+                return nullptr;
+            }
+        }
+
+        if (!wake)
+        {
+            return m_Peers[i].hProcess;
+        }
+
+        if (m_Peers[i].hWake == nullptr)
+        {
+            WCHAR name[x_LbMaxName];
+            LbSection::FormatName(name, _countof(name), L"Wake", pid, 0);
+            m_Peers[i].hWake = ::OpenEventW(EVENT_MODIFY_STATE, FALSE, name);
+        }
+        return m_Peers[i].hWake;
+    }
+#else
+    int
+        LbFabric::GetProcess(
+            DWORD pid
+        )
+    {
+        Lock lock(&m_PeerLock);
+
+        ULONG i;
+        for (i = 0; i < m_nPeers; i++)
+        {
+            if (m_Peers[i].Pid == pid)
+            {
+                return m_Peers[i].Process;
+            }
+        }
+
+        //
+        // Recycle the slot of a peer that has exited when the cache is full.
+        //
+        if (m_nPeers == x_LbMaxPeers)
+        {
+            for (i = 0; i < m_nPeers; i++)
+            {
+                if (HasExited(m_Peers[i].Process))
+                {
+                    break;
+                }
+            }
+            if (i == m_nPeers)
+            {
+                return -1;
+            }
+            ::close(m_Peers[i].Process);
+        }
+        else
+        {
+            m_nPeers++;
+        }
+
+        m_Peers[i].Pid = pid;
+        m_Peers[i].Process = static_cast<int>(::syscall(SYS_pidfd_open, static_cast<pid_t>(pid), 0));
+        if (m_Peers[i].Process < 0)
+        {
+            m_Peers[i] = m_Peers[--m_nPeers];
+            return -1;
+        }
+        return m_Peers[i].Process;
+    }
+#endif
+
+
+    HRESULT
+        LbFabric::QueueRequest(
+            _In_ LbRequestOwner* pOwner,
+            _In_ LbOverlappedFile* pFile,
+            _Inout_ OVERLAPPED* pOverlapped,
+            LbRequestType type,
+            ULONG param,
+            _In_opt_ void* pContext
+        )
+    {
+        LbRequest* pRequest = new LbRequest();
+        if (pRequest == nullptr)
+        {
+            return ND_NO_MEMORY;
+        }
+
+        pRequest->m_pOwner = pOwner;
+        pRequest->m_pFile = pFile;
+        pRequest->m_pOv = pOverlapped;
+        pRequest->m_Type = type;
+        pRequest->m_Param = param;
+        pRequest->m_pContext = pContext;
+        LbOverlappedFile::Pend(pOverlapped);
+
+        //
+        // Check under the lock so that a state change that raced with queuing
+        // the request is either seen here or by the wake thread.
+        //
+        Lock lock(&m_lock);
+        HRESULT status;
+        if (pOwner->CheckRequest(pRequest, &status))
+        {
+            pFile->Complete(pOverlapped, status);
+            delete pRequest;
+        }
+        else
+        {
+            m_Requests.push_back(pRequest);
+        }
+        return ND_PENDING;
+    }
+
+
+    void
+        LbFabric::CancelRequests(
+            _In_ LbRequestOwner* pOwner
+        )
+    {
+        Lock lock(&m_lock);
+        List<LbRequest>::iterator iter = m_Requests.begin();
+        while (iter != m_Requests.end())
+        {
+            LbRequest* pRequest = &*iter;
+            ++iter;
+
+            if (pRequest->m_pOwner != pOwner)
+            {
+                continue;
+            }
+
+            m_Requests.remove(*pRequest);
+            pRequest->m_pFile->Complete(pRequest->m_pOv, ND_CANCELED);
+            delete pRequest;
+        }
+    }
+
+
+    void
+        LbFabric::AddQueuePair(
+            _In_ LbQueuePair* pQp
+        )
+    {
+        Lock lock(&m_lock);
+        m_QueuePairs.push_back(pQp);
+    }
+
+
+    void
+        LbFabric::RemoveQueuePair(
+            _In_ LbQueuePair* pQp
+        )
+    {
+        Lock lock(&m_lock);
+        m_QueuePairs.remove(*pQp);
+    }
+
+
+    void
+        LbFabric::ProcessRequests()
+    {
+        Lock lock(&m_lock);
+        List<LbRequest>::iterator iter = m_Requests.begin();
+        while (iter != m_Requests.end())
+        {
+            LbRequest* pRequest = &*iter;
+            ++iter;
+
+            HRESULT status;
+            if (!pRequest->m_pOwner->CheckRequest(pRequest, &status))
+            {
+                continue;
+            }
+
+            m_Requests.remove(*pRequest);
+            pRequest->m_pFile->Complete(pRequest->m_pOv, status);
+            delete pRequest;
+        }
+    }
+
+
+    void
+        LbFabric::CheckTimeouts()
+    {
+        //
+        // Queue pairs unregister themselves under m_lock before they tear
+        // down, and nothing that holds a queue pair lock acquires m_lock, so
+        // it is safe to run the timeout checks with m_lock held.
+        //
+        DWORD now = ::GetTickCount();
+        Lock lock(&m_lock);
+        for (List<LbQueuePair>::iterator pQp = m_QueuePairs.begin();
+            pQp != m_QueuePairs.end();
+            ++pQp)
+        {
+            if (pQp->TimeoutSend(now))
+            {
+                pQp->Break();
+            }
+        }
+    }
+
+
+    DWORD WINAPI
+        LbFabric::WakeThread(
+            LPVOID pParam
+        )
+    {
+        LbFabric* pFabric = static_cast<LbFabric*>(pParam);
+        DWORD lastScan = ::GetTickCount();
+
+        while (!pFabric->m_bShutdown)
+        {
+#ifdef _WIN32
+            DWORD ret = ::WaitForSingleObject(pFabric->m_hWake, x_LbScanIntervalMs);
+#else
+            struct pollfd pollFd = { pFabric->m_Wake, POLLIN, 0 };
+            DWORD ret = ::poll(&pollFd, 1, x_LbScanIntervalMs) > 0 ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+
+            BYTE signal;
+            while (::recv(pFabric->m_Wake, &signal, sizeof(signal), MSG_DONTWAIT) > 0)
+            {
+            }
+#endif
+            if (pFabric->m_bShutdown)
+            {
+                break;
+            }
+
+            pFabric->ProcessRequests();
+
+            DWORD now = ::GetTickCount();
+            if (ret == WAIT_TIMEOUT || now - lastScan >= x_LbScanIntervalMs)
+            {
+                lastScan = now;
+                pFabric->CheckTimeouts();
+            }
+        }
+
+        return 0;
+    }
+
+} // namespace NetworkDirect
@@ -0,0 +1,942 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Loopback queue pair and data path.
+//
+// Each direction of a connection is an LbPath.  A request posted by the
+// initiator is queued on its send ring and executed under the target's lock
+// by whichever side arrives second: the initiator when it posts and a
+// receive is already waiting (or the request is an RDMA read or write), or
+// the target when it posts the receive a queued send was waiting for.
+//
+
+#include "precomp.h"
+#include "ndaddr.h"
+#include "ndprov.h"
+#include "ndloopback.h"
+
+
+namespace NetworkDirect
+{
+
+    static HRESULT
+        CopySges(
+            _In_ LbFabric* pFabric,
+            DWORD dstPid,
+            _In_reads_(nDst) const LbSgeShm* pDst,
+            ULONG nDst,
+            DWORD srcPid,
+            _In_reads_(nSrc) const LbSgeShm* pSrc,
+            ULONG nSrc,
+            ULONG length
+        )
+    {
+        ULONG iDst = 0;
+        ULONG iSrc = 0;
+        ULONG offDst = 0;
+        ULONG offSrc = 0;
+
+        while (length > 0)
+        {
+            while (iSrc < nSrc && offSrc == pSrc[iSrc].Length)
+            {
+                iSrc++;
+                offSrc = 0;
+            }
+            while (iDst < nDst && offDst == pDst[iDst].Length)
+            {
+                iDst++;
+                offDst = 0;
+            }
+            if (iSrc == nSrc || iDst == nDst)
+            {
+                return ND_BUFFER_OVERFLOW;
+            }
+
+            ULONG cb = min(length, min(pSrc[iSrc].Length - offSrc, pDst[iDst].Length - offDst));
+            HRESULT hr = pFabric->Copy(
+                dstPid,
+                pDst[iDst].Buffer + offDst,
+                srcPid,
+                pSrc[iSrc].Buffer + offSrc,
+                cb
+            );
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            offSrc += cb;
+            offDst += cb;
+            length -= cb;
+        }
+
+        return ND_SUCCESS;
+    }
+
+
+    static bool
+        ValidateSges(
+            _In_ const LbMrTableShm* pTable,
+            _In_reads_(nSge) const LbSgeShm* pSge,
+            ULONG nSge,
+            ULONG requiredFlags
+        )
+    {
+        for (ULONG i = 0; i < nSge; i++)
+        {
+            if (pSge[i].Length == 0)
+            {
+                continue;
+            }
+
+            if (!LbFabric::ValidateToken(
+                pTable, pSge[i].Token, pSge[i].Buffer, pSge[i].Length, requiredFlags))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    LbQueuePair::LbQueuePair(
+        _In_ LbAdapter* pAdapter,
+        _In_ LbCompletionQueue* pReceiveCq,
+        _In_ LbCompletionQueue* pInitiatorCq
+    ) :
+        m_pAdapter(pAdapter),
+        m_pFabric(pAdapter->GetFabric()),
+        m_pReceiveCq(pReceiveCq),
+        m_pInitiatorCq(pInitiatorCq),
+        m_Id(0),
+        m_MaxReceiveSge(0),
+        m_MaxInitiatorSge(0),
+        m_InlineDataSize(0),
+        m_pShm(nullptr),
+        m_bConnected(false)
+    {
+        m_link.Flink = &m_link;
+        m_link.Blink = &m_link;
+        ::ZeroMemory(&m_Out, sizeof(m_Out));
+        ::ZeroMemory(&m_In, sizeof(m_In));
+
+        m_pAdapter->AddRef();
+        m_pReceiveCq->AddRef();
+        m_pInitiatorCq->AddRef();
+    }
+
+
+    LbQueuePair::~LbQueuePair()
+    {
+        if (m_pShm != nullptr)
+        {
+            m_pFabric->RemoveQueuePair(this);
+            if (m_pShm->State != LbQpStateError)
+            {
+                Break();
+            }
+        }
+
+        m_PeerMrSection.Close();
+        m_PeerInitiatorCqSection.Close();
+        m_PeerReceiveCqSection.Close();
+        m_PeerSection.Close();
+        m_Section.Close();
+
+        m_pInitiatorCq->Release();
+        m_pReceiveCq->Release();
+        m_pAdapter->Release();
+    }
+
+
+    HRESULT
+        LbQueuePair::Init(
+            _In_opt_ VOID* context,
+            ULONG receiveQueueDepth,
+            ULONG initiatorQueueDepth,
+            ULONG maxReceiveRequestSge,
+            ULONG maxInitiatorRequestSge,
+            ULONG inlineDataSize
+        )
+    {
+        if (receiveQueueDepth == 0 || receiveQueueDepth > x_LbMaxQueueDepth)
+        {
+            return ND_INVALID_PARAMETER_5;
+        }
+
+        if (initiatorQueueDepth == 0 || initiatorQueueDepth > x_LbMaxQueueDepth)
+        {
+            return ND_INVALID_PARAMETER_6;
+        }
+
+        if (maxReceiveRequestSge > x_LbMaxSge)
+        {
+            return ND_INVALID_PARAMETER_7;
+        }
+
+        if (maxInitiatorRequestSge > x_LbMaxSge)
+        {
+            return ND_INVALID_PARAMETER_8;
+        }
+
+        if (inlineDataSize > x_LbMaxInlineData)
+        {
+            return ND_INVALID_PARAMETER_9;
+        }
+
+        m_Id = m_pFabric->NextId();
+        m_MaxReceiveSge = maxReceiveRequestSge;
+        m_MaxInitiatorSge = maxInitiatorRequestSge;
+        m_InlineDataSize = inlineDataSize;
+
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Qp", m_pFabric->GetPid(), m_Id);
+        HRESULT hr = m_Section.Create(
+            name, LbQpShm::Size(receiveQueueDepth, initiatorQueueDepth));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_pShm = static_cast<LbQpShm*>(m_Section.View());
+        m_pShm->State = LbQpStateIdle;
+        m_pShm->Pid = m_pFabric->GetPid();
+        m_pShm->ReceiveCqId = m_pReceiveCq->GetId();
+        m_pShm->InitiatorCqId = m_pInitiatorCq->GetId();
+        m_pShm->ReceiveDepth = receiveQueueDepth;
+        m_pShm->InitiatorDepth = initiatorQueueDepth;
+        m_pShm->Context = reinterpret_cast<ULONG_PTR>(context);
+
+        m_pFabric->AddQueuePair(this);
+        return ND_SUCCESS;
+    }
+
+
+    HRESULT
+        LbQueuePair::ConnectTo(
+            DWORD peerPid,
+            ULONG peerQpId
+        )
+    {
+        if (m_bConnected)
+        {
+            return ND_CONNECTION_ACTIVE;
+        }
+
+        WCHAR name[x_LbMaxName];
+        LbSection::FormatName(name, _countof(name), L"Qp", peerPid, peerQpId);
+        HRESULT hr = m_PeerSection.Open(name);
+        if (FAILED(hr))
+        {
+            return ND_CONNECTION_ABORTED;
+        }
+        LbQpShm* pPeer = static_cast<LbQpShm*>(m_PeerSection.View());
+
+        LbSection::FormatName(name, _countof(name), L"Cq", peerPid, pPeer->ReceiveCqId);
+        hr = m_PeerReceiveCqSection.Open(name);
+        if (SUCCEEDED(hr))
+        {
+            LbSection::FormatName(name, _countof(name), L"Cq", peerPid, pPeer->InitiatorCqId);
+            hr = m_PeerInitiatorCqSection.Open(name);
+        }
+        if (SUCCEEDED(hr))
+        {
+            LbSection::FormatName(name, _countof(name), L"Mr", peerPid, 0);
+            hr = m_PeerMrSection.Open(name);
+        }
+        if (FAILED(hr))
+        {
+            m_PeerMrSection.Close();
+            m_PeerInitiatorCqSection.Close();
+            m_PeerReceiveCqSection.Close();
+            m_PeerSection.Close();
+            return ND_CONNECTION_ABORTED;
+        }
+
+        m_Out.pInitiator = m_pShm;
+        m_Out.pInitiatorCq = m_pInitiatorCq->GetShm();
+        m_Out.pInitiatorMr = m_pFabric->GetMrTable();
+        m_Out.pTarget = pPeer;
+        m_Out.pTargetCq = static_cast<LbCqShm*>(m_PeerReceiveCqSection.View());
+        m_Out.pTargetMr = static_cast<const LbMrTableShm*>(m_PeerMrSection.View());
+
+        m_In.pInitiator = pPeer;
+        m_In.pInitiatorCq = static_cast<LbCqShm*>(m_PeerInitiatorCqSection.View());
+        m_In.pInitiatorMr = m_Out.pTargetMr;
+        m_In.pTarget = m_pShm;
+        m_In.pTargetCq = m_pReceiveCq->GetShm();
+        m_In.pTargetMr = m_Out.pInitiatorMr;
+
+        //
+        // A queue pair can be connected once; a flushed one stays in error.
+        //
+        if (::InterlockedCompareExchange(
+            &m_pShm->State, LbQpStateConnected, LbQpStateIdle) != LbQpStateIdle)
+        {
+            return ND_CONNECTION_INVALID;
+        }
+
+        MemoryBarrier();
+        m_bConnected = true;
+
+        //
+        // Pick up anything the peer queued before we were connected.
+        //
+        LbSpinLock lock(&m_pShm->Lock);
+        Drain(m_In);
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbQueuePair::Break()
+    {
+        ::InterlockedExchange(&m_pShm->State, LbQpStateError);
+        if (!m_bConnected)
+        {
+            FlushLocal();
+            return;
+        }
+
+        ::InterlockedExchange(&m_Out.pTarget->State, LbQpStateError);
+        FlushPath(m_Out);
+        FlushPath(m_In);
+        m_pFabric->Wake(m_Out.pTarget->Pid);
+    }
+
+
+    void
+        LbQueuePair::FlushPath(
+            _In_ const LbPath& path
+        )
+    {
+        LbSpinLock lock(&path.pTarget->Lock);
+
+        LbQpShm* pI = path.pInitiator;
+        while (pI->SendHead != pI->SendTail)
+        {
+            const LbSendWqe& wqe = pI->SendRing()[pI->SendHead % pI->InitiatorDepth];
+            LbCompletionQueue::Push(
+                m_pFabric,
+                path.pInitiatorCq,
+                ND_CANCELED,
+                0,
+                pI->Context,
+                wqe.RequestContext,
+                static_cast<ND2_REQUEST_TYPE>(wqe.Type),
+                false
+            );
+            pI->SendHead++;
+        }
+
+        LbQpShm* pT = path.pTarget;
+        while (pT->ReceiveHead != pT->ReceiveTail)
+        {
+            const LbReceiveWqe& rwqe = pT->ReceiveRing()[pT->ReceiveHead % pT->ReceiveDepth];
+            LbCompletionQueue::Push(
+                m_pFabric,
+                path.pTargetCq,
+                ND_CANCELED,
+                0,
+                pT->Context,
+                rwqe.RequestContext,
+                Nd2RequestTypeReceive,
+                false
+            );
+            pT->ReceiveHead++;
+        }
+    }
+
+
+    void
+        LbQueuePair::FlushLocal()
+    {
+        LbPath path;
+        path.pInitiator = m_pShm;
+        path.pInitiatorCq = m_pInitiatorCq->GetShm();
+        path.pInitiatorMr = m_pFabric->GetMrTable();
+        path.pTarget = m_pShm;
+        path.pTargetCq = m_pReceiveCq->GetShm();
+        path.pTargetMr = path.pInitiatorMr;
+        FlushPath(path);
+    }
+
+
+    bool
+        LbQueuePair::TimeoutSend(
+            DWORD now
+        )
+    {
+        if (!m_bConnected || m_pShm->State != LbQpStateConnected)
+        {
+            return false;
+        }
+
+        LbQpShm* pI = m_Out.pInitiator;
+        LbQpShm* pT = m_Out.pTarget;
+
+        LbSpinLock lock(&pT->Lock);
+        if (pI->SendHead == pI->SendTail || pT->ReceiveHead != pT->ReceiveTail)
+        {
+            return false;
+        }
+
+        const LbSendWqe& wqe = pI->SendRing()[pI->SendHead % pI->InitiatorDepth];
+        if (wqe.Type != Nd2RequestTypeSend || now - wqe.PostTime < x_LbRnrTimeoutMs)
+        {
+            return false;
+        }
+
+        LbCompletionQueue::Push(
+            m_pFabric,
+            m_Out.pInitiatorCq,
+            ND_IO_TIMEOUT,
+            0,
+            pI->Context,
+            wqe.RequestContext,
+            Nd2RequestTypeSend,
+            false
+        );
+        pI->SendHead++;
+        return true;
+    }
+
+
+    HRESULT
+        LbQueuePair::CopyToReceive(
+            _In_ const LbPath& path,
+            _In_ const LbSendWqe& wqe,
+            _In_ const LbReceiveWqe& rwqe
+        )
+    {
+        ULONG cbReceive = 0;
+        for (ULONG i = 0; i < rwqe.nSge; i++)
+        {
+            cbReceive += rwqe.Sge[i].Length;
+        }
+        if (cbReceive < wqe.Length)
+        {
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        if (!ValidateSges(path.pTargetMr, rwqe.Sge, rwqe.nSge, ND_MR_FLAG_ALLOW_LOCAL_WRITE))
+        {
+            return ND_ACCESS_VIOLATION;
+        }
+
+        if ((wqe.Flags & ND_OP_FLAG_INLINE) != 0)
+        {
+            //
+            // Inline data lives in the send ring, which is mapped locally.
+            //
+            LbSgeShm src = { reinterpret_cast<ULONG_PTR>(wqe.InlineData), wqe.Length, 0 };
+            return CopySges(
+                m_pFabric,
+                path.pTarget->Pid,
+                rwqe.Sge,
+                rwqe.nSge,
+                m_pFabric->GetPid(),
+                &src,
+                1,
+                wqe.Length
+            );
+        }
+
+        return CopySges(
+            m_pFabric,
+            path.pTarget->Pid,
+            rwqe.Sge,
+            rwqe.nSge,
+            path.pInitiator->Pid,
+            wqe.Sge,
+            wqe.nSge,
+            wqe.Length
+        );
+    }
+
+
+    HRESULT
+        LbQueuePair::Execute(
+            _In_ const LbPath& path,
+            _In_ const LbSendWqe& wqe,
+            _Out_ ULONG* pBytes,
+            _Out_ bool* pBreak
+        )
+    {
+        *pBytes = 0;
+        *pBreak = true;
+
+        LbSgeShm remote = { wqe.RemoteAddress, wqe.Length, wqe.RemoteToken };
+        HRESULT hr;
+
+        if (wqe.Type == Nd2RequestTypeWrite)
+        {
+            if (!LbFabric::ValidateToken(path.pTargetMr, wqe.RemoteToken,
+                wqe.RemoteAddress, wqe.Length, ND_MR_FLAG_ALLOW_REMOTE_WRITE))
+            {
+                return ND_ACCESS_VIOLATION;
+            }
+
+            if ((wqe.Flags & ND_OP_FLAG_INLINE) != 0)
+            {
+                LbSgeShm src = { reinterpret_cast<ULONG_PTR>(wqe.InlineData), wqe.Length, 0 };
+                hr = CopySges(m_pFabric, path.pTarget->Pid, &remote, 1,
+                    m_pFabric->GetPid(), &src, 1, wqe.Length);
+            }
+            else
+            {
+                hr = CopySges(m_pFabric, path.pTarget->Pid, &remote, 1,
+                    path.pInitiator->Pid, wqe.Sge, wqe.nSge, wqe.Length);
+            }
+        }
+        else
+        {
+            ASSERT(wqe.Type == Nd2RequestTypeRead);
+            if (!ValidateSges(path.pInitiatorMr, wqe.Sge, wqe.nSge, ND_MR_FLAG_ALLOW_LOCAL_WRITE))
+            {
+                return ND_ACCESS_VIOLATION;
+            }
+
+            if (!LbFabric::ValidateToken(path.pTargetMr, wqe.RemoteToken,
+                wqe.RemoteAddress, wqe.Length, ND_MR_FLAG_ALLOW_REMOTE_READ))
+            {
+                return ND_ACCESS_VIOLATION;
+            }
+
+            hr = CopySges(m_pFabric, path.pInitiator->Pid, wqe.Sge, wqe.nSge,
+                path.pTarget->Pid, &remote, 1, wqe.Length);
+        }
+
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        *pBytes = wqe.Length;
+        *pBreak = false;
+        return ND_SUCCESS;
+    }
+
+
+    void
+        LbQueuePair::Drain(
+            _In_ const LbPath& path
+        )
+    {
+        LbQpShm* pI = path.pInitiator;
+        LbQpShm* pT = path.pTarget;
+        bool bBreak = false;
+
+        while (pI->SendHead != pI->SendTail && !bBreak)
+        {
+            if (pI->State == LbQpStateError || pT->State == LbQpStateError)
+            {
+                break;
+            }
+
+            const LbSendWqe& wqe = pI->SendRing()[pI->SendHead % pI->InitiatorDepth];
+            HRESULT status;
+            ULONG bytes = 0;
+
+            //
+            // Inline requests carry their data and need no source registration.
+            //
+            if ((wqe.Flags & ND_OP_FLAG_INLINE) == 0 &&
+                wqe.Type != Nd2RequestTypeRead &&
+                !ValidateSges(path.pInitiatorMr, wqe.Sge, wqe.nSge, 0))
+            {
+                status = ND_ACCESS_VIOLATION;
+                bBreak = true;
+            }
+            else if (wqe.Type == Nd2RequestTypeSend)
+            {
+                if (pT->ReceiveHead == pT->ReceiveTail)
+                {
+                    // Wait for the target to post a receive.
+                    break;
+                }
+
+                LbReceiveWqe rwqe = pT->ReceiveRing()[pT->ReceiveHead % pT->ReceiveDepth];
+                pT->ReceiveHead++;
+
+                status = CopyToReceive(path, wqe, rwqe);
+                HRESULT receiveStatus = status;
+                if (FAILED(status))
+                {
+                    status = ND_REMOTE_ERROR;
+                    bBreak = true;
+                }
+                else
+                {
+                    bytes = wqe.Length;
+                }
+
+                LbCompletionQueue::Push(
+                    m_pFabric,
+                    path.pTargetCq,
+                    receiveStatus,
+                    bytes,
+                    pT->Context,
+                    rwqe.RequestContext,
+                    Nd2RequestTypeReceive,
+                    (wqe.Flags & ND_OP_FLAG_SEND_AND_SOLICIT_EVENT) != 0
+                );
+            }
+            else
+            {
+                status = Execute(path, wqe, &bytes, &bBreak);
+            }
+
+            if (FAILED(status) || (wqe.Flags & ND_OP_FLAG_SILENT_SUCCESS) == 0)
+            {
+                LbCompletionQueue::Push(
+                    m_pFabric,
+                    path.pInitiatorCq,
+                    status,
+                    bytes,
+                    pI->Context,
+                    wqe.RequestContext,
+                    static_cast<ND2_REQUEST_TYPE>(wqe.Type),
+                    false
+                );
+            }
+            pI->SendHead++;
+        }
+
+        if (bBreak)
+        {
+            //
+            // Move both ends to error now; the caller flushes them once it has
+            // dropped the lock.
+            //
+            ::InterlockedExchange(&pI->State, LbQpStateError);
+            ::InterlockedExchange(&pT->State, LbQpStateError);
+        }
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::QueryInterface(
+            REFIID riid,
+            LPVOID* ppvObj
+        )
+    {
+        return QueryInterfaceHelper(riid, ppvObj, IID_IND2QueuePair, IID_IND2QueuePair);
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Flush()
+    {
+        Break();
+        return ND_SUCCESS;
+    }
+
+
+    HRESULT
+        LbQueuePair::PostRequest(
+            ND2_REQUEST_TYPE type,
+            _In_opt_ VOID* requestContext,
+            _In_reads_opt_(nSge) const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        )
+    {
+        if (nSge > m_MaxInitiatorSge)
+        {
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        LbSendWqe wqe;
+        wqe.RequestContext = reinterpret_cast<ULONG_PTR>(requestContext);
+        wqe.Type = type;
+        wqe.Flags = flags;
+        wqe.nSge = nSge;
+        wqe.RemoteAddress = remoteAddress;
+        wqe.RemoteToken = remoteToken;
+
+        UINT64 length = 0;
+        for (ULONG i = 0; i < nSge; i++)
+        {
+            wqe.Sge[i].Buffer = reinterpret_cast<ULONG_PTR>(sge[i].Buffer);
+            wqe.Sge[i].Length = sge[i].BufferLength;
+            wqe.Sge[i].Token = sge[i].MemoryRegionToken;
+            length += sge[i].BufferLength;
+        }
+        if (length > x_LbMaxTransferLength)
+        {
+            return ND_INVALID_BUFFER_SIZE;
+        }
+        wqe.Length = static_cast<ULONG>(length);
+
+        if ((flags & ND_OP_FLAG_INLINE) != 0 && type != Nd2RequestTypeRead)
+        {
+            if (wqe.Length > m_InlineDataSize)
+            {
+                return ND_INVALID_BUFFER_SIZE;
+            }
+
+            BYTE* pInline = wqe.InlineData;
+            for (ULONG i = 0; i < nSge; i++)
+            {
+                ::CopyMemory(pInline, sge[i].Buffer, sge[i].BufferLength);
+                pInline += sge[i].BufferLength;
+            }
+        }
+        else
+        {
+            wqe.Flags &= ~ND_OP_FLAG_INLINE;
+        }
+
+        if (!m_bConnected)
+        {
+            if (m_pShm->State != LbQpStateError)
+            {
+                return ND_CONNECTION_INVALID;
+            }
+
+            LbCompletionQueue::Push(m_pFabric, m_pInitiatorCq->GetShm(), ND_CANCELED, 0,
+                m_pShm->Context, wqe.RequestContext, type, false);
+            return ND_SUCCESS;
+        }
+
+        bool bBreak;
+        {
+            LbSpinLock lock(&m_Out.pTarget->Lock);
+            if (m_pShm->State == LbQpStateError)
+            {
+                LbCompletionQueue::Push(m_pFabric, m_Out.pInitiatorCq, ND_CANCELED, 0,
+                    m_pShm->Context, wqe.RequestContext, type, false);
+                return ND_SUCCESS;
+            }
+
+            if (m_pShm->SendTail - m_pShm->SendHead >= m_pShm->InitiatorDepth)
+            {
+                return ND_INSUFFICIENT_RESOURCES;
+            }
+
+            wqe.PostTime = ::GetTickCount();
+            m_pShm->SendRing()[m_pShm->SendTail % m_pShm->InitiatorDepth] = wqe;
+            m_pShm->SendTail++;
+
+            Drain(m_Out);
+            bBreak = (m_pShm->State == LbQpStateError);
+        }
+
+        if (bBreak)
+        {
+            Break();
+        }
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Send(
+            VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            ULONG flags
+        )
+    {
+        return PostRequest(Nd2RequestTypeSend, requestContext, sge, nSge, 0, 0, flags);
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Receive(
+            VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge
+        )
+    {
+        if (nSge > m_MaxReceiveSge)
+        {
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        bool bBreak;
+        {
+            LbSpinLock lock(&m_pShm->Lock);
+            if (m_pShm->State == LbQpStateError)
+            {
+                LbCompletionQueue::Push(m_pFabric, m_pReceiveCq->GetShm(), ND_CANCELED, 0,
+                    m_pShm->Context, reinterpret_cast<ULONG_PTR>(requestContext),
+                    Nd2RequestTypeReceive, false);
+                return ND_SUCCESS;
+            }
+
+            if (m_pShm->ReceiveTail - m_pShm->ReceiveHead >= m_pShm->ReceiveDepth)
+            {
+                return ND_INSUFFICIENT_RESOURCES;
+            }
+
+            LbReceiveWqe* pWqe = &m_pShm->ReceiveRing()[m_pShm->ReceiveTail % m_pShm->ReceiveDepth];
+            pWqe->RequestContext = reinterpret_cast<ULONG_PTR>(requestContext);
+            pWqe->nSge = nSge;
+            for (ULONG i = 0; i < nSge; i++)
+            {
+                pWqe->Sge[i].Buffer = reinterpret_cast<ULONG_PTR>(sge[i].Buffer);
+                pWqe->Sge[i].Length = sge[i].BufferLength;
+                pWqe->Sge[i].Token = sge[i].MemoryRegionToken;
+            }
+            m_pShm->ReceiveTail++;
+
+            if (!m_bConnected)
+            {
+                return ND_SUCCESS;
+            }
+
+            Drain(m_In);
+            bBreak = (m_pShm->State == LbQpStateError);
+        }
+
+        if (bBreak)
+        {
+            Break();
+        }
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Bind(
+            VOID* requestContext,
+            IUnknown* pMemoryRegion,
+            IUnknown* pMemoryWindow,
+            const VOID* pBuffer,
+            SIZE_T cbBuffer,
+            ULONG flags
+        )
+    {
+        IND2MemoryRegion* pMr;
+        HRESULT hr = pMemoryRegion->QueryInterface(
+            IID_IND2MemoryRegion, reinterpret_cast<void**>(&pMr));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_2;
+        }
+
+        IND2MemoryWindow* pMw;
+        hr = pMemoryWindow->QueryInterface(
+            IID_IND2MemoryWindow, reinterpret_cast<void**>(&pMw));
+        if (FAILED(hr))
+        {
+            pMr->Release();
+            return ND_INVALID_PARAMETER_3;
+        }
+
+        const LbMrEntry* pMrEntry = static_cast<LbMemoryRegion*>(pMr)->GetEntry();
+        LbMrEntry* pMwEntry = static_cast<LbMemoryWindow*>(pMw)->GetEntry();
+
+        UINT64 base = reinterpret_cast<ULONG_PTR>(pBuffer);
+        if (pMrEntry->Flags == 0 ||
+            base < pMrEntry->Base ||
+            cbBuffer > pMrEntry->Length ||
+            base - pMrEntry->Base > pMrEntry->Length - cbBuffer)
+        {
+            hr = ND_ACCESS_VIOLATION;
+        }
+        else if (m_pShm->State == LbQpStateError)
+        {
+            hr = ND_CANCELED;
+        }
+        else
+        {
+            ULONG mwFlags = x_LbMrValid;
+            if ((flags & ND_OP_FLAG_ALLOW_READ) != 0)
+            {
+                mwFlags |= ND_MR_FLAG_ALLOW_REMOTE_READ;
+            }
+            if ((flags & ND_OP_FLAG_ALLOW_WRITE) != 0)
+            {
+                mwFlags |= ND_MR_FLAG_ALLOW_REMOTE_WRITE;
+            }
+
+            ::InterlockedExchange(reinterpret_cast<volatile LONG*>(&pMwEntry->Flags), 0);
+            pMwEntry->Base = base;
+            pMwEntry->Length = cbBuffer;
+            ::InterlockedIncrement(&pMwEntry->Key);
+            ::InterlockedExchange(
+                reinterpret_cast<volatile LONG*>(&pMwEntry->Flags), static_cast<LONG>(mwFlags));
+            hr = ND_SUCCESS;
+        }
+
+        pMw->Release();
+        pMr->Release();
+
+        if (FAILED(hr) || (flags & ND_OP_FLAG_SILENT_SUCCESS) == 0)
+        {
+            LbCompletionQueue::Push(m_pFabric, m_pInitiatorCq->GetShm(), hr, 0,
+                m_pShm->Context, reinterpret_cast<ULONG_PTR>(requestContext),
+                Nd2RequestTypeBind, false);
+        }
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Invalidate(
+            VOID* requestContext,
+            IUnknown* pMemoryWindow,
+            ULONG flags
+        )
+    {
+        IND2MemoryWindow* pMw;
+        HRESULT hr = pMemoryWindow->QueryInterface(
+            IID_IND2MemoryWindow, reinterpret_cast<void**>(&pMw));
+        if (FAILED(hr))
+        {
+            return ND_INVALID_PARAMETER_2;
+        }
+
+        LbMrEntry* pMwEntry = static_cast<LbMemoryWindow*>(pMw)->GetEntry();
+        ::InterlockedIncrement(&pMwEntry->Key);
+        ::InterlockedExchange(reinterpret_cast<volatile LONG*>(&pMwEntry->Flags), 0);
+        pMw->Release();
+
+        hr = (m_pShm->State == LbQpStateError) ? ND_CANCELED : ND_SUCCESS;
+        if (FAILED(hr) || (flags & ND_OP_FLAG_SILENT_SUCCESS) == 0)
+        {
+            LbCompletionQueue::Push(m_pFabric, m_pInitiatorCq->GetShm(), hr, 0,
+                m_pShm->Context, reinterpret_cast<ULONG_PTR>(requestContext),
+                Nd2RequestTypeInvalidate, false);
+        }
+        return ND_SUCCESS;
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Read(
+            VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        )
+    {
+        return PostRequest(
+            Nd2RequestTypeRead, requestContext, sge, nSge, remoteAddress, remoteToken, flags);
+    }
+
+
+    STDMETHODIMP
+        LbQueuePair::Write(
+            VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        )
+    {
+        return PostRequest(
+            Nd2RequestTypeWrite, requestContext, sge, nSge, remoteAddress, remoteToken, flags);
+    }
+
+} // namespace NetworkDirect
@@ -0,0 +1,1056 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Shared-memory loopback provider.
+//
+// The loopback provider implements the IND2 object model on top of named
+// shared memory sections so that ND applications can run on machines without
+// RDMA hardware, both between threads of one process and between processes.
+// Every queue pair, completion queue, connection and listener keeps its
+// state in a named section that the peer maps; memory registrations are
+// published in a per-process token table.  Data is copied directly from the
+// source buffer into the destination buffer by whichever side of the
+// connection makes the transfer possible: with memcpy within a process, and
+// across processes with Read/WriteProcessMemory on Windows or
+// process_vm_readv/process_vm_writev on Linux.
+//
+// On Windows, sections are named file mappings and overlapped requests are
+// completed through a private named pipe: the overlapped file handed to the
+// application is the server end of the pipe, and completing a request issues
+// a one byte read on it with the caller's OVERLAPPED.  This gives the
+// application the usual event, IOCP and GetOverlappedResult semantics
+// without a kernel driver.  Each process has a named wake event.
+//
+// On Linux, sections are POSIX shared memory objects (shm_open and mmap),
+// unlinked by the process that created them when it closes them.  The
+// overlapped file is an eventfd, passed to the application as a HANDLE
+// holding the file descriptor: every completion signals it, so it can be
+// associated with a CompletionPort, and the application closes it with
+// close().  OVERLAPPED.hEvent is not used.  Each process's wake doorbell is
+// a datagram socket bound to an abstract socket address named after the
+// process ID.  Cross-process copies need ptrace access to the peer, so the
+// fabric allows any process to attach to it (PR_SET_PTRACER) when the Yama
+// security module restricts ptrace to descendants.
+//
+// The provider is opt-in: set ND_LOOPBACK_PROVIDER=1 in the environment
+// before calling NdStartup to have 127.0.0.1 and ::1 reported as ND
+// addresses.  Setting ND_LOOPBACK_ADDRESSES=<n> reports n IPv4 addresses
+// starting at 127.0.0.1, which is useful to measure address lookups against
+// large address lists.
+//
+// Shared receive queues are not supported: the adapter reports a maximum
+// shared receive queue depth of zero and CreateSharedReceiveQueue fails with
+// ND_NOT_SUPPORTED.
+//
+
+#pragma once
+
+namespace NetworkDirect
+{
+
+    // {5C4E5D7B-2F6A-4C4B-9F0E-6B8B2E0A1D31}
+    DEFINE_GUID(GUID_NdLoopbackProvider,
+        0x5c4e5d7b, 0x2f6a, 0x4c4b, 0x9f, 0xe, 0x6b, 0x8b, 0x2e, 0xa, 0x1d, 0x31);
+
+    //
+    // Adapter limits.
+    //
+    const ULONG x_LbMaxSge = 4;
+    const ULONG x_LbMaxQueueDepth = 4096;
+    const ULONG x_LbMaxCqDepth = 65536;
+    const ULONG x_LbMaxInlineData = 64;
+    const ULONG x_LbLargeRequestThreshold = 64 * 1024;
+    const ULONG x_LbMaxTransferLength = 1024 * 1024 * 1024;
+    const ULONG x_LbMaxReadLimit = 128;
+    const ULONG x_LbMaxCallerData = 56;
+    const ULONG x_LbMaxCalleeData = 148;
+    const ULONG x_LbMaxPrivateData = 148;
+    const ULONG x_LbMaxBacklog = 128;
+    const ULONG x_LbMaxMr = 65536;
+    const ULONG x_LbMaxPeers = 64;
+    const ULONG x_LbMaxAddresses = 65536;
+
+    // A send that finds no receive posted for this long fails with ND_IO_TIMEOUT.
+    const DWORD x_LbRnrTimeoutMs = 2000;
+    // Interval at which the wake thread re-evaluates timeouts and peer liveness.
+    const DWORD x_LbScanIntervalMs = 100;
+
+    //
+    // Status codes that the IND2 tests expect but ndstatus.mc does not define.
+    //
+    const HRESULT x_LbStatusAddressAlreadyAssociated = static_cast<HRESULT>(0xC0000328L);
+    const HRESULT x_LbStatusBadNetworkName = static_cast<HRESULT>(0xC00000CCL);
+
+
+    //---------------------------------------------------------
+    // Shared memory layouts.  All pointers are carried as UINT64 so the
+    // layouts do not depend on the bitness of the process that maps them.
+    //
+    struct LbSgeShm
+    {
+        UINT64 Buffer;
+        ULONG Length;
+        UINT32 Token;
+    };
+
+    struct LbReceiveWqe
+    {
+        UINT64 RequestContext;
+        ULONG nSge;
+        ULONG Reserved;
+        LbSgeShm Sge[x_LbMaxSge];
+    };
+
+    struct LbSendWqe
+    {
+        UINT64 RequestContext;
+        ULONG Type;                 // ND2_REQUEST_TYPE
+        ULONG Flags;                // ND_OP_FLAG_*
+        ULONG nSge;
+        ULONG Length;
+        UINT64 RemoteAddress;
+        UINT32 RemoteToken;
+        DWORD PostTime;             // GetTickCount() when posted, for RNR timeouts
+        LbSgeShm Sge[x_LbMaxSge];
+        BYTE InlineData[x_LbMaxInlineData];
+    };
+
+    enum LbQpState
+    {
+        LbQpStateIdle,
+        LbQpStateConnected,
+        LbQpStateError
+    };
+
+    //
+    // Queue pair section: header followed by the receive ring and the send
+    // ring.  The receive ring is protected by Lock; the send ring holds
+    // requests destined to the peer and is protected by the peer's Lock.
+    //
+    struct LbQpShm
+    {
+        volatile LONG Lock;
+        volatile LONG State;
+        DWORD Pid;
+        ULONG ReceiveCqId;
+        ULONG InitiatorCqId;
+        ULONG ReceiveDepth;
+        ULONG InitiatorDepth;
+        ULONG Reserved;
+        UINT64 Context;
+        volatile ULONG ReceiveHead;
+        volatile ULONG ReceiveTail;
+        volatile ULONG SendHead;
+        volatile ULONG SendTail;
+
+        LbReceiveWqe* ReceiveRing()
+        {
+            return reinterpret_cast<LbReceiveWqe*>(this + 1);
+        }
+
+        LbSendWqe* SendRing()
+        {
+            return reinterpret_cast<LbSendWqe*>(ReceiveRing() + ReceiveDepth);
+        }
+
+        static SIZE_T Size(ULONG receiveDepth, ULONG initiatorDepth)
+        {
+            return sizeof(LbQpShm) +
+                (sizeof(LbReceiveWqe) * receiveDepth) +
+                (sizeof(LbSendWqe) * initiatorDepth);
+        }
+    };
+
+    struct LbResultShm
+    {
+        HRESULT Status;
+        ULONG BytesTransferred;
+        UINT64 QueuePairContext;
+        UINT64 RequestContext;
+        ULONG RequestType;
+        ULONG Reserved;
+    };
+
+    struct LbCqShm
+    {
+        volatile LONG Lock;
+        // Zero when not armed, otherwise the ND_CQ_NOTIFY_* type plus one.
+        volatile LONG Armed;
+        volatile LONG Overrun;
+        DWORD Pid;
+        ULONG Depth;
+        ULONG Reserved;
+        volatile ULONG Head;
+        volatile ULONG Tail;
+
+        LbResultShm* Ring()
+        {
+            return reinterpret_cast<LbResultShm*>(this + 1);
+        }
+
+        static SIZE_T Size(ULONG depth)
+        {
+            return sizeof(LbCqShm) + (sizeof(LbResultShm) * depth);
+        }
+    };
+
+    //
+    // Memory region and memory window table entry.  Writers bump Key around
+    // updates so remote readers can detect a concurrent change.  Tokens are
+    // the table index in the upper 16 bits and the low 16 bits of Key.
+    //
+    const ULONG x_LbMrValid = 0x40000000;
+
+    struct LbMrEntry
+    {
+        volatile LONG Key;
+        volatile ULONG Flags;       // ND_MR_FLAG_* | x_LbMrValid, zero when not valid
+        UINT64 Base;
+        UINT64 Length;
+    };
+
+    struct LbMrTableShm
+    {
+        LbMrEntry Entries[x_LbMaxMr];
+    };
+
+    enum LbConnState
+    {
+        LbConnRequested,
+        LbConnAccepted,
+        LbConnRejected,
+        LbConnEstablished,
+        LbConnDisconnected
+    };
+
+    enum LbConnSide
+    {
+        LbConnActive,
+        LbConnPassive
+    };
+
+    struct LbPeerShm
+    {
+        DWORD Pid;
+        ULONG QpId;
+        ULONG InboundReadLimit;
+        ULONG OutboundReadLimit;
+        ULONG cbPrivateData;
+        BYTE PrivateData[x_LbMaxPrivateData];
+        SOCKADDR_INET Address;
+    };
+
+    struct LbConnShm
+    {
+        volatile LONG Lock;
+        volatile LONG State;
+        LbPeerShm Peer[2];
+    };
+
+    struct LbConnRef
+    {
+        DWORD Pid;
+        ULONG ConnId;
+    };
+
+    struct LbListenerShm
+    {
+        volatile LONG Lock;
+        volatile LONG Listening;
+        DWORD Pid;
+        ULONG Backlog;
+        volatile ULONG Head;
+        volatile ULONG Tail;
+        LbConnRef Requests[x_LbMaxBacklog];
+    };
+    //---------------------------------------------------------
+
+
+    //---------------------------------------------------------
+    // Spin lock wrapper for locks that live in shared memory.
+    //
+    class LbSpinLock
+    {
+        volatile LONG* m_pLock;
+
+    public:
+        LbSpinLock(volatile LONG* pLock) : m_pLock(pLock)
+        {
+            for (ULONG spin = 0;
+                ::InterlockedCompareExchange(m_pLock, 1, 0) != 0;
+                spin++)
+            {
+                if (spin < 64)
+                {
+                    YieldProcessor();
+                }
+                else
+                {
+                    ::SwitchToThread();
+                }
+            }
+        }
+
+        ~LbSpinLock() { ::InterlockedExchange(m_pLock, 0); }
+    };
+    //---------------------------------------------------------
+
+
+    const SIZE_T x_LbMaxName = 64;
+
+
+    //
+    // Named shared memory section.
+    //
+    class LbSection
+    {
+#ifdef _WIN32
+        HANDLE m_hMap;
+#else
+        SIZE_T m_cbView;
+        // Set when this section created the object, which it unlinks on Close.
+        char m_Name[x_LbMaxName];
+#endif
+        void* m_pView;
+
+    public:
+#ifdef _WIN32
+        LbSection() : m_hMap(nullptr), m_pView(nullptr) {}
+#else
+        LbSection() : m_cbView(0), m_pView(nullptr) { m_Name[0] = '\0'; }
+#endif
+        ~LbSection() { Close(); }
+
+        HRESULT Create(_In_z_ const WCHAR* name, SIZE_T cbSize);
+        HRESULT Open(_In_z_ const WCHAR* name);
+        void Close();
+
+        void* View() const { return m_pView; }
+        bool IsOpen() const { return m_pView != nullptr; }
+
+        static void FormatName(
+            _Out_writes_z_(cchName) WCHAR* name,
+            SIZE_T cchName,
+            _In_z_ const WCHAR* kind,
+            DWORD pid,
+            ULONG id
+        );
+
+#ifndef _WIN32
+        //
+        // Unlinks the sections left behind by an earlier process that had
+        // the given process ID and exited without closing them.
+        //
+        static void RemoveStale(DWORD pid);
+#endif
+    };
+
+
+    //
+    // Overlapped file backing an application's completion handle.
+    //
+    class LbOverlappedFile
+    {
+        friend class ListHelper<LbOverlappedFile>;
+
+        LIST_ENTRY m_link;
+        HANDLE m_hFile;
+#ifdef _WIN32
+        HANDLE m_hSignal;
+        BYTE m_Scratch;
+#else
+        // Signalled on every completion; m_hFile holds a duplicate.
+        int m_Event;
+#endif
+
+    public:
+        LbOverlappedFile();
+        ~LbOverlappedFile();
+
+        HRESULT Init(ULONG id);
+
+        HANDLE GetHandle() const { return m_hFile; }
+
+        static void Pend(_Inout_ OVERLAPPED* pOverlapped);
+        void Complete(_Inout_ OVERLAPPED* pOverlapped, HRESULT status);
+        HRESULT CompleteNow(_Inout_ OVERLAPPED* pOverlapped, HRESULT status);
+        HRESULT GetResult(_Inout_ OVERLAPPED* pOverlapped, BOOL wait);
+    };
+
+
+    class LbRequestOwner;
+
+    enum LbRequestType
+    {
+        LbRequestNotify,
+        LbRequestGetConnection,
+        LbRequestConnect,
+        LbRequestAccept,
+        LbRequestNotifyDisconnect
+    };
+
+    //
+    // Overlapped request waiting on a condition that another thread or
+    // process will satisfy.
+    //
+    class LbRequest : private ListLink
+    {
+        friend class ListLinkHelper<LbRequest>;
+
+    public:
+        LbRequestOwner* m_pOwner;
+        LbOverlappedFile* m_pFile;
+        OVERLAPPED* m_pOv;
+        LbRequestType m_Type;
+        ULONG m_Param;
+        void* m_pContext;
+    };
+
+    class LbRequestOwner
+    {
+    public:
+        //
+        // Called with the fabric lock held.  Returns true and sets *pStatus if
+        // the request can complete.
+        //
+        virtual bool CheckRequest(_In_ LbRequest* pRequest, _Out_ HRESULT* pStatus) PURE;
+    };
+
+
+    class LbFabric;
+
+
+    //---------------------------------------------------------
+    // Reference counting shared by all loopback objects.
+    //
+    template<typename TInterface>
+    class LbObject : public TInterface
+    {
+    protected:
+        volatile LONG m_nRef;
+
+    public:
+        LbObject() : m_nRef(1) {}
+        virtual ~LbObject() {}
+
+        IFACEMETHOD_(ULONG, AddRef)(THIS)
+        {
+            return ::InterlockedIncrement(&m_nRef);
+        }
+
+        IFACEMETHOD_(ULONG, Release)(THIS)
+        {
+            ULONG nRef = ::InterlockedDecrement(&m_nRef);
+            if (nRef == 0)
+            {
+                delete this;
+            }
+            return nRef;
+        }
+
+    protected:
+        HRESULT QueryInterfaceHelper(
+            REFIID riid,
+            _Deref_out_ LPVOID* ppvObj,
+            REFIID iid,
+            REFIID baseIid
+        )
+        {
+            if (InlineIsEqualGUID(riid, IID_IUnknown) ||
+                InlineIsEqualGUID(riid, iid) ||
+                InlineIsEqualGUID(riid, baseIid))
+            {
+                AddRef();
+                *ppvObj = static_cast<TInterface*>(this);
+                return S_OK;
+            }
+
+            *ppvObj = nullptr;
+            return E_NOINTERFACE;
+        }
+    };
+    //---------------------------------------------------------
+
+
+    class LbAdapter : public LbObject<IND2Adapter>
+    {
+        LbFabric* m_pFabric;
+        SOCKADDR_INET m_Address;
+        ULONG m_Id;
+
+        // Protects m_Files.
+        CRITICAL_SECTION m_lock;
+        List<LbOverlappedFile> m_Files;
+
+    public:
+        LbAdapter(_In_ LbFabric* pFabric);
+        ~LbAdapter();
+
+        HRESULT Init(_In_ const struct sockaddr* pAddress);
+
+        LbFabric* GetFabric() const { return m_pFabric; }
+        const SOCKADDR_INET& GetAddress() const { return m_Address; }
+        LbOverlappedFile* LookupFile(HANDLE hOverlappedFile);
+
+        static bool IsLoopback(_In_ const struct sockaddr* pAddress);
+        static ULONG SockaddrSize(_In_ const SOCKADDR_INET& addr);
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2Adapter methods ***
+        STDMETHOD(CreateOverlappedFile)(THIS_ HANDLE* phOverlappedFile) override;
+        STDMETHOD(Query)(THIS_ ND2_ADAPTER_INFO* pInfo, ULONG* pcbInfo) override;
+        STDMETHOD(QueryAddressList)(
+            THIS_ SOCKET_ADDRESS_LIST* pAddressList,
+            ULONG* pcbAddressList
+        ) override;
+        STDMETHOD(CreateCompletionQueue)(
+            THIS_ REFIID iid,
+            HANDLE hOverlappedFile,
+            ULONG queueDepth,
+            USHORT group,
+            KAFFINITY affinity,
+            VOID** ppCompletionQueue
+        ) override;
+        STDMETHOD(CreateMemoryRegion)(
+            THIS_ REFIID iid,
+            HANDLE hOverlappedFile,
+            VOID** ppMemoryRegion
+        ) override;
+        STDMETHOD(CreateMemoryWindow)(THIS_ REFIID iid, VOID** ppMemoryWindow) override;
+        STDMETHOD(CreateSharedReceiveQueue)(
+            THIS_ REFIID iid,
+            HANDLE hOverlappedFile,
+            ULONG queueDepth,
+            ULONG maxRequestSge,
+            ULONG notifyThreshold,
+            USHORT group,
+            KAFFINITY affinity,
+            VOID** ppSharedReceiveQueue
+        ) override;
+        STDMETHOD(CreateQueuePair)(
+            THIS_ REFIID iid,
+            IUnknown* pReceiveCompletionQueue,
+            IUnknown* pInitiatorCompletionQueue,
+            VOID* context,
+            ULONG receiveQueueDepth,
+            ULONG initiatorQueueDepth,
+            ULONG maxReceiveRequestSge,
+            ULONG maxInitiatorRequestSge,
+            ULONG inlineDataSize,
+            VOID** ppQueuePair
+        ) override;
+        STDMETHOD(CreateQueuePairWithSrq)(
+            THIS_ REFIID iid,
+            IUnknown* pReceiveCompletionQueue,
+            IUnknown* pInitiatorCompletionQueue,
+            IUnknown* pSharedReceiveQueue,
+            VOID* context,
+            ULONG initiatorQueueDepth,
+            ULONG maxInitiatorRequestSge,
+            ULONG inlineDataSize,
+            VOID** ppQueuePair
+        ) override;
+        STDMETHOD(CreateConnector)(THIS_ REFIID iid, HANDLE hOverlappedFile, VOID** ppConnector) override;
+        STDMETHOD(CreateListener)(THIS_ REFIID iid, HANDLE hOverlappedFile, VOID** ppListener) override;
+    };
+
+
+    class LbCompletionQueue : public LbObject<IND2CompletionQueue>, public LbRequestOwner
+    {
+        LbAdapter* m_pAdapter;
+        LbOverlappedFile* m_pFile;
+        ULONG m_Id;
+        LbSection m_Section;
+        LbCqShm* m_pShm;
+
+    public:
+        LbCompletionQueue(_In_ LbAdapter* pAdapter, _In_ LbOverlappedFile* pFile);
+        ~LbCompletionQueue();
+
+        HRESULT Init(ULONG queueDepth);
+
+        ULONG GetId() const { return m_Id; }
+        LbCqShm* GetShm() const { return m_pShm; }
+
+        static void Push(
+            _In_ LbFabric* pFabric,
+            _Inout_ LbCqShm* pCq,
+            HRESULT status,
+            ULONG bytesTransferred,
+            UINT64 queuePairContext,
+            UINT64 requestContext,
+            ND2_REQUEST_TYPE type,
+            bool solicited
+        );
+
+        bool CheckRequest(_In_ LbRequest* pRequest, _Out_ HRESULT* pStatus) override;
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2Overlapped methods ***
+        STDMETHOD(CancelOverlappedRequests)(THIS) override;
+        STDMETHOD(GetOverlappedResult)(THIS_ OVERLAPPED* pOverlapped, BOOL wait) override;
+
+        // *** IND2CompletionQueue methods ***
+        STDMETHOD(GetNotifyAffinity)(THIS_ USHORT* pGroup, KAFFINITY* pAffinity) override;
+        STDMETHOD(Resize)(THIS_ ULONG queueDepth) override;
+        STDMETHOD(Notify)(THIS_ ULONG type, OVERLAPPED* pOverlapped) override;
+        STDMETHOD_(ULONG, GetResults)(THIS_ ND2_RESULT results[], ULONG nResults) override;
+    };
+
+
+    class LbMemoryRegion : public LbObject<IND2MemoryRegion>
+    {
+        LbAdapter* m_pAdapter;
+        LbOverlappedFile* m_pFile;
+        ULONG m_Index;
+        LbMrEntry* m_pEntry;
+
+    public:
+        LbMemoryRegion(_In_ LbAdapter* pAdapter, _In_ LbOverlappedFile* pFile);
+        ~LbMemoryRegion();
+
+        HRESULT Init();
+
+        const LbMrEntry* GetEntry() const { return m_pEntry; }
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2Overlapped methods ***
+        STDMETHOD(CancelOverlappedRequests)(THIS) override;
+        STDMETHOD(GetOverlappedResult)(THIS_ OVERLAPPED* pOverlapped, BOOL wait) override;
+
+        // *** IND2MemoryRegion methods ***
+        STDMETHOD(Register)(
+            THIS_ const VOID* pBuffer,
+            SIZE_T cbBuffer,
+            ULONG flags,
+            OVERLAPPED* pOverlapped
+        ) override;
+        STDMETHOD(Deregister)(THIS_ OVERLAPPED* pOverlapped) override;
+        STDMETHOD_(UINT32, GetLocalToken)(THIS) override;
+        STDMETHOD_(UINT32, GetRemoteToken)(THIS) override;
+    };
+
+
+    class LbMemoryWindow : public LbObject<IND2MemoryWindow>
+    {
+        LbAdapter* m_pAdapter;
+        ULONG m_Index;
+        LbMrEntry* m_pEntry;
+
+    public:
+        LbMemoryWindow(_In_ LbAdapter* pAdapter);
+        ~LbMemoryWindow();
+
+        HRESULT Init();
+
+        LbMrEntry* GetEntry() const { return m_pEntry; }
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2MemoryWindow methods ***
+        STDMETHOD_(UINT32, GetRemoteToken)(THIS) override;
+    };
+
+
+    //
+    // One direction of a connection: requests queued on the initiator's send
+    // ring are matched against the target's receive ring.  All fields are
+    // views in the address space of the process that owns the path.
+    //
+    struct LbPath
+    {
+        LbQpShm* pInitiator;
+        LbCqShm* pInitiatorCq;
+        const LbMrTableShm* pInitiatorMr;
+        LbQpShm* pTarget;
+        LbCqShm* pTargetCq;
+        const LbMrTableShm* pTargetMr;
+    };
+
+
+    class LbQueuePair : public LbObject<IND2QueuePair>, private ListLink
+    {
+        friend class ListLinkHelper<LbQueuePair>;
+        friend class LbFabric;
+
+        LbAdapter* m_pAdapter;
+        LbFabric* m_pFabric;
+        LbCompletionQueue* m_pReceiveCq;
+        LbCompletionQueue* m_pInitiatorCq;
+        ULONG m_Id;
+        ULONG m_MaxReceiveSge;
+        ULONG m_MaxInitiatorSge;
+        ULONG m_InlineDataSize;
+
+        LbSection m_Section;
+        LbQpShm* m_pShm;
+
+        // Peer views, valid once connected.
+        LbSection m_PeerSection;
+        LbSection m_PeerReceiveCqSection;
+        LbSection m_PeerInitiatorCqSection;
+        LbSection m_PeerMrSection;
+        LbPath m_Out;
+        LbPath m_In;
+        volatile bool m_bConnected;
+
+    public:
+        LbQueuePair(
+            _In_ LbAdapter* pAdapter,
+            _In_ LbCompletionQueue* pReceiveCq,
+            _In_ LbCompletionQueue* pInitiatorCq
+        );
+        ~LbQueuePair();
+
+        HRESULT Init(
+            _In_opt_ VOID* context,
+            ULONG receiveQueueDepth,
+            ULONG initiatorQueueDepth,
+            ULONG maxReceiveRequestSge,
+            ULONG maxInitiatorRequestSge,
+            ULONG inlineDataSize
+        );
+
+        ULONG GetId() const { return m_Id; }
+        bool IsConnected() const { return m_bConnected; }
+        bool IsInError() const { return m_pShm->State == LbQpStateError; }
+
+        HRESULT ConnectTo(DWORD peerPid, ULONG peerQpId);
+        void Break();
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2QueuePair methods ***
+        STDMETHOD(Flush)(THIS) override;
+        STDMETHOD(Send)(
+            THIS_ VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            ULONG flags
+        ) override;
+        STDMETHOD(Receive)(
+            THIS_ VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge
+        ) override;
+        STDMETHOD(Bind)(
+            THIS_ VOID* requestContext,
+            IUnknown* pMemoryRegion,
+            IUnknown* pMemoryWindow,
+            const VOID* pBuffer,
+            SIZE_T cbBuffer,
+            ULONG flags
+        ) override;
+        STDMETHOD(Invalidate)(THIS_ VOID* requestContext, IUnknown* pMemoryWindow, ULONG flags) override;
+        STDMETHOD(Read)(
+            THIS_ VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        ) override;
+        STDMETHOD(Write)(
+            THIS_ VOID* requestContext,
+            const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        ) override;
+
+    private:
+        HRESULT PostRequest(
+            ND2_REQUEST_TYPE type,
+            _In_opt_ VOID* requestContext,
+            _In_reads_opt_(nSge) const ND2_SGE sge[],
+            ULONG nSge,
+            UINT64 remoteAddress,
+            UINT32 remoteToken,
+            ULONG flags
+        );
+        bool TimeoutSend(DWORD now);
+        void Drain(_In_ const LbPath& path);
+        HRESULT Execute(_In_ const LbPath& path, _In_ const LbSendWqe& wqe, _Out_ ULONG* pBytes, _Out_ bool* pBreak);
+        HRESULT CopyToReceive(
+            _In_ const LbPath& path,
+            _In_ const LbSendWqe& wqe,
+            _In_ const LbReceiveWqe& rwqe
+        );
+        void FlushPath(_In_ const LbPath& path);
+        void FlushLocal();
+    };
+
+
+    //
+    // Per-process state shared by all loopback adapters: the memory token
+    // table, the wake doorbell and the thread that completes pending requests.
+    //
+    class LbFabric
+    {
+        struct PeerProcess
+        {
+            DWORD Pid;
+#ifdef _WIN32
+            HANDLE hProcess;
+            HANDLE hWake;
+#else
+            // pidfd, readable once the process has exited.
+            int Process;
+#endif
+        };
+
+        volatile LONG m_nRef;
+        DWORD m_Pid;
+        volatile LONG m_NextId;
+
+        // Protects m_Requests and m_QueuePairs.
+        CRITICAL_SECTION m_lock;
+        List<LbRequest> m_Requests;
+        List<LbQueuePair> m_QueuePairs;
+
+        // Protects the memory table free list.
+        CRITICAL_SECTION m_MrLock;
+        LbSection m_MrSection;
+        LbMrTableShm* m_pMrTable;
+        ULONG* m_pFreeMr;
+        ULONG m_nFreeMr;
+
+        // Protects m_Peers.  Never held while acquiring any other lock.
+        CRITICAL_SECTION m_PeerLock;
+        PeerProcess m_Peers[x_LbMaxPeers];
+        ULONG m_nPeers;
+
+#ifdef _WIN32
+        HANDLE m_hWake;
+#else
+        // Datagram socket bound to the abstract address of this process.
+        int m_Wake;
+#endif
+        HANDLE m_hThread;
+        volatile bool m_bShutdown;
+
+    public:
+        LbFabric();
+        ~LbFabric();
+
+        HRESULT Init();
+
+        ULONG AddRef();
+        ULONG Release();
+
+        DWORD GetPid() const { return m_Pid; }
+        ULONG NextId() { return static_cast<ULONG>(::InterlockedIncrement(&m_NextId)); }
+
+        HRESULT AllocMr(_Out_ ULONG* pIndex);
+        void FreeMr(ULONG index);
+        LbMrEntry* GetMr(ULONG index) { return &m_pMrTable->Entries[index]; }
+        const LbMrTableShm* GetMrTable() const { return m_pMrTable; }
+
+        static UINT32 MakeToken(ULONG index, LONG key)
+        {
+            return static_cast<UINT32>(index << 16) | (static_cast<UINT32>(key) & 0xFFFF);
+        }
+
+        static bool ValidateToken(
+            _In_ const LbMrTableShm* pTable,
+            UINT32 token,
+            UINT64 address,
+            UINT64 length,
+            ULONG requiredFlags
+        );
+
+        HRESULT Copy(DWORD dstPid, UINT64 dst, DWORD srcPid, UINT64 src, SIZE_T cb);
+        void Wake(DWORD pid);
+        bool IsAlive(DWORD pid);
+
+        HRESULT QueueRequest(
+            _In_ LbRequestOwner* pOwner,
+            _In_ LbOverlappedFile* pFile,
+            _Inout_ OVERLAPPED* pOverlapped,
+            LbRequestType type,
+            ULONG param,
+            _In_opt_ void* pContext
+        );
+        void CancelRequests(_In_ LbRequestOwner* pOwner);
+
+        void AddQueuePair(_In_ LbQueuePair* pQp);
+        void RemoveQueuePair(_In_ LbQueuePair* pQp);
+
+    private:
+#ifdef _WIN32
+        HANDLE GetProcess(DWORD pid, bool wake);
+#else
+        int GetProcess(DWORD pid);
+#endif
+        void ProcessRequests();
+        void CheckTimeouts();
+        static DWORD WINAPI WakeThread(LPVOID pParam);
+    };
+
+
+    class LbConnector : public LbObject<IND2Connector>, public LbRequestOwner
+    {
+        LbAdapter* m_pAdapter;
+        LbFabric* m_pFabric;
+        LbOverlappedFile* m_pFile;
+        SOCKADDR_INET m_LocalAddress;
+        bool m_bBound;
+
+        LbConnSide m_Side;
+        LbSection m_ConnSection;
+        LbConnShm* m_pConn;
+        LbSection m_ListenerSection;
+        LbQueuePair* m_pQp;
+
+    public:
+        LbConnector(_In_ LbAdapter* pAdapter, _In_ LbOverlappedFile* pFile);
+        ~LbConnector();
+
+        HRESULT AttachIncoming(DWORD pid, ULONG connId);
+
+        bool CheckRequest(_In_ LbRequest* pRequest, _Out_ HRESULT* pStatus) override;
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2Overlapped methods ***
+        STDMETHOD(CancelOverlappedRequests)(THIS) override;
+        STDMETHOD(GetOverlappedResult)(THIS_ OVERLAPPED* pOverlapped, BOOL wait) override;
+
+        // *** IND2Connector methods ***
+        STDMETHOD(Bind)(THIS_ const struct sockaddr* pAddress, ULONG cbAddress) override;
+        STDMETHOD(Connect)(
+            THIS_ IUnknown* pQueuePair,
+            const struct sockaddr* pDestAddress,
+            ULONG cbDestAddress,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            const VOID* pPrivateData,
+            ULONG cbPrivateData,
+            OVERLAPPED* pOverlapped
+        ) override;
+        STDMETHOD(CompleteConnect)(THIS_ OVERLAPPED* pOverlapped) override;
+        STDMETHOD(Accept)(
+            THIS_ IUnknown* pQueuePair,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            const VOID* pPrivateData,
+            ULONG cbPrivateData,
+            OVERLAPPED* pOverlapped
+        ) override;
+        STDMETHOD(Reject)(THIS_ const VOID* pPrivateData, ULONG cbPrivateData) override;
+        STDMETHOD(GetReadLimits)(THIS_ ULONG* pInboundReadLimit, ULONG* pOutboundReadLimit) override;
+        STDMETHOD(GetPrivateData)(THIS_ VOID* pPrivateData, ULONG* pcbPrivateData) override;
+        STDMETHOD(GetLocalAddress)(THIS_ struct sockaddr* pAddress, ULONG* pcbAddress) override;
+        STDMETHOD(GetPeerAddress)(THIS_ struct sockaddr* pAddress, ULONG* pcbAddress) override;
+        STDMETHOD(NotifyDisconnect)(THIS_ OVERLAPPED* pOverlapped) override;
+        STDMETHOD(Disconnect)(THIS_ OVERLAPPED* pOverlapped) override;
+
+    private:
+        const LbPeerShm& Peer() const { return m_pConn->Peer[m_Side == LbConnActive ? LbConnPassive : LbConnActive]; }
+        LbPeerShm& Self() { return m_pConn->Peer[m_Side]; }
+        void FillSelf(
+            _In_ LbQueuePair* pQp,
+            ULONG inboundReadLimit,
+            ULONG outboundReadLimit,
+            _In_reads_bytes_opt_(cbPrivateData) const VOID* pPrivateData,
+            ULONG cbPrivateData
+        );
+        void Teardown();
+    };
+
+
+    class LbListener : public LbObject<IND2Listener>, public LbRequestOwner
+    {
+        LbAdapter* m_pAdapter;
+        LbFabric* m_pFabric;
+        LbOverlappedFile* m_pFile;
+        SOCKADDR_INET m_LocalAddress;
+        bool m_bBound;
+        LbSection m_Section;
+        LbListenerShm* m_pShm;
+
+    public:
+        LbListener(_In_ LbAdapter* pAdapter, _In_ LbOverlappedFile* pFile);
+        ~LbListener();
+
+        static void FormatName(_Out_writes_z_(cchName) WCHAR* name, SIZE_T cchName, USHORT port);
+
+        bool CheckRequest(_In_ LbRequest* pRequest, _Out_ HRESULT* pStatus) override;
+
+        // *** IUnknown methods ***
+        IFACEMETHOD(QueryInterface)(THIS_ REFIID riid, LPVOID* ppvObj) override;
+
+        // *** IND2Overlapped methods ***
+        STDMETHOD(CancelOverlappedRequests)(THIS) override;
+        STDMETHOD(GetOverlappedResult)(THIS_ OVERLAPPED* pOverlapped, BOOL wait) override;
+
+        // *** IND2Listener methods ***
+        STDMETHOD(Bind)(THIS_ const struct sockaddr* pAddress, ULONG cbAddress) override;
+        STDMETHOD(Listen)(THIS_ ULONG backlog) override;
+        STDMETHOD(GetLocalAddress)(THIS_ struct sockaddr* pAddress, ULONG* pcbAddress) override;
+        STDMETHOD(GetConnectionRequest)(THIS_ IUnknown* pConnector, OVERLAPPED* pOverlapped) override;
+
+    private:
+        bool PopRequest(_Out_ LbConnRef* pRef);
+    };
+
+
+    //
+    // Provider entry that the framework registers for loopback addresses.
+    // It is not backed by a DLL, so it never unloads.
+    //
+    class NdLoopbackProvider : public Provider
+    {
+        // Serializes creation of m_pFabric.
+        CRITICAL_SECTION m_lock;
+        LbFabric* volatile m_pFabric;
+
+    public:
+        NdLoopbackProvider();
+        ~NdLoopbackProvider();
+
+        static bool IsEnabled();
+        static ULONG AddressCount();
+
+        HRESULT OpenAdapter(
+            _In_ REFIID iid,
+            _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
+            _In_ ULONG cbAddress,
+            _Deref_out_ VOID** ppIAdapter
+        ) override;
+
+        HRESULT QueryAddressList(
+            _Out_opt_bytecap_post_bytecount_(*pcbAddressList, *pcbAddressList) SOCKET_ADDRESS_LIST* pAddressList,
+            _Inout_ ULONG* pcbAddressList
+        ) override;
+
+    private:
+        HRESULT GetFabric(_Out_ LbFabric** ppFabric);
+    };
+
+} // namespace NetworkDirect
+
+
+template<>
+class ListHelper<NetworkDirect::LbRequest> :
+    public ListLinkHelper<NetworkDirect::LbRequest>
+{
+};
+
+
+template<>
+class ListHelper<NetworkDirect::LbQueuePair> :
+    public ListLinkHelper<NetworkDirect::LbQueuePair>
+{
+};
@@ -0,0 +1,492 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+
+#include "precomp.h"
+#include "ndnotify.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+
+namespace NetworkDirect
+{
+
+#ifdef _WIN32
+    WsaNotificationSource::WsaNotificationSource() :
+        m_hIocp(nullptr),
+        m_hProviderChange(nullptr),
+        m_Socket(INVALID_SOCKET),
+        m_Shutdown(0)
+    {
+        ::ZeroMemory(m_Ov, sizeof(m_Ov));
+    }
+
+
+    WsaNotificationSource::~WsaNotificationSource()
+    {
+        if (m_hProviderChange != nullptr)
+        {
+            ::CloseHandle(m_hProviderChange);
+        }
+
+        if (m_Socket != INVALID_SOCKET)
+        {
+            ::closesocket(m_Socket);
+        }
+
+        if (m_hIocp != nullptr)
+        {
+            ::CloseHandle(m_hIocp);
+        }
+    }
+
+
+    HRESULT
+        WsaNotificationSource::Init()
+    {
+        // Create an IOCP to get all the different notifications:
+        // - provider change
+        // - address change
+        m_hIocp = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+        if (m_hIocp == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        // Create a socket for address changes.
+        m_Socket = ::WSASocketW(AF_INET, SOCK_STREAM, 0, nullptr, 0, WSA_FLAG_OVERLAPPED);
+        if (m_Socket == INVALID_SOCKET)
+        {
+            return HRESULT_FROM_WIN32(::WSAGetLastError());
+        }
+
+        // Bind the socket change handle to the IOCP.
+        HANDLE hIocp = ::CreateIoCompletionPort(
+            reinterpret_cast<HANDLE>(m_Socket), m_hIocp, ND_NOTIFY_ADDR_CHANGE, 0);
+        if (hIocp != m_hIocp)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        // Get provider change notification handle.
+        int ret = ::WSAProviderConfigChange(&m_hProviderChange, nullptr, nullptr);
+        if (ret != 0)
+        {
+            return HRESULT_FROM_WIN32(::WSAGetLastError());
+        }
+
+        // Bind the provider change handle to the IOCP.
+        __analysis_assume(m_hProviderChange != nullptr);
+        hIocp = ::CreateIoCompletionPort(
+            m_hProviderChange, m_hIocp, ND_NOTIFY_PROVIDER_CHANGE, 0);
+        if (hIocp != m_hIocp)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        // Request provider change notification.  The request must be armed
+        // here rather than on the first completion: a framework running the
+        // watcher thread builds its first lists directly and never posts a
+        // provider change, so nothing else would arm it.
+        ret = ::WSAProviderConfigChange(
+            &m_hProviderChange, &m_Ov[ND_NOTIFY_PROVIDER_CHANGE], nullptr);
+        if (ret != 0 && WSAGetLastError() != WSA_IO_PENDING)
+        {
+            return HRESULT_FROM_WIN32(::WSAGetLastError());
+        }
+
+        // Request address change notification.
+        DWORD BytesRet;
+        ret = ::WSAIoctl(m_Socket, SIO_ADDRESS_LIST_CHANGE, nullptr, 0, nullptr,
+            0, &BytesRet, &m_Ov[ND_NOTIFY_ADDR_CHANGE], nullptr);
+        if (ret != 0 && WSAGetLastError() != WSA_IO_PENDING)
+        {
+            return HRESULT_FROM_WIN32(::WSAGetLastError());
+        }
+
+        return S_OK;
+    }
+
+
+    HRESULT
+        WsaNotificationSource::GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        )
+    {
+        for (;;)
+        {
+            if (m_Shutdown != 0)
+            {
+                return ND_CANCELED;
+            }
+
+            DWORD len;
+            ULONG_PTR key;
+            OVERLAPPED* pOv;
+            INT status;
+            DWORD bytesRet;
+
+            BOOL ret = ::GetQueuedCompletionStatus(m_hIocp, &len, &key, &pOv, timeout);
+            if (ret == FALSE)
+            {
+                if (pOv == nullptr)
+                {
+                    return m_Shutdown != 0 ? ND_CANCELED : ND_TIMEOUT;
+                }
+
+                // TODO: Should we re-issue requests if they have failed?
+                // What if (can?) they immediately fail again to the IOCP?
+                // We'd end up stuck in this loop.
+                continue;
+            }
+
+            // Packets queued by Post carry no OVERLAPPED; only the
+            // completion of an outstanding request needs to re-issue it.
+            // Re-issuing for posted packets would put a second request on
+            // the OVERLAPPED that is still in flight.
+            if (pOv == nullptr && key < ND_NOTIFY_MAX)
+            {
+                *pType = static_cast<ND_NOTIFY_TYPE>(key);
+                return ND_SUCCESS;
+            }
+
+            switch (key)
+            {
+            case ND_NOTIFY_PROVIDER_CHANGE:
+                // Issue the next request for protocol catalog changes,
+                // in case things change while we are processing this event.
+                status = ::WSAProviderConfigChange(
+                    &m_hProviderChange, &m_Ov[ND_NOTIFY_PROVIDER_CHANGE], nullptr);
+                ASSERT(status == 0 || ::WSAGetLastError() == WSA_IO_PENDING);
+                break;
+
+            case ND_NOTIFY_ADDR_CHANGE:
+                // Issue the next request for address changes, in case
+                // things change while we are processing this event.
+                status = ::WSAIoctl(m_Socket, SIO_ADDRESS_LIST_CHANGE, nullptr, 0, nullptr,
+                    0, &bytesRet, &m_Ov[ND_NOTIFY_ADDR_CHANGE], nullptr);
+                ASSERT(status == 0 || ::WSAGetLastError() == WSA_IO_PENDING);
+                break;
+
+            case ND_NOTIFY_MAX:
+                // Posted by Shutdown.
+                return ND_CANCELED;
+
+            default:
+                ASSERT(key == ND_NOTIFY_PROVIDER_CHANGE ||
+                    key == ND_NOTIFY_ADDR_CHANGE);
+                continue;
+            }
+
+            *pType = static_cast<ND_NOTIFY_TYPE>(key);
+            return ND_SUCCESS;
+        }
+    }
+
+
+    HRESULT
+        WsaNotificationSource::Post(
+            _In_ ND_NOTIFY_TYPE type
+        )
+    {
+        ASSERT(type < ND_NOTIFY_MAX);
+
+        // The OVERLAPPED structures belong to the outstanding requests, so
+        // posted packets go without one.
+        BOOL ret = ::PostQueuedCompletionStatus(m_hIocp, 0, type, nullptr);
+        if (ret == FALSE)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+        return ND_SUCCESS;
+    }
+
+
+    void
+        WsaNotificationSource::Shutdown()
+    {
+        ::InterlockedExchange(&m_Shutdown, 1);
+        ::PostQueuedCompletionStatus(m_hIocp, 0, ND_NOTIFY_MAX, nullptr);
+    }
+#else
+    PosixNotificationSource::PosixNotificationSource() :
+        m_Inotify(-1),
+        m_Netlink(-1),
+        m_Shutdown(0)
+    {
+    }
+
+
+    PosixNotificationSource::~PosixNotificationSource()
+    {
+        if (m_Inotify != -1)
+        {
+            ::close(m_Inotify);
+        }
+
+        if (m_Netlink != -1)
+        {
+            ::close(m_Netlink);
+        }
+    }
+
+
+    HRESULT
+        PosixNotificationSource::Init()
+    {
+        HRESULT hr = m_Port.Init();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        // Watch the catalog's directory for provider changes.
+        m_Inotify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_Inotify == -1)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        char path[MAX_PATH];
+        ::snprintf(path, sizeof(path), "%s", NdPosixCatalogPath());
+        if (::inotify_add_watch(m_Inotify, ::dirname(path),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) == -1)
+        {
+            // Without a catalog directory there are no providers to track.
+            // The catalog is still read when the framework starts.
+            ::close(m_Inotify);
+            m_Inotify = -1;
+        }
+        else
+        {
+            hr = m_Port.Associate(m_Inotify, ND_NOTIFY_PROVIDER_CHANGE);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+
+        // Subscribe to address changes.
+        m_Netlink = ::socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_ROUTE);
+        if (m_Netlink == -1)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        struct sockaddr_nl addr;
+        ::ZeroMemory(&addr, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+        if (::bind(m_Netlink, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        return m_Port.Associate(m_Netlink, ND_NOTIFY_ADDR_CHANGE);
+    }
+
+
+    HRESULT
+        PosixNotificationSource::GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        )
+    {
+        for (;;)
+        {
+            if (m_Shutdown != 0)
+            {
+                return ND_CANCELED;
+            }
+
+            ULONG_PTR key;
+            HRESULT hr = m_Port.Wait(timeout, &key);
+            if (hr == ND_TIMEOUT)
+            {
+                return m_Shutdown != 0 ? ND_CANCELED : ND_TIMEOUT;
+            }
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            // Consume the pending events, so that the descriptor only becomes
+            // ready again for changes made after this point.
+            switch (key)
+            {
+            case ND_NOTIFY_PROVIDER_CHANGE:
+                if (m_Inotify != -1)
+                {
+                    Drain(m_Inotify);
+                }
+                break;
+
+            case ND_NOTIFY_ADDR_CHANGE:
+                Drain(m_Netlink);
+                break;
+
+            case ND_NOTIFY_MAX:
+                // Posted by Shutdown.
+                return ND_CANCELED;
+
+            default:
+                ASSERT(key == ND_NOTIFY_PROVIDER_CHANGE ||
+                    key == ND_NOTIFY_ADDR_CHANGE);
+                continue;
+            }
+
+            *pType = static_cast<ND_NOTIFY_TYPE>(key);
+            return ND_SUCCESS;
+        }
+    }
+
+
+    HRESULT
+        PosixNotificationSource::Post(
+            _In_ ND_NOTIFY_TYPE type
+        )
+    {
+        ASSERT(type < ND_NOTIFY_MAX);
+        return m_Port.Post(type);
+    }
+
+
+    void
+        PosixNotificationSource::Shutdown()
+    {
+        ::InterlockedExchange(&m_Shutdown, 1);
+        m_Port.Post(ND_NOTIFY_MAX);
+    }
+
+
+    void
+        PosixNotificationSource::Drain(
+            _In_ int fd
+        )
+    {
+        char buf[4096];
+        while (::read(fd, buf, sizeof(buf)) > 0)
+        {
+        }
+    }
+#endif
+
+
+    SyntheticNotificationSource::SyntheticNotificationSource() :
+#ifdef _WIN32
+        m_hIocp(nullptr),
+#endif
+        m_Shutdown(0)
+    {
+    }
+
+
+    SyntheticNotificationSource::~SyntheticNotificationSource()
+    {
+#ifdef _WIN32
+        if (m_hIocp != nullptr)
+        {
+            ::CloseHandle(m_hIocp);
+        }
+#endif
+    }
+
+
+    HRESULT
+        SyntheticNotificationSource::Init()
+    {
+#ifdef _WIN32
+        m_hIocp = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+        if (m_hIocp == nullptr)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+        return S_OK;
+#else
+        return m_Port.Init();
+#endif
+    }
+
+
+    HRESULT
+        SyntheticNotificationSource::GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        )
+    {
+        if (m_Shutdown != 0)
+        {
+            return ND_CANCELED;
+        }
+
+        ULONG_PTR key;
+#ifdef _WIN32
+        DWORD len;
+        OVERLAPPED* pOv;
+        if (::GetQueuedCompletionStatus(m_hIocp, &len, &key, &pOv, timeout) == FALSE)
+        {
+            return m_Shutdown != 0 ? ND_CANCELED : ND_TIMEOUT;
+        }
+#else
+        HRESULT hr = m_Port.Wait(timeout, &key);
+        if (hr == ND_TIMEOUT)
+        {
+            return m_Shutdown != 0 ? ND_CANCELED : ND_TIMEOUT;
+        }
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+#endif
+
+        if (key >= ND_NOTIFY_MAX)
+        {
+            // Posted by Shutdown.
+            return ND_CANCELED;
+        }
+
+        *pType = static_cast<ND_NOTIFY_TYPE>(key);
+        return ND_SUCCESS;
+    }
+
+
+    HRESULT
+        SyntheticNotificationSource::Post(
+            _In_ ND_NOTIFY_TYPE type
+        )
+    {
+        ASSERT(type < ND_NOTIFY_MAX);
+#ifdef _WIN32
+        if (::PostQueuedCompletionStatus(m_hIocp, 0, type, nullptr) == FALSE)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+        return ND_SUCCESS;
+#else
+        return m_Port.Post(type);
+#endif
+    }
+
+
+    void
+        SyntheticNotificationSource::Shutdown()
+    {
+        ::InterlockedExchange(&m_Shutdown, 1);
+#ifdef _WIN32
+        ::PostQueuedCompletionStatus(m_hIocp, 0, ND_NOTIFY_MAX, nullptr);
+#else
+        m_Port.Post(ND_NOTIFY_MAX);
+#endif
+    }
+
+} // namespace NetworkDirect
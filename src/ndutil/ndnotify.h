@@ -0,0 +1,154 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+
+#pragma once
+
+namespace NetworkDirect
+{
+
+    enum ND_NOTIFY_TYPE
+    {
+        ND_NOTIFY_PROVIDER_CHANGE,
+        ND_NOTIFY_ADDR_CHANGE,
+        ND_NOTIFY_MAX
+    };
+
+
+    //
+    // Source of provider catalog and address list change notifications.  The
+    // framework either polls it from the API calls, or blocks on it from a
+    // background watcher thread.  Sources other than the Winsock one can feed
+    // the framework a synthetic sequence of changes.
+    //
+    class NotificationSource
+    {
+    public:
+        virtual ~NotificationSource(void) {}
+
+        virtual HRESULT Init(void) PURE;
+
+        //
+        // Waits up to timeout milliseconds for a change.  Returns ND_SUCCESS
+        // with the type of change, ND_TIMEOUT if there was none, or
+        // ND_CANCELED once Shutdown has been called.  The source re-arms
+        // itself before returning, so that changes made while the caller
+        // processes this one are reported by a later call.
+        //
+        virtual HRESULT GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        ) PURE;
+
+        //
+        // Queues a notification, e.g. to force the initial catalog scan.
+        //
+        virtual HRESULT Post(_In_ ND_NOTIFY_TYPE type) PURE;
+
+        //
+        // Wakes any thread blocked in GetNotification.  Subsequent calls to
+        // GetNotification return ND_CANCELED.
+        //
+        virtual void Shutdown(void) PURE;
+    };
+
+
+#ifdef _WIN32
+    //
+    // Notifications from the Winsock provider catalog and the IP address
+    // list, delivered through an IOCP.
+    //
+    class WsaNotificationSource : public NotificationSource
+    {
+        HANDLE m_hIocp;
+        HANDLE m_hProviderChange;
+        // Socket for address list change notifications.
+        SOCKET m_Socket;
+        OVERLAPPED m_Ov[ND_NOTIFY_MAX];
+        volatile LONG m_Shutdown;
+
+    public:
+        WsaNotificationSource(void);
+        ~WsaNotificationSource(void);
+
+        HRESULT Init(void) override;
+
+        HRESULT GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        ) override;
+
+        HRESULT Post(_In_ ND_NOTIFY_TYPE type) override;
+
+        void Shutdown(void) override;
+    };
+#else
+    //
+    // Notifications from the file-based provider catalog (inotify on its
+    // directory) and the IP address list (rtnetlink), delivered through a
+    // CompletionPort.
+    //
+    class PosixNotificationSource : public NotificationSource
+    {
+        CompletionPort m_Port;
+        // Watches the catalog's directory, so that the catalog file can be
+        // replaced or created after startup.
+        int m_Inotify;
+        // Route netlink socket subscribed to address changes.
+        int m_Netlink;
+        volatile LONG m_Shutdown;
+
+    public:
+        PosixNotificationSource(void);
+        ~PosixNotificationSource(void);
+
+        HRESULT Init(void) override;
+
+        HRESULT GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        ) override;
+
+        HRESULT Post(_In_ ND_NOTIFY_TYPE type) override;
+
+        void Shutdown(void) override;
+
+    private:
+        static void Drain(_In_ int fd);
+    };
+#endif
+
+
+    //
+    // Source that only reports the notifications queued with Post.  Tests use
+    // it to feed the framework a scripted sequence of catalog and address
+    // changes, in place of the platform's source.
+    //
+    class SyntheticNotificationSource : public NotificationSource
+    {
+#ifdef _WIN32
+        HANDLE m_hIocp;
+#else
+        CompletionPort m_Port;
+#endif
+        volatile LONG m_Shutdown;
+
+    public:
+        SyntheticNotificationSource(void);
+        ~SyntheticNotificationSource(void);
+
+        HRESULT Init(void) override;
+
+        HRESULT GetNotification(
+            _In_ DWORD timeout,
+            _Out_ ND_NOTIFY_TYPE* pType
+        ) override;
+
+        HRESULT Post(_In_ ND_NOTIFY_TYPE type) override;
+
+        void Shutdown(void) override;
+    };
+
+} // namespace NetworkDirect
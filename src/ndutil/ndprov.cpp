@@ -17,17 +17,27 @@ namespace NetworkDirect
         m_hProvider(nullptr),
         m_pfnDllGetClassObject(nullptr),
         m_pfnDllCanUnloadNow(nullptr),
+        m_pIProvider(nullptr),
         m_Path(nullptr),
         m_Version(version),
-        m_Active(true)
+        m_Active(true),
+        m_WasActive(false),
+        m_nAdapterCacheHits(0),
+        m_nAdapterCacheMisses(0)
     {
         m_link.Flink = &m_link;
         m_link.Blink = &m_link;
+        ::InitializeSRWLock(&m_UnloadLock);
     }
 
 
     Provider::~Provider()
     {
+        if (m_pIProvider != nullptr)
+        {
+            m_pIProvider->Release();
+        }
+
         if (m_hProvider != nullptr)
         {
             ::FreeLibrary(m_hProvider);
@@ -95,8 +105,8 @@ namespace NetworkDirect
 
 
     //
-    // Serialization with TryUnload must be provided by the caller.  Multiple
-    // callers may call this function concurrently.
+    // The caller must hold m_UnloadLock shared.  Multiple callers may call
+    // this function concurrently.
     //
     HRESULT Provider::GetClassObject(
         _In_ const IID& iid,
@@ -152,27 +162,77 @@ namespace NetworkDirect
 
 
     //
-    // Strict serialization must be provided by the caller.
+    // Returns the provider object, creating it on first use.  The object is
+    // kept until the provider is unloaded, so the caller must hold
+    // m_UnloadLock shared while using it, and must not release it.
     //
-    bool Provider::TryUnload(void)
+    HRESULT Provider::GetProviderObject(
+        _Deref_out_ IUnknown** ppIProvider
+    )
     {
-        if (m_hProvider == nullptr)
+        IUnknown* pIProvider = m_pIProvider;
+        if (pIProvider == nullptr)
         {
-            return true;
+            HRESULT hr = CreateProviderObject(&pIProvider);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            IUnknown* pCurrentProvider = static_cast<IUnknown*>(
+                ::InterlockedCompareExchangePointer(
+                    reinterpret_cast<void* volatile*>(&m_pIProvider), pIProvider, nullptr)
+                );
+            if (pCurrentProvider != nullptr)
+            {
+                pIProvider->Release();
+                pIProvider = pCurrentProvider;
+            }
         }
 
-        ASSERT(m_pfnDllCanUnloadNow != nullptr);
+        *ppIProvider = pIProvider;
+        return S_OK;
+    }
+
 
-        HRESULT hr = m_pfnDllCanUnloadNow();
-        if (hr != S_OK)
+    //
+    // Callers of OpenAdapter and QueryAddressList no longer hold the
+    // framework lock, so unloading only proceeds if no other thread is using
+    // the provider DLL.
+    //
+    bool Provider::TryUnload(void)
+    {
+        if (::TryAcquireSRWLockExclusive(&m_UnloadLock) == FALSE)
         {
             return false;
         }
 
-        ::FreeLibrary(m_hProvider);
-        m_hProvider = nullptr;
+        // The provider object keeps the DLL in use.
+        if (m_pIProvider != nullptr)
+        {
+            m_pIProvider->Release();
+            m_pIProvider = nullptr;
+        }
+
+        bool unloaded = true;
+        if (m_hProvider != nullptr)
+        {
+            ASSERT(m_pfnDllCanUnloadNow != nullptr);
+
+            HRESULT hr = m_pfnDllCanUnloadNow();
+            if (hr == S_OK)
+            {
+                ::FreeLibrary(m_hProvider);
+                m_hProvider = nullptr;
+            }
+            else
+            {
+                unloaded = false;
+            }
+        }
 
-        return true;
+        ::ReleaseSRWLockExclusive(&m_UnloadLock);
+        return unloaded;
     }
 
 
@@ -182,11 +242,16 @@ namespace NetworkDirect
     }
 
 
+    NdV1Provider::~NdV1Provider()
+    {
+    }
+
+
     //
-    // Serialization with TryUnload must be provided by the caller.  Multiple
-    // callers may call this function concurrently.
+    // The caller must hold m_UnloadLock shared.  Multiple callers may call
+    // this function concurrently.
     //
-    HRESULT NdV1Provider::GetProvider(INDProvider** ppIProvider)
+    HRESULT NdV1Provider::CreateProviderObject(_Deref_out_ IUnknown** ppIProvider)
     {
         IClassFactory* pClassFactory;
         HRESULT hr = GetClassObject(
@@ -210,6 +275,19 @@ namespace NetworkDirect
     }
 
 
+    //
+    // The caller must hold m_UnloadLock shared, and must not release the
+    // provider object.
+    //
+    HRESULT NdV1Provider::GetProvider(INDProvider** ppIProvider)
+    {
+        IUnknown* pIProvider;
+        HRESULT hr = GetProviderObject(&pIProvider);
+        *ppIProvider = static_cast<INDProvider*>(pIProvider);
+        return hr;
+    }
+
+
     HRESULT
         NdV1Provider::OpenAdapter(
             _In_ REFIID iid,
@@ -224,9 +302,11 @@ namespace NetworkDirect
         }
 
         INDProvider* pIProvider;
+        ::AcquireSRWLockShared(&m_UnloadLock);
         HRESULT hr = GetProvider(&pIProvider);
         if (FAILED(hr))
         {
+            ::ReleaseSRWLockShared(&m_UnloadLock);
             TryUnload();
             return ND_INVALID_ADDRESS;
         }
@@ -237,9 +317,7 @@ namespace NetworkDirect
             reinterpret_cast<INDAdapter**>(ppIAdapter)
         );
 
-        pIProvider->Release();
-        TryUnload();
-
+        ::ReleaseSRWLockShared(&m_UnloadLock);
         return hr;
     }
 
@@ -251,9 +329,11 @@ namespace NetworkDirect
         )
     {
         INDProvider *pIProvider;
+        ::AcquireSRWLockShared(&m_UnloadLock);
         HRESULT hr = GetProvider(&pIProvider);
         if (FAILED(hr))
         {
+            ::ReleaseSRWLockShared(&m_UnloadLock);
             TryUnload();
             return ND_DEVICE_NOT_READY;
         }
@@ -262,22 +342,87 @@ namespace NetworkDirect
         hr = pIProvider->QueryAddressList(pAddressList, &cbAddressList);
         *pcbAddressList = static_cast<ULONG>(cbAddressList);
 
-        pIProvider->Release();
-        TryUnload();
-
+        ::ReleaseSRWLockShared(&m_UnloadLock);
         return hr;
     }
 
 
     NdProvider::NdProvider() :
-        Provider(ND_VERSION_2)
+        Provider(ND_VERSION_2),
+        m_CacheAdapters(IsAdapterCacheEnabled()),
+        m_nAdapters(0)
+    {
+        InitializeCriticalSection(&m_AdapterLock);
+    }
+
+
+    NdProvider::~NdProvider()
+    {
+        // Release our references while the provider DLL is still loaded.
+        FlushAdapterCache();
+        DeleteCriticalSection(&m_AdapterLock);
+    }
+
+
+    bool
+        NdProvider::IsAdapterCacheEnabled()
+    {
+        WCHAR value[8];
+        DWORD len = ::GetEnvironmentVariableW(L"ND_ADAPTER_CACHE", value, _countof(value));
+        return len > 0 && len < _countof(value) && value[0] == L'1';
+    }
+
+
+    void
+        NdProvider::FlushAdapterCache()
+    {
+        CachedAdapter adapters[x_MaxCachedAdapters];
+        ULONG nAdapters;
+        {
+            Lock lock(&m_AdapterLock);
+            nAdapters = m_nAdapters;
+            RtlCopyMemory(adapters, m_Adapters, sizeof(*adapters) * nAdapters);
+            m_nAdapters = 0;
+        }
+
+        //
+        // Keep the provider DLL loaded while releasing, as this may be the
+        // last reference on the adapter.
+        //
+        ::AcquireSRWLockShared(&m_UnloadLock);
+        for (ULONG i = 0; i < nAdapters; i++)
+        {
+            adapters[i].m_pAdapter->Release();
+        }
+        ::ReleaseSRWLockShared(&m_UnloadLock);
+    }
+
+
+    //
+    // The caller must hold m_UnloadLock shared.  Multiple callers may call
+    // this function concurrently.
+    //
+    HRESULT NdProvider::CreateProviderObject(_Deref_out_ IUnknown** ppIProvider)
+    {
+        return GetClassObject(IID_IND2Provider, reinterpret_cast<void**>(ppIProvider));
+    }
+
+
+    //
+    // The caller must hold m_UnloadLock shared, and must not release the
+    // provider object.
+    //
+    HRESULT NdProvider::GetProvider(IND2Provider** ppIProvider)
     {
+        IUnknown* pIProvider;
+        HRESULT hr = GetProviderObject(&pIProvider);
+        *ppIProvider = static_cast<IND2Provider*>(pIProvider);
+        return hr;
     }
 
 
     //
-    // Serialization with TryUnload must be provided by the caller.  Multiple
-    // callers may call this function concurrently.
+    // Multiple callers may call this function concurrently.
     //
     HRESULT NdProvider::OpenAdapter(
         _In_ REFIID iid,
@@ -287,12 +432,11 @@ namespace NetworkDirect
     )
     {
         IND2Provider* pIProvider;
-        HRESULT hr = GetClassObject(
-            IID_IND2Provider,
-            reinterpret_cast<void**>(&pIProvider)
-        );
+        ::AcquireSRWLockShared(&m_UnloadLock);
+        HRESULT hr = GetProvider(&pIProvider);
         if (FAILED(hr))
         {
+            ::ReleaseSRWLockShared(&m_UnloadLock);
             TryUnload();
             return ND_INVALID_ADDRESS;
         }
@@ -301,16 +445,91 @@ namespace NetworkDirect
         hr = pIProvider->ResolveAddress(pAddress, cbAddress, &id);
         if (FAILED(hr))
         {
-            pIProvider->Release();
-            TryUnload();
+            ::ReleaseSRWLockShared(&m_UnloadLock);
             return ND_INVALID_ADDRESS;
         }
 
-        hr = pIProvider->OpenAdapter(iid, id, ppIAdapter);
+        if (m_CacheAdapters)
+        {
+            hr = OpenCachedAdapter(pIProvider, iid, id, ppIAdapter);
+        }
+        else
+        {
+            hr = pIProvider->OpenAdapter(iid, id, ppIAdapter);
+        }
+
+        ::ReleaseSRWLockShared(&m_UnloadLock);
+        return hr;
+    }
+
+
+    //
+    // The caller must hold m_UnloadLock shared.
+    //
+    HRESULT
+        NdProvider::OpenCachedAdapter(
+            _In_ IND2Provider* pIProvider,
+            _In_ REFIID iid,
+            _In_ UINT64 id,
+            _Deref_out_ VOID** ppIAdapter
+        )
+    {
+        {
+            Lock lock(&m_AdapterLock);
+            for (ULONG i = 0; i < m_nAdapters; i++)
+            {
+                if (m_Adapters[i].m_Id == id)
+                {
+                    ::InterlockedIncrement64(&m_nAdapterCacheHits);
+                    return m_Adapters[i].m_pAdapter->QueryInterface(iid, ppIAdapter);
+                }
+            }
+        }
+
+        ::InterlockedIncrement64(&m_nAdapterCacheMisses);
 
-        pIProvider->Release();
-        TryUnload();
+        IND2Adapter* pAdapter;
+        HRESULT hr = pIProvider->OpenAdapter(
+            IID_IND2Adapter,
+            id,
+            reinterpret_cast<void**>(&pAdapter)
+        );
+        if (FAILED(hr))
+        {
+            return hr;
+        }
 
+        hr = pAdapter->QueryInterface(iid, ppIAdapter);
+        if (FAILED(hr))
+        {
+            pAdapter->Release();
+            return hr;
+        }
+
+        //
+        // The cache keeps the reference from OpenAdapter, unless another
+        // thread cached the same adapter first or the cache is full.
+        //
+        Lock lock(&m_AdapterLock);
+        for (ULONG i = 0; i < m_nAdapters; i++)
+        {
+            if (m_Adapters[i].m_Id == id)
+            {
+                pAdapter->Release();
+                return hr;
+            }
+        }
+
+        if (m_nAdapters < x_MaxCachedAdapters)
+        {
+            m_Adapters[m_nAdapters].m_Id = id;
+            m_Adapters[m_nAdapters].m_pAdapter = pAdapter;
+            m_nAdapters++;
+        }
+        else
+        {
+            pAdapter->Release();
+        }
         return hr;
     }
 
@@ -322,21 +541,18 @@ namespace NetworkDirect
         )
     {
         IND2Provider *pIProvider;
-        HRESULT hr = GetClassObject(
-            IID_IND2Provider,
-            reinterpret_cast<void**>(&pIProvider)
-        );
+        ::AcquireSRWLockShared(&m_UnloadLock);
+        HRESULT hr = GetProvider(&pIProvider);
         if (FAILED(hr))
         {
+            ::ReleaseSRWLockShared(&m_UnloadLock);
             TryUnload();
             return ND_DEVICE_NOT_READY;
         }
 
         hr = pIProvider->QueryAddressList(pAddressList, pcbAddressList);
 
-        pIProvider->Release();
-        TryUnload();
-
+        ::ReleaseSRWLockShared(&m_UnloadLock);
         return hr;
     }
 
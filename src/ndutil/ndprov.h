@@ -20,34 +20,61 @@ namespace NetworkDirect
     (*DLLCANUNLOADNOW)(void);
 
 
-    class Provider
+    //
+    // Providers have virtual functions, so they are linked through ListLink
+    // rather than an m_link member.
+    //
+    class Provider : private ListLink
     {
-        friend class ListHelper<Provider>;
+        friend class ListLinkHelper<Provider>;
 
         GUID m_Guid;
-        LIST_ENTRY m_link;
         HMODULE m_hProvider;
         DLLGETCLASSOBJECT m_pfnDllGetClassObject;
         DLLCANUNLOADNOW m_pfnDllCanUnloadNow;
+        // Provider object shared by all callers while the DLL is loaded.
+        IUnknown* volatile m_pIProvider;
         WCHAR* m_Path;
         int m_Version;
         bool m_Active;
+        // Whether the provider was active before the current catalog update.
+        bool m_WasActive;
 
     public:
         Provider(int version);
-        ~Provider(void);
+        virtual ~Provider(void);
         HRESULT Init(GUID& ProviderGuid);
         void MarkActive(void) { m_Active = true; }
         void MarkInactive(void) { m_Active = false; }
         bool IsActive(void) const { return m_Active; }
+
+        //
+        // Marks the provider inactive at the start of a catalog update,
+        // remembering whether it was active so changes can be counted.
+        //
+        void BeginUpdate(void) { m_WasActive = m_Active; m_Active = false; }
+        bool WasActive(void) const { return m_WasActive; }
         int GetVersion(void) const { return m_Version; }
 
         //
-        // GetClassObject and TryUnload require the caller to provide
-        // proper serialization.
+        // TryUnload does not wait for callers using the provider DLL; it
+        // returns false if the DLL is in use.  It releases the cached
+        // provider object first, so the object is recreated on next use even
+        // if the DLL stays loaded.
         //
         bool TryUnload(void);
 
+        //
+        // Releases the adapters cached by OpenAdapter, if any, so that the
+        // provider can be unloaded once callers release theirs.
+        //
+        virtual void FlushAdapterCache(void) {}
+
+        // Adapter opens answered from the adapter cache, and opens that had
+        // to go to the provider while the cache was enabled.
+        ULONG64 AdapterCacheHits(void) const { return m_nAdapterCacheHits; }
+        ULONG64 AdapterCacheMisses(void) const { return m_nAdapterCacheMisses; }
+
         virtual HRESULT OpenAdapter(
             _In_ REFIID iid,
             _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
@@ -68,11 +95,29 @@ namespace NetworkDirect
         }
 
     protected:
+        // Held shared while the provider DLL is in use, and exclusive to
+        // unload it.
+        SRWLOCK m_UnloadLock;
+
+        volatile LONG64 m_nAdapterCacheHits;
+        volatile LONG64 m_nAdapterCacheMisses;
+
         //
-        // GetClassObject and TryUnload require the caller to provide
-        // proper serialization.
+        // GetClassObject requires the caller to hold m_UnloadLock shared.
         //
         HRESULT GetClassObject(_In_ const IID& iid, _Out_ void** ppInterface);
+
+        HRESULT GetProviderObject(_Deref_out_ IUnknown** ppIProvider);
+
+        //
+        // Creates the provider object for GetProviderObject.  The caller
+        // holds m_UnloadLock shared.
+        //
+        virtual HRESULT CreateProviderObject(_Deref_out_ IUnknown** ppIProvider)
+        {
+            UNREFERENCED_PARAMETER(ppIProvider);
+            return E_NOINTERFACE;
+        }
     };
 
 
@@ -94,17 +139,46 @@ namespace NetworkDirect
             _Inout_ ULONG* pcbAddressList
         ) override;
 
+    protected:
+        HRESULT CreateProviderObject(_Deref_out_ IUnknown** ppIProvider) override;
+
     private:
         HRESULT GetProvider(INDProvider** ppIProvider);
     };
 
 
+    //
+    // When the adapter cache is enabled, OpenAdapter keeps a reference on
+    // each adapter it opens, and hands out further references to the same
+    // adapter for later opens of the same adapter ID.
+    //
     class NdProvider : public Provider
     {
+        static const ULONG x_MaxCachedAdapters = 8;
+
+        struct CachedAdapter
+        {
+            UINT64 m_Id;
+            IND2Adapter* m_pAdapter;
+        };
+
+        bool m_CacheAdapters;
+        CRITICAL_SECTION m_AdapterLock;
+        CachedAdapter m_Adapters[x_MaxCachedAdapters];
+        ULONG m_nAdapters;
+
     public:
         NdProvider();
         ~NdProvider();
 
+        //
+        // The adapter cache is opt-in: set ND_ADAPTER_CACHE=1 in the
+        // environment before calling NdStartup.
+        //
+        static bool IsAdapterCacheEnabled(void);
+
+        void FlushAdapterCache(void) override;
+
         HRESULT OpenAdapter(
             _In_ REFIID iid,
             _In_bytecount_(cbAddress) const struct sockaddr* pAddress,
@@ -116,6 +190,26 @@ namespace NetworkDirect
             _Out_opt_bytecap_post_bytecount_(*pcbAddressList, *pcbAddressList) SOCKET_ADDRESS_LIST* pAddressList,
             _Inout_ ULONG* pcbAddressList
         ) override;
+
+    protected:
+        HRESULT CreateProviderObject(_Deref_out_ IUnknown** ppIProvider) override;
+
+    private:
+        HRESULT GetProvider(IND2Provider** ppIProvider);
+
+        HRESULT OpenCachedAdapter(
+            _In_ IND2Provider* pIProvider,
+            _In_ REFIID iid,
+            _In_ UINT64 id,
+            _Deref_out_ VOID** ppIAdapter
+        );
     };
 
 } // namespace NetworkDirect
+
+
+template<>
+class ListHelper<NetworkDirect::Provider> :
+    public ListLinkHelper<NetworkDirect::Provider>
+{
+};
@@ -0,0 +1,277 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+
+#include "precomp.h"
+#include "ndsupport.h"
+#include "ndroute.h"
+
+
+namespace NetworkDirect
+{
+
+    RouteCache::RouteCache() :
+        m_nEntries(0),
+        m_iNext(0),
+        m_Epoch(0),
+        m_nHits(0),
+        m_nMisses(0),
+        m_nFlushes(0)
+    {
+        ::InitializeSRWLock(&m_lock);
+    }
+
+
+    bool
+        RouteCache::Lookup(
+            _In_ const struct sockaddr* pRemote,
+            _Out_ SOCKADDR_INET* pLocal
+        )
+    {
+        ::AcquireSRWLockShared(&m_lock);
+        const Entry* pMatch = Find(pRemote);
+        if (pMatch != nullptr)
+        {
+            *pLocal = pMatch->m_Local;
+        }
+        ::ReleaseSRWLockShared(&m_lock);
+
+        if (pMatch == nullptr)
+        {
+            ::InterlockedIncrement64(&m_nMisses);
+            return false;
+        }
+
+        ::InterlockedIncrement64(&m_nHits);
+        return true;
+    }
+
+
+    void
+        RouteCache::Lookup(
+            _In_ SIZE_T nAddresses,
+            _In_reads_(nAddresses) const SOCKADDR_INET* pRemote,
+            _Out_writes_(nAddresses) SOCKADDR_INET* pLocal,
+            _Inout_updates_(nAddresses) HRESULT* pResults
+        )
+    {
+        LONG64 nHits = 0;
+
+        ::AcquireSRWLockShared(&m_lock);
+        for (SIZE_T i = 0; i < nAddresses; i++)
+        {
+            if (pResults[i] != ND_PENDING)
+            {
+                continue;
+            }
+
+            const Entry* pMatch =
+                Find(reinterpret_cast<const struct sockaddr*>(&pRemote[i]));
+            if (pMatch != nullptr)
+            {
+                pLocal[i] = pMatch->m_Local;
+                pResults[i] = ND_SUCCESS;
+                nHits++;
+            }
+        }
+        ::ReleaseSRWLockShared(&m_lock);
+
+        ::InterlockedAdd64(&m_nHits, nHits);
+    }
+
+
+    void
+        RouteCache::Insert(
+            _In_ LONG epoch,
+            _In_ const struct sockaddr* pRemote,
+            _In_ const MIB_IPFORWARD_ROW2& route,
+            _In_ const SOCKADDR_INET& local
+        )
+    {
+        Entry entry;
+        ::ZeroMemory(&entry, sizeof(entry));
+
+        bool onLink;
+        if (pRemote->sa_family == AF_INET)
+        {
+            onLink = route.NextHop.Ipv4.sin_addr.s_addr == INADDR_ANY;
+            entry.m_Prefix.Ipv4.sin_family = AF_INET;
+            entry.m_Prefix.Ipv4.sin_addr =
+                reinterpret_cast<const struct sockaddr_in*>(pRemote)->sin_addr;
+            entry.m_PrefixLength = 32;
+        }
+        else
+        {
+            ASSERT(pRemote->sa_family == AF_INET6);
+            onLink = IN6_IS_ADDR_UNSPECIFIED(&route.NextHop.Ipv6.sin6_addr) != FALSE;
+            const struct sockaddr_in6* pRemote6 =
+                reinterpret_cast<const struct sockaddr_in6*>(pRemote);
+            entry.m_Prefix.Ipv6.sin6_family = AF_INET6;
+            entry.m_Prefix.Ipv6.sin6_addr = pRemote6->sin6_addr;
+            entry.m_Prefix.Ipv6.sin6_scope_id = pRemote6->sin6_scope_id;
+            entry.m_PrefixLength = 128;
+        }
+
+        //
+        // The route's prefix is already masked.  Keep the remote scope ID, so
+        // that link-local prefixes only match on the same interface.
+        //
+        if (onLink && route.DestinationPrefix.PrefixLength != 0 &&
+            route.DestinationPrefix.Prefix.si_family == pRemote->sa_family)
+        {
+            if (pRemote->sa_family == AF_INET)
+            {
+                entry.m_Prefix.Ipv4.sin_addr =
+                    route.DestinationPrefix.Prefix.Ipv4.sin_addr;
+            }
+            else
+            {
+                entry.m_Prefix.Ipv6.sin6_addr =
+                    route.DestinationPrefix.Prefix.Ipv6.sin6_addr;
+            }
+            entry.m_PrefixLength = route.DestinationPrefix.PrefixLength;
+        }
+        entry.m_Local = local;
+
+        ::AcquireSRWLockExclusive(&m_lock);
+        if (epoch == m_Epoch && !Contains(entry))
+        {
+            if (m_nEntries < x_MaxEntries)
+            {
+                m_Entries[m_nEntries++] = entry;
+            }
+            else
+            {
+                m_Entries[m_iNext] = entry;
+                m_iNext = (m_iNext + 1) % x_MaxEntries;
+            }
+        }
+        ::ReleaseSRWLockExclusive(&m_lock);
+    }
+
+
+    void
+        RouteCache::Flush()
+    {
+        ::AcquireSRWLockExclusive(&m_lock);
+        m_nEntries = 0;
+        m_iNext = 0;
+        ::InterlockedIncrement(&m_Epoch);
+        ::ReleaseSRWLockExclusive(&m_lock);
+
+        ::InterlockedIncrement64(&m_nFlushes);
+    }
+
+
+    void
+        RouteCache::QueryStatistics(
+            _Out_ ND_ROUTE_CACHE_STATISTICS* pStats
+        )
+    {
+        pStats->Hits = m_nHits;
+        pStats->Misses = m_nMisses;
+        pStats->Flushes = m_nFlushes;
+
+        ::AcquireSRWLockShared(&m_lock);
+        pStats->Entries = m_nEntries;
+        ::ReleaseSRWLockShared(&m_lock);
+    }
+
+
+    //
+    // Returns the entry with the longest prefix matching pRemote, so that a
+    // destination cached individually takes precedence over its subnet.  Must
+    // be called with m_lock held.
+    //
+    const RouteCache::Entry*
+        RouteCache::Find(
+            _In_ const struct sockaddr* pRemote
+        ) const
+    {
+        const Entry* pMatch = nullptr;
+        for (ULONG i = 0; i < m_nEntries; i++)
+        {
+            const Entry& entry = m_Entries[i];
+            if ((pMatch == nullptr || entry.m_PrefixLength > pMatch->m_PrefixLength) &&
+                PrefixMatches(entry.m_Prefix, entry.m_PrefixLength, pRemote))
+            {
+                pMatch = &entry;
+            }
+        }
+        return pMatch;
+    }
+
+
+    //
+    // Returns true if a concurrent miss already cached the same prefix.  Must
+    // be called with m_lock held.
+    //
+    bool
+        RouteCache::Contains(
+            _In_ const Entry& entry
+        ) const
+    {
+        for (ULONG i = 0; i < m_nEntries; i++)
+        {
+            if (m_Entries[i].m_PrefixLength == entry.m_PrefixLength &&
+                PrefixMatches(m_Entries[i].m_Prefix, m_Entries[i].m_PrefixLength,
+                    reinterpret_cast<const struct sockaddr*>(&entry.m_Prefix)))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    bool
+        RouteCache::PrefixMatches(
+            _In_ const SOCKADDR_INET& prefix,
+            _In_ UINT8 prefixLength,
+            _In_ const struct sockaddr* pAddr
+        )
+    {
+        if (prefix.si_family != pAddr->sa_family)
+        {
+            return false;
+        }
+
+        const BYTE* pPrefix;
+        const BYTE* pBytes;
+        if (pAddr->sa_family == AF_INET)
+        {
+            pPrefix = reinterpret_cast<const BYTE*>(&prefix.Ipv4.sin_addr);
+            pBytes = reinterpret_cast<const BYTE*>(
+                &reinterpret_cast<const struct sockaddr_in*>(pAddr)->sin_addr);
+        }
+        else
+        {
+            const struct sockaddr_in6* pAddr6 =
+                reinterpret_cast<const struct sockaddr_in6*>(pAddr);
+            if (prefix.Ipv6.sin6_scope_id != pAddr6->sin6_scope_id)
+            {
+                return false;
+            }
+            pPrefix = reinterpret_cast<const BYTE*>(&prefix.Ipv6.sin6_addr);
+            pBytes = reinterpret_cast<const BYTE*>(&pAddr6->sin6_addr);
+        }
+
+        ULONG nBytes = prefixLength / 8;
+        if (memcmp(pPrefix, pBytes, nBytes) != 0)
+        {
+            return false;
+        }
+
+        ULONG nBits = prefixLength % 8;
+        if (nBits == 0)
+        {
+            return true;
+        }
+
+        BYTE mask = static_cast<BYTE>(0xFF << (8 - nBits));
+        return ((pPrefix[nBytes] ^ pBytes[nBytes]) & mask) == 0;
+    }
+
+} // namespace NetworkDirect
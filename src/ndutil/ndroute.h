@@ -0,0 +1,103 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+
+#pragma once
+
+
+namespace NetworkDirect
+{
+
+    //
+    // Bounded cache of route lookups, mapping remote addresses to the local
+    // address used to reach them.
+    //
+    // Destinations reached through an on-link route are cached by the route's
+    // destination prefix, so that one lookup serves every peer on the subnet.
+    // Destinations reached through a gateway are cached individually, since a
+    // more specific route may exist for other destinations under the same
+    // prefix.  When full, entries are replaced in round-robin order.
+    //
+    // The cache is flushed on every address change notification, since the
+    // best route can change even when the ND address list doesn't.
+    // Lookups that started before a flush do not populate the cache.
+    //
+    class RouteCache
+    {
+        static const ULONG x_MaxEntries = 256;
+
+        struct Entry
+        {
+            SOCKADDR_INET m_Prefix;
+            UINT8 m_PrefixLength;
+            SOCKADDR_INET m_Local;
+        };
+
+        SRWLOCK m_lock;
+        Entry m_Entries[x_MaxEntries];
+        ULONG m_nEntries;
+        // Next entry to replace once the cache is full.
+        ULONG m_iNext;
+
+        // Incremented by each flush.
+        volatile LONG m_Epoch;
+
+        volatile LONG64 m_nHits;
+        volatile LONG64 m_nMisses;
+        volatile LONG64 m_nFlushes;
+
+    public:
+        RouteCache(void);
+
+        LONG Epoch(void) const { return m_Epoch; }
+
+        //
+        // Returns true and the local address if pRemote matches an entry.
+        //
+        bool Lookup(
+            _In_ const struct sockaddr* pRemote,
+            _Out_ SOCKADDR_INET* pLocal
+        );
+
+        //
+        // Looks up every entry of pRemote whose pResults entry is ND_PENDING
+        // while holding the lock once, and sets it to ND_SUCCESS on a hit.
+        // Only hits are counted; callers resolve the remaining entries with
+        // the single-address Lookup.
+        //
+        void Lookup(
+            _In_ SIZE_T nAddresses,
+            _In_reads_(nAddresses) const SOCKADDR_INET* pRemote,
+            _Out_writes_(nAddresses) SOCKADDR_INET* pLocal,
+            _Inout_updates_(nAddresses) HRESULT* pResults
+        );
+
+        //
+        // Caches the result of a route lookup for pRemote, unless the cache
+        // was flushed since epoch was read.
+        //
+        void Insert(
+            _In_ LONG epoch,
+            _In_ const struct sockaddr* pRemote,
+            _In_ const MIB_IPFORWARD_ROW2& route,
+            _In_ const SOCKADDR_INET& local
+        );
+
+        void Flush(void);
+
+        void QueryStatistics(_Out_ ND_ROUTE_CACHE_STATISTICS* pStats);
+
+    private:
+        const Entry* Find(_In_ const struct sockaddr* pRemote) const;
+        bool Contains(_In_ const Entry& entry) const;
+
+        static bool PrefixMatches(
+            _In_ const SOCKADDR_INET& prefix,
+            _In_ UINT8 prefixLength,
+            _In_ const struct sockaddr* pAddr
+        );
+    };
+
+} // namespace NetworkDirect
@@ -26,6 +26,10 @@
 #include "ndstatus.h"
 #include "nddef.h"
 
+#ifndef _WIN32
+#include <ndsalbegin.h>
+#endif
+
 
 //
 // Overlapped object
@@ -1340,4 +1344,8 @@ DECLARE_INTERFACE_(INDProvider, IUnknown)
 #define ND_LOCAL_LENGTH         ND_DATA_OVERRUN
 #define ND_INVALIDATION_ERROR   ND_INVALID_DEVICE_REQUEST
 
+#ifndef _WIN32
+#include <ndsalend.h>
+#endif
+
 #endif // _NDSPI_H_
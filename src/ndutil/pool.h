@@ -0,0 +1,126 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#pragma once
+
+namespace NetworkDirect
+{
+
+    //---------------------------------------------------------
+    //
+    //  class FixedPool
+    //
+    //  Fixed-size block allocator.  Blocks are carved out of slabs allocated
+    //  from ghHeap and recycled through a free list; slabs are only returned
+    //  to the heap when the pool is destroyed, so the pool must outlive every
+    //  block allocated from it.  Callers must serialize access.
+    //
+    //  Objects are constructed in place:
+    //
+    //      void* pMem = pool.Alloc();
+    //      T* p = (pMem == nullptr) ? nullptr : new (pMem) T(...);
+    //      ...
+    //      p->~T();
+    //      pool.Free(p);
+    //
+    //---------------------------------------------------------
+    class FixedPool
+    {
+        struct Block
+        {
+            Block* m_pNext;
+        };
+
+        SIZE_T m_cbBlock;
+        ULONG m_nBlocksPerSlab;
+        // Slabs are chained through their first block.
+        Block* m_pSlabs;
+        Block* m_pFree;
+
+        ULONG64 m_nAllocs;
+        ULONG64 m_nSlabs;
+
+    public:
+        FixedPool(SIZE_T cbBlock, ULONG nBlocksPerSlab) :
+            m_nBlocksPerSlab(nBlocksPerSlab),
+            m_pSlabs(nullptr),
+            m_pFree(nullptr),
+            m_nAllocs(0),
+            m_nSlabs(0)
+        {
+            ASSERT(nBlocksPerSlab > 1);
+
+            // Keep blocks pointer aligned so that any object can be placed.
+            m_cbBlock = (max(cbBlock, sizeof(Block)) + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+                ~static_cast<SIZE_T>(MEMORY_ALLOCATION_ALIGNMENT - 1);
+        }
+
+        ~FixedPool()
+        {
+            while (m_pSlabs != nullptr)
+            {
+                Block* pSlab = m_pSlabs;
+                m_pSlabs = pSlab->m_pNext;
+                ::HeapFree(ghHeap, 0, pSlab);
+            }
+        }
+
+        void* Alloc()
+        {
+            if (m_pFree == nullptr && !Grow())
+            {
+                return nullptr;
+            }
+
+            Block* pBlock = m_pFree;
+            m_pFree = pBlock->m_pNext;
+            m_nAllocs++;
+            return pBlock;
+        }
+
+        void Free(_In_opt_ void* p)
+        {
+            if (p == nullptr)
+            {
+                return;
+            }
+
+            Block* pBlock = static_cast<Block*>(p);
+            pBlock->m_pNext = m_pFree;
+            m_pFree = pBlock;
+        }
+
+        // Number of blocks handed out over the pool's lifetime.
+        ULONG64 AllocCount() const { return m_nAllocs; }
+
+        // Number of slabs allocated from the heap.
+        ULONG64 SlabCount() const { return m_nSlabs; }
+
+    private:
+        bool Grow()
+        {
+            BYTE* pSlab = static_cast<BYTE*>(
+                ::HeapAlloc(ghHeap, 0, m_cbBlock * m_nBlocksPerSlab));
+            if (pSlab == nullptr)
+            {
+                return false;
+            }
+
+            // The first block links the slab; the rest go on the free list.
+            reinterpret_cast<Block*>(pSlab)->m_pNext = m_pSlabs;
+            m_pSlabs = reinterpret_cast<Block*>(pSlab);
+
+            for (ULONG i = 1; i < m_nBlocksPerSlab; i++)
+            {
+                Free(pSlab + (m_cbBlock * i));
+            }
+
+            m_nSlabs++;
+            return true;
+        }
+    };
+    //---------------------------------------------------------
+
+} // namespace NetworkDirect
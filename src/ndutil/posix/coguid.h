@@ -0,0 +1,10 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Stands in for the Windows SDK header of the same name; see ndposix.h.
+//
+
+#pragma once
+
+#include "ndposix.h"
@@ -0,0 +1,16 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Stands in for the Windows SDK header of the same name; see ndposix.h.
+// GUIDs declared after this header is included are defined, not just
+// declared.  As with __declspec(selectany) on Windows, every translation unit
+// that includes this header may define them.
+//
+
+#include "ndposix.h"
+
+#undef DEFINE_GUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern "C" const GUID name; \
+    extern "C" const GUID __attribute__((weak)) name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
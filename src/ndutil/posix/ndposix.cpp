@@ -0,0 +1,1270 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// POSIX implementation of the platform layer declared in ndposix.h.
+//
+
+#include "ndposix.h"
+#include "ndstatus.h"
+#include "nddef.h"
+
+#include <new>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <ifaddrs.h>
+#include <linux/futex.h>
+
+
+namespace
+{
+
+    thread_local DWORD tLastError = NO_ERROR;
+
+    static const char x_DefaultCatalogPath[] = "/etc/networkdirect/providers.conf";
+
+    // Path and environment variable names are converted with a fixed buffer.
+    static const size_t x_MaxNarrow = 4096;
+
+
+    int
+        FutexWait(
+            _In_ volatile int* pAddr,
+            _In_ int value
+        )
+    {
+        return static_cast<int>(::syscall(SYS_futex, pAddr, FUTEX_WAIT_PRIVATE,
+            value, nullptr, nullptr, 0));
+    }
+
+
+    void
+        FutexWake(
+            _In_ volatile int* pAddr,
+            _In_ int count
+        )
+    {
+        ::syscall(SYS_futex, pAddr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+
+    pid_t
+        CurrentThreadId()
+    {
+        static thread_local pid_t tid = 0;
+        if (tid == 0)
+        {
+            tid = static_cast<pid_t>(::syscall(SYS_gettid));
+        }
+        return tid;
+    }
+
+
+    bool
+        ToNarrow(
+            _In_ LPCWSTR pSrc,
+            _Out_writes_(cch) char* pDst,
+            _In_ size_t cch
+        )
+    {
+        size_t len = ::wcstombs(pDst, pSrc, cch);
+        return len != static_cast<size_t>(-1) && len < cch;
+    }
+
+
+    //
+    // Parses "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}".
+    //
+    bool
+        ParseGuid(
+            _In_ const char* pStr,
+            _Out_ GUID* pGuid
+        )
+    {
+        unsigned int d1, d2, d3, b[8];
+        int n = 0;
+        if (::sscanf(pStr, "{%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x}%n",
+            &d1, &d2, &d3, &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &b[6], &b[7], &n) != 11 ||
+            n != 38)
+        {
+            return false;
+        }
+
+        pGuid->Data1 = d1;
+        pGuid->Data2 = static_cast<uint16_t>(d2);
+        pGuid->Data3 = static_cast<uint16_t>(d3);
+        for (int i = 0; i < 8; i++)
+        {
+            pGuid->Data4[i] = static_cast<uint8_t>(b[i]);
+        }
+        return true;
+    }
+
+
+    struct CatalogEntry
+    {
+        GUID m_ProviderId;
+        INT m_Version;
+        char m_Path[MAX_PATH];
+    };
+
+
+    //
+    // Reads the next valid entry from the catalog.  Malformed lines are
+    // skipped.  Returns false at the end of the file.
+    //
+    bool
+        ReadCatalogEntry(
+            _In_ FILE* pFile,
+            _Out_ CatalogEntry* pEntry
+        )
+    {
+        char line[MAX_PATH + 64];
+        while (::fgets(line, sizeof(line), pFile) != nullptr)
+        {
+            char* p = line;
+            while (isspace(static_cast<unsigned char>(*p)))
+            {
+                p++;
+            }
+            if (*p == '\0' || *p == '#')
+            {
+                continue;
+            }
+
+            char guid[40];
+            int version;
+            char path[MAX_PATH];
+            if (::sscanf(p, "%39s %d %259s", guid, &version, path) != 3 ||
+                !ParseGuid(guid, &pEntry->m_ProviderId))
+            {
+                continue;
+            }
+
+            switch (version)
+            {
+            case 1:
+                pEntry->m_Version = ND_VERSION_1;
+                break;
+            case 2:
+                pEntry->m_Version = ND_VERSION_2;
+                break;
+            default:
+                continue;
+            }
+
+            ::strcpy(pEntry->m_Path, path);
+            return true;
+        }
+        return false;
+    }
+
+
+    struct ThreadStart
+    {
+        pthread_t m_Thread;
+        LPTHREAD_START_ROUTINE m_pfnStart;
+        LPVOID m_pParameter;
+        bool m_Joined;
+    };
+
+
+    void*
+        ThreadTrampoline(
+            _In_ void* pParameter
+        )
+    {
+        ThreadStart* pStart = static_cast<ThreadStart*>(pParameter);
+        pStart->m_pfnStart(pStart->m_pParameter);
+        return nullptr;
+    }
+
+} // namespace
+
+
+DWORD
+    GetLastError()
+{
+    return tLastError;
+}
+
+
+void
+    SetLastError(
+        _In_ DWORD error
+    )
+{
+    tLastError = error;
+}
+
+
+//
+// CRITICAL_SECTION
+//
+void
+    InitializeCriticalSection(
+        _Out_ CRITICAL_SECTION* pCs
+    )
+{
+    pCs->m_State = 0;
+    pCs->m_Owner = 0;
+    pCs->m_Recursion = 0;
+}
+
+
+void
+    DeleteCriticalSection(
+        _Inout_ CRITICAL_SECTION* pCs
+    )
+{
+    UNREFERENCED_PARAMETER(pCs);
+}
+
+
+void
+    EnterCriticalSection(
+        _Inout_ CRITICAL_SECTION* pCs
+    )
+{
+    pid_t tid = CurrentThreadId();
+    if (__atomic_load_n(&pCs->m_Owner, __ATOMIC_RELAXED) == tid)
+    {
+        pCs->m_Recursion++;
+        return;
+    }
+
+    int state = 0;
+    if (!__atomic_compare_exchange_n(&pCs->m_State, &state, 1, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        // Contended: mark the lock as having waiters before sleeping.
+        if (state != 2)
+        {
+            state = __atomic_exchange_n(&pCs->m_State, 2, __ATOMIC_ACQUIRE);
+        }
+        while (state != 0)
+        {
+            FutexWait(&pCs->m_State, 2);
+            state = __atomic_exchange_n(&pCs->m_State, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    __atomic_store_n(&pCs->m_Owner, tid, __ATOMIC_RELAXED);
+    pCs->m_Recursion = 1;
+}
+
+
+BOOL
+    TryEnterCriticalSection(
+        _Inout_ CRITICAL_SECTION* pCs
+    )
+{
+    pid_t tid = CurrentThreadId();
+    if (__atomic_load_n(&pCs->m_Owner, __ATOMIC_RELAXED) == tid)
+    {
+        pCs->m_Recursion++;
+        return TRUE;
+    }
+
+    int state = 0;
+    if (!__atomic_compare_exchange_n(&pCs->m_State, &state, 1, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return FALSE;
+    }
+
+    __atomic_store_n(&pCs->m_Owner, tid, __ATOMIC_RELAXED);
+    pCs->m_Recursion = 1;
+    return TRUE;
+}
+
+
+void
+    LeaveCriticalSection(
+        _Inout_ CRITICAL_SECTION* pCs
+    )
+{
+    if (--pCs->m_Recursion != 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&pCs->m_Owner, 0, __ATOMIC_RELAXED);
+    if (__atomic_fetch_sub(&pCs->m_State, 1, __ATOMIC_RELEASE) != 1)
+    {
+        __atomic_store_n(&pCs->m_State, 0, __ATOMIC_RELEASE);
+        FutexWake(&pCs->m_State, 1);
+    }
+}
+
+
+//
+// SRWLOCK
+//
+static const int x_SrwExclusive = -1;
+
+
+void
+    InitializeSRWLock(
+        _Out_ SRWLOCK* pLock
+    )
+{
+    pLock->m_State = 0;
+    pLock->m_Sequence = 0;
+    pLock->m_Waiters = 0;
+}
+
+
+static void
+    SrwWait(
+        _Inout_ SRWLOCK* pLock,
+        _In_ int sequence
+    )
+{
+    __atomic_add_fetch(&pLock->m_Waiters, 1, __ATOMIC_SEQ_CST);
+    FutexWait(&pLock->m_Sequence, sequence);
+    __atomic_sub_fetch(&pLock->m_Waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void
+    SrwWake(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    __atomic_add_fetch(&pLock->m_Sequence, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pLock->m_Waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        FutexWake(&pLock->m_Sequence, INT_MAX);
+    }
+}
+
+
+void
+    AcquireSRWLockShared(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    for (;;)
+    {
+        // Read the sequence first, so that a release between the state check
+        // and the wait is not missed.
+        int sequence = __atomic_load_n(&pLock->m_Sequence, __ATOMIC_SEQ_CST);
+        int state = __atomic_load_n(&pLock->m_State, __ATOMIC_SEQ_CST);
+        if (state != x_SrwExclusive)
+        {
+            if (__atomic_compare_exchange_n(&pLock->m_State, &state, state + 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                return;
+            }
+            continue;
+        }
+        SrwWait(pLock, sequence);
+    }
+}
+
+
+void
+    ReleaseSRWLockShared(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    if (__atomic_sub_fetch(&pLock->m_State, 1, __ATOMIC_RELEASE) == 0)
+    {
+        SrwWake(pLock);
+    }
+}
+
+
+void
+    AcquireSRWLockExclusive(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    for (;;)
+    {
+        int sequence = __atomic_load_n(&pLock->m_Sequence, __ATOMIC_SEQ_CST);
+        if (TryAcquireSRWLockExclusive(pLock))
+        {
+            return;
+        }
+        SrwWait(pLock, sequence);
+    }
+}
+
+
+BOOL
+    TryAcquireSRWLockExclusive(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    int state = 0;
+    return __atomic_compare_exchange_n(&pLock->m_State, &state, x_SrwExclusive, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? TRUE : FALSE;
+}
+
+
+void
+    ReleaseSRWLockExclusive(
+        _Inout_ SRWLOCK* pLock
+    )
+{
+    __atomic_store_n(&pLock->m_State, 0, __ATOMIC_RELEASE);
+    SrwWake(pLock);
+}
+
+
+//
+// Heap
+//
+static int gProcessHeap;
+
+
+HANDLE
+    HeapCreate(
+        _In_ DWORD options,
+        _In_ SIZE_T cbInitial,
+        _In_ SIZE_T cbMaximum
+    )
+{
+    UNREFERENCED_PARAMETER(options);
+    UNREFERENCED_PARAMETER(cbInitial);
+    UNREFERENCED_PARAMETER(cbMaximum);
+    return &gProcessHeap;
+}
+
+
+BOOL
+    HeapDestroy(
+        _In_ HANDLE hHeap
+    )
+{
+    UNREFERENCED_PARAMETER(hHeap);
+    return TRUE;
+}
+
+
+LPVOID
+    HeapAlloc(
+        _In_ HANDLE hHeap,
+        _In_ DWORD flags,
+        _In_ SIZE_T cb
+    )
+{
+    UNREFERENCED_PARAMETER(hHeap);
+    if ((flags & HEAP_ZERO_MEMORY) != 0)
+    {
+        return ::calloc(1, cb);
+    }
+    return ::malloc(cb);
+}
+
+
+BOOL
+    HeapFree(
+        _In_ HANDLE hHeap,
+        _In_ DWORD flags,
+        _In_opt_ LPVOID p
+    )
+{
+    UNREFERENCED_PARAMETER(hHeap);
+    UNREFERENCED_PARAMETER(flags);
+    ::free(p);
+    return TRUE;
+}
+
+
+//
+// Threads and processors
+//
+HANDLE
+    CreateThread(
+        _In_opt_ void* pAttributes,
+        _In_ SIZE_T cbStack,
+        _In_ LPTHREAD_START_ROUTINE pfnStart,
+        _In_opt_ LPVOID pParameter,
+        _In_ DWORD flags,
+        _Out_opt_ DWORD* pThreadId
+    )
+{
+    UNREFERENCED_PARAMETER(pAttributes);
+    UNREFERENCED_PARAMETER(cbStack);
+    UNREFERENCED_PARAMETER(flags);
+
+    ThreadStart* pStart = new (std::nothrow) ThreadStart;
+    if (pStart == nullptr)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return nullptr;
+    }
+    pStart->m_pfnStart = pfnStart;
+    pStart->m_pParameter = pParameter;
+    pStart->m_Joined = false;
+
+    int ret = ::pthread_create(&pStart->m_Thread, nullptr, ThreadTrampoline, pStart);
+    if (ret != 0)
+    {
+        delete pStart;
+        SetLastError(static_cast<DWORD>(ret));
+        return nullptr;
+    }
+
+    if (pThreadId != nullptr)
+    {
+        *pThreadId = 0;
+    }
+    return pStart;
+}
+
+
+DWORD
+    WaitForSingleObject(
+        _In_ HANDLE hObject,
+        _In_ DWORD timeout
+    )
+{
+    ThreadStart* pStart = static_cast<ThreadStart*>(hObject);
+    if (pStart->m_Joined)
+    {
+        return WAIT_OBJECT_0;
+    }
+
+    int ret;
+    if (timeout == INFINITE)
+    {
+        ret = ::pthread_join(pStart->m_Thread, nullptr);
+    }
+    else
+    {
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += static_cast<long>(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        ret = ::pthread_timedjoin_np(pStart->m_Thread, nullptr, &deadline);
+        if (ret == ETIMEDOUT)
+        {
+            return WAIT_TIMEOUT;
+        }
+    }
+
+    if (ret != 0)
+    {
+        SetLastError(static_cast<DWORD>(ret));
+        return WAIT_FAILED;
+    }
+
+    pStart->m_Joined = true;
+    return WAIT_OBJECT_0;
+}
+
+
+BOOL
+    CloseHandle(
+        _In_ HANDLE hObject
+    )
+{
+    ThreadStart* pStart = static_cast<ThreadStart*>(hObject);
+    if (!pStart->m_Joined)
+    {
+        ::pthread_detach(pStart->m_Thread);
+    }
+    delete pStart;
+    return TRUE;
+}
+
+
+BOOL
+    SwitchToThread()
+{
+    return ::sched_yield() == 0 ? TRUE : FALSE;
+}
+
+
+DWORD
+    GetCurrentProcessorNumber()
+{
+    int cpu = ::sched_getcpu();
+    return cpu < 0 ? 0 : static_cast<DWORD>(cpu);
+}
+
+
+DWORD
+    GetCurrentProcessId()
+{
+    return static_cast<DWORD>(::getpid());
+}
+
+
+DWORD
+    GetTickCount()
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<DWORD>((now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+
+BOOL
+    WaitOnAddress(
+        _In_ volatile VOID* pAddress,
+        _In_ PVOID pCompare,
+        _In_ SIZE_T cbCompare,
+        _In_ DWORD timeout
+    )
+{
+    if (cbCompare != sizeof(int))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    struct timespec ts;
+    struct timespec* pTs = nullptr;
+    if (timeout != INFINITE)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        pTs = &ts;
+    }
+
+    int value;
+    ::memcpy(&value, pCompare, sizeof(value));
+    if (::syscall(SYS_futex, pAddress, FUTEX_WAIT_PRIVATE, value, pTs, nullptr, 0) != 0 &&
+        errno == ETIMEDOUT)
+    {
+        SetLastError(ERROR_TIMEOUT);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+void
+    WakeByAddressAll(
+        _In_ PVOID pAddress
+    )
+{
+    FutexWake(static_cast<volatile int*>(pAddress), INT_MAX);
+}
+
+
+//
+// Environment
+//
+DWORD
+    GetEnvironmentVariableW(
+        _In_ LPCWSTR name,
+        _Out_writes_(cch) LPWSTR pBuffer,
+        _In_ DWORD cch
+    )
+{
+    char narrowName[x_MaxNarrow];
+    if (!ToNarrow(name, narrowName, sizeof(narrowName)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    const char* pValue = ::getenv(narrowName);
+    if (pValue == nullptr)
+    {
+        SetLastError(ERROR_ENVVAR_NOT_FOUND);
+        return 0;
+    }
+
+    size_t len = ::mbstowcs(nullptr, pValue, 0);
+    if (len == static_cast<size_t>(-1))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    // As on Windows, return the required size including the terminator if
+    // the buffer is too small, and the length without it otherwise.
+    if (pBuffer == nullptr || len >= cch)
+    {
+        return static_cast<DWORD>(len + 1);
+    }
+
+    ::mbstowcs(pBuffer, pValue, cch);
+    return static_cast<DWORD>(len);
+}
+
+
+//
+// Expands %NAME% references.  References to undefined variables are left
+// as is.  Returns the number of characters needed, including the terminator.
+//
+DWORD
+    ExpandEnvironmentStringsW(
+        _In_ LPCWSTR pSrc,
+        _Out_writes_(cch) LPWSTR pDst,
+        _In_ DWORD cch
+    )
+{
+    DWORD nNeeded = 0;
+    for (LPCWSTR p = pSrc; *p != L'\0'; )
+    {
+        WCHAR value[x_MaxNarrow];
+        const WCHAR* pCopy = p;
+        size_t nCopy = 1;
+
+        const WCHAR* pEnd = (*p == L'%') ? ::wcschr(p + 1, L'%') : nullptr;
+        if (pEnd != nullptr && pEnd > p + 1 &&
+            static_cast<size_t>(pEnd - p - 1) < _countof(value))
+        {
+            WCHAR name[x_MaxNarrow];
+            ::wmemcpy(name, p + 1, pEnd - p - 1);
+            name[pEnd - p - 1] = L'\0';
+
+            DWORD len = GetEnvironmentVariableW(name, value, _countof(value));
+            if (len != 0 && len < _countof(value))
+            {
+                pCopy = value;
+                nCopy = len;
+                p = pEnd + 1;
+            }
+            else
+            {
+                nCopy = pEnd - p + 1;
+                p = pEnd + 1;
+            }
+        }
+        else
+        {
+            p++;
+        }
+
+        if (pDst != nullptr && nNeeded + nCopy < cch)
+        {
+            ::wmemcpy(pDst + nNeeded, pCopy, nCopy);
+        }
+        nNeeded += static_cast<DWORD>(nCopy);
+    }
+
+    if (pDst != nullptr && nNeeded < cch)
+    {
+        pDst[nNeeded] = L'\0';
+    }
+    return nNeeded + 1;
+}
+
+
+//
+// Dynamic loading
+//
+HMODULE
+    LoadLibraryExW(
+        _In_ LPCWSTR path,
+        _In_opt_ HANDLE hFile,
+        _In_ DWORD flags
+    )
+{
+    UNREFERENCED_PARAMETER(hFile);
+    UNREFERENCED_PARAMETER(flags);
+
+    char narrowPath[x_MaxNarrow];
+    if (!ToNarrow(path, narrowPath, sizeof(narrowPath)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+
+    HMODULE hModule = ::dlopen(narrowPath, RTLD_NOW | RTLD_LOCAL);
+    if (hModule == nullptr)
+    {
+        SetLastError(ERROR_MOD_NOT_FOUND);
+    }
+    return hModule;
+}
+
+
+FARPROC
+    GetProcAddress(
+        _In_ HMODULE hModule,
+        _In_ LPCSTR name
+    )
+{
+    void* pProc = ::dlsym(hModule, name);
+    if (pProc == nullptr)
+    {
+        SetLastError(ERROR_PROC_NOT_FOUND);
+    }
+    return reinterpret_cast<FARPROC>(pProc);
+}
+
+
+BOOL
+    FreeLibrary(
+        _In_ HMODULE hModule
+    )
+{
+    return ::dlclose(hModule) == 0 ? TRUE : FALSE;
+}
+
+
+//
+// CompletionPort
+//
+static const uint64_t x_PostKey = ~static_cast<uint64_t>(0);
+
+
+CompletionPort::CompletionPort() :
+    m_Epoll(-1),
+    m_Event(-1),
+    m_nPosted(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+
+CompletionPort::~CompletionPort()
+{
+    if (m_Event != -1)
+    {
+        ::close(m_Event);
+    }
+
+    if (m_Epoll != -1)
+    {
+        ::close(m_Epoll);
+    }
+
+    DeleteCriticalSection(&m_lock);
+}
+
+
+HRESULT
+    CompletionPort::Init()
+{
+    m_Epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_Epoll == -1)
+    {
+        return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+    }
+
+    m_Event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_Event == -1)
+    {
+        return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = x_PostKey;
+    if (::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Event, &ev) != 0)
+    {
+        return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+    }
+    return ND_SUCCESS;
+}
+
+
+HRESULT
+    CompletionPort::Associate(
+        _In_ int fd,
+        _In_ ULONG_PTR key
+    )
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = key;
+    if (::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+    }
+    return ND_SUCCESS;
+}
+
+
+HRESULT
+    CompletionPort::Post(
+        _In_ ULONG_PTR key
+    )
+{
+    EnterCriticalSection(&m_lock);
+    if (m_nPosted == x_MaxPosted)
+    {
+        LeaveCriticalSection(&m_lock);
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+    m_Posted[m_nPosted++] = key;
+    LeaveCriticalSection(&m_lock);
+
+    uint64_t one = 1;
+    if (::write(m_Event, &one, sizeof(one)) != sizeof(one))
+    {
+        return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+    }
+    return ND_SUCCESS;
+}
+
+
+HRESULT
+    CompletionPort::Wait(
+        _In_ DWORD timeout,
+        _Out_ ULONG_PTR* pKey
+    )
+{
+    for (;;)
+    {
+        // Posted packets are delivered in order, ahead of ready descriptors.
+        EnterCriticalSection(&m_lock);
+        if (m_nPosted != 0)
+        {
+            *pKey = m_Posted[0];
+            m_nPosted--;
+            ::memmove(&m_Posted[0], &m_Posted[1], sizeof(m_Posted[0]) * m_nPosted);
+            LeaveCriticalSection(&m_lock);
+            return ND_SUCCESS;
+        }
+        LeaveCriticalSection(&m_lock);
+
+        struct epoll_event ev;
+        int ret = ::epoll_wait(m_Epoll, &ev, 1,
+            timeout == INFINITE ? -1 : static_cast<int>(min<DWORD>(timeout, INT_MAX)));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return HRESULT_FROM_WIN32(static_cast<unsigned long>(errno));
+        }
+
+        if (ret == 0)
+        {
+            return ND_TIMEOUT;
+        }
+
+        if (ev.data.u64 != x_PostKey)
+        {
+            *pKey = static_cast<ULONG_PTR>(ev.data.u64);
+            return ND_SUCCESS;
+        }
+
+        // Reset the event, then pick up the posted packet.
+        uint64_t count;
+        ssize_t cb = ::read(m_Event, &count, sizeof(count));
+        UNREFERENCED_PARAMETER(cb);
+    }
+}
+
+
+//
+// Provider catalog
+//
+const char*
+    NdPosixCatalogPath()
+{
+    const char* pPath = ::getenv("ND_PROVIDER_CATALOG");
+    return (pPath != nullptr && *pPath != '\0') ? pPath : x_DefaultCatalogPath;
+}
+
+
+int
+    WSCEnumProtocols(
+        _In_opt_ INT* pProtocols,
+        _Out_writes_bytes_(*pcbBuffer) WSAPROTOCOL_INFOW* pBuffer,
+        _Inout_ DWORD* pcbBuffer,
+        _Out_ INT* pErr
+    )
+{
+    UNREFERENCED_PARAMETER(pProtocols);
+
+    // A missing catalog means that no providers are installed.
+    FILE* pFile = ::fopen(NdPosixCatalogPath(), "r");
+    if (pFile == nullptr)
+    {
+        return 0;
+    }
+
+    DWORD nEntries = 0;
+    DWORD nMax = (pBuffer == nullptr) ? 0 : *pcbBuffer / sizeof(WSAPROTOCOL_INFOW);
+    CatalogEntry entry;
+    while (ReadCatalogEntry(pFile, &entry))
+    {
+        if (nEntries < nMax)
+        {
+            // Fill in the entry so that it passes the framework's checks
+            // for NetworkDirect providers.
+            WSAPROTOCOL_INFOW& info = pBuffer[nEntries];
+            ::memset(&info, 0, sizeof(info));
+            info.dwServiceFlags1 = XP1_GUARANTEED_DELIVERY | XP1_GUARANTEED_ORDER |
+                XP1_MESSAGE_ORIENTED | XP1_CONNECT_DATA;
+            info.dwProviderFlags = PFL_HIDDEN | PFL_NETWORKDIRECT_PROVIDER;
+            info.ProviderId = entry.m_ProviderId;
+            info.iVersion = entry.m_Version;
+            info.iAddressFamily = AF_INET;
+            info.iSocketType = -1;
+            info.iProtocol = 0;
+            info.iProtocolMaxOffset = 0;
+        }
+        nEntries++;
+    }
+    ::fclose(pFile);
+
+    if (nEntries > nMax)
+    {
+        *pcbBuffer = nEntries * sizeof(WSAPROTOCOL_INFOW);
+        *pErr = WSAENOBUFS;
+        return SOCKET_ERROR;
+    }
+    return static_cast<int>(nEntries);
+}
+
+
+int
+    WSCGetProviderPath(
+        _In_ GUID* pProviderId,
+        _Out_writes_(*pcchPath) WCHAR* pPath,
+        _Inout_ INT* pcchPath,
+        _Out_ INT* pErr
+    )
+{
+    FILE* pFile = ::fopen(NdPosixCatalogPath(), "r");
+    if (pFile == nullptr)
+    {
+        *pErr = WSAEINVAL;
+        return SOCKET_ERROR;
+    }
+
+    CatalogEntry entry;
+    bool found = false;
+    while (ReadCatalogEntry(pFile, &entry))
+    {
+        if (InlineIsEqualGUID(entry.m_ProviderId, *pProviderId))
+        {
+            found = true;
+            break;
+        }
+    }
+    ::fclose(pFile);
+
+    if (!found)
+    {
+        *pErr = WSAEINVAL;
+        return SOCKET_ERROR;
+    }
+
+    size_t len = ::mbstowcs(nullptr, entry.m_Path, 0);
+    if (len == static_cast<size_t>(-1))
+    {
+        *pErr = WSAEINVAL;
+        return SOCKET_ERROR;
+    }
+
+    if (len >= static_cast<size_t>(*pcchPath))
+    {
+        *pcchPath = static_cast<INT>(len + 1);
+        *pErr = WSAEFAULT;
+        return SOCKET_ERROR;
+    }
+
+    ::mbstowcs(pPath, entry.m_Path, *pcchPath);
+    *pcchPath = static_cast<INT>(len + 1);
+    return 0;
+}
+
+
+//
+// Routing
+//
+static const UINT8*
+    AddressBytes(
+        _In_ const struct sockaddr* pAddr,
+        _Out_ ULONG* pcbAddr
+    )
+{
+    if (pAddr->sa_family == AF_INET)
+    {
+        *pcbAddr = sizeof(struct in_addr);
+        return reinterpret_cast<const UINT8*>(
+            &reinterpret_cast<const struct sockaddr_in*>(pAddr)->sin_addr);
+    }
+    *pcbAddr = sizeof(struct in6_addr);
+    return reinterpret_cast<const UINT8*>(
+        &reinterpret_cast<const struct sockaddr_in6*>(pAddr)->sin6_addr);
+}
+
+
+//
+// Finds the interface holding the source address, and if the destination is
+// within its subnet returns the masked on-link prefix.
+//
+static bool
+    GetOnLinkPrefix(
+        _In_ const SOCKADDR_INET& source,
+        _In_ const SOCKADDR_INET& destination,
+        _Out_ IP_ADDRESS_PREFIX* pPrefix
+    )
+{
+    struct ifaddrs* pIfList;
+    if (::getifaddrs(&pIfList) != 0)
+    {
+        return false;
+    }
+
+    ULONG cbAddr;
+    const UINT8* pSource =
+        AddressBytes(reinterpret_cast<const struct sockaddr*>(&source), &cbAddr);
+    const UINT8* pDest =
+        AddressBytes(reinterpret_cast<const struct sockaddr*>(&destination), &cbAddr);
+
+    const UINT8* pMask = nullptr;
+    for (struct ifaddrs* pIf = pIfList; pIf != nullptr; pIf = pIf->ifa_next)
+    {
+        if (pIf->ifa_addr == nullptr || pIf->ifa_netmask == nullptr ||
+            pIf->ifa_addr->sa_family != source.si_family)
+        {
+            continue;
+        }
+        if (source.si_family == AF_INET6 &&
+            reinterpret_cast<const struct sockaddr_in6*>(pIf->ifa_addr)->sin6_scope_id !=
+                source.Ipv6.sin6_scope_id)
+        {
+            continue;
+        }
+        if (::memcmp(AddressBytes(pIf->ifa_addr, &cbAddr), pSource, cbAddr) == 0)
+        {
+            pMask = AddressBytes(pIf->ifa_netmask, &cbAddr);
+            break;
+        }
+    }
+
+    bool onLink = (pMask != nullptr);
+    if (onLink)
+    {
+        ::memset(pPrefix, 0, sizeof(*pPrefix));
+        pPrefix->Prefix.si_family = destination.si_family;
+        if (destination.si_family == AF_INET6)
+        {
+            pPrefix->Prefix.Ipv6.sin6_scope_id = destination.Ipv6.sin6_scope_id;
+        }
+        UINT8* pPrefixBytes = const_cast<UINT8*>(AddressBytes(
+            reinterpret_cast<const struct sockaddr*>(&pPrefix->Prefix), &cbAddr));
+        for (ULONG i = 0; i < cbAddr && onLink; i++)
+        {
+            onLink = ((pDest[i] ^ pSource[i]) & pMask[i]) == 0;
+            pPrefixBytes[i] = pDest[i] & pMask[i];
+            pPrefix->PrefixLength += static_cast<UINT8>(__builtin_popcount(pMask[i]));
+        }
+    }
+
+    ::freeifaddrs(pIfList);
+    return onLink;
+}
+
+
+DWORD
+    GetBestRoute2(
+        _In_opt_ NET_LUID* pInterfaceLuid,
+        _In_ NET_IFINDEX interfaceIndex,
+        _In_opt_ const SOCKADDR_INET* pSourceAddress,
+        _In_ const SOCKADDR_INET* pDestinationAddress,
+        _In_ ULONG addressSortOptions,
+        _Out_ MIB_IPFORWARD_ROW2* pBestRoute,
+        _Out_ SOCKADDR_INET* pBestSourceAddress
+    )
+{
+    UNREFERENCED_PARAMETER(pInterfaceLuid);
+    UNREFERENCED_PARAMETER(interfaceIndex);
+    UNREFERENCED_PARAMETER(pSourceAddress);
+    UNREFERENCED_PARAMETER(addressSortOptions);
+
+    socklen_t cbAddr;
+    switch (pDestinationAddress->si_family)
+    {
+    case AF_INET:
+        cbAddr = sizeof(pDestinationAddress->Ipv4);
+        break;
+    case AF_INET6:
+        cbAddr = sizeof(pDestinationAddress->Ipv6);
+        break;
+    default:
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    int s = ::socket(pDestinationAddress->si_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s == -1)
+    {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Connecting a datagram socket selects a route without sending anything.
+    // The port only needs to be non-zero.
+    SOCKADDR_INET dest = *pDestinationAddress;
+    if (dest.si_family == AF_INET)
+    {
+        dest.Ipv4.sin_port = htons(9);
+    }
+    else
+    {
+        dest.Ipv6.sin6_port = htons(9);
+    }
+
+    DWORD ret = NO_ERROR;
+    if (::connect(s, reinterpret_cast<const struct sockaddr*>(&dest), cbAddr) != 0)
+    {
+        ret = (errno == EHOSTUNREACH) ? ERROR_HOST_UNREACHABLE : ERROR_NETWORK_UNREACHABLE;
+    }
+    else
+    {
+        ::memset(pBestSourceAddress, 0, sizeof(*pBestSourceAddress));
+        socklen_t cbLocal = sizeof(*pBestSourceAddress);
+        if (::getsockname(s, reinterpret_cast<struct sockaddr*>(pBestSourceAddress),
+            &cbLocal) != 0)
+        {
+            ret = ERROR_NOT_FOUND;
+        }
+        else
+        {
+            if (pBestSourceAddress->si_family == AF_INET)
+            {
+                pBestSourceAddress->Ipv4.sin_port = 0;
+            }
+            else
+            {
+                pBestSourceAddress->Ipv6.sin6_port = 0;
+            }
+
+            //
+            // A destination in the subnet of the source interface is reached
+            // directly, so report the subnet with no next hop, as Windows
+            // does.  Otherwise the gateway isn't known; report a host route
+            // through the destination, so the result is only reused for
+            // this destination.
+            //
+            ::memset(pBestRoute, 0, sizeof(*pBestRoute));
+            if (GetOnLinkPrefix(*pBestSourceAddress, *pDestinationAddress,
+                &pBestRoute->DestinationPrefix))
+            {
+                pBestRoute->NextHop.si_family = pDestinationAddress->si_family;
+            }
+            else
+            {
+                pBestRoute->DestinationPrefix.Prefix = *pDestinationAddress;
+                pBestRoute->DestinationPrefix.PrefixLength =
+                    (pDestinationAddress->si_family == AF_INET) ? 32 : 128;
+                pBestRoute->NextHop = *pDestinationAddress;
+            }
+        }
+    }
+
+    ::close(s);
+    return ret;
+}
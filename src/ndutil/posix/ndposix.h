@@ -0,0 +1,589 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// POSIX platform layer for ndutil.
+//
+// The framework is written against the subset of Win32 declared here.  On
+// POSIX systems this directory is put on the include path, so that the
+// Windows SDK headers the framework includes (winsock2.h, unknwn.h,
+// ndstatus.h, ...) resolve to the declarations below, backed by:
+//
+//  - locks:            futexes (CRITICAL_SECTION, SRWLOCK, WaitOnAddress)
+//  - heap:             malloc (HeapCreate, HeapAlloc, HeapFree)
+//  - completion ports: epoll and eventfd (CompletionPort)
+//  - dynamic loading:  dlopen (LoadLibraryExW, GetProcAddress, FreeLibrary)
+//  - provider catalog: a text file (WSCEnumProtocols, WSCGetProviderPath)
+//
+// The provider catalog is read from the file named by ND_PROVIDER_CATALOG,
+// or /etc/networkdirect/providers.conf.  Each line names a provider:
+//
+//      <provider GUID> <ND version: 1 or 2> <path to shared object>
+//
+// for example:
+//
+//      {12345678-1234-1234-1234-123456789abc} 2 /usr/lib/libndprov.so
+//
+// Blank lines and lines starting with '#' are ignored.  Providers export
+// DllGetClassObject and DllCanUnloadNow with C linkage.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+//
+// Calling conventions and annotations.
+//
+#define __stdcall
+#define __cdecl
+#define WINAPI
+#define STDMETHODCALLTYPE
+#define STDAPI              extern "C" HRESULT
+#define EXTERN_C            extern "C"
+#define PURE                = 0
+#define FORCEINLINE         inline __attribute__((always_inline))
+
+#define UNREFERENCED_PARAMETER(P)           ((void)(P))
+#define __analysis_assume(expr)
+#define __fallthrough
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Deref_out_
+#define _In_z_
+#define _Out_writes_z_(size)
+#define _In_reads_opt_(size)
+#define _In_reads_bytes_opt_(size)
+#define _In_bytecount_(size)
+#define _In_reads_(size)
+#define _In_reads_bytes_(size)
+#define _Out_bytecap_(size)
+#define _Out_writes_(size)
+#define _Out_writes_bytes_(size)
+#define _Out_writes_bytes_opt_(size)
+#define _Out_writes_to_(size, count)
+#define _Inout_updates_(size)
+#define _Out_opt_bytecap_post_bytecount_(cap, count)
+#define _Releases_lock_(lock)
+#define _Acquires_lock_(lock)
+
+// The legacy __in/__out annotations clash with names used by libstdc++, so
+// they are only defined while ndspi.h is parsed; see ndsalbegin.h.
+
+
+//
+// Basic types.  Widths match Windows (LLP64), not the native LP64 model.
+//
+typedef void                VOID;
+typedef void*               PVOID;
+typedef void*               LPVOID;
+typedef char                CHAR;
+typedef char*               PCHAR;
+typedef uint8_t             BYTE;
+typedef uint8_t             UINT8;
+typedef uint8_t             UCHAR;
+typedef uint8_t             BOOLEAN;
+typedef int16_t             SHORT;
+typedef uint16_t            USHORT;
+typedef uint16_t            WORD;
+typedef uint16_t            UINT16;
+typedef int32_t             INT;
+typedef int32_t             INT32;
+typedef int32_t             LONG;
+typedef int32_t             BOOL;
+typedef uint32_t            UINT;
+typedef uint32_t            UINT32;
+typedef uint32_t            ULONG;
+typedef uint32_t            DWORD;
+typedef int64_t             INT64;
+typedef int64_t             LONG64;
+typedef int64_t             LONGLONG;
+typedef uint64_t            UINT64;
+typedef uint64_t            ULONG64;
+typedef uint64_t            ULONGLONG;
+typedef uint64_t            DWORD64;
+typedef size_t              SIZE_T;
+typedef ptrdiff_t           SSIZE_T;
+typedef uintptr_t           ULONG_PTR;
+typedef intptr_t            LONG_PTR;
+typedef uintptr_t           KAFFINITY;
+typedef wchar_t             WCHAR;
+typedef const WCHAR*        LPCWSTR;
+typedef WCHAR*              LPWSTR;
+typedef const char*         LPCSTR;
+typedef void*               HANDLE;
+typedef void*               HMODULE;
+typedef int32_t             HRESULT;
+typedef int                 SOCKET;
+
+#define TRUE                1
+#define FALSE               0
+#define INFINITE            0xFFFFFFFF
+#define MAX_PATH            260
+#define INVALID_HANDLE_VALUE    (reinterpret_cast<HANDLE>(-1))
+#define INVALID_SOCKET      (-1)
+#define SOCKET_ERROR        (-1)
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+#define DECLARE_HANDLE(name) struct name##__ { int unused; }; typedef struct name##__* name
+
+#define FIELD_OFFSET(type, field)   (static_cast<LONG>(offsetof(type, field)))
+#define CONTAINING_RECORD(address, type, field) \
+    (reinterpret_cast<type*>(reinterpret_cast<char*>(address) - offsetof(type, field)))
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+#define _countof(a)         (sizeof(a) / sizeof((a)[0]))
+#define ZeroMemory(p, cb)   memset((p), 0, (cb))
+#define CopyMemory(d, s, cb)    memcpy((d), (s), (cb))
+#define RtlCopyMemory(d, s, cb) memcpy((d), (s), (cb))
+#define MAKEWORD(a, b)      (static_cast<WORD>((static_cast<BYTE>(a)) | (static_cast<WORD>(static_cast<BYTE>(b)) << 8)))
+
+template<typename T> inline T min(T a, T b) { return (a < b) ? a : b; }
+template<typename T> inline T max(T a, T b) { return (a > b) ? a : b; }
+
+
+//
+// HRESULTs and Win32 error codes.
+//
+#define SUCCEEDED(hr)       ((static_cast<HRESULT>(hr)) >= 0)
+#define FAILED(hr)          ((static_cast<HRESULT>(hr)) < 0)
+
+#define S_OK                static_cast<HRESULT>(0x00000000L)
+#define S_FALSE             static_cast<HRESULT>(0x00000001L)
+#define E_NOTIMPL           static_cast<HRESULT>(0x80004001L)
+#define E_NOINTERFACE       static_cast<HRESULT>(0x80004002L)
+#define E_FAIL              static_cast<HRESULT>(0x80004005L)
+#define E_OUTOFMEMORY       static_cast<HRESULT>(0x8007000EL)
+#define E_INVALIDARG        static_cast<HRESULT>(0x80070057L)
+#define CLASS_E_CLASSNOTAVAILABLE   static_cast<HRESULT>(0x80040111L)
+
+#define NO_ERROR                    0
+#define ERROR_FILE_NOT_FOUND        2
+#define ERROR_NOT_ENOUGH_MEMORY     8
+#define ERROR_INVALID_PARAMETER     87
+#define ERROR_INSUFFICIENT_BUFFER   122
+#define ERROR_MOD_NOT_FOUND         126
+#define ERROR_PROC_NOT_FOUND        127
+#define ERROR_ENVVAR_NOT_FOUND      203
+#define ERROR_NOT_FOUND             1168
+#define ERROR_NETWORK_UNREACHABLE   1231
+#define ERROR_HOST_UNREACHABLE      1232
+#define ERROR_TIMEOUT               1460
+
+#define WSAEFAULT           10014
+#define WSAEINVAL           10022
+#define WSAENOBUFS          10055
+#define WSAENETDOWN         10050
+#define WSAENETUNREACH      10051
+#define WSA_IO_PENDING      997
+
+inline HRESULT HRESULT_FROM_WIN32(unsigned long x)
+{
+    return static_cast<HRESULT>(x) <= 0 ?
+        static_cast<HRESULT>(x) :
+        static_cast<HRESULT>((x & 0x0000FFFF) | (7 << 16) | 0x80000000);
+}
+
+DWORD GetLastError(void);
+void SetLastError(_In_ DWORD error);
+inline int WSAGetLastError(void) { return static_cast<int>(GetLastError()); }
+
+
+//
+// GUIDs and COM.
+//
+struct GUID
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+};
+
+typedef GUID IID;
+typedef GUID CLSID;
+typedef const GUID& REFGUID;
+typedef const IID& REFIID;
+typedef const CLSID& REFCLSID;
+
+inline bool InlineIsEqualGUID(REFGUID a, REFGUID b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+inline bool IsEqualGUID(REFGUID a, REFGUID b) { return InlineIsEqualGUID(a, b); }
+inline bool operator==(REFGUID a, REFGUID b) { return InlineIsEqualGUID(a, b); }
+inline bool operator!=(REFGUID a, REFGUID b) { return !InlineIsEqualGUID(a, b); }
+
+// Declares a GUID; initguid.h redefines this to also define it.
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern "C" const GUID name
+
+// Defined weak in every translation unit, like the GUIDs of initguid.h, so
+// that providers built against this header don't depend on the framework.
+extern "C" const GUID __attribute__((weak)) GUID_NULL =
+    { 0x00000000, 0x0000, 0x0000, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+extern "C" const GUID __attribute__((weak)) IID_IUnknown =
+    { 0x00000000, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+extern "C" const GUID __attribute__((weak)) IID_IClassFactory =
+    { 0x00000001, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+
+#define interface           struct
+#define DECLARE_INTERFACE_(iface, baseiface)    struct iface : public baseiface
+#define STDMETHOD(method)                       virtual HRESULT method
+#define STDMETHOD_(type, method)                virtual type method
+#define STDMETHODIMP                            HRESULT
+#define STDMETHODIMP_(type)                     type
+#define IFACEMETHOD(method)                     STDMETHOD(method)
+#define IFACEMETHOD_(type, method)              STDMETHOD_(type, method)
+#define THIS_
+#define THIS                                    void
+
+struct IUnknown
+{
+    virtual HRESULT QueryInterface(REFIID riid, void** ppvObject) = 0;
+    virtual ULONG AddRef(void) = 0;
+    virtual ULONG Release(void) = 0;
+};
+
+struct IClassFactory : public IUnknown
+{
+    virtual HRESULT CreateInstance(IUnknown* pUnkOuter, REFIID riid, void** ppvObject) = 0;
+    virtual HRESULT LockServer(BOOL fLock) = 0;
+};
+
+
+//
+// Overlapped requests, as used by the ND SPI.
+//
+struct OVERLAPPED
+{
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    union
+    {
+        struct
+        {
+            DWORD Offset;
+            DWORD OffsetHigh;
+        };
+        PVOID Pointer;
+    };
+    HANDLE hEvent;
+};
+
+
+//
+// Interlocked operations.
+//
+inline LONG InterlockedIncrement(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(volatile LONG* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchange(volatile LONG* p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchangeAdd(volatile LONG* p, LONG v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedCompareExchange(volatile LONG* p, LONG v, LONG cmp)
+{
+    __atomic_compare_exchange_n(p, &cmp, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return cmp;
+}
+inline LONG64 InterlockedIncrement64(volatile LONG64* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG64 InterlockedDecrement64(volatile LONG64* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG64 InterlockedAdd64(volatile LONG64* p, LONG64 v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+inline PVOID InterlockedExchangePointer(PVOID volatile* p, PVOID v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* p, PVOID v, PVOID cmp)
+{
+    __atomic_compare_exchange_n(p, &cmp, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return cmp;
+}
+inline void MemoryBarrier(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#if defined(__x86_64__) || defined(__i386__)
+inline void YieldProcessor(void) { __builtin_ia32_pause(); }
+#elif defined(__aarch64__)
+inline void YieldProcessor(void) { __asm__ volatile("yield" ::: "memory"); }
+#else
+// No spin-wait hint; keep the compiler from folding the spin loop.
+inline void YieldProcessor(void) { __atomic_signal_fence(__ATOMIC_SEQ_CST); }
+#endif
+
+
+//
+// Locks, built on futexes.
+//
+// CRITICAL_SECTION is recursive, as on Windows.  m_State is 0 when free, 1
+// when held, and 2 when held with waiters.
+//
+struct CRITICAL_SECTION
+{
+    volatile int m_State;
+    volatile pid_t m_Owner;
+    ULONG m_Recursion;
+};
+
+void InitializeCriticalSection(_Out_ CRITICAL_SECTION* pCs);
+void DeleteCriticalSection(_Inout_ CRITICAL_SECTION* pCs);
+void EnterCriticalSection(_Inout_ CRITICAL_SECTION* pCs);
+BOOL TryEnterCriticalSection(_Inout_ CRITICAL_SECTION* pCs);
+void LeaveCriticalSection(_Inout_ CRITICAL_SECTION* pCs);
+
+//
+// m_State holds the reader count, or -1 when held exclusive.  Waiters sleep
+// on m_Sequence, which changes on every release that may unblock them.
+//
+struct SRWLOCK
+{
+    volatile int m_State;
+    volatile int m_Sequence;
+    volatile int m_Waiters;
+};
+
+#define SRWLOCK_INIT        { 0, 0, 0 }
+
+void InitializeSRWLock(_Out_ SRWLOCK* pLock);
+void AcquireSRWLockShared(_Inout_ SRWLOCK* pLock);
+void ReleaseSRWLockShared(_Inout_ SRWLOCK* pLock);
+void AcquireSRWLockExclusive(_Inout_ SRWLOCK* pLock);
+BOOL TryAcquireSRWLockExclusive(_Inout_ SRWLOCK* pLock);
+void ReleaseSRWLockExclusive(_Inout_ SRWLOCK* pLock);
+
+
+//
+// Heap.  There is a single process heap; handles only need to be non-null.
+//
+#define HEAP_ZERO_MEMORY    0x00000008
+
+HANDLE HeapCreate(_In_ DWORD options, _In_ SIZE_T cbInitial, _In_ SIZE_T cbMaximum);
+BOOL HeapDestroy(_In_ HANDLE hHeap);
+LPVOID HeapAlloc(_In_ HANDLE hHeap, _In_ DWORD flags, _In_ SIZE_T cb);
+BOOL HeapFree(_In_ HANDLE hHeap, _In_ DWORD flags, _In_opt_ LPVOID p);
+
+
+//
+// Threads and processors.
+//
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID pParameter);
+
+HANDLE CreateThread(
+    _In_opt_ void* pAttributes,
+    _In_ SIZE_T cbStack,
+    _In_ LPTHREAD_START_ROUTINE pfnStart,
+    _In_opt_ LPVOID pParameter,
+    _In_ DWORD flags,
+    _Out_opt_ DWORD* pThreadId
+    );
+
+#define WAIT_OBJECT_0       0
+#define WAIT_TIMEOUT        258
+#define WAIT_FAILED         0xFFFFFFFF
+
+// Only thread handles can be waited on.
+DWORD WaitForSingleObject(_In_ HANDLE hObject, _In_ DWORD timeout);
+BOOL CloseHandle(_In_ HANDLE hObject);
+BOOL SwitchToThread(void);
+DWORD GetCurrentProcessorNumber(void);
+DWORD GetCurrentProcessId(void);
+DWORD GetTickCount(void);
+
+// Only 4-byte values can be waited on.  Waits and wakes are private to the
+// process.
+BOOL WaitOnAddress(
+    _In_ volatile VOID* pAddress,
+    _In_ PVOID pCompare,
+    _In_ SIZE_T cbCompare,
+    _In_ DWORD timeout
+    );
+void WakeByAddressAll(_In_ PVOID pAddress);
+
+
+//
+// Environment.
+//
+DWORD GetEnvironmentVariableW(_In_ LPCWSTR name, _Out_writes_(cch) LPWSTR pBuffer, _In_ DWORD cch);
+DWORD ExpandEnvironmentStringsW(_In_ LPCWSTR pSrc, _Out_writes_(cch) LPWSTR pDst, _In_ DWORD cch);
+
+
+//
+// Dynamic loading.
+//
+typedef void (*FARPROC)(void);
+
+HMODULE LoadLibraryExW(_In_ LPCWSTR path, _In_opt_ HANDLE hFile, _In_ DWORD flags);
+FARPROC GetProcAddress(_In_ HMODULE hModule, _In_ LPCSTR name);
+BOOL FreeLibrary(_In_ HMODULE hModule);
+
+
+//
+// Completion port, built on epoll and eventfd.  File descriptors associated
+// with the port report their key when readable; Post queues a key without a
+// file descriptor.  Unlike an IOCP, the owner of an associated descriptor
+// must drain it after each wakeup, or it will be reported again.
+//
+class CompletionPort
+{
+    static const ULONG x_MaxPosted = 64;
+
+    int m_Epoll;
+    int m_Event;
+
+    CRITICAL_SECTION m_lock;
+    ULONG_PTR m_Posted[x_MaxPosted];
+    ULONG m_nPosted;
+
+public:
+    CompletionPort(void);
+    ~CompletionPort(void);
+
+    HRESULT Init(void);
+
+    HRESULT Associate(_In_ int fd, _In_ ULONG_PTR key);
+
+    HRESULT Post(_In_ ULONG_PTR key);
+
+    //
+    // Returns ND_SUCCESS with the key of a ready descriptor or posted
+    // packet, or ND_TIMEOUT.
+    //
+    HRESULT Wait(_In_ DWORD timeout, _Out_ ULONG_PTR* pKey);
+};
+
+
+//
+// Sockets.
+//
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr* LPSOCKADDR;
+typedef uint16_t ADDRESS_FAMILY;
+
+typedef union _SOCKADDR_INET
+{
+    struct sockaddr_in Ipv4;
+    struct sockaddr_in6 Ipv6;
+    ADDRESS_FAMILY si_family;
+} SOCKADDR_INET;
+
+typedef struct _SOCKET_ADDRESS
+{
+    LPSOCKADDR lpSockaddr;
+    INT iSockaddrLength;
+} SOCKET_ADDRESS;
+
+typedef struct _SOCKET_ADDRESS_LIST
+{
+    INT iAddressCount;
+    SOCKET_ADDRESS Address[1];
+} SOCKET_ADDRESS_LIST;
+
+typedef struct _WSADATA
+{
+    WORD wVersion;
+    WORD wHighVersion;
+} WSADATA;
+
+inline int WSAStartup(WORD version, WSADATA* pData)
+{
+    pData->wVersion = version;
+    pData->wHighVersion = version;
+    return 0;
+}
+inline int WSACleanup(void) { return 0; }
+
+
+//
+// Provider catalog.  Only the fields the framework inspects are provided.
+//
+#define XP1_GUARANTEED_DELIVERY     0x00000002
+#define XP1_GUARANTEED_ORDER        0x00000004
+#define XP1_MESSAGE_ORIENTED        0x00000008
+#define XP1_CONNECT_DATA            0x00000080
+#define PFL_HIDDEN                  0x00000004
+#define PFL_NETWORKDIRECT_PROVIDER  0x00000010
+
+typedef struct _WSAPROTOCOL_INFOW
+{
+    DWORD dwServiceFlags1;
+    DWORD dwProviderFlags;
+    GUID ProviderId;
+    INT iVersion;
+    INT iAddressFamily;
+    INT iSocketType;
+    INT iProtocol;
+    INT iProtocolMaxOffset;
+} WSAPROTOCOL_INFOW;
+
+//
+// Returns one entry per catalog line, or SOCKET_ERROR with *pErr set to
+// WSAENOBUFS and *pcbBuffer set to the required size.
+//
+int WSCEnumProtocols(
+    _In_opt_ INT* pProtocols,
+    _Out_writes_bytes_(*pcbBuffer) WSAPROTOCOL_INFOW* pBuffer,
+    _Inout_ DWORD* pcbBuffer,
+    _Out_ INT* pErr
+    );
+
+int WSCGetProviderPath(
+    _In_ GUID* pProviderId,
+    _Out_writes_(*pcchPath) WCHAR* pPath,
+    _Inout_ INT* pcchPath,
+    _Out_ INT* pErr
+    );
+
+//
+// Returns the path of the catalog file.
+//
+const char* NdPosixCatalogPath(void);
+
+
+//
+// Routing.  The best route is found by connecting a datagram socket; the
+// route's prefix is not known, so the returned route is a host route through
+// the destination itself.
+//
+typedef struct _IP_ADDRESS_PREFIX
+{
+    SOCKADDR_INET Prefix;
+    UINT8 PrefixLength;
+} IP_ADDRESS_PREFIX;
+
+typedef struct _MIB_IPFORWARD_ROW2
+{
+    IP_ADDRESS_PREFIX DestinationPrefix;
+    SOCKADDR_INET NextHop;
+} MIB_IPFORWARD_ROW2;
+
+typedef struct _NET_LUID NET_LUID;
+typedef ULONG NET_IFINDEX;
+
+DWORD GetBestRoute2(
+    _In_opt_ NET_LUID* pInterfaceLuid,
+    _In_ NET_IFINDEX interfaceIndex,
+    _In_opt_ const SOCKADDR_INET* pSourceAddress,
+    _In_ const SOCKADDR_INET* pDestinationAddress,
+    _In_ ULONG addressSortOptions,
+    _Out_ MIB_IPFORWARD_ROW2* pBestRoute,
+    _Out_ SOCKADDR_INET* pBestSourceAddress
+    );
+
+
+//
+// Debugging.
+//
+inline void OutputDebugStringA(LPCSTR) {}
@@ -0,0 +1,28 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Legacy SAL annotations (__in, __out, ...) for ndspi.h on POSIX systems.
+//
+// libstdc++ uses these names for its own parameters, so they can't stay
+// defined after the SPI declarations: including <thread> or <utility> with
+// them defined fails to compile.  ndspi.h includes this header before its
+// declarations and ndsalend.h after them.  There is no include guard, since
+// the pair may be used by more than one header.
+//
+
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define __deref_out
+#define __in_bcount(size)
+#define __in_bcount_opt(size)
+#define __in_ecount_opt(size)
+#define __inout_bcount_opt(size)
+#define __out_bcount_opt(size)
+#define __out_bcount_part_opt(size, length)
+#define __out_ecount_part(size, length)
+#define __out_ecount_part_opt(size, length)
@@ -0,0 +1,22 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Removes the annotations defined by ndsalbegin.h.
+//
+
+#undef __in
+#undef __in_opt
+#undef __out
+#undef __out_opt
+#undef __inout
+#undef __inout_opt
+#undef __deref_out
+#undef __in_bcount
+#undef __in_bcount_opt
+#undef __in_ecount_opt
+#undef __inout_bcount_opt
+#undef __out_bcount_opt
+#undef __out_bcount_part_opt
+#undef __out_ecount_part
+#undef __out_ecount_part_opt
@@ -0,0 +1,56 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ND status codes, as generated from ndstatus.mc by the message compiler on
+// Windows.  Keep in sync with ndstatus.mc.
+//
+
+#pragma once
+
+#include "ndposix.h"
+
+#define ND_SUCCESS                       static_cast<HRESULT>(0x00000000L)
+#define ND_TIMEOUT                       static_cast<HRESULT>(0x00000102L)
+#define ND_PENDING                       static_cast<HRESULT>(0x00000103L)
+#define ND_BUFFER_OVERFLOW               static_cast<HRESULT>(0x80000005L)
+#define ND_DEVICE_BUSY                   static_cast<HRESULT>(0x80000011L)
+#define ND_NO_MORE_ENTRIES               static_cast<HRESULT>(0x8000001AL)
+#define ND_UNSUCCESSFUL                  static_cast<HRESULT>(0xC0000001L)
+#define ND_ACCESS_VIOLATION              static_cast<HRESULT>(0xC0000005L)
+#define ND_INVALID_HANDLE                static_cast<HRESULT>(0xC0000008L)
+#define ND_INVALID_DEVICE_REQUEST        static_cast<HRESULT>(0xC0000010L)
+#define ND_INVALID_PARAMETER             static_cast<HRESULT>(0xC000000DL)
+#define ND_NO_MEMORY                     static_cast<HRESULT>(0xC0000017L)
+#define ND_INVALID_PARAMETER_MIX         static_cast<HRESULT>(0xC0000030L)
+#define ND_DATA_OVERRUN                  static_cast<HRESULT>(0xC000003CL)
+#define ND_SHARING_VIOLATION             static_cast<HRESULT>(0xC0000043L)
+#define ND_INSUFFICIENT_RESOURCES        static_cast<HRESULT>(0xC000009AL)
+#define ND_DEVICE_NOT_READY              static_cast<HRESULT>(0xC00000A3L)
+#define ND_IO_TIMEOUT                    static_cast<HRESULT>(0xC00000B5L)
+#define ND_NOT_SUPPORTED                 static_cast<HRESULT>(0xC00000BBL)
+#define ND_INTERNAL_ERROR                static_cast<HRESULT>(0xC00000E5L)
+#define ND_INVALID_PARAMETER_1           static_cast<HRESULT>(0xC00000EFL)
+#define ND_INVALID_PARAMETER_2           static_cast<HRESULT>(0xC00000F0L)
+#define ND_INVALID_PARAMETER_3           static_cast<HRESULT>(0xC00000F1L)
+#define ND_INVALID_PARAMETER_4           static_cast<HRESULT>(0xC00000F2L)
+#define ND_INVALID_PARAMETER_5           static_cast<HRESULT>(0xC00000F3L)
+#define ND_INVALID_PARAMETER_6           static_cast<HRESULT>(0xC00000F4L)
+#define ND_INVALID_PARAMETER_7           static_cast<HRESULT>(0xC00000F5L)
+#define ND_INVALID_PARAMETER_8           static_cast<HRESULT>(0xC00000F6L)
+#define ND_INVALID_PARAMETER_9           static_cast<HRESULT>(0xC00000F7L)
+#define ND_INVALID_PARAMETER_10          static_cast<HRESULT>(0xC00000F8L)
+#define ND_CANCELED                      static_cast<HRESULT>(0xC0000120L)
+#define ND_REMOTE_ERROR                  static_cast<HRESULT>(0xC000013DL)
+#define ND_INVALID_ADDRESS               static_cast<HRESULT>(0xC0000141L)
+#define ND_INVALID_DEVICE_STATE          static_cast<HRESULT>(0xC0000184L)
+#define ND_INVALID_BUFFER_SIZE           static_cast<HRESULT>(0xC0000206L)
+#define ND_TOO_MANY_ADDRESSES            static_cast<HRESULT>(0xC0000209L)
+#define ND_ADDRESS_ALREADY_EXISTS        static_cast<HRESULT>(0xC000020AL)
+#define ND_CONNECTION_REFUSED            static_cast<HRESULT>(0xC0000236L)
+#define ND_CONNECTION_INVALID            static_cast<HRESULT>(0xC000023AL)
+#define ND_CONNECTION_ACTIVE             static_cast<HRESULT>(0xC000023BL)
+#define ND_NETWORK_UNREACHABLE           static_cast<HRESULT>(0xC000023CL)
+#define ND_HOST_UNREACHABLE              static_cast<HRESULT>(0xC000023DL)
+#define ND_CONNECTION_ABORTED            static_cast<HRESULT>(0xC0000241L)
+#define ND_DEVICE_REMOVED                static_cast<HRESULT>(0xC00002B6L)
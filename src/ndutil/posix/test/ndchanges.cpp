@@ -0,0 +1,206 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndchanges.cpp - NetworkDirect catalog and address change test
+//
+// Starts the framework on a SyntheticNotificationSource, then changes the
+// stub provider's addresses and the provider catalog, posting the matching
+// notification after each change, and checks the lookups and update
+// statistics that follow.  Run with ND_BACKGROUND_WATCHER=1 the changes are
+// applied by the watcher thread, otherwise by the API calls.
+//
+
+#include "precomp.h"
+#include "ndsupport.h"
+#include "ndnotify.h"
+#include "ndaddr.h"
+#include "ndroute.h"
+#include "ndprov.h"
+#include "ndfrmwrk.h"
+
+#include <string>
+#include <unistd.h>
+
+const DWORD x_UpdateTimeoutMs = 5000;
+
+// {8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}
+static const char x_StubProviderGuid[] = "{8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}";
+
+static std::string gCatalog;
+static NetworkDirect::NotificationSource* gpNotify;
+
+#define CHECK(cond, ...) \
+    if (!(cond)) \
+    { \
+        printf(__VA_ARGS__); \
+        exit(__LINE__); \
+    }
+
+
+static void WriteCatalog(bool withProvider)
+{
+    std::string tmp = gCatalog + ".tmp";
+    FILE* pFile = ::fopen(tmp.c_str(), "w");
+    CHECK(pFile != nullptr, "Failed to create %s, error %d\n", tmp.c_str(), errno);
+    if (withProvider)
+    {
+        fprintf(pFile, "%s 2 %s\n", x_StubProviderGuid, ND_STUB_PROVIDER_PATH);
+    }
+    fclose(pFile);
+    CHECK(::rename(tmp.c_str(), gCatalog.c_str()) == 0, "rename failed, error %d\n", errno);
+}
+
+
+static bool IsNdAddress(const char* pAddr)
+{
+    struct sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    ::inet_pton(AF_INET, pAddr, &v4.sin_addr);
+    return NdCheckAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4)) == ND_SUCCESS;
+}
+
+
+static ND_UPDATE_STATISTICS QueryStats(void)
+{
+    ND_UPDATE_STATISTICS stats;
+    HRESULT hr = NdQueryUpdateStatistics(&stats);
+    CHECK(hr == ND_SUCCESS, "NdQueryUpdateStatistics returned %08x\n", hr);
+    return stats;
+}
+
+
+static ND_ROUTE_CACHE_STATISTICS QueryRouteStats(void)
+{
+    ND_ROUTE_CACHE_STATISTICS stats;
+    HRESULT hr = NdQueryRouteCacheStatistics(&stats);
+    CHECK(hr == ND_SUCCESS, "NdQueryRouteCacheStatistics returned %08x\n", hr);
+    return stats;
+}
+
+
+static ULONG64 QueryRouteFlushes(void)
+{
+    return QueryRouteStats().Flushes;
+}
+
+
+static void Resolve(const char* pRemote)
+{
+    struct sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    ::inet_pton(AF_INET, pRemote, &v4.sin_addr);
+    struct sockaddr_in local;
+    SIZE_T cbLocal = sizeof(local);
+    HRESULT hr = NdResolveAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4),
+        reinterpret_cast<struct sockaddr*>(&local), &cbLocal);
+    CHECK(hr == ND_SUCCESS, "NdResolveAddress(%s) returned %08x\n", pRemote, hr);
+}
+
+
+//
+// Posts a notification and waits until the framework has processed it.  The
+// statistics query drives ProcessUpdates when there is no watcher thread.
+//
+static ND_UPDATE_STATISTICS Notify(NetworkDirect::ND_NOTIFY_TYPE type)
+{
+    ULONG64 updates = QueryStats().Updates;
+    HRESULT hr = gpNotify->Post(type);
+    CHECK(hr == ND_SUCCESS, "Post returned %08x\n", hr);
+
+    DWORD start = ::GetTickCount();
+    for (;;)
+    {
+        ND_UPDATE_STATISTICS stats = QueryStats();
+        if (stats.Updates != updates)
+        {
+            return stats;
+        }
+        CHECK(::GetTickCount() - start < x_UpdateTimeoutMs, "Notification was not processed\n");
+        ::usleep(1000);
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    char dir[] = "/tmp/ndchangesXXXXXX";
+    CHECK(::mkdtemp(dir) != nullptr, "mkdtemp failed, error %d\n", errno);
+    gCatalog = std::string(dir) + "/providers.conf";
+    ::setenv("ND_PROVIDER_CATALOG", gCatalog.c_str(), 1);
+    ::setenv("ND_STUB_ADDRESSES", "127.0.0.1", 1);
+    WriteCatalog(true);
+
+    gpNotify = new NetworkDirect::SyntheticNotificationSource();
+    CHECK(gpNotify != nullptr, "Failed to allocate the notification source\n");
+    HRESULT hr = NetworkDirect::Startup(gpNotify);
+    CHECK(hr == ND_SUCCESS, "Startup returned %08x\n", hr);
+
+    // The first table is built by Startup.
+    CHECK(IsNdAddress("127.0.0.1"), "127.0.0.1 missing after startup\n");
+    CHECK(!IsNdAddress("127.0.0.2"), "127.0.0.2 reported before it was added\n");
+
+    // Peers on the loopback subnet are reached directly, so one route cache
+    // entry covers them all.
+    ND_ROUTE_CACHE_STATISTICS routeStats = QueryRouteStats();
+    Resolve("127.0.0.3");
+    Resolve("127.0.0.4");
+    ND_ROUTE_CACHE_STATISTICS newRouteStats = QueryRouteStats();
+    CHECK(newRouteStats.Misses == routeStats.Misses + 1 &&
+        newRouteStats.Hits == routeStats.Hits + 1,
+        "Resolving two on-link peers took %llu lookups\n",
+        static_cast<unsigned long long>(newRouteStats.Misses - routeStats.Misses));
+
+    // Every address change flushes the route cache, as it can move the best
+    // route to a peer.
+    //
+    // Adding an address publishes it.
+    ULONG64 flushes = QueryRouteFlushes();
+    ::setenv("ND_STUB_ADDRESSES", "127.0.0.1,127.0.0.2", 1);
+    ND_UPDATE_STATISTICS stats = Notify(NetworkDirect::ND_NOTIFY_ADDR_CHANGE);
+    CHECK(stats.LastAddressesAdded == 1 && stats.LastAddressesRemoved == 0,
+        "Adding an address reported %u added, %u removed\n",
+        stats.LastAddressesAdded, stats.LastAddressesRemoved);
+    CHECK(IsNdAddress("127.0.0.2"), "127.0.0.2 missing after it was added\n");
+    CHECK(QueryRouteFlushes() == flushes + 1, "Adding an address did not flush the route cache\n");
+
+    // An address change that leaves the list alone keeps the table.
+    ULONG64 unchanged = stats.UnchangedUpdates;
+    stats = Notify(NetworkDirect::ND_NOTIFY_ADDR_CHANGE);
+    CHECK(stats.UnchangedUpdates == unchanged + 1, "Unchanged update was not detected\n");
+    CHECK(QueryRouteFlushes() == flushes + 2, "Unchanged update did not flush the route cache\n");
+
+    // Removing an address unpublishes it.
+    ::setenv("ND_STUB_ADDRESSES", "127.0.0.2", 1);
+    stats = Notify(NetworkDirect::ND_NOTIFY_ADDR_CHANGE);
+    CHECK(stats.LastAddressesAdded == 0 && stats.LastAddressesRemoved == 1,
+        "Removing an address reported %u added, %u removed\n",
+        stats.LastAddressesAdded, stats.LastAddressesRemoved);
+    CHECK(!IsNdAddress("127.0.0.1"), "127.0.0.1 reported after it was removed\n");
+    CHECK(QueryRouteFlushes() == flushes + 3, "Removing an address did not flush the route cache\n");
+
+    // Removing the provider from the catalog removes its addresses.
+    ULONG64 providersRemoved = stats.ProvidersRemoved;
+    WriteCatalog(false);
+    stats = Notify(NetworkDirect::ND_NOTIFY_PROVIDER_CHANGE);
+    CHECK(stats.ProvidersRemoved == providersRemoved + 1, "Provider removal was not counted\n");
+    CHECK(!IsNdAddress("127.0.0.2"), "127.0.0.2 reported after its provider was removed\n");
+
+    // And adding it back restores them.
+    ULONG64 providersAdded = stats.ProvidersAdded;
+    WriteCatalog(true);
+    stats = Notify(NetworkDirect::ND_NOTIFY_PROVIDER_CHANGE);
+    CHECK(stats.ProvidersAdded == providersAdded + 1, "Provider addition was not counted\n");
+    CHECK(IsNdAddress("127.0.0.2"), "127.0.0.2 missing after its provider was added back\n");
+
+    hr = NdCleanup();
+    CHECK(hr == ND_SUCCESS, "NdCleanup returned %08x\n", hr);
+
+    ::unlink(gCatalog.c_str());
+    ::rmdir(dir);
+    printf("ndchanges: passed\n");
+    return 0;
+}
@@ -0,0 +1,387 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndloopback.cpp - loopback provider test on the POSIX layer
+//
+// Enables the loopback provider with an empty provider catalog, connects two
+// queue pairs through 127.0.0.1, and checks a send/receive, an RDMA write and
+// an RDMA read.  It runs once with both ends in this process, and once with
+// the passive end in a forked child, so that data crosses the process
+// boundary.
+//
+
+#include "precomp.h"
+#include "ndsupport.h"
+
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+
+const DWORD x_TimeoutMs = 5000;
+const ULONG x_BufferSize = 64 * 1024;
+const ULONG x_QueueDepth = 4;
+const USHORT x_Port = 54321;
+
+#define CHECK(cond, ...) \
+    if (!(cond)) \
+    { \
+        printf(__VA_ARGS__); \
+        exit(__LINE__); \
+    }
+
+
+//
+// Exchanged as connection private data, so that each side can address the
+// other's buffer.
+//
+struct RemoteBuffer
+{
+    UINT64 Address;
+    UINT32 Token;
+};
+
+
+static struct sockaddr_in LoopbackAddress(USHORT port)
+{
+    struct sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    v4.sin_port = htons(port);
+    return v4;
+}
+
+
+static void Wait(IND2Overlapped* pObject, OVERLAPPED* pOv, HRESULT hr, const char* call)
+{
+    if (hr == ND_PENDING)
+    {
+        hr = pObject->GetOverlappedResult(pOv, TRUE);
+    }
+    CHECK(hr == ND_SUCCESS, "%s returned %08x\n", call, hr);
+}
+
+
+//
+// One end of a connection: an adapter with one completion queue, queue pair,
+// connector and registered buffer.
+//
+class Endpoint
+{
+public:
+    IND2Adapter* m_pAdapter;
+    HANDLE m_hFile;
+    IND2CompletionQueue* m_pCq;
+    IND2QueuePair* m_pQp;
+    IND2Connector* m_pConnector;
+    IND2MemoryRegion* m_pMr;
+    char* m_Buffer;
+
+    Endpoint()
+    {
+        struct sockaddr_in addr = LoopbackAddress(0);
+        HRESULT hr = NdOpenAdapter(IID_IND2Adapter, reinterpret_cast<const struct sockaddr*>(&addr),
+            sizeof(addr), reinterpret_cast<void**>(&m_pAdapter));
+        CHECK(hr == ND_SUCCESS, "NdOpenAdapter returned %08x\n", hr);
+
+        hr = m_pAdapter->CreateOverlappedFile(&m_hFile);
+        CHECK(hr == ND_SUCCESS, "CreateOverlappedFile returned %08x\n", hr);
+
+        hr = m_pAdapter->CreateCompletionQueue(IID_IND2CompletionQueue, m_hFile,
+            x_QueueDepth * 2, 0, 0, reinterpret_cast<void**>(&m_pCq));
+        CHECK(hr == ND_SUCCESS, "CreateCompletionQueue returned %08x\n", hr);
+
+        hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, m_pCq, m_pCq, this,
+            x_QueueDepth, x_QueueDepth, 1, 1, 0, reinterpret_cast<void**>(&m_pQp));
+        CHECK(hr == ND_SUCCESS, "CreateQueuePair returned %08x\n", hr);
+
+        hr = m_pAdapter->CreateConnector(IID_IND2Connector, m_hFile,
+            reinterpret_cast<void**>(&m_pConnector));
+        CHECK(hr == ND_SUCCESS, "CreateConnector returned %08x\n", hr);
+
+        hr = m_pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, m_hFile,
+            reinterpret_cast<void**>(&m_pMr));
+        CHECK(hr == ND_SUCCESS, "CreateMemoryRegion returned %08x\n", hr);
+
+        m_Buffer = new char[x_BufferSize];
+        ::memset(m_Buffer, 0, x_BufferSize);
+        OVERLAPPED ov = {};
+        hr = m_pMr->Register(m_Buffer, x_BufferSize,
+            ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ | ND_MR_FLAG_ALLOW_REMOTE_WRITE,
+            &ov);
+        Wait(m_pMr, &ov, hr, "Register");
+    }
+
+    ~Endpoint()
+    {
+        OVERLAPPED ov = {};
+        Wait(m_pMr, &ov, m_pMr->Deregister(&ov), "Deregister");
+        m_pMr->Release();
+        m_pConnector->Release();
+        m_pQp->Release();
+        m_pCq->Release();
+        ::close(static_cast<int>(reinterpret_cast<ULONG_PTR>(m_hFile)));
+        m_pAdapter->Release();
+        delete[] m_Buffer;
+    }
+
+    ND2_SGE Sge(ULONG offset, ULONG length)
+    {
+        ND2_SGE sge;
+        sge.Buffer = m_Buffer + offset;
+        sge.BufferLength = length;
+        sge.MemoryRegionToken = m_pMr->GetLocalToken();
+        return sge;
+    }
+
+    RemoteBuffer Remote()
+    {
+        RemoteBuffer remote;
+        remote.Address = reinterpret_cast<ULONG_PTR>(m_Buffer);
+        remote.Token = m_pMr->GetRemoteToken();
+        return remote;
+    }
+
+    ND2_RESULT Poll(ND2_REQUEST_TYPE type)
+    {
+        ND2_RESULT result;
+        DWORD start = ::GetTickCount();
+        while (m_pCq->GetResults(&result, 1) == 0)
+        {
+            CHECK(::GetTickCount() - start < x_TimeoutMs, "Request type %d did not complete\n", type);
+        }
+        CHECK(result.Status == ND_SUCCESS, "Request type %d failed with %08x\n",
+            result.RequestType, result.Status);
+        CHECK(result.RequestType == type, "Expected request type %d, got %d\n",
+            type, result.RequestType);
+        return result;
+    }
+
+    void Disconnect()
+    {
+        OVERLAPPED ov = {};
+        Wait(m_pConnector, &ov, m_pConnector->Disconnect(&ov), "Disconnect");
+    }
+};
+
+
+static IND2Listener* Listen(Endpoint& endpoint)
+{
+    IND2Listener* pListener;
+    HRESULT hr = endpoint.m_pAdapter->CreateListener(IID_IND2Listener, endpoint.m_hFile,
+        reinterpret_cast<void**>(&pListener));
+    CHECK(hr == ND_SUCCESS, "CreateListener returned %08x\n", hr);
+
+    struct sockaddr_in addr = LoopbackAddress(x_Port);
+    hr = pListener->Bind(reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr));
+    CHECK(hr == ND_SUCCESS, "Listener Bind returned %08x\n", hr);
+
+    hr = pListener->Listen(0);
+    CHECK(hr == ND_SUCCESS, "Listen returned %08x\n", hr);
+    return pListener;
+}
+
+
+static HRESULT Connect(Endpoint& active, OVERLAPPED* pOv)
+{
+    struct sockaddr_in addr = LoopbackAddress(x_Port);
+    RemoteBuffer remote = active.Remote();
+    return active.m_pConnector->Connect(active.m_pQp,
+        reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr),
+        1, 1, &remote, sizeof(remote), pOv);
+}
+
+
+static HRESULT Accept(Endpoint& passive, OVERLAPPED* pOv)
+{
+    RemoteBuffer remote = passive.Remote();
+    return passive.m_pConnector->Accept(passive.m_pQp, 1, 1, &remote, sizeof(remote), pOv);
+}
+
+
+static RemoteBuffer GetPeerBuffer(Endpoint& endpoint)
+{
+    RemoteBuffer remote;
+    ULONG cbRemote = sizeof(remote);
+    HRESULT hr = endpoint.m_pConnector->GetPrivateData(&remote, &cbRemote);
+    CHECK(hr == ND_SUCCESS, "GetPrivateData returned %08x\n", hr);
+    return remote;
+}
+
+
+//
+// The active side sends a message, then writes a pattern into the second
+// half of the passive side's buffer and reads it back.
+//
+static void RunActive(Endpoint& active)
+{
+    RemoteBuffer peer = GetPeerBuffer(active);
+
+    static const char x_Message[] = "loopback send";
+    ::strcpy(active.m_Buffer, x_Message);
+    ND2_SGE sge = active.Sge(0, sizeof(x_Message));
+    HRESULT hr = active.m_pQp->Send(nullptr, &sge, 1, 0);
+    CHECK(hr == ND_SUCCESS, "Send returned %08x\n", hr);
+    active.Poll(Nd2RequestTypeSend);
+
+    for (ULONG i = 0; i < x_BufferSize; i++)
+    {
+        active.m_Buffer[i] = static_cast<char>(i * 7);
+    }
+    UINT64 remoteAddress = peer.Address + (x_BufferSize / 2);
+    sge = active.Sge(0, x_BufferSize / 2);
+    hr = active.m_pQp->Write(nullptr, &sge, 1, remoteAddress, peer.Token, 0);
+    CHECK(hr == ND_SUCCESS, "Write returned %08x\n", hr);
+    active.Poll(Nd2RequestTypeWrite);
+
+    sge = active.Sge(x_BufferSize / 2, x_BufferSize / 2);
+    hr = active.m_pQp->Read(nullptr, &sge, 1, remoteAddress, peer.Token, 0);
+    CHECK(hr == ND_SUCCESS, "Read returned %08x\n", hr);
+    ND2_RESULT result = active.Poll(Nd2RequestTypeRead);
+    CHECK(result.BytesTransferred == x_BufferSize / 2, "Read transferred %u bytes\n",
+        result.BytesTransferred);
+    CHECK(::memcmp(active.m_Buffer, active.m_Buffer + (x_BufferSize / 2), x_BufferSize / 2) == 0,
+        "Read returned different data than was written\n");
+}
+
+
+static void PostReceive(Endpoint& passive)
+{
+    ND2_SGE sge = passive.Sge(0, x_BufferSize);
+    HRESULT hr = passive.m_pQp->Receive(nullptr, &sge, 1);
+    CHECK(hr == ND_SUCCESS, "Receive returned %08x\n", hr);
+}
+
+
+static void CheckReceive(Endpoint& passive)
+{
+    ND2_RESULT result = passive.Poll(Nd2RequestTypeReceive);
+    CHECK(result.BytesTransferred == sizeof("loopback send") &&
+        ::strcmp(passive.m_Buffer, "loopback send") == 0,
+        "Received %u bytes: %s\n", result.BytesTransferred, passive.m_Buffer);
+}
+
+
+static void RunInProcess(void)
+{
+    Endpoint active;
+    Endpoint passive;
+    IND2Listener* pListener = Listen(passive);
+
+    OVERLAPPED listenOv = {};
+    HRESULT listenHr = pListener->GetConnectionRequest(passive.m_pConnector, &listenOv);
+    OVERLAPPED connectOv = {};
+    HRESULT connectHr = Connect(active, &connectOv);
+
+    Wait(pListener, &listenOv, listenHr, "GetConnectionRequest");
+    PostReceive(passive);
+    OVERLAPPED acceptOv = {};
+    HRESULT acceptHr = Accept(passive, &acceptOv);
+
+    Wait(active.m_pConnector, &connectOv, connectHr, "Connect");
+    OVERLAPPED completeOv = {};
+    Wait(active.m_pConnector, &completeOv, active.m_pConnector->CompleteConnect(&completeOv),
+        "CompleteConnect");
+    Wait(passive.m_pConnector, &acceptOv, acceptHr, "Accept");
+
+    RunActive(active);
+    CheckReceive(passive);
+    CHECK(::memcmp(passive.m_Buffer + (x_BufferSize / 2), active.m_Buffer, x_BufferSize / 2) == 0,
+        "Write did not reach the passive side's buffer\n");
+
+    active.Disconnect();
+    pListener->Release();
+}
+
+
+//
+// Passive side of the cross-process run.  The exit code reports the result.
+//
+static void RunChild(int ready)
+{
+    HRESULT hr = NdStartup();
+    CHECK(hr == ND_SUCCESS, "NdStartup returned %08x in the child\n", hr);
+    {
+        Endpoint passive;
+        IND2Listener* pListener = Listen(passive);
+        CHECK(::write(ready, "r", 1) == 1, "Failed to signal the parent\n");
+
+        OVERLAPPED ov = {};
+        Wait(pListener, &ov, pListener->GetConnectionRequest(passive.m_pConnector, &ov),
+            "GetConnectionRequest");
+        PostReceive(passive);
+        Wait(passive.m_pConnector, &ov, Accept(passive, &ov), "Accept");
+        CheckReceive(passive);
+
+        // The parent disconnects once it has checked the write and read.
+        Wait(passive.m_pConnector, &ov, passive.m_pConnector->NotifyDisconnect(&ov),
+            "NotifyDisconnect");
+        pListener->Release();
+    }
+    NdCleanup();
+}
+
+
+static void RunCrossProcess(void)
+{
+    int ready[2];
+    CHECK(::pipe(ready) == 0, "pipe failed, error %d\n", errno);
+
+    pid_t child = ::fork();
+    CHECK(child >= 0, "fork failed, error %d\n", errno);
+    if (child == 0)
+    {
+        ::close(ready[0]);
+        RunChild(ready[1]);
+        ::_exit(0);
+    }
+
+    ::close(ready[1]);
+    char signal;
+    CHECK(::read(ready[0], &signal, 1) == 1, "The child exited before listening\n");
+    ::close(ready[0]);
+
+    HRESULT hr = NdStartup();
+    CHECK(hr == ND_SUCCESS, "NdStartup returned %08x\n", hr);
+    {
+        Endpoint active;
+        OVERLAPPED ov = {};
+        Wait(active.m_pConnector, &ov, Connect(active, &ov), "Connect");
+        Wait(active.m_pConnector, &ov, active.m_pConnector->CompleteConnect(&ov),
+            "CompleteConnect");
+        RunActive(active);
+        active.Disconnect();
+    }
+    NdCleanup();
+
+    int status;
+    CHECK(::waitpid(child, &status, 0) == child, "waitpid failed, error %d\n", errno);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+        "The child failed at line %d\n", WEXITSTATUS(status));
+}
+
+
+int main(int argc, char* argv[])
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    char catalog[] = "/tmp/ndloopbackXXXXXX";
+    int fd = ::mkstemp(catalog);
+    CHECK(fd >= 0, "mkstemp failed, error %d\n", errno);
+    ::close(fd);
+    ::setenv("ND_PROVIDER_CATALOG", catalog, 1);
+    ::setenv("ND_LOOPBACK_PROVIDER", "1", 1);
+
+    HRESULT hr = NdStartup();
+    CHECK(hr == ND_SUCCESS, "NdStartup returned %08x\n", hr);
+    RunInProcess();
+    hr = NdCleanup();
+    CHECK(hr == ND_SUCCESS, "NdCleanup returned %08x\n", hr);
+
+    RunCrossProcess();
+
+    ::unlink(catalog);
+    printf("ndloopback: passed\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndprovperf.cpp - NetworkDirect provider object reuse measurement
+//
+// Measures, against the stub provider, the cost of NdOpenAdapter with the
+// provider kept loaded and with the providers flushed before each open (the
+// POSIX counterpart of ndaddrperf --open), and the cost of refreshing the
+// address list.  Each provider caches one provider object while loaded, so
+// the loaded opens and the refreshes must not create provider objects; the
+// test fails if they do.
+//
+
+#include "precomp.h"
+#include "ndsupport.h"
+#include "ndnotify.h"
+#include "ndaddr.h"
+#include "ndroute.h"
+#include "ndprov.h"
+#include "ndfrmwrk.h"
+
+#include <string>
+#include <chrono>
+#include <dlfcn.h>
+#include <unistd.h>
+
+const ULONG x_DefaultIters = 10000;
+
+// {8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}
+static const char x_StubProviderGuid[] = "{8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}";
+
+typedef LONG (*PROVIDERSCREATED)(void);
+
+#define CHECK(cond, ...) \
+    if (!(cond)) \
+    { \
+        printf(__VA_ARGS__); \
+        exit(__LINE__); \
+    }
+
+
+static void ShowUsage()
+{
+    printf("ndprovperf [options]\n"
+        "Options:\n"
+        "\t-i,--iterations <count>     Opens and refreshes per pass (default: %u)\n"
+        "\t-h,--help                   Show this message\n",
+        x_DefaultIters);
+}
+
+
+//
+// Returns the number of provider objects the stub has created, or -1 if the
+// stub is not loaded.  Looking it up doesn't keep it loaded.
+//
+static LONG ProvidersCreated(void)
+{
+    void* hStub = ::dlopen(ND_STUB_PROVIDER_PATH, RTLD_NOW | RTLD_NOLOAD);
+    if (hStub == nullptr)
+    {
+        return -1;
+    }
+
+    PROVIDERSCREATED pfn = reinterpret_cast<PROVIDERSCREATED>(
+        ::dlsym(hStub, "ndstubprov_ProvidersCreated"));
+    LONG nCreated = (pfn != nullptr) ? pfn() : -1;
+    ::dlclose(hStub);
+    return nCreated;
+}
+
+
+static double Microseconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+
+//
+// Opens and releases an adapter nIters times, flushing the providers before
+// each open if requested, and returns the average cost in microseconds.
+//
+static double RunOpenTest(ULONG nIters, bool flush)
+{
+    struct sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    auto start = std::chrono::steady_clock::now();
+    for (ULONG i = 0; i < nIters; i++)
+    {
+        if (flush)
+        {
+            NdFlushProviders();
+        }
+
+        IND2Adapter* pAdapter;
+        HRESULT hr = NdOpenAdapter(
+            IID_IND2Adapter,
+            reinterpret_cast<const struct sockaddr*>(&v4),
+            sizeof(v4),
+            reinterpret_cast<void**>(&pAdapter)
+        );
+        CHECK(hr == ND_SUCCESS, "NdOpenAdapter returned %08x\n", hr);
+        pAdapter->Release();
+    }
+    return Microseconds(start) / nIters;
+}
+
+
+//
+// Posts nIters address changes, processing each before the next, and returns
+// the average cost in microseconds.
+//
+static double RunRefreshTest(NetworkDirect::NotificationSource* pNotify, ULONG nIters)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (ULONG i = 0; i < nIters; i++)
+    {
+        HRESULT hr = pNotify->Post(NetworkDirect::ND_NOTIFY_ADDR_CHANGE);
+        CHECK(hr == ND_SUCCESS, "Post returned %08x\n", hr);
+
+        // Drives ProcessUpdates, which applies the change.
+        ND_UPDATE_STATISTICS stats;
+        hr = NdQueryUpdateStatistics(&stats);
+        CHECK(hr == ND_SUCCESS, "NdQueryUpdateStatistics returned %08x\n", hr);
+    }
+    return Microseconds(start) / nIters;
+}
+
+
+int main(int argc, char* argv[])
+{
+    ULONG nIters = x_DefaultIters;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-i" || arg == "--iterations") && i + 1 < argc)
+        {
+            nIters = ::strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            ShowUsage();
+            exit(arg == "-h" || arg == "--help" ? 0 : __LINE__);
+        }
+    }
+    CHECK(nIters != 0, "Invalid iteration count.\n");
+
+    // The refresh pass posts its own notifications, so the watcher must not
+    // be running.
+    ::unsetenv("ND_BACKGROUND_WATCHER");
+
+    char dir[] = "/tmp/ndprovperfXXXXXX";
+    CHECK(::mkdtemp(dir) != nullptr, "mkdtemp failed, error %d\n", errno);
+    std::string catalog = std::string(dir) + "/providers.conf";
+    FILE* pFile = ::fopen(catalog.c_str(), "w");
+    CHECK(pFile != nullptr, "Failed to create %s, error %d\n", catalog.c_str(), errno);
+    fprintf(pFile, "%s 2 %s\n", x_StubProviderGuid, ND_STUB_PROVIDER_PATH);
+    fclose(pFile);
+    ::setenv("ND_PROVIDER_CATALOG", catalog.c_str(), 1);
+    ::setenv("ND_STUB_ADDRESSES", "127.0.0.1", 1);
+
+    NetworkDirect::NotificationSource* pNotify = new NetworkDirect::SyntheticNotificationSource();
+    CHECK(pNotify != nullptr, "Failed to allocate the notification source\n");
+    HRESULT hr = NetworkDirect::Startup(pNotify);
+    CHECK(hr == ND_SUCCESS, "Startup returned %08x\n", hr);
+
+    printf("     Pass      Iter   usec/call  Providers created\n");
+
+    // Warm up, so that the loaded pass starts with the provider object.
+    RunOpenTest(1, false);
+    LONG nCreated = ProvidersCreated();
+    double cost = RunOpenTest(nIters, false);
+    LONG nLoaded = ProvidersCreated() - nCreated;
+    printf("%9s %9u %11.3f %18d\n", "loaded", nIters, cost, nLoaded);
+
+    nCreated = ProvidersCreated();
+    cost = RunRefreshTest(pNotify, nIters);
+    LONG nRefresh = ProvidersCreated() - nCreated;
+    printf("%9s %9u %11.3f %18d\n", "refresh", nIters, cost, nRefresh);
+
+    // Flushing unloads the stub, which resets its counter.
+    cost = RunOpenTest(nIters, true);
+    printf("%9s %9u %11.3f %18s\n", "flushed", nIters, cost, "-");
+
+    hr = NdCleanup();
+    CHECK(hr == ND_SUCCESS, "NdCleanup returned %08x\n", hr);
+    ::unlink(catalog.c_str());
+    ::rmdir(dir);
+
+    CHECK(nLoaded == 0, "Loaded opens created %d provider objects\n", nLoaded);
+    CHECK(nRefresh == 0, "Address refreshes created %d provider objects\n", nRefresh);
+    return 0;
+}
@@ -0,0 +1,216 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// ndstartup.cpp - NetworkDirect framework smoke test on the POSIX layer
+//
+// Registers the stub provider in a private catalog, then checks that
+// NdStartup, the address queries and NdOpenAdapter work, and that threads
+// making their first lookup right after NdStartup all find the address.
+//
+// The standard headers are deliberately included after the framework ones,
+// which used to fail when the shim left the legacy SAL annotations defined.
+//
+
+#include "precomp.h"
+#include "ndsupport.h"
+
+#include <thread>
+#include <vector>
+#include <string>
+#include <unistd.h>
+
+const ULONG x_FirstRounds = 50;
+const ULONG x_FirstThreads = 16;
+
+// {8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}
+static const char x_StubProviderGuid[] = "{8B6D4F3A-3C1E-4E57-9A0B-2D6C7E1F5A42}";
+
+#define CHECK_HR(hr, expected, call) \
+    if ((hr) != (expected)) \
+    { \
+        printf("%s returned %08x, expected %08x\n", call, hr, expected); \
+        exit(__LINE__); \
+    }
+
+
+//
+// Writes a catalog naming the stub provider, and points the framework at it.
+//
+static std::string CreateCatalog(void)
+{
+    char dir[] = "/tmp/ndstartupXXXXXX";
+    if (::mkdtemp(dir) == nullptr)
+    {
+        printf("mkdtemp failed, error %d\n", errno);
+        exit(__LINE__);
+    }
+
+    std::string path = std::string(dir) + "/providers.conf";
+    FILE* pFile = ::fopen(path.c_str(), "w");
+    if (pFile == nullptr)
+    {
+        printf("Failed to create %s, error %d\n", path.c_str(), errno);
+        exit(__LINE__);
+    }
+    fprintf(pFile, "%s 2 %s\n", x_StubProviderGuid, ND_STUB_PROVIDER_PATH);
+    fclose(pFile);
+
+    ::setenv("ND_PROVIDER_CATALOG", path.c_str(), 1);
+    ::setenv("ND_STUB_ADDRESSES", "127.0.0.1", 1);
+    return path;
+}
+
+
+static void RemoveCatalog(const std::string& path)
+{
+    ::unlink(path.c_str());
+    ::rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+
+
+static struct sockaddr_in Loopback(void)
+{
+    struct sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return v4;
+}
+
+
+static void TestQueries(void)
+{
+    HRESULT hr = NdStartup();
+    CHECK_HR(hr, ND_SUCCESS, "NdStartup");
+
+    struct sockaddr_in v4 = Loopback();
+    hr = NdCheckAddress(reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4));
+    CHECK_HR(hr, ND_SUCCESS, "NdCheckAddress");
+
+    SIZE_T cbList = 0;
+    hr = NdQueryAddressList(0, nullptr, &cbList);
+    CHECK_HR(hr, ND_BUFFER_OVERFLOW, "NdQueryAddressList");
+
+    std::vector<char> buf(cbList);
+    SOCKET_ADDRESS_LIST* pList = reinterpret_cast<SOCKET_ADDRESS_LIST*>(buf.data());
+    hr = NdQueryAddressList(0, pList, &cbList);
+    CHECK_HR(hr, ND_SUCCESS, "NdQueryAddressList");
+    if (pList->iAddressCount != 1)
+    {
+        printf("NdQueryAddressList returned %d addresses, expected 1\n", pList->iAddressCount);
+        exit(__LINE__);
+    }
+
+    struct sockaddr_in local;
+    SIZE_T cbLocal = sizeof(local);
+    hr = NdResolveAddress(
+        reinterpret_cast<const struct sockaddr*>(&v4),
+        sizeof(v4),
+        reinterpret_cast<struct sockaddr*>(&local),
+        &cbLocal
+    );
+    CHECK_HR(hr, ND_SUCCESS, "NdResolveAddress");
+    if (local.sin_addr.s_addr != v4.sin_addr.s_addr)
+    {
+        printf("NdResolveAddress returned the wrong local address\n");
+        exit(__LINE__);
+    }
+
+    IND2Adapter* pAdapter;
+    hr = NdOpenAdapter(
+        IID_IND2Adapter,
+        reinterpret_cast<const struct sockaddr*>(&v4),
+        sizeof(v4),
+        reinterpret_cast<void**>(&pAdapter)
+    );
+    CHECK_HR(hr, ND_SUCCESS, "NdOpenAdapter");
+
+    ND2_ADAPTER_INFO info = {};
+    ULONG cbInfo = sizeof(info);
+    hr = pAdapter->Query(&info, &cbInfo);
+    CHECK_HR(hr, ND_SUCCESS, "IND2Adapter::Query");
+    if (info.AdapterId != INADDR_LOOPBACK)
+    {
+        printf("Opened adapter %llx, expected %x\n",
+            static_cast<unsigned long long>(info.AdapterId), INADDR_LOOPBACK);
+        exit(__LINE__);
+    }
+    pAdapter->Release();
+
+    hr = NdCleanup();
+    CHECK_HR(hr, ND_SUCCESS, "NdCleanup");
+}
+
+
+//
+// Starts the framework with threads waiting to make their first lookup, and
+// releases them as soon as NdStartup returns.  The provider is slowed down so
+// that a thread building the address list is likely to be preempted by the
+// others, even on a single processor.
+//
+static void TestFirstLookups(void)
+{
+    struct sockaddr_in v4 = Loopback();
+    volatile LONG nFailed = 0;
+
+    ::setenv("ND_STUB_QUERY_DELAY_US", "1000", 1);
+
+    for (ULONG round = 0; round < x_FirstRounds; round++)
+    {
+        volatile LONG start = 0;
+        std::vector<std::thread> threads;
+        for (ULONG i = 0; i < x_FirstThreads; i++)
+        {
+            threads.emplace_back([&]()
+            {
+                while (start == 0)
+                {
+                    YieldProcessor();
+                }
+
+                HRESULT hr = NdCheckAddress(
+                    reinterpret_cast<const struct sockaddr*>(&v4), sizeof(v4));
+                if (FAILED(hr))
+                {
+                    ::InterlockedIncrement(&nFailed);
+                }
+            });
+        }
+
+        HRESULT hr = NdStartup();
+        CHECK_HR(hr, ND_SUCCESS, "NdStartup");
+        ::InterlockedExchange(&start, 1);
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        hr = NdCleanup();
+        CHECK_HR(hr, ND_SUCCESS, "NdCleanup");
+    }
+
+    ::unsetenv("ND_STUB_QUERY_DELAY_US");
+
+    if (nFailed != 0)
+    {
+        printf("%d of %u first lookups failed\n", nFailed, x_FirstRounds * x_FirstThreads);
+        exit(__LINE__);
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    std::string catalog = CreateCatalog();
+
+    TestQueries();
+    TestFirstLookups();
+
+    RemoveCatalog(catalog);
+    printf("ndstartup: passed\n");
+    return 0;
+}
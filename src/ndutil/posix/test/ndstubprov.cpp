@@ -0,0 +1,357 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+// Stub NDv2 provider, built as a shared object for the POSIX tests.
+//
+// The provider reports the IPv4 addresses listed, comma separated, in
+// ND_STUB_ADDRESSES (127.0.0.1 if unset), and is read again on every
+// QueryAddressList so that tests can change the address list at run time.
+// ND_STUB_QUERY_DELAY_US makes each provider QueryAddressList call sleep for
+// that many microseconds, to widen races with address updates.
+// Adapters answer Query and QueryAddressList; every other call fails with
+// E_NOTIMPL.  ndstubprov_ProvidersCreated returns the number of provider
+// objects handed out by DllGetClassObject since the module was loaded.
+//
+
+#include <winsock2.h>
+#include <unknwn.h>
+#include <initguid.h>
+#include <ndspi.h>
+
+#include <new>
+#include <stdio.h>
+#include <unistd.h>
+
+
+namespace
+{
+
+    const ULONG x_MaxAddresses = 64;
+
+    volatile LONG gnObjectsAlive = 0;
+    volatile LONG gnProvidersCreated = 0;
+
+
+    //
+    // Parses ND_STUB_ADDRESSES into pAddrs, returning the number of
+    // addresses.
+    //
+    ULONG ReadAddresses(_Out_writes_(x_MaxAddresses) struct sockaddr_in* pAddrs)
+    {
+        const char* pList = ::getenv("ND_STUB_ADDRESSES");
+        if (pList == nullptr)
+        {
+            pList = "127.0.0.1";
+        }
+
+        ULONG nAddrs = 0;
+        while (*pList != '\0' && nAddrs < x_MaxAddresses)
+        {
+            char addr[INET_ADDRSTRLEN];
+            size_t len = ::strcspn(pList, ",");
+            if (len < sizeof(addr))
+            {
+                ::memcpy(addr, pList, len);
+                addr[len] = '\0';
+
+                ::memset(&pAddrs[nAddrs], 0, sizeof(pAddrs[nAddrs]));
+                pAddrs[nAddrs].sin_family = AF_INET;
+                if (::inet_pton(AF_INET, addr, &pAddrs[nAddrs].sin_addr) == 1)
+                {
+                    nAddrs++;
+                }
+            }
+
+            pList += len;
+            if (*pList == ',')
+            {
+                pList++;
+            }
+        }
+        return nAddrs;
+    }
+
+
+    HRESULT BuildAddressList(
+        _Out_opt_bytecap_post_bytecount_(*pcbAddressList, *pcbAddressList)
+        SOCKET_ADDRESS_LIST* pAddressList,
+        _Inout_ ULONG* pcbAddressList
+    )
+    {
+        struct sockaddr_in addrs[x_MaxAddresses];
+        ULONG nAddrs = ReadAddresses(addrs);
+
+        ULONG cbNeeded = static_cast<ULONG>(
+            FIELD_OFFSET(SOCKET_ADDRESS_LIST, Address) +
+            (sizeof(SOCKET_ADDRESS) + sizeof(struct sockaddr_in)) * nAddrs);
+        if (pAddressList == nullptr || *pcbAddressList < cbNeeded)
+        {
+            *pcbAddressList = cbNeeded;
+            return ND_BUFFER_OVERFLOW;
+        }
+
+        struct sockaddr_in* pAddrs = reinterpret_cast<struct sockaddr_in*>(
+            &pAddressList->Address[nAddrs]);
+        pAddressList->iAddressCount = static_cast<INT>(nAddrs);
+        for (ULONG i = 0; i < nAddrs; i++)
+        {
+            pAddrs[i] = addrs[i];
+            pAddressList->Address[i].lpSockaddr = reinterpret_cast<LPSOCKADDR>(&pAddrs[i]);
+            pAddressList->Address[i].iSockaddrLength = sizeof(pAddrs[i]);
+        }
+        *pcbAddressList = cbNeeded;
+        return ND_SUCCESS;
+    }
+
+
+    class StubAdapter final : public IND2Adapter
+    {
+        volatile LONG m_nRef;
+        UINT64 m_Id;
+
+    public:
+        explicit StubAdapter(UINT64 id) :
+            m_nRef(1),
+            m_Id(id)
+        {
+            ::InterlockedIncrement(&gnObjectsAlive);
+        }
+
+        ~StubAdapter()
+        {
+            ::InterlockedDecrement(&gnObjectsAlive);
+        }
+
+        HRESULT QueryInterface(REFIID riid, LPVOID* ppvObj) override
+        {
+            if (riid != IID_IUnknown && riid != IID_IND2Adapter)
+            {
+                *ppvObj = nullptr;
+                return E_NOINTERFACE;
+            }
+
+            AddRef();
+            *ppvObj = static_cast<IND2Adapter*>(this);
+            return S_OK;
+        }
+
+        ULONG AddRef(void) override
+        {
+            return ::InterlockedIncrement(&m_nRef);
+        }
+
+        ULONG Release(void) override
+        {
+            LONG nRef = ::InterlockedDecrement(&m_nRef);
+            if (nRef == 0)
+            {
+                delete this;
+            }
+            return nRef;
+        }
+
+        HRESULT CreateOverlappedFile(HANDLE* phOverlappedFile) override
+        {
+            UNREFERENCED_PARAMETER(phOverlappedFile);
+            return E_NOTIMPL;
+        }
+
+        HRESULT Query(ND2_ADAPTER_INFO* pInfo, ULONG* pcbInfo) override
+        {
+            if (pInfo == nullptr || *pcbInfo < sizeof(*pInfo))
+            {
+                *pcbInfo = sizeof(*pInfo);
+                return ND_BUFFER_OVERFLOW;
+            }
+
+            ::memset(pInfo, 0, sizeof(*pInfo));
+            pInfo->InfoVersion = ND_VERSION_2;
+            pInfo->AdapterId = m_Id;
+            *pcbInfo = sizeof(*pInfo);
+            return ND_SUCCESS;
+        }
+
+        HRESULT QueryAddressList(SOCKET_ADDRESS_LIST* pAddressList, ULONG* pcbAddressList) override
+        {
+            return BuildAddressList(pAddressList, pcbAddressList);
+        }
+
+        HRESULT CreateCompletionQueue(REFIID, HANDLE, ULONG, USHORT, KAFFINITY, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateMemoryRegion(REFIID, HANDLE, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateMemoryWindow(REFIID, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateSharedReceiveQueue(
+            REFIID, HANDLE, ULONG, ULONG, ULONG, USHORT, KAFFINITY, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateQueuePair(
+            REFIID, IUnknown*, IUnknown*, VOID*, ULONG, ULONG, ULONG, ULONG, ULONG, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateQueuePairWithSrq(
+            REFIID, IUnknown*, IUnknown*, IUnknown*, VOID*, ULONG, ULONG, ULONG, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateConnector(REFIID, HANDLE, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CreateListener(REFIID, HANDLE, VOID**) override
+        {
+            return E_NOTIMPL;
+        }
+    };
+
+
+    class StubProvider final : public IND2Provider
+    {
+        volatile LONG m_nRef;
+
+    public:
+        StubProvider() :
+            m_nRef(1)
+        {
+            ::InterlockedIncrement(&gnProvidersCreated);
+            ::InterlockedIncrement(&gnObjectsAlive);
+        }
+
+        ~StubProvider()
+        {
+            ::InterlockedDecrement(&gnObjectsAlive);
+        }
+
+        HRESULT QueryInterface(REFIID riid, LPVOID* ppvObj) override
+        {
+            if (riid != IID_IUnknown && riid != IID_IND2Provider)
+            {
+                *ppvObj = nullptr;
+                return E_NOINTERFACE;
+            }
+
+            AddRef();
+            *ppvObj = static_cast<IND2Provider*>(this);
+            return S_OK;
+        }
+
+        ULONG AddRef(void) override
+        {
+            return ::InterlockedIncrement(&m_nRef);
+        }
+
+        ULONG Release(void) override
+        {
+            LONG nRef = ::InterlockedDecrement(&m_nRef);
+            if (nRef == 0)
+            {
+                delete this;
+            }
+            return nRef;
+        }
+
+        HRESULT QueryAddressList(SOCKET_ADDRESS_LIST* pAddressList, ULONG* pcbAddressList) override
+        {
+            const char* pDelay = ::getenv("ND_STUB_QUERY_DELAY_US");
+            if (pDelay != nullptr)
+            {
+                ::usleep(static_cast<useconds_t>(::strtoul(pDelay, nullptr, 10)));
+            }
+            return BuildAddressList(pAddressList, pcbAddressList);
+        }
+
+        //
+        // The adapter ID is the IPv4 address in host order.
+        //
+        HRESULT ResolveAddress(const struct sockaddr* pAddress, ULONG cbAddress, UINT64* pAdapterId) override
+        {
+            if (cbAddress < sizeof(struct sockaddr_in) || pAddress->sa_family != AF_INET)
+            {
+                return ND_INVALID_ADDRESS;
+            }
+
+            const struct sockaddr_in* pAddr = reinterpret_cast<const struct sockaddr_in*>(pAddress);
+            struct sockaddr_in addrs[x_MaxAddresses];
+            ULONG nAddrs = ReadAddresses(addrs);
+            for (ULONG i = 0; i < nAddrs; i++)
+            {
+                if (addrs[i].sin_addr.s_addr == pAddr->sin_addr.s_addr)
+                {
+                    *pAdapterId = ntohl(pAddr->sin_addr.s_addr);
+                    return ND_SUCCESS;
+                }
+            }
+            return ND_INVALID_ADDRESS;
+        }
+
+        HRESULT OpenAdapter(REFIID iid, UINT64 adapterId, VOID** ppAdapter) override
+        {
+            StubAdapter* pAdapter = new (std::nothrow) StubAdapter(adapterId);
+            if (pAdapter == nullptr)
+            {
+                return ND_NO_MEMORY;
+            }
+
+            HRESULT hr = pAdapter->QueryInterface(iid, ppAdapter);
+            pAdapter->Release();
+            return hr;
+        }
+    };
+
+} // namespace
+
+
+EXTERN_C HRESULT
+    DllGetClassObject(
+        _In_ REFCLSID rclsid,
+        _In_ REFIID riid,
+        _Deref_out_ LPVOID* ppv
+    )
+{
+    UNREFERENCED_PARAMETER(rclsid);
+
+    if (riid != IID_IND2Provider)
+    {
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    StubProvider* pProvider = new (std::nothrow) StubProvider();
+    if (pProvider == nullptr)
+    {
+        return ND_NO_MEMORY;
+    }
+    *ppv = static_cast<IND2Provider*>(pProvider);
+    return S_OK;
+}
+
+
+EXTERN_C HRESULT
+    DllCanUnloadNow(void)
+{
+    return (gnObjectsAlive == 0) ? S_OK : S_FALSE;
+}
+
+
+EXTERN_C LONG
+    ndstubprov_ProvidersCreated(void)
+{
+    return gnProvidersCreated;
+}
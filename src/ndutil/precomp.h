@@ -6,10 +6,15 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <ws2spi.h>
+#include <iphlpapi.h>
 #include <coguid.h>
+#include <stdio.h>
+#include <new>
 
 #include "assertutil.h"
 #include "ndutil.h"
 #include "list.h"
+#include "rcu.h"
+#include "pool.h"
 #include "initguid.h"
 #include "ndspi.h"
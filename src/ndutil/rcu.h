@@ -0,0 +1,104 @@
+//
+// Copyright(c) Microsoft Corporation.All rights reserved.
+// Licensed under the MIT License.
+//
+
+#pragma once
+
+namespace NetworkDirect
+{
+
+    //---------------------------------------------------------
+    //
+    //  class Rcu
+    //
+    //  Read-copy-update grace period tracking.  Readers announce themselves
+    //  in a per-processor slot, so concurrent readers do not share cache
+    //  lines.  Writers publish a new version of the protected data with an
+    //  interlocked pointer swap, then call Synchronize before freeing the old
+    //  version.  Writers must be serialized by the caller.
+    //
+    //  Readers must not block on anything a writer holds while calling
+    //  Synchronize.
+    //
+    //---------------------------------------------------------
+    class Rcu
+    {
+        static const ULONG x_nSlots = 64;
+        static const ULONG x_CacheLine = 64;
+
+        struct Slot
+        {
+            volatile LONG m_nReaders[2];
+            BYTE m_pad[x_CacheLine - (2 * sizeof(LONG))];
+        };
+
+        Slot m_Slots[x_nSlots];
+        volatile LONG m_Epoch;
+
+    public:
+        Rcu()
+        {
+            ::ZeroMemory(m_Slots, sizeof(m_Slots));
+            m_Epoch = 0;
+        }
+
+        //
+        // Returns a cookie that must be passed to ReadUnlock.  The interlocked
+        // increment orders the slot update before any subsequent read of the
+        // protected pointer.
+        //
+        ULONG ReadLock()
+        {
+            ULONG slot = ::GetCurrentProcessorNumber() % x_nSlots;
+            ULONG epoch = static_cast<ULONG>(m_Epoch) & 1;
+            ::InterlockedIncrement(&m_Slots[slot].m_nReaders[epoch]);
+            return (slot << 1) | epoch;
+        }
+
+        void ReadUnlock(ULONG cookie)
+        {
+            ::InterlockedDecrement(&m_Slots[cookie >> 1].m_nReaders[cookie & 1]);
+        }
+
+        //
+        // Waits until every reader that could have observed the previously
+        // published pointer has called ReadUnlock.  The epoch is flipped twice
+        // so that readers that sampled the epoch just before a flip, but had
+        // not yet registered, are also waited for.
+        //
+        void Synchronize()
+        {
+            for (int pass = 0; pass < 2; pass++)
+            {
+                LONG epoch = m_Epoch & 1;
+                ::InterlockedExchange(&m_Epoch, epoch ^ 1);
+
+                for (ULONG i = 0; i < x_nSlots; i++)
+                {
+                    while (m_Slots[i].m_nReaders[epoch] != 0)
+                    {
+                        ::SwitchToThread();
+                    }
+                }
+            }
+        }
+    };
+
+
+    //---------------------------------------------------------
+    // Read-side critical section wrapper.
+    //
+    class RcuReadLock
+    {
+        Rcu* m_pRcu;
+        ULONG m_Cookie;
+
+    public:
+        RcuReadLock(Rcu* pRcu) { m_pRcu = pRcu; m_Cookie = pRcu->ReadLock(); }
+
+        ~RcuReadLock() { m_pRcu->ReadUnlock(m_Cookie); }
+    };
+    //---------------------------------------------------------
+
+} // namespace NetworkDirect
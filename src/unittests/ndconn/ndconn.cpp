@@ -12,6 +12,14 @@
 
 const USHORT x_DefaultPort = 54321;
 const SIZE_T x_XferLen = 4096;
+const DWORD x_DefaultSrqDepth = 1024;
+// Connections in flight for each phase of -n, and how long each phase runs.
+const LONG x_ScaleConnections[] = { 1, 100, 10000 };
+const DWORD x_ScalePhaseMs = 20000;
+// A thread at the limit still looks at m_bEndTest this often.
+const DWORD x_LimitWaitMs = 100;
+// Large enough for the private data of any provider.
+const ULONG x_MaxPrivateData = 256;
 
 const LPCWSTR TESTNAME = L"ndconn.exe";
 
@@ -22,9 +30,15 @@ void ShowUsage()
         "\t-s              - Start as server (listen on IP/Port)\n"
         "\t-c              - Start as client (connect to server IP/Port)\n"
         "\t-t <numThreads> - Number of threads for the test (default: 2)\n"
+        "\t-r [srqDepth]   - Take the receives of all connections from one shared receive\n"
+        "\t                  queue of <srqDepth> entries (server only) (default srqDepth: %u)\n"
+        "\t-n              - Run with 1, 100 and 10,000 connections in flight, %u seconds\n"
+        "\t                  each, and report the server's receive memory (client only)\n"
         "\t-l <logFile>    - Log output to a file named <logFile>\n"
         "<ip>              - IPv4 Address\n"
         "<port>            - Port number, (default: %hu)\n",
+        x_DefaultSrqDepth,
+        x_ScalePhaseMs / 1000,
         x_DefaultPort
     );
 }
@@ -79,35 +93,55 @@ HRESULT NDConnServerQp::Init(_In_ IND2Connector* pConnector)
 {
     m_pConnector = pConnector;
 
-    HRESULT hr = m_pTest->m_pAdapter->CreateQueuePair(IID_IND2QueuePair,
-        m_pTest->m_pRecvCq, m_pTest->m_pSendCq, nullptr,
-        1, 1, 1, 1, 0, reinterpret_cast<void **>(&m_pQp));
-    if (FAILED(hr))
+    HRESULT hr;
+    if (m_pTest->m_srqDepth != 0)
     {
-        printf("CreateQueuePair failed with %08x\n", hr);
-        return hr;
-    }
+        hr = m_pTest->m_pAdapter->CreateQueuePairWithSrq(IID_IND2QueuePair,
+            m_pTest->m_pRecvCq, m_pTest->m_pSendCq, m_pTest->m_Srq.Srq(), this,
+            1, 1, 0, reinterpret_cast<void **>(&m_pQp));
+        if (FAILED(hr))
+        {
+            printf("CreateQueuePairWithSrq failed with %08x\n", hr);
+            return hr;
+        }
 
-    // Pre-post receive request.
-    ND2_SGE sge;
-    sge.Buffer = m_pTest->m_Buf;
-    sge.BufferLength = m_pTest->m_Buf_Len;
-    sge.MemoryRegionToken = m_pTest->m_pMr->GetLocalToken();
-    hr = m_pQp->Receive(this, &sge, 1);
-    AddRef();
-    if (FAILED(hr))
+        // Hold the reference a posted receive would for the client's message.
+        AddRef();
+        m_fRecvPending = 1;
+    }
+    else
     {
-        printf("IND2QueuePair::Receive failed with %08x\n", hr);
-        Release();
-        return hr;
+        hr = m_pTest->m_pAdapter->CreateQueuePair(IID_IND2QueuePair,
+            m_pTest->m_pRecvCq, m_pTest->m_pSendCq, this,
+            1, 1, 1, 1, 0, reinterpret_cast<void **>(&m_pQp));
+        if (FAILED(hr))
+        {
+            printf("CreateQueuePair failed with %08x\n", hr);
+            return hr;
+        }
+
+        // Pre-post receive request.
+        ND2_SGE sge;
+        sge.Buffer = m_pTest->m_Buf;
+        sge.BufferLength = m_pTest->m_Buf_Len;
+        sge.MemoryRegionToken = m_pTest->m_pMr->GetLocalToken();
+        hr = m_pQp->Receive(this, &sge, 1);
+        AddRef();
+        if (FAILED(hr))
+        {
+            printf("IND2QueuePair::Receive failed with %08x\n", hr);
+            Release();
+            return hr;
+        }
     }
 
     InterlockedIncrement(&m_pTest->m_nQpCreated);
 
     // Accept the connection
     AddRef();
+    m_pTest->GetServerInfo(&m_ServerInfo);
     m_Timer.Start();
-    hr = m_pConnector->Accept(m_pQp, 0, 0, nullptr, 0, &m_AcceptOv);
+    hr = m_pConnector->Accept(m_pQp, 0, 0, &m_ServerInfo, sizeof(m_ServerInfo), &m_AcceptOv);
     if (FAILED(hr))
     {
         AcceptError(hr);
@@ -219,6 +253,13 @@ void NDConnServerQp::AcceptError(_In_ HRESULT hr)
         InterlockedIncrement(&m_pTest->m_nConnFailure);
         m_pQp->Flush();
 
+        // A shared receive isn't flushed with the queue pair, so the
+        // message that won't come can't drop its reference.
+        if (m_pTest->m_srqDepth != 0 && InterlockedExchange(&m_fRecvPending, 0) != 0)
+        {
+            Release();
+        }
+
         // Release again to destroy it.
         Release();
         return;
@@ -274,7 +315,19 @@ void NDConnServerQp::RecvDone(_In_ ND2_RESULT* pResult)
         exit(__LINE__);
     }
 
-    NDConnServerQp* pQp = static_cast<NDConnServerQp *>(pResult->RequestContext);
+    // The request context of a shared receive is its slot, so the queue pair
+    // comes from its own context.
+    NDConnServerQp* pQp = static_cast<NDConnServerQp *>(pResult->QueuePairContext);
+    if (pQp->m_pTest->m_srqDepth != 0)
+    {
+        pQp->m_pTest->m_Srq.Complete(pResult);
+        if (InterlockedExchange(&pQp->m_fRecvPending, 0) == 0)
+        {
+            // The connection failed and already dropped the reference.
+            return;
+        }
+    }
+
     if (InterlockedIncrement(&pQp->m_fDoSend) == 2)
     {
         pQp->Send();
@@ -329,7 +382,20 @@ void NDConnServer::RecvSucceeded(_In_ NDConnOverlapped* pOv)
         SIZE_T nResults = pTest->m_pRecvCq->GetResults(&result, 1);
         if (nResults == 0)
         {
-            HRESULT hr = pTest->m_pRecvCq->Notify(ND_CQ_NOTIFY_ANY, pOv);
+            // Only this thread takes receives from the shared queue until
+            // the CQ is armed again, so it also does the refill.
+            HRESULT hr;
+            if (pTest->m_srqDepth != 0)
+            {
+                hr = pTest->m_Srq.Poll();
+                if (FAILED(hr))
+                {
+                    printf("Refilling the shared receive queue failed with %08x\n", hr);
+                    exit(__LINE__);
+                }
+            }
+
+            hr = pTest->m_pRecvCq->Notify(ND_CQ_NOTIFY_ANY, pOv);
             if (FAILED(hr))
             {
                 printf("IND2CompletionQueue::Notify failed with %08x\n", hr);
@@ -396,6 +462,27 @@ void NDConnServer::Init(_In_ const struct sockaddr_in& v4Src)
     NdTestBase::CreateCQ(&m_pSendCq, queueDepth);
     NdTestBase::CreateCQ(&m_pRecvCq, queueDepth);
 
+    if (m_srqDepth != 0)
+    {
+        if (adapterInfo.MaxSharedReceiveQueueDepth == 0)
+        {
+            printf("Adapter does not support shared receive queues.\n");
+            exit(__LINE__);
+        }
+        m_srqDepth = min(m_srqDepth, adapterInfo.MaxSharedReceiveQueueDepth);
+
+        // The pool registers its buffer, and must do so before the adapter
+        // file is bound to the completion port.
+        NdTestBase::CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+        HRESULT hr = m_Srq.Init(m_pAdapter, m_hAdapterFile, m_pBufPool, m_srqDepth,
+            static_cast<ULONG>(x_XferLen));
+        if (FAILED(hr))
+        {
+            printf("SharedReceiveQueue::Init failed with %08x\n", hr);
+            exit(__LINE__);
+        }
+    }
+
     NdTestServerBase::CreateListener();
     NdTestServerBase::Listen(v4Src);
 
@@ -481,6 +568,31 @@ void NDConnServer::RunTest(
     );
 
     printf("%d connection failures.\n", m_nConnFailure);
+
+    if (m_srqDepth != 0)
+    {
+        printf("Shared receive queue: %u receives, %llu bytes, %llu low watermark notifications.\n",
+            m_Srq.Depth(),
+            static_cast<ULONGLONG>(m_Srq.ReceiveBytes()),
+            m_Srq.Notifications());
+    }
+}
+
+void NDConnServer::GetServerInfo(_Out_ NDConnServerInfo* pInfo) const
+{
+    pInfo->m_nConnections = m_nQpCreated - m_nQpDestroyed;
+    if (m_srqDepth != 0)
+    {
+        pInfo->m_nRecvs = m_Srq.Depth();
+        pInfo->m_RecvBytes = m_Srq.ReceiveBytes();
+    }
+    else
+    {
+        // Every queue pair keeps a receive posted.  They all land in m_Buf
+        // here, but a server that keeps the data needs a buffer for each.
+        pInfo->m_nRecvs = pInfo->m_nConnections;
+        pInfo->m_RecvBytes = static_cast<ULONGLONG>(pInfo->m_nConnections) * x_XferLen;
+    }
 }
 
 
@@ -507,6 +619,15 @@ void NDConnClientQp::ConnectSucceeded(_In_ NDConnOverlapped* pOv)
     pQp->m_Timer.End();
     InterlockedExchangeAdd64(&pQp->m_pTest->m_ConnectTime, (LONGLONG)pQp->m_Timer.Report());
 
+    // Providers may pad the private data.
+    char privateData[x_MaxPrivateData];
+    ULONG len = sizeof(privateData);
+    if (pQp->m_pConnector->GetPrivateData(privateData, &len) == ND_SUCCESS &&
+        len >= sizeof(NDConnServerInfo))
+    {
+        pQp->m_pTest->RecordServerInfo(*reinterpret_cast<NDConnServerInfo*>(privateData));
+    }
+
     pQp->m_Timer.Start();
     hr = pQp->m_pConnector->CompleteConnect(&pQp->m_CompleteConnectOv);
 
@@ -693,6 +814,7 @@ HRESULT NDConnClientQp::Create(_In_ NDConnClient* pTest)
     NDConnClientQp* pQp = new (std::nothrow) NDConnClientQp(pTest);
     if (pQp == nullptr)
     {
+        InterlockedDecrement(&pTest->m_nInFlight);
         return ND_NO_MEMORY;
     }
 
@@ -797,9 +919,19 @@ DWORD CALLBACK NDConnClient::ClientTestRoutine(_In_ LPVOID This)
         // or system is out of resources, and we don't treat that as
         // a test failure.
         HRESULT hr;
+        bool fAtLimit = false;
         if (pTest->m_bEndTest == false)
         {
-            hr = NDConnClientQp::Create(pTest);
+            if (pTest->ReserveConnection())
+            {
+                hr = NDConnClientQp::Create(pTest);
+            }
+            else
+            {
+                // Wait for a connection in flight to finish.
+                fAtLimit = true;
+                hr = ND_SUCCESS;
+            }
         }
         else
         {
@@ -814,7 +946,11 @@ DWORD CALLBACK NDConnClient::ClientTestRoutine(_In_ LPVOID This)
             hr = ND_CANCELED;
         }
 
-        if (FAILED(hr))
+        if (fAtLimit)
+        {
+            timeout = x_LimitWaitMs;
+        }
+        else if (FAILED(hr))
         {
             timeout = INFINITE;
         }
@@ -855,7 +991,75 @@ DWORD CALLBACK NDConnClient::ClientTestRoutine(_In_ LPVOID This)
 
                 static_cast<NDConnOverlapped*>(pOv)->Succeeded();
             }
-        } while (fSuccess == TRUE);
+        } while (fSuccess == TRUE && !(fAtLimit && !pTest->AtLimit()));
+    }
+}
+
+// Takes a slot for a new connection; the connection gives it back when it
+// is destroyed.
+bool NDConnClient::ReserveConnection()
+{
+    LONG nInFlight = InterlockedIncrement(&m_nInFlight);
+    if (m_nMaxConnections == 0 || nInFlight <= m_nMaxConnections)
+    {
+        return true;
+    }
+
+    InterlockedDecrement(&m_nInFlight);
+    return false;
+}
+
+static void InterlockedMax(_Inout_ volatile LONGLONG* pTarget, _In_ LONGLONG value)
+{
+    LONGLONG current = *pTarget;
+    while (value > current)
+    {
+        LONGLONG prev = InterlockedCompareExchange64(pTarget, value, current);
+        if (prev == current)
+        {
+            return;
+        }
+        current = prev;
+    }
+}
+
+void NDConnClient::RecordServerInfo(_In_ const NDConnServerInfo& info)
+{
+    InterlockedMax(&m_nServerConnections, info.m_nConnections);
+    InterlockedMax(&m_nServerRecvs, info.m_nRecvs);
+    InterlockedMax(&m_ServerRecvBytes, static_cast<LONGLONG>(info.m_RecvBytes));
+}
+
+// Raises the connections in flight phase by phase, reporting the
+// connection rate and the server's peak receive memory for each.
+void NDConnClient::RunScale()
+{
+    printf("%11s %11s %11s %11s %13s %9s\n",
+        "Connections", "Conn/sec", "SrvConns", "SrvRecvs", "SrvRecvBytes", "Failures");
+
+    for (LONG nConnections : x_ScaleConnections)
+    {
+        LONG nDestroyed = m_nQpDestroyed;
+        LONG nFailures = m_nConnFailure;
+        InterlockedExchange64(&m_nServerConnections, 0);
+        InterlockedExchange64(&m_nServerRecvs, 0);
+        InterlockedExchange64(&m_ServerRecvBytes, 0);
+
+        Timer timer;
+        timer.Start();
+        InterlockedExchange(&m_nMaxConnections, nConnections);
+        Sleep(x_ScalePhaseMs);
+        timer.End();
+
+        nFailures = m_nConnFailure - nFailures;
+        long nConnected = m_nQpDestroyed - nDestroyed - nFailures;
+        printf("%11d %11.2f %11lld %11lld %13lld %9d\n",
+            nConnections,
+            nConnected / (timer.Report() / 1000000.0),
+            m_nServerConnections,
+            m_nServerRecvs,
+            m_ServerRecvBytes,
+            nFailures);
     }
 }
 
@@ -908,6 +1112,11 @@ void NDConnClient::RunTest(
     // Wait 5 seconds for the server to be ready.
     Sleep(5000);
 
+    if (m_bScale)
+    {
+        m_nMaxConnections = x_ScaleConnections[0];
+    }
+
     // Create and launch test threads.
     for (LONG i = 0; i < m_nThreads; i++)
     {
@@ -922,8 +1131,15 @@ void NDConnClient::RunTest(
     Timer timer;
     timer.Start();
 
-    // Run for a minute.
-    Sleep(60000);
+    if (m_bScale)
+    {
+        RunScale();
+    }
+    else
+    {
+        // Run for a minute.
+        Sleep(60000);
+    }
 
     // Signal the end of the test.
     m_bEndTest = true;
@@ -970,6 +1186,8 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
     }
 
     DWORD nThreads = 2;
+    DWORD srqDepth = 0;
+    bool bScale = false;
     for (int i = 1; i < argc; i++)
     {
         TCHAR *arg = argv[i];
@@ -985,6 +1203,19 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
         {
             nThreads = _ttol(argv[++i]);
         }
+        else if ((wcscmp(arg, L"-r") == 0) || (wcscmp(arg, L"--srq") == 0))
+        {
+            srqDepth = x_DefaultSrqDepth;
+            // The depth is optional; the address is always last.
+            if (i < argc - 2 && _istdigit(argv[i + 1][0]))
+            {
+                srqDepth = _ttol(argv[++i]);
+            }
+        }
+        else if ((wcscmp(arg, L"-n") == 0) || (wcscmp(arg, L"--scale") == 0))
+        {
+            bScale = true;
+        }
         else if ((wcscmp(arg, L"-l") == 0) || (wcscmp(arg, L"--logFile") == 0))
         {
             RedirectLogsToFile(argv[++i]);
@@ -1036,7 +1267,7 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
 
     if (bServer)
     {
-        NDConnServer server(nThreads);
+        NDConnServer server(nThreads, srqDepth);
         server.RunTest(v4Server, 0, 0);
     }
     else
@@ -1053,7 +1284,7 @@ int __cdecl _tmain(int argc, TCHAR* argv[])
             LOG_FAILURE_HRESULT_AND_EXIT(hr, L"NdResolveAddress failed with %08x", __LINE__);
         }
 
-        NDConnClient client(nThreads);
+        NDConnClient client(nThreads, bScale);
         client.RunTest(v4Src, v4Server, 0, 0);
     }
 
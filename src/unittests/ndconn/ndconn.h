@@ -7,6 +7,18 @@
 #pragma once
 
 #include "ndtestutil.h"
+#include "ndsrq.h"
+
+// Private data the server accepts each connection with, so the client can
+// report the receive memory the server holds at its connection count.
+struct NDConnServerInfo
+{
+    // Queue pairs open on the server, this one included.
+    ULONG m_nConnections;
+    // Receives posted for them, shared by all of them with -r.
+    ULONG m_nRecvs;
+    ULONGLONG m_RecvBytes;
+};
 
 class NDConnOverlapped : public OVERLAPPED
 {
@@ -37,8 +49,9 @@ class NDConnServer : public NdTestServerBase
     friend class NDConnServerQp;
 
 public:
-    NDConnServer(DWORD numThreads) :
+    NDConnServer(DWORD numThreads, DWORD srqDepth) :
         m_nThreads(numThreads),
+        m_srqDepth(srqDepth),
         m_SendOv(SendSucceeded, SendFailed),
         m_RecvOv(RecvSucceeded, RecvFailed)
     {
@@ -70,6 +83,7 @@ public:
 
     void Init(_In_ const struct sockaddr_in& v4Src);
     void RunTest(_In_ const struct sockaddr_in& v4Src, _In_ DWORD queueDepth, _In_ DWORD nSge);
+    void GetServerInfo(_Out_ NDConnServerInfo* pInfo) const;
 
 protected:
     volatile LONG m_nOv = 0;
@@ -86,6 +100,10 @@ private:
     DWORD m_nThreads = 0;
     volatile bool m_bEndTest = false;
 
+    // All queue pairs take their receives from m_Srq if not 0.
+    DWORD m_srqDepth = 0;
+    SharedReceiveQueue m_Srq;
+
     IND2CompletionQueue *m_pSendCq = nullptr;
     IND2CompletionQueue *m_pRecvCq = nullptr;
 
@@ -207,8 +225,11 @@ private:
     NDConnOverlapped m_AcceptOv;
     NDConnOverlapped m_DisconnectOv;
     NDConnOverlapped m_NotifyDisconnectOv;
+    NDConnServerInfo m_ServerInfo = {};
 
     volatile LONG m_fDoSend = 0;
+    // Set while the reference for the client's message is held.
+    volatile LONG m_fRecvPending = 0;
 };
 
 class NDConnClient : public NdTestClientBase
@@ -216,10 +237,11 @@ class NDConnClient : public NdTestClientBase
     friend class NDConnClientQp;
 
 public:
-    NDConnClient(DWORD nThreads) :
+    NDConnClient(DWORD nThreads, bool bScale) :
         m_SendOv(SendSucceeded, SendFailed),
         m_RecvOv(RecvSucceeded, RecvFailed),
-        m_nThreads(nThreads)
+        m_nThreads(nThreads),
+        m_bScale(bScale)
     {
     }
 
@@ -259,7 +281,16 @@ private:
     __callback static void RecvSucceeded(_In_ NDConnOverlapped* pOv);
     __callback static void RecvFailed(_In_ NDConnOverlapped* pOv);
 
+    bool ReserveConnection();
+    bool AtLimit() const
+    {
+        return m_nMaxConnections != 0 && m_nInFlight >= m_nMaxConnections;
+    }
+    void RecordServerInfo(_In_ const NDConnServerInfo& info);
+    void RunScale();
+
     LONG m_nThreads;
+    bool m_bScale;
 
 protected:
     struct sockaddr_in m_serverAddr = {0};
@@ -283,6 +314,15 @@ protected:
     volatile LONG m_nConnTimeout = 0;
     volatile bool m_bEndTest = false;
 
+    // Connections allowed in flight at once, 0 for no limit.
+    volatile LONG m_nMaxConnections = 0;
+    volatile LONG m_nInFlight = 0;
+
+    // Peaks the server reported while connecting.
+    volatile LONGLONG m_nServerConnections = 0;
+    volatile LONGLONG m_nServerRecvs = 0;
+    volatile LONGLONG m_ServerRecvBytes = 0;
+
     __callback static DWORD CALLBACK ClientTestRoutine(_In_ LPVOID This);
 };
 
@@ -315,6 +355,7 @@ private:
         }
 
         InterlockedIncrement(&m_pTest->m_nQpDestroyed);
+        InterlockedDecrement(&m_pTest->m_nInFlight);
     }
 
     HRESULT Init();